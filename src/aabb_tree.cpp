@@ -0,0 +1,362 @@
+#include "aabb_tree.h"
+
+#include <cassert>
+#include <algorithm>
+#include <cstdlib>
+
+float AABBTree::margin = 0.1f;
+float AABBTree::displacement_factor = 4.0f;
+
+static inline Vector3 minVector(const Vector3& a, const Vector3& b) { return Vector3(std::min(a.x, b.x), std::min(a.y, b.y), std::min(a.z, b.z)); }
+static inline Vector3 maxVector(const Vector3& a, const Vector3& b) { return Vector3(std::max(a.x, b.x), std::max(a.y, b.y), std::max(a.z, b.z)); }
+
+//half the area of the box, only compared
+static inline float area(const Vector3& min, const Vector3& max)
+{
+	Vector3 d = max - min;
+	return d.x * d.y + d.y * d.z + d.z * d.x;
+}
+
+static inline float mergedArea(const AABBTree::Node& a, const AABBTree::Node& b)
+{
+	return area(minVector(a.min, b.min), maxVector(a.max, b.max));
+}
+
+void AABBTree::clear()
+{
+	nodes.clear();
+	moved.clear();
+	root = -1;
+	free_list = -1;
+	num_proxies = 0;
+}
+
+int AABBTree::allocateNode()
+{
+	if (free_list == -1)
+	{
+		nodes.resize(nodes.size() + 1);
+		free_list = (int)nodes.size() - 1;
+		nodes[free_list].parent = -1;
+	}
+	int index = free_list;
+	Node& node = nodes[index];
+	free_list = node.parent;
+	node.parent = -1;
+	node.child1 = node.child2 = -1;
+	node.height = 0;
+	node.user_data = NULL;
+	return index;
+}
+
+void AABBTree::freeNode(int index)
+{
+	nodes[index].parent = free_list;
+	nodes[index].height = -1;
+	free_list = index;
+}
+
+int AABBTree::createProxy(const Vector3& min, const Vector3& max, void* user_data)
+{
+	int proxy = allocateNode();
+	Node& node = nodes[proxy];
+	Vector3 fat(margin, margin, margin);
+	node.min = min - fat;
+	node.max = max + fat;
+	node.user_data = user_data;
+	insertLeaf(proxy);
+	moved.push_back(proxy);
+	num_proxies++;
+	return proxy;
+}
+
+void AABBTree::destroyProxy(int proxy)
+{
+	assert(nodes[proxy].isLeaf() && nodes[proxy].height == 0);
+	removeLeaf(proxy);
+	freeNode(proxy);
+	num_proxies--;
+	//it can't be in a pair anymore
+	moved.erase(std::remove(moved.begin(), moved.end(), proxy), moved.end());
+}
+
+bool AABBTree::moveProxy(int proxy, const Vector3& min, const Vector3& max, const Vector3& displacement)
+{
+	Node& node = nodes[proxy];
+	assert(node.isLeaf() && node.height == 0);
+	if (node.min.x <= min.x && node.min.y <= min.y && node.min.z <= min.z && max.x <= node.max.x && max.y <= node.max.y && max.z <= node.max.z)
+		return false;
+
+	removeLeaf(proxy);
+
+	//the fat box is extended towards where it goes, so it takes longer to leave it again
+	Vector3 fat(margin, margin, margin);
+	Vector3 fat_min = min - fat;
+	Vector3 fat_max = max + fat;
+	Vector3 d = displacement * displacement_factor;
+	for (int k = 0; k < 3; ++k)
+	{
+		if (d.v[k] < 0.0f)
+			fat_min.v[k] += d.v[k];
+		else
+			fat_max.v[k] += d.v[k];
+	}
+	node.min = fat_min;
+	node.max = fat_max;
+
+	insertLeaf(proxy);
+	moved.push_back(proxy);
+	return true;
+}
+
+void AABBTree::insertLeaf(int leaf)
+{
+	if (root == -1)
+	{
+		root = leaf;
+		nodes[root].parent = -1;
+		return;
+	}
+
+	//descends to the sibling that makes the tree grow less: the cost of a node is its area, creating a parent for the
+	//leaf costs the merged area and going down makes every ancestor grow by the area the leaf adds to it
+	const Node& leaf_node = nodes[leaf];
+	int index = root;
+	while (!nodes[index].isLeaf())
+	{
+		const Node& node = nodes[index];
+		float node_area = area(node.min, node.max);
+		float combined_area = mergedArea(node, leaf_node);
+		float cost = 2.0f * combined_area;
+		float inheritance_cost = 2.0f * (combined_area - node_area);
+
+		float child_costs[2];
+		int children[2] = { node.child1, node.child2 };
+		for (int i = 0; i < 2; ++i)
+		{
+			const Node& child = nodes[children[i]];
+			float merged = mergedArea(child, leaf_node);
+			child_costs[i] = (child.isLeaf() ? merged : merged - area(child.min, child.max)) + inheritance_cost;
+		}
+		if (cost < child_costs[0] && cost < child_costs[1])
+			break;
+		index = child_costs[0] < child_costs[1] ? children[0] : children[1];
+	}
+
+	//a new parent for the leaf and the sibling
+	int sibling = index;
+	int old_parent = nodes[sibling].parent;
+	int new_parent = allocateNode();
+	Node& parent = nodes[new_parent];
+	parent.parent = old_parent;
+	parent.min = minVector(nodes[leaf].min, nodes[sibling].min);
+	parent.max = maxVector(nodes[leaf].max, nodes[sibling].max);
+	parent.height = nodes[sibling].height + 1;
+	parent.child1 = sibling;
+	parent.child2 = leaf;
+	nodes[sibling].parent = new_parent;
+	nodes[leaf].parent = new_parent;
+	if (old_parent == -1)
+		root = new_parent;
+	else if (nodes[old_parent].child1 == sibling)
+		nodes[old_parent].child1 = new_parent;
+	else
+		nodes[old_parent].child2 = new_parent;
+
+	//the ancestors grow and are balanced on the way up
+	index = nodes[leaf].parent;
+	while (index != -1)
+	{
+		index = balance(index);
+		Node& node = nodes[index];
+		const Node& child1 = nodes[node.child1];
+		const Node& child2 = nodes[node.child2];
+		node.height = 1 + std::max(child1.height, child2.height);
+		node.min = minVector(child1.min, child2.min);
+		node.max = maxVector(child1.max, child2.max);
+		index = node.parent;
+	}
+}
+
+void AABBTree::removeLeaf(int leaf)
+{
+	if (leaf == root)
+	{
+		root = -1;
+		return;
+	}
+
+	//the parent is removed and the sibling takes its place
+	int parent = nodes[leaf].parent;
+	int grand_parent = nodes[parent].parent;
+	int sibling = nodes[parent].child1 == leaf ? nodes[parent].child2 : nodes[parent].child1;
+	freeNode(parent);
+	if (grand_parent == -1)
+	{
+		root = sibling;
+		nodes[sibling].parent = -1;
+		return;
+	}
+	if (nodes[grand_parent].child1 == parent)
+		nodes[grand_parent].child1 = sibling;
+	else
+		nodes[grand_parent].child2 = sibling;
+	nodes[sibling].parent = grand_parent;
+
+	int index = grand_parent;
+	while (index != -1)
+	{
+		index = balance(index);
+		Node& node = nodes[index];
+		const Node& child1 = nodes[node.child1];
+		const Node& child2 = nodes[node.child2];
+		node.min = minVector(child1.min, child2.min);
+		node.max = maxVector(child1.max, child2.max);
+		node.height = 1 + std::max(child1.height, child2.height);
+		index = node.parent;
+	}
+}
+
+//if one child of a is more than one level taller than the other, that child (c) goes up to the place of a and a takes
+//the shorter grandchild out of it. Returns the index of the node that is now in that place
+int AABBTree::balance(int a_index)
+{
+	Node& a = nodes[a_index];
+	if (a.isLeaf() || a.height < 2)
+		return a_index;
+
+	int b_index = a.child1;
+	int c_index = a.child2;
+	int difference = nodes[c_index].height - nodes[b_index].height;
+	if (difference >= -1 && difference <= 1)
+		return a_index;
+
+	//the same rotation both ways, with b the short child and c the tall one
+	bool c_is_second = difference > 1;
+	if (!c_is_second)
+		std::swap(b_index, c_index);
+	Node& b = nodes[b_index];
+	Node& c = nodes[c_index];
+	int f_index = c.child1;
+	int g_index = c.child2;
+	Node& f = nodes[f_index];
+	Node& g = nodes[g_index];
+
+	//c takes the place of a
+	c.child1 = a_index;
+	c.parent = a.parent;
+	a.parent = c_index;
+	if (c.parent == -1)
+		root = c_index;
+	else if (nodes[c.parent].child1 == a_index)
+		nodes[c.parent].child1 = c_index;
+	else
+		nodes[c.parent].child2 = c_index;
+
+	//the taller grandchild stays in c, the other one replaces c in a
+	int keep = f.height > g.height ? f_index : g_index;
+	int give = keep == f_index ? g_index : f_index;
+	c.child2 = keep;
+	if (c_is_second)
+		a.child2 = give;
+	else
+		a.child1 = give;
+	nodes[give].parent = a_index;
+
+	a.min = minVector(b.min, nodes[give].min);
+	a.max = maxVector(b.max, nodes[give].max);
+	a.height = 1 + std::max(b.height, nodes[give].height);
+	c.min = minVector(a.min, nodes[keep].min);
+	c.max = maxVector(a.max, nodes[keep].max);
+	c.height = 1 + std::max(a.height, nodes[keep].height);
+	return c_index;
+}
+
+void AABBTree::query(const Vector3& min, const Vector3& max, std::vector<int>& result) const
+{
+	query(min, max, [&](int proxy) { result.push_back(proxy); return true; });
+}
+
+void AABBTree::querySphere(const Vector3& center, float radius, std::vector<int>& result) const
+{
+	Vector3 r(radius, radius, radius);
+	query(center - r, center + r, [&](int proxy) {
+		const Node& node = nodes[proxy];
+		float distance = 0.0f;
+		for (int k = 0; k < 3; ++k)
+		{
+			float d = std::max(std::max(node.min.v[k] - center.v[k], center.v[k] - node.max.v[k]), 0.0f);
+			distance += d * d;
+		}
+		if (distance <= radius * radius)
+			result.push_back(proxy);
+		return true;
+	});
+}
+
+void AABBTree::updatePairs(std::vector< std::pair<int, int> >& pairs)
+{
+	pairs.clear();
+	std::sort(moved.begin(), moved.end());
+	moved.erase(std::unique(moved.begin(), moved.end()), moved.end());
+	for (int proxy : moved)
+	{
+		const Node& node = nodes[proxy];
+		query(node.min, node.max, [&](int other) {
+			//two that moved would give the pair twice, only the smaller one adds it
+			if (other == proxy || (other < proxy && std::binary_search(moved.begin(), moved.end(), other)))
+				return true;
+			pairs.push_back(std::make_pair(std::min(proxy, other), std::max(proxy, other)));
+			return true;
+		});
+	}
+	moved.clear();
+	std::sort(pairs.begin(), pairs.end());
+}
+
+float AABBTree::getAreaRatio() const
+{
+	if (root == -1)
+		return 0.0f;
+	float total = 0.0f;
+	for (int i = 0; i < nodes.size(); ++i)
+		if (nodes[i].height > 0)
+			total += area(nodes[i].min, nodes[i].max);
+	return total / area(nodes[root].min, nodes[root].max);
+}
+
+void AABBTree::validate() const
+{
+	int num_leaves = 0;
+	std::vector<int> stack;
+	if (root != -1)
+	{
+		assert(nodes[root].parent == -1);
+		stack.push_back(root);
+	}
+	while (stack.size())
+	{
+		int index = stack.back();
+		stack.pop_back();
+		const Node& node = nodes[index];
+		if (node.isLeaf())
+		{
+			assert(node.height == 0);
+			num_leaves++;
+			continue;
+		}
+		const Node& child1 = nodes[node.child1];
+		const Node& child2 = nodes[node.child2];
+		assert(child1.parent == index && child2.parent == index);
+		assert(node.height == 1 + std::max(child1.height, child2.height));
+		assert(abs(child1.height - child2.height) <= 1);
+		Vector3 min = minVector(child1.min, child2.min);
+		Vector3 max = maxVector(child1.max, child2.max);
+		assert(min.x == node.min.x && min.y == node.min.y && min.z == node.min.z);
+		assert(max.x == node.max.x && max.y == node.max.y && max.z == node.max.z);
+		stack.push_back(node.child1);
+		stack.push_back(node.child2);
+	}
+	assert(num_leaves == num_proxies);
+	(void)num_leaves;
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include "framework.h"
+#include <vector>
+#include <utility>
+
+//Dynamic tree of boxes for objects that move (the broadphase of a physics engine): every proxy is stored with a fat
+//box, so it is only reinserted when the object leaves it, and the tree is kept balanced with rotations while the leaves
+//are inserted and removed. The queries visit O(log n) nodes
+class AABBTree {
+public:
+	static float margin;				//added to the boxes of the proxies
+	static float displacement_factor;	//the fat box is also extended this many times the displacement of a move
+
+	struct Node {
+		Vector3 min;
+		int parent;		//the next free node when it is not used
+		Vector3 max;
+		int height;		//0 for the leaves, -1 when it is free
+		int child1;		//-1 for the leaves
+		int child2;
+		void* user_data;
+
+		bool isLeaf() const { return child1 == -1; }
+	};
+
+	std::vector<Node> nodes;
+	int root;
+	int free_list;
+	int num_proxies;
+	std::vector<int> moved; //proxies inserted or reinserted since the last updatePairs
+
+	AABBTree() { clear(); }
+	void clear();
+
+	//the proxy is the index of its leaf, it doesn't change till it is destroyed
+	int createProxy(const Vector3& min, const Vector3& max, void* user_data);
+	void destroyProxy(int proxy);
+	//false if the box is still inside the fat one, then nothing changes
+	bool moveProxy(int proxy, const Vector3& min, const Vector3& max, const Vector3& displacement = Vector3());
+	void* getUserData(int proxy) const { return nodes[proxy].user_data; }
+	const Node& getProxy(int proxy) const { return nodes[proxy]; }
+
+	//proxies whose fat box overlaps the volume, the callback returns false to stop
+	template<typename T> void query(const Vector3& min, const Vector3& max, T callback) const;
+	void query(const Vector3& min, const Vector3& max, std::vector<int>& result) const;
+	void querySphere(const Vector3& center, float radius, std::vector<int>& result) const;
+	//pairs of proxies whose fat boxes overlap with at least one of them moved, the smaller proxy first and sorted
+	void updatePairs(std::vector< std::pair<int, int> >& pairs);
+
+	int getHeight() const { return root == -1 ? 0 : nodes[root].height; }
+	float getAreaRatio() const; //of all the inner nodes to the root, smaller is better
+	void validate() const; //asserts the links, heights and boxes of the tree
+
+private:
+	int allocateNode();
+	void freeNode(int index);
+	void insertLeaf(int leaf);
+	void removeLeaf(int leaf);
+	int balance(int index);
+};
+
+template<typename T> void AABBTree::query(const Vector3& min, const Vector3& max, T callback) const
+{
+	if (root == -1)
+		return;
+	int stack[128];
+	int stack_size = 0;
+	stack[stack_size++] = root;
+	while (stack_size)
+	{
+		int index = stack[--stack_size];
+		const Node& node = nodes[index];
+		if (node.min.x > max.x || node.max.x < min.x || node.min.y > max.y || node.max.y < min.y || node.min.z > max.z || node.max.z < min.z)
+			continue;
+		if (node.isLeaf())
+		{
+			if (!callback(index))
+				return;
+			continue;
+		}
+		stack[stack_size++] = node.child1;
+		stack[stack_size++] = node.child2;
+	}
+}
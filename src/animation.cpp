@@ -1,13 +1,16 @@
 #include "animation.h"
 #include "framework.h"
 #include "utils.h"
+#include "simd.h"
+#include "task.h"
 #include <cassert>
+#include <cfloat>
 
 #include "camera.h"
 #include "shader.h"
 #include "mesh.h"
-
-#include <sys/stat.h>
+
+#include <sys/stat.h>
 
 Skeleton::Skeleton()
 {
@@ -33,6 +36,30 @@ Matrix44& Skeleton::getBoneMatrix(const char* name, bool local )
 	return global_bone_matrices[ it->second ];
 }
 
+void BoneRemap::build(Mesh* mesh, Skeleton* skeleton)
+{
+	this->mesh = mesh;
+	skeleton_bones.resize(mesh->bones_info.size());
+	bind_matrices.resize(mesh->bones_info.size());
+	for (int i = 0; i < (int)mesh->bones_info.size(); ++i)
+	{
+		BoneInfo& bone_info = mesh->bones_info[i];
+		auto it = skeleton->bones_by_name.find(bone_info.name);
+		skeleton_bones[i] = it == skeleton->bones_by_name.end() ? -1 : it->second;
+		bind_matrices[i] = mesh->bind_matrix * bone_info.bind_pose;
+	}
+}
+
+const BoneRemap& Skeleton::getBoneRemap(Mesh* mesh)
+{
+	for (BoneRemap& remap : bone_remaps)
+		if (remap.mesh == mesh)
+			return remap;
+	bone_remaps.push_back(BoneRemap());
+	bone_remaps.back().build(mesh, this);
+	return bone_remaps.back();
+}
+
 void Skeleton::computeFinalBoneMatrices( std::vector<Matrix44>& bone_matrices, Mesh* mesh )
 {
 	assert(mesh);
@@ -40,11 +67,16 @@ void Skeleton::computeFinalBoneMatrices( std::vector<Matrix44>& bone_matrices, M
 	updateGlobalMatrices();
 
 	bone_matrices.resize(mesh->bones_info.size());
-	#pragma omp for  
-	for (int i = 0; i < mesh->bones_info.size(); ++i)
+	if (bone_matrices.size())
+		computeFinalBoneMatrices(&bone_matrices[0], getBoneRemap(mesh));
+}
+
+void Skeleton::computeFinalBoneMatrices(Matrix44* bone_matrices, const BoneRemap& remap)
+{
+	for (int i = 0; i < (int)remap.skeleton_bones.size(); ++i)
 	{
-		BoneInfo& bone_info = mesh->bones_info[i];
-		bone_matrices[i] = mesh->bind_matrix * bone_info.bind_pose * getBoneMatrix( bone_info.name, false ); //use globals
+		int bone = remap.skeleton_bones[i];
+		bone_matrices[i] = bone == -1 ? remap.bind_matrices[i] : remap.bind_matrices[i] * global_bone_matrices[bone]; //use globals
 	}
 }
 
@@ -75,11 +107,11 @@ void blendSkeleton(Skeleton* a, Skeleton* b, float w, Skeleton* result, uint8 la
 	{
 		memcpy(result->bones, a->bones, sizeof(result->bones)); //copy skeleton structure
 		result->bones_by_name = a->bones_by_name;
+		result->bone_remaps = a->bone_remaps;
 		result->num_bones = a->num_bones;
 	}
 
 	//blend bones locally
-	#pragma omp for  
 	for (int i = 0; i < result->num_bones; ++i)
 	{
 		Skeleton::Bone& bone = result->bones[i];
@@ -87,7 +119,6 @@ void blendSkeleton(Skeleton* a, Skeleton* b, float w, Skeleton* result, uint8 la
 		Skeleton::Bone& boneB = b->bones[i];
 		if ( layer != 0xFF && !(bone.layer & layer) ) //not in the same layer
 			continue;
-		#pragma omp for  
 		for (int j = 0; j < 16; ++j)
 			bone.model.m[j] = lerp( boneA.model.m[j], boneB.model.m[j], w);
 	}
@@ -134,6 +165,24 @@ void Skeleton::applyTransformToBones(const char* root, Matrix44 transform)
 	bone->model = bone->model * transform;
 }
 
+//result = a * b like Matrix44::operator*, written in place (the operator builds an identity and copies it)
+static inline void multiplyMatrix(const Matrix44& a, const Matrix44& b, Matrix44& result)
+{
+	using namespace simd;
+	float4 b0 = load(b.m);
+	float4 b1 = load(b.m + 4);
+	float4 b2 = load(b.m + 8);
+	float4 b3 = load(b.m + 12);
+	for (int i = 0; i < 4; i++)
+	{
+		float4 row = mul(splat(a.M[i][0]), b0);
+		row = add(row, mul(splat(a.M[i][1]), b1));
+		row = add(row, mul(splat(a.M[i][2]), b2));
+		row = add(row, mul(splat(a.M[i][3]), b3));
+		store(result.M[i], row);
+	}
+}
+
 void Skeleton::updateGlobalMatrices()
 {
 	//compute global matrices
@@ -142,7 +191,7 @@ void Skeleton::updateGlobalMatrices()
 	for (int i = 1; i < num_bones; ++i)
 	{
 		Skeleton::Bone& bone = bones[i];
-		global_bone_matrices[i] = bone.model * global_bone_matrices[ bone.parent ];
+		multiplyMatrix(bone.model, global_bone_matrices[bone.parent], global_bone_matrices[i]);
 	}
 }
 
@@ -161,23 +210,276 @@ void Skeleton::assignLayer( Bone* bone, uint8 layer )
 	}
 }
 
+float Animation::translation_tolerance = 0.01f;
+float Animation::rotation_tolerance = 0.001f;
+float Animation::scale_tolerance = 0.001f;
+
+void QuantizedQuat::encode(const Quaternion& q)
+{
+	int biggest = 0;
+	for (int i = 1; i < 4; ++i)
+		if (fabsf(q.q[i]) > fabsf(q.q[biggest]))
+			biggest = i;
+	float sign = q.q[biggest] < 0 ? -1.0f : 1.0f;
+
+	//the others are in [-1/sqrt(2), 1/sqrt(2)]
+	for (int i = 0, j = 0; i < 4; ++i)
+	{
+		if (i == biggest)
+			continue;
+		float f = clamp(q.q[i] * sign * 0.70710678f + 0.5f, 0.0f, 1.0f);
+		v[j++] = (uint16)(f * 32767.0f + 0.5f);
+	}
+	v[0] |= (biggest & 1) << 15;
+	v[1] |= (biggest >> 1) << 15;
+}
+
+void QuantizedQuat::decode(float* q) const
+{
+	//indexed instead of skipping the biggest in a loop, that branch is mispredicted all the time when sampling
+	static const int8 others[4][3] = { { 1, 2, 3 }, { 0, 2, 3 }, { 0, 1, 3 }, { 0, 1, 2 } };
+	int biggest = (v[0] >> 15) | ((v[1] >> 15) << 1);
+	float a = (v[0] & 0x7FFF) * (1.41421356f / 32767.0f) - 0.70710678f;
+	float b = (v[1] & 0x7FFF) * (1.41421356f / 32767.0f) - 0.70710678f;
+	float c = (v[2] & 0x7FFF) * (1.41421356f / 32767.0f) - 0.70710678f;
+	q[others[biggest][0]] = a;
+	q[others[biggest][1]] = b;
+	q[others[biggest][2]] = c;
+	q[biggest] = sqrtf(std::max(1.0f - a * a - b * b - c * c, 0.0f));
+}
+
 Animation::Animation()
 {
 	duration = 0.0f;
-	keyframes = NULL;
 	num_keyframes = 0;
 	num_animated_bones = 0;
 }
 
-Animation::~Animation()
+//last key not after the keyframe (the first key is always 0), without branches so it is not slowed by mispredictions
+static int searchKey(const uint16* frames, int num_keys, uint16 key_frame)
 {
-	if (keyframes)
-		delete[] keyframes;
+	const uint16* base = frames;
+	for (int n = num_keys; n > 1; n -= n / 2)
+		base = base[n / 2] <= key_frame ? base + n / 2 : base;
+	return (int)(base - frames);
+}
+
+//the same from the key of the last sample, the time usually stays in its segment or moves to the next one
+static inline int moveKey(const uint16* frames, int num_keys, uint16 key_frame, int key)
+{
+	if (frames[key] > key_frame)
+		return searchKey(frames, num_keys, key_frame);
+	for (int i = 0; i < 2; ++i, ++key)
+		if (key == num_keys - 1 || frames[key + 1] > key_frame)
+			return key;
+	return searchKey(frames, num_keys, key_frame);
+}
+
+//finds the keys around a keyframe in one channel of a track and the interpolation factor between them
+static void findKeys(const uint16* frames, int num_keys, float frame, int& a, int& b, float& f)
+{
+	a = searchKey(frames, num_keys, (uint16)frame);
+	if (a == num_keys - 1) //after the last keyframe it blends with the first one, like the loop
+	{
+		b = 0;
+		f = frame - frames[a];
+		return;
+	}
+	b = a + 1;
+	f = (frame - frames[a]) / (float)(frames[b] - frames[a]);
+}
+
+void Animation::sampleTrack(int i, float frame, Matrix44& result) const
+{
+	const AnimationTrack& track = tracks[i];
+	int a, b;
+	float f;
+
+	//translation and scale are lerped, the rotation normalized after lerping (nlerp)
+	int first = track.first_key[TRACK_TRANSLATION];
+	findKeys(&key_frames[TRACK_TRANSLATION][first], track.num_keys[TRACK_TRANSLATION], frame, a, b, f);
+	simd::float4 t0 = simd::load3(translation_keys[first + a].v);
+	simd::float4 t1 = simd::load3(translation_keys[first + b].v);
+	simd::float4 translation = simd::add(t0, simd::mul(simd::sub(t1, t0), simd::splat(f)));
+
+	first = track.first_key[TRACK_SCALE];
+	findKeys(&key_frames[TRACK_SCALE][first], track.num_keys[TRACK_SCALE], frame, a, b, f);
+	simd::float4 s0 = simd::load3(scale_keys[first + a].v);
+	simd::float4 s1 = simd::load3(scale_keys[first + b].v);
+	simd::float4 scale = simd::add(s0, simd::mul(simd::sub(s1, s0), simd::splat(f)));
+
+	first = track.first_key[TRACK_ROTATION];
+	findKeys(&key_frames[TRACK_ROTATION][first], track.num_keys[TRACK_ROTATION], frame, a, b, f);
+	float q[8];
+	rotation_keys[first + a].decode(q);
+	simd::float4 rotation = simd::set(q[0], q[1], q[2], q[3]); //not load, the scalar stores would not be forwarded
+	if (a != b) //not a constant rotation
+	{
+		rotation_keys[first + b].decode(q + 4);
+		simd::float4 q1 = simd::set(q[4], q[5], q[6], q[7]);
+		float sign = simd::first(simd::sum(simd::mul(rotation, q1))) < 0.0f ? -1.0f : 1.0f; //shortest path
+		q1 = simd::mul(q1, simd::splat(sign));
+		rotation = simd::add(rotation, simd::mul(simd::sub(q1, rotation), simd::splat(f)));
+		rotation = simd::mul(rotation, simd::splat(1.0f / sqrtf(simd::first(simd::sum(simd::mul(rotation, rotation))))));
+	}
+
+	//the matrix is only built here, the rows of Quaternion::toMatrix scaled and the translation in the last one
+	float r[4], s[4];
+	simd::store(r, rotation);
+	simd::store(s, scale);
+	float xx = r[0] * r[0] * 2.0f, yy = r[1] * r[1] * 2.0f, zz = r[2] * r[2] * 2.0f;
+	float xy = r[0] * r[1] * 2.0f, xz = r[0] * r[2] * 2.0f, yz = r[1] * r[2] * 2.0f;
+	float wx = r[3] * r[0] * 2.0f, wy = r[3] * r[1] * 2.0f, wz = r[3] * r[2] * 2.0f;
+	float* m = result.m;
+	m[0] = (1.0f - yy - zz) * s[0]; m[1] = (xy + wz) * s[0]; m[2] = (xz - wy) * s[0]; m[3] = 0.0f;
+	m[4] = (xy - wz) * s[1]; m[5] = (1.0f - xx - zz) * s[1]; m[6] = (yz + wx) * s[1]; m[7] = 0.0f;
+	m[8] = (xz + wy) * s[2]; m[9] = (yz - wx) * s[2]; m[10] = (1.0f - xx - yy) * s[2]; m[11] = 0.0f;
+	simd::store3(m + 12, translation);
+	m[15] = 1.0f;
+}
+
+//components of every channel in the values of a cursor group: translation xyz, rotation xyzw and scale xyz
+static const int channel_components[NUM_TRACK_CHANNELS + 1] = { 0, 3, 7, 10 };
+
+//the segment of the channel c of the track i that starts at the key a, in its lane of the group
+template<int c> void loadSegment(const Animation& animation, int i, int a, AnimationCursor::Group& group, int lane)
+{
+	const AnimationTrack& track = animation.tracks[i];
+	int first = track.first_key[c];
+	int num_keys = track.num_keys[c];
+	const uint16* frames = &animation.key_frames[c][first];
+	int b = a == num_keys - 1 ? 0 : a + 1; //after the last keyframe it blends with the first one, like the loop
+	//moving to the next segment, its first key is the last one of the loaded segment (an empty one ends at 0)
+	bool next = group.end[c][lane] != 0.0f && a == group.keys[c][lane] + 1;
+	float q[8];
+	if (next)
+		for (int k = 0; k < channel_components[c + 1] - channel_components[c]; ++k)
+			q[k] = group.values[channel_components[c] + k][lane] + group.deltas[channel_components[c] + k][lane];
+
+	group.keys[c][lane] = (uint16)a;
+	group.start[c][lane] = frames[a];
+	group.end[c][lane] = num_keys == 1 ? FLT_MAX : (b ? frames[b] : frames[a] + 1.0f);
+	group.factor[c][lane] = num_keys == 1 ? 0.0f : 1.0f / (group.end[c][lane] - group.start[c][lane]);
+
+	if (c == TRACK_ROTATION)
+	{
+		if (!next)
+			animation.rotation_keys[first + a].decode(q);
+		animation.rotation_keys[first + b].decode(q + 4);
+		if (q[0] * q[4] + q[1] * q[5] + q[2] * q[6] + q[3] * q[7] < 0.0f) //shortest path
+			for (int k = 4; k < 8; ++k)
+				q[k] = -q[k];
+	}
+	else
+	{
+		const Vector3* keys = c == TRACK_TRANSLATION ? &animation.translation_keys[first] : &animation.scale_keys[first];
+		memcpy(q, keys[a].v, sizeof(float) * 3);
+		memcpy(q + 4, keys[b].v, sizeof(float) * 3);
+	}
+	for (int k = 0; k < channel_components[c + 1] - channel_components[c]; ++k)
+	{
+		group.values[channel_components[c] + k][lane] = q[k];
+		group.deltas[channel_components[c] + k][lane] = q[k + 4] - q[k];
+	}
+}
+
+void AnimationCursor::reset(const Animation* animation)
+{
+	this->animation = animation;
+	int num_tracks = (int)animation->tracks.size();
+	groups.resize((num_tracks + 3) / 4);
+	memset(&groups[0], 0, sizeof(Group) * groups.size()); //empty segments, the first sample loads them
+
+	//the lanes after the last track are a constant identity
+	for (int i = num_tracks; i < groups.size() * 4; ++i)
+	{
+		Group& group = groups[i / 4];
+		for (int c = 0; c < NUM_TRACK_CHANNELS; ++c)
+			group.end[c][i % 4] = FLT_MAX;
+		for (int k = channel_components[TRACK_ROTATION + 1] - 1; k < channel_components[NUM_TRACK_CHANNELS]; ++k)
+			group.values[k][i % 4] = 1.0f; //rotation w and scale
+	}
+}
+
+//loads the segments of the channel c of a group that do not contain the keyframe
+template<int c> void moveSegments(const Animation& animation, AnimationCursor::Group& group, int first_track, float frame)
+{
+	using namespace simd;
+	static const int8 lowest_bit[16] = { 0, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0 };
+	float4 frames = splat(frame);
+	int outside = ~lessEqualMask(load(group.start[c]), frames) | lessEqualMask(load(group.end[c]), frames);
+	for (outside &= 15; outside; outside &= outside - 1)
+	{
+		int lane = lowest_bit[outside];
+		int i = first_track + lane;
+		const AnimationTrack& track = animation.tracks[i];
+		int a = moveKey(&animation.key_frames[c][track.first_key[c]], track.num_keys[c], (uint16)frame, group.keys[c][lane]);
+		loadSegment<c>(animation, i, a, group, lane);
+	}
+}
+
+//the four tracks of a group of the cursor at a keyframe, the segments that do not contain it anymore are loaded first.
+//The same as sampleTrack with one track per lane, the local matrices are written in the results that are not NULL
+static void sampleGroup(const Animation& animation, AnimationCursor::Group& group, int first_track, float frame, Matrix44** results)
+{
+	using namespace simd;
+	float4 frames = splat(frame);
+	if (frame < group.from || frame >= group.until)
+	{
+		moveSegments<TRACK_TRANSLATION>(animation, group, first_track, frame);
+		moveSegments<TRACK_ROTATION>(animation, group, first_track, frame);
+		moveSegments<TRACK_SCALE>(animation, group, first_track, frame);
+		float4 from = max(max(load(group.start[TRACK_TRANSLATION]), load(group.start[TRACK_ROTATION])), load(group.start[TRACK_SCALE]));
+		float4 until = min(min(load(group.end[TRACK_TRANSLATION]), load(group.end[TRACK_ROTATION])), load(group.end[TRACK_SCALE]));
+		group.from = first(hmax(from));
+		group.until = first(hmin(until));
+	}
+
+	//translation and scale are lerped, the rotation normalized after lerping (nlerp)
+	float4 ft = mul(sub(frames, load(group.start[TRACK_TRANSLATION])), load(group.factor[TRACK_TRANSLATION]));
+	float4 fr = mul(sub(frames, load(group.start[TRACK_ROTATION])), load(group.factor[TRACK_ROTATION]));
+	float4 fs = mul(sub(frames, load(group.start[TRACK_SCALE])), load(group.factor[TRACK_SCALE]));
+	#define LERP_COMPONENT(k, f) add(load(group.values[k]), mul(load(group.deltas[k]), f))
+	float4 tx = LERP_COMPONENT(0, ft), ty = LERP_COMPONENT(1, ft), tz = LERP_COMPONENT(2, ft);
+	float4 x = LERP_COMPONENT(3, fr), y = LERP_COMPONENT(4, fr), z = LERP_COMPONENT(5, fr), w = LERP_COMPONENT(6, fr);
+	float4 sx = LERP_COMPONENT(7, fs), sy = LERP_COMPONENT(8, fs), sz = LERP_COMPONENT(9, fs);
+	#undef LERP_COMPONENT
+
+	//the rows of Quaternion::toMatrix scaled and the translation in the last one, a component of every track per register.
+	//Dividing the products by the squared length normalizes the quaternion without the square root
+	float4 one = splat(1.0f), zero = splat(0.0f);
+	float4 s = div(splat(2.0f), add(add(mul(x, x), mul(y, y)), add(mul(z, z), mul(w, w))));
+	float4 xs = mul(x, s), ys = mul(y, s), zs = mul(z, s);
+	float4 xx = mul(x, xs), yy = mul(y, ys), zz = mul(z, zs);
+	float4 xy = mul(x, ys), xz = mul(x, zs), yz = mul(y, zs);
+	float4 wx = mul(w, xs), wy = mul(w, ys), wz = mul(w, zs);
+	float4 m0 = mul(sub(sub(one, yy), zz), sx), m1 = mul(add(xy, wz), sx), m2 = mul(sub(xz, wy), sx), m3 = zero;
+	float4 m4 = mul(sub(xy, wz), sy), m5 = mul(sub(sub(one, xx), zz), sy), m6 = mul(add(yz, wx), sy), m7 = zero;
+	float4 m8 = mul(add(xz, wy), sz), m9 = mul(sub(yz, wx), sz), m10 = mul(sub(sub(one, xx), yy), sz), m11 = zero;
+	float4 m12 = tx, m13 = ty, m14 = tz, m15 = one;
+	transpose(m0, m1, m2, m3);
+	transpose(m4, m5, m6, m7);
+	transpose(m8, m9, m10, m11);
+	transpose(m12, m13, m14, m15);
+	#define STORE_MATRIX(lane, r0, r1, r2, r3) if (Matrix44* result = results[lane]) { store(result->m, r0); store(result->m + 4, r1); store(result->m + 8, r2); store(result->m + 12, r3); }
+	STORE_MATRIX(0, m0, m4, m8, m12);
+	STORE_MATRIX(1, m1, m5, m9, m13);
+	STORE_MATRIX(2, m2, m6, m10, m14);
+	STORE_MATRIX(3, m3, m7, m11, m15);
+	#undef STORE_MATRIX
 }
 
 void Animation::assignTime(float t, bool loop, bool interpolate, uint8 layers)
 {
-	assert(keyframes && skeleton.num_bones);
+	samplePose(skeleton, t, loop, interpolate, layers, &cursor);
+	skeleton.updateGlobalMatrices();
+}
+
+void Animation::samplePose(Skeleton& pose, float t, bool loop, bool interpolate, uint8 layers, AnimationCursor* cursor) const
+{
+	assert(tracks.size() && pose.num_bones);
+	if (cursor && cursor->animation != this)
+		cursor->reset(this);
 
 	if (loop)
 	{
@@ -188,35 +490,187 @@ void Animation::assignTime(float t, bool loop, bool interpolate, uint8 layers)
 	else
 		t = clamp( t, 0.0f, duration - (1.0/samples_per_second) );
 	float v = samples_per_second * t;
-	int index = clamp(floor(v), 0, num_keyframes - 1);
-	int index2 = index + 1;
-	if (index2 >= num_keyframes)
-		index2 = 0;
-	float f = v - floor(v);
-
-	Matrix44* k = keyframes + index * num_animated_bones;
-	Matrix44* k2 = keyframes + index2 * num_animated_bones;
+	if (!interpolate)
+		v = floor(v);
+	v = clamp(v, 0.0f, num_keyframes - 0.001f);
 
 	//compute local bones
-	#pragma omp for  
+	if (cursor)
+	{
+		for (int group = 0; group < cursor->groups.size(); ++group)
+		{
+			Matrix44* results[4] = { NULL, NULL, NULL, NULL };
+			for (int i = group * 4; i < std::min(group * 4 + 4, num_animated_bones); ++i)
+			{
+				Skeleton::Bone& bone = pose.bones[bones_map[i]];
+				if (layers == 0xFF || (bone.layer & layers))
+					results[i - group * 4] = &bone.model;
+			}
+			sampleGroup(*this, cursor->groups[group], group * 4, v, results);
+		}
+		return;
+	}
 	for (int i = 0; i < num_animated_bones; ++i)
 	{
 		int bone_index = bones_map[i];
-		Skeleton::Bone& bone = skeleton.bones[bone_index];
+		Skeleton::Bone& bone = pose.bones[bone_index];
 		if (layers != 0xFF && !(bone.layer & layers))
 			continue;
-		for (int j = 0; j < 16; ++j)
-			bone.model.m[j] = lerp(k[i].m[j], k2[i].m[j], f);
+		sampleTrack(i, v, bone.model);
 	}
+}
 
-	skeleton.updateGlobalMatrices();
+//the rows of the 3x3 part are the axis scaled, a mirrored matrix has a negative scale in x
+static void decomposeMatrix(const Matrix44& m, Vector3& translation, Quaternion& rotation, Vector3& scale)
+{
+	translation.set(m.m[12], m.m[13], m.m[14]);
+	Vector3 rows[3] = { Vector3(m.m[0], m.m[1], m.m[2]), Vector3(m.m[4], m.m[5], m.m[6]), Vector3(m.m[8], m.m[9], m.m[10]) };
+	for (int i = 0; i < 3; ++i)
+	{
+		scale.v[i] = rows[i].length();
+		if (scale.v[i] > 0.0f)
+			rows[i] = rows[i] * (1.0f / scale.v[i]);
+	}
+	if (rows[0].dot(rows[1].cross(rows[2])) < 0.0f)
+	{
+		scale.x = -scale.x;
+		rows[0] = rows[0] * -1.0f;
+	}
+	Matrix44 rotation_matrix;
+	for (int i = 0; i < 3; ++i)
+		for (int j = 0; j < 3; ++j)
+			rotation_matrix.m[i * 4 + j] = rows[i].v[j];
+	rotation.fromMatrix(rotation_matrix);
+}
+
+//keeps the fewest keyframes that reproduce every sample within the tolerance when interpolating, growing every
+//segment while the frames inside it are close enough
+template<typename T, typename Lerp, typename Distance>
+static void reduceKeys(const std::vector<T>& samples, float tolerance, Lerp lerp, Distance distance, std::vector<int>& kept)
+{
+	int num = (int)samples.size();
+	kept.assign(1, 0);
+
+	bool constant = true;
+	for (int i = 1; i < num && constant; ++i)
+		constant = distance(samples[0], samples[i]) <= tolerance;
+	if (constant)
+		return;
+
+	int start = 0;
+	while (start < num - 1)
+	{
+		int end = start + 1;
+		for (int candidate = end + 1; candidate < num; ++candidate)
+		{
+			bool fits = true;
+			for (int i = start + 1; i < candidate && fits; ++i)
+				fits = distance(lerp(samples[start], samples[candidate], (i - start) / (float)(candidate - start)), samples[i]) <= tolerance;
+			if (!fits)
+				break;
+			end = candidate;
+		}
+		kept.push_back(end);
+		start = end;
+	}
+}
+
+static Vector3 lerpVector3(const Vector3& a, const Vector3& b, float f) { return a + (b - a) * f; }
+
+static Quaternion nlerpQuat(const Quaternion& a, const Quaternion& b, float f)
+{
+	float sign = DotProduct(a, b) < 0.0f ? -1.0f : 1.0f;
+	Quaternion q(lerp(a.x, b.x * sign, f), lerp(a.y, b.y * sign, f), lerp(a.z, b.z * sign, f), lerp(a.w, b.w * sign, f));
+	q.normalize();
+	return q;
+}
+
+static float angleBetween(const Quaternion& a, const Quaternion& b)
+{
+	return 2.0f * acosf(std::min(fabsf(DotProduct(a, b)), 1.0f));
 }
 
+void Animation::compressKeyframes(const Matrix44* keyframes)
+{
+	assert(num_keyframes < 65536);
+	cursor.animation = NULL; //its keys are not valid anymore
+	tracks.resize(num_animated_bones);
+	for (int c = 0; c < NUM_TRACK_CHANNELS; ++c)
+		key_frames[c].clear();
+	translation_keys.clear();
+	rotation_keys.clear();
+	scale_keys.clear();
+
+	std::vector<Vector3> translations(num_keyframes);
+	std::vector<Quaternion> rotations(num_keyframes);
+	std::vector<QuantizedQuat> quantized(num_keyframes);
+	std::vector<Vector3> scales(num_keyframes);
+	std::vector<int> kept;
+	auto distance = [](const Vector3& a, const Vector3& b) { return a.distance(b); };
+
+	for (int i = 0; i < num_animated_bones; ++i)
+	{
+		for (int j = 0; j < num_keyframes; ++j)
+		{
+			decomposeMatrix(keyframes[j * num_animated_bones + i], translations[j], rotations[j], scales[j]);
+			//the keys are chosen with the quantized values so the tolerance also covers that error
+			quantized[j].encode(rotations[j]);
+			quantized[j].decode(rotations[j].q);
+		}
+
+		AnimationTrack& track = tracks[i];
+
+		reduceKeys(translations, translation_tolerance, lerpVector3, distance, kept);
+		track.first_key[TRACK_TRANSLATION] = (int)translation_keys.size();
+		track.num_keys[TRACK_TRANSLATION] = (int)kept.size();
+		for (int k : kept)
+		{
+			key_frames[TRACK_TRANSLATION].push_back(k);
+			translation_keys.push_back(translations[k]);
+		}
+
+		reduceKeys(rotations, rotation_tolerance, nlerpQuat, angleBetween, kept);
+		track.first_key[TRACK_ROTATION] = (int)rotation_keys.size();
+		track.num_keys[TRACK_ROTATION] = (int)kept.size();
+		for (int k : kept)
+		{
+			key_frames[TRACK_ROTATION].push_back(k);
+			rotation_keys.push_back(quantized[k]);
+		}
+
+		reduceKeys(scales, scale_tolerance, lerpVector3, distance, kept);
+		track.first_key[TRACK_SCALE] = (int)scale_keys.size();
+		track.num_keys[TRACK_SCALE] = (int)kept.size();
+		for (int k : kept)
+		{
+			key_frames[TRACK_SCALE].push_back(k);
+			scale_keys.push_back(scales[k]);
+		}
+	}
+}
+
+size_t Animation::getMemorySize() const
+{
+	size_t size = tracks.size() * sizeof(AnimationTrack);
+	for (int c = 0; c < NUM_TRACK_CHANNELS; ++c)
+		size += key_frames[c].size() * sizeof(uint16);
+	return size + translation_keys.size() * sizeof(Vector3) + rotation_keys.size() * sizeof(QuantizedQuat) + scale_keys.size() * sizeof(Vector3);
+}
 
 void Animation::operator = (Animation* anim)
 {
-	memcpy(this, anim, sizeof(Animation));
-	this->keyframes = NULL;
+	skeleton = anim->skeleton;
+	duration = anim->duration;
+	samples_per_second = anim->samples_per_second;
+	num_animated_bones = anim->num_animated_bones;
+	num_keyframes = anim->num_keyframes;
+	memcpy(bones_map, anim->bones_map, sizeof(bones_map));
+	tracks = anim->tracks;
+	for (int c = 0; c < NUM_TRACK_CHANNELS; ++c)
+		key_frames[c] = anim->key_frames[c];
+	translation_keys = anim->translation_keys;
+	rotation_keys = anim->rotation_keys;
+	scale_keys = anim->scale_keys;
 }
 
 bool Animation::load(const char* filename)
@@ -251,7 +705,8 @@ bool Animation::load(const char* filename)
 		}
 	}
 
-	std::cout << "[OK] Num. Bones: " << skeleton.num_bones << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
+	std::cout << "[OK] Num. Bones: " << skeleton.num_bones << " Keys: " << getMemorySize() / 1024 << "KB (" << 
+		sizeof(Matrix44) * num_keyframes * num_animated_bones / 1024 << "KB as matrices) Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
 	return true;
 }
 
@@ -267,6 +722,12 @@ struct sAnimHeader {
 	char extra[16];
 };
 
+//after the skeleton in version 4, followed by the tracks, the key frames of every channel and the keys
+struct sAnimTracksHeader {
+	int num_keys[NUM_TRACK_CHANNELS];
+	float tolerances[NUM_TRACK_CHANNELS]; //the ones used to remove keys
+};
+
 bool Animation::writeABIN(const char* filename)
 {
 	std::string s_filename = filename;
@@ -298,8 +759,21 @@ bool Animation::writeABIN(const char* filename)
 	//write skeleton
 	fwrite((void*)skeleton.bones, sizeof(skeleton.bones), 1, f);
 
-	//write keyframes
-	fwrite((void*)keyframes, sizeof(Matrix44) * num_keyframes * num_animated_bones, 1, f);
+	//write tracks
+	sAnimTracksHeader tracks_header;
+	tracks_header.num_keys[TRACK_TRANSLATION] = (int)translation_keys.size();
+	tracks_header.num_keys[TRACK_ROTATION] = (int)rotation_keys.size();
+	tracks_header.num_keys[TRACK_SCALE] = (int)scale_keys.size();
+	tracks_header.tolerances[TRACK_TRANSLATION] = translation_tolerance;
+	tracks_header.tolerances[TRACK_ROTATION] = rotation_tolerance;
+	tracks_header.tolerances[TRACK_SCALE] = scale_tolerance;
+	fwrite((void*)&tracks_header, sizeof(sAnimTracksHeader), 1, f);
+	fwrite((void*)&tracks[0], sizeof(AnimationTrack) * num_animated_bones, 1, f);
+	for (int c = 0; c < NUM_TRACK_CHANNELS; ++c)
+		fwrite((void*)&key_frames[c][0], sizeof(uint16) * key_frames[c].size(), 1, f);
+	fwrite((void*)&translation_keys[0], sizeof(Vector3) * translation_keys.size(), 1, f);
+	fwrite((void*)&rotation_keys[0], sizeof(QuantizedQuat) * rotation_keys.size(), 1, f);
+	fwrite((void*)&scale_keys[0], sizeof(Vector3) * scale_keys.size(), 1, f);
 
 	fclose(f);
 	return true;
@@ -334,9 +808,10 @@ bool Animation::loadABIN(const char* filename)
 	memcpy(&header, pos, sizeof(sAnimHeader));
 	pos += sizeof(sAnimHeader);
 
-	if (header.version != ANIM_BIN_VERSION || header.header_bytes != sizeof(sAnimHeader))
+	if ((header.version != ANIM_BIN_VERSION && header.version != 3) || header.header_bytes != sizeof(sAnimHeader))
 	{
 		std::cout << "[WARN] loading BIN: old version: " << filename << std::endl;
+		delete[] data;
 		return false;
 	}
 
@@ -352,11 +827,34 @@ bool Animation::loadABIN(const char* filename)
 	memcpy( skeleton.bones, pos, sizeof(skeleton.bones) );
 	pos += sizeof(skeleton.bones);
 
-	//extract keyframes
-	assert(keyframes == NULL);
-	keyframes = new Matrix44[num_keyframes * num_animated_bones];
-	memcpy( keyframes, pos, sizeof(Matrix44)*num_keyframes * num_animated_bones );
-	pos += sizeof(Matrix44) * num_keyframes * num_animated_bones;
+	if (header.version == 3) //a matrix per bone and keyframe, compressed now
+		compressKeyframes((Matrix44*)pos);
+	else
+	{
+		//extract tracks
+		sAnimTracksHeader tracks_header;
+		memcpy(&tracks_header, pos, sizeof(sAnimTracksHeader));
+		pos += sizeof(sAnimTracksHeader);
+		cursor.animation = NULL; //its keys are not valid anymore
+		tracks.resize(num_animated_bones);
+		memcpy(&tracks[0], pos, sizeof(AnimationTrack) * num_animated_bones);
+		pos += sizeof(AnimationTrack) * num_animated_bones;
+		for (int c = 0; c < NUM_TRACK_CHANNELS; ++c)
+		{
+			key_frames[c].resize(tracks_header.num_keys[c]);
+			memcpy(&key_frames[c][0], pos, sizeof(uint16) * tracks_header.num_keys[c]);
+			pos += sizeof(uint16) * tracks_header.num_keys[c];
+		}
+		translation_keys.resize(tracks_header.num_keys[TRACK_TRANSLATION]);
+		memcpy(&translation_keys[0], pos, sizeof(Vector3) * translation_keys.size());
+		pos += sizeof(Vector3) * translation_keys.size();
+		rotation_keys.resize(tracks_header.num_keys[TRACK_ROTATION]);
+		memcpy(&rotation_keys[0], pos, sizeof(QuantizedQuat) * rotation_keys.size());
+		pos += sizeof(QuantizedQuat) * rotation_keys.size();
+		scale_keys.resize(tracks_header.num_keys[TRACK_SCALE]);
+		memcpy(&scale_keys[0], pos, sizeof(Vector3) * scale_keys.size());
+		pos += sizeof(Vector3) * scale_keys.size();
+	}
 
 	//compute bone names map
 	for (int i = 0; i < skeleton.num_bones; ++i)
@@ -396,6 +894,7 @@ bool Animation::loadSKANIM(const char* filename)
 	num_animated_bones = 0;
 
 	int current_keyframe = 0;
+	std::vector<Matrix44> keyframes; //only until they are compressed in tracks
 
 	while (*pos)
 	{
@@ -432,14 +931,13 @@ bool Animation::loadSKANIM(const char* filename)
 			for (int j = 0; j < (int)bones_map_info.size(); ++j)
 				bones_map[j] = bones_map_info[j];
 			num_animated_bones = (int)bones_map_info.size();
-			assert(keyframes == NULL);
-			keyframes = new Matrix44[num_animated_bones * num_keyframes];
+			keyframes.resize(num_animated_bones * num_keyframes);
 		}
 		else if (type == 'K')
 		{
 			pos = fetchWord(pos, word);
 			//float time = atof(word);
-			Matrix44* k = keyframes + current_keyframe * num_animated_bones;
+			Matrix44* k = &keyframes[current_keyframe * num_animated_bones];
 			current_keyframe++;
 			for (int j = 0; j < num_animated_bones; ++j)
 				pos = fetchMatrix44(pos, *(k + j));
@@ -468,6 +966,7 @@ bool Animation::loadSKANIM(const char* filename)
 		skeleton.assignLayer(skeleton.getBone("mixamorig_LeftShoulder"), LEFT_ARM);
 	}
 
+	compressKeyframes(&keyframes[0]);
 	assignTime(0); //reset pose
 
 	delete[] data;
@@ -496,3 +995,256 @@ Animation* Animation::Get(const char* filename)
 	sAnimationsLoaded[filename] = anim;
 	return anim;
 }
+
+Crowd::~Crowd()
+{
+	clear();
+}
+
+void Crowd::clear()
+{
+	for (Character& character : characters)
+		delete character.pose;
+	characters.clear();
+	bone_matrices.clear();
+}
+
+int Crowd::addCharacter(Mesh* mesh, Animation* animation, float time)
+{
+	assert(mesh && animation);
+	Character character;
+	character.mesh = mesh;
+	character.animation = animation;
+	character.time = time;
+	character.blend_animation = NULL;
+	character.blend_time = 0.0f;
+	character.blend_weight = 0.0f;
+	character.blend_layers = 0xFF;
+	character.model.setIdentity();
+
+	//the pose starts as the skeleton of the animation, only the animated bones change after that
+	character.pose = new Skeleton();
+	memcpy(character.pose->bones, animation->skeleton.bones, sizeof(animation->skeleton.bones));
+	character.pose->num_bones = animation->skeleton.num_bones;
+	character.pose->bones_by_name = animation->skeleton.bones_by_name;
+
+	//the names are only compared the first time a mesh is used with the skeleton of this animation
+	character.remap = &animation->skeleton.getBoneRemap(mesh);
+	character.first_bone = (int)bone_matrices.size();
+	bone_matrices.resize(bone_matrices.size() + mesh->bones_info.size());
+
+	characters.push_back(character);
+	return (int)characters.size() - 1;
+}
+
+void Crowd::update(float elapsed_time, Matrix44* output)
+{
+	if (!output)
+		output = bone_matrices.size() ? &bone_matrices[0] : NULL;
+
+	for (Character& character : characters)
+	{
+		character.time += elapsed_time;
+		character.blend_time += elapsed_time;
+	}
+
+	//every character only writes its own pose and its range of bone_matrices
+	parallelFor((int)characters.size(), [&](int i) {
+		updateCharacter(characters[i], output);
+	});
+}
+
+void Crowd::updatePalette(float elapsed_time)
+{
+	if (!bone_matrices.size())
+		return;
+	Matrix44* matrices = palette.map((int)bone_matrices.size());
+	if (!matrices)
+		return;
+	update(elapsed_time, matrices);
+	palette.unmap();
+}
+
+void Crowd::getInstances(Mesh* mesh, SkinnedInstances& instances)
+{
+	instances.clear();
+	instances.mesh = mesh;
+	instances.palette = &palette;
+	for (Character& character : characters)
+		if (character.mesh == mesh)
+			instances.add(character.model, character.first_bone);
+}
+
+void Crowd::updateCharacter(Character& character, Matrix44* output)
+{
+	Skeleton& pose = *character.pose;
+	character.animation->samplePose(pose, character.time, true, true, 0xFF, &character.cursor);
+
+	if (character.blend_animation && character.blend_weight > 0.0f)
+	{
+		if (character.blend_weight >= 1.0f && character.blend_layers == 0xFF)
+			character.blend_animation->samplePose(pose, character.blend_time, true, true, 0xFF, &character.blend_cursor);
+		else
+		{
+			Skeleton blend_pose; //only the bones, blendSkeleton doesn't need the rest
+			memcpy(blend_pose.bones, pose.bones, sizeof(pose.bones));
+			blend_pose.num_bones = pose.num_bones;
+			character.blend_animation->samplePose(blend_pose, character.blend_time, true, true, 0xFF, &character.blend_cursor);
+			blendSkeleton(&pose, &blend_pose, character.blend_weight, &pose, character.blend_layers);
+		}
+	}
+
+	pose.updateGlobalMatrices();
+	if (character.remap->skeleton_bones.size())
+		pose.computeFinalBoneMatrices(output + character.first_bone, *character.remap);
+}
+
+BonePalette::BonePalette()
+{
+	buffer_id = texture_id = 0;
+	capacity = 0;
+}
+
+BonePalette::~BonePalette()
+{
+	if (texture_id)
+		glDeleteTextures(1, &texture_id);
+	if (buffer_id)
+		glDeleteBuffers(1, &buffer_id);
+}
+
+Matrix44* BonePalette::map(int num_matrices)
+{
+	if (num_matrices <= 0)
+		return NULL;
+	if (!buffer_id)
+	{
+		glGenBuffers(1, &buffer_id);
+		glGenTextures(1, &texture_id);
+	}
+
+	glBindBuffer(GL_TEXTURE_BUFFER, buffer_id);
+	if (num_matrices > capacity) //it only grows
+	{
+		capacity = num_matrices;
+		glBufferData(GL_TEXTURE_BUFFER, capacity * sizeof(Matrix44), NULL, GL_STREAM_DRAW);
+		glBindTexture(GL_TEXTURE_BUFFER, texture_id);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, buffer_id);
+		glBindTexture(GL_TEXTURE_BUFFER, 0);
+	}
+	Matrix44* matrices = (Matrix44*)glMapBufferRange(GL_TEXTURE_BUFFER, 0, num_matrices * sizeof(Matrix44), GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+	return matrices;
+}
+
+void BonePalette::unmap()
+{
+	glBindBuffer(GL_TEXTURE_BUFFER, buffer_id);
+	glUnmapBuffer(GL_TEXTURE_BUFFER);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+}
+
+void BonePalette::upload(const Matrix44* matrices, int num_matrices)
+{
+	Matrix44* data = map(num_matrices);
+	if (!data)
+		return;
+	memcpy(data, matrices, num_matrices * sizeof(Matrix44));
+	unmap();
+}
+
+void BonePalette::bind(Shader* shader, const char* uniform_name, int slot)
+{
+	glActiveTexture(GL_TEXTURE0 + slot);
+	glBindTexture(GL_TEXTURE_BUFFER, texture_id);
+	glActiveTexture(GL_TEXTURE0);
+	shader->setUniform(uniform_name, slot);
+}
+
+SkinnedInstances::SkinnedInstances()
+{
+	mesh = NULL;
+	palette = NULL;
+	instances_buffer_id = 0;
+}
+
+SkinnedInstances::~SkinnedInstances()
+{
+	if (instances_buffer_id)
+		glDeleteBuffers(1, &instances_buffer_id);
+}
+
+void SkinnedInstances::clear()
+{
+	models.clear();
+	bone_offsets.clear();
+}
+
+void SkinnedInstances::add(const Matrix44& model, int first_bone)
+{
+	models.push_back(model);
+	bone_offsets.push_back((float)first_bone);
+}
+
+//the models followed by the bone offsets
+void SkinnedInstances::upload()
+{
+	if (!models.size())
+		return;
+	if (!instances_buffer_id)
+		glGenBuffers(1, &instances_buffer_id);
+	size_t models_size = models.size() * sizeof(Matrix44);
+	glBindBuffer(GL_ARRAY_BUFFER, instances_buffer_id);
+	glBufferData(GL_ARRAY_BUFFER, models_size + bone_offsets.size() * sizeof(float), NULL, GL_STREAM_DRAW);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, models_size, &models[0]);
+	glBufferSubData(GL_ARRAY_BUFFER, models_size, bone_offsets.size() * sizeof(float), &bone_offsets[0]);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void SkinnedInstances::render(unsigned int primitive)
+{
+	Shader* shader = Shader::current;
+	assert(shader && mesh && "shader must be enabled");
+	int model_location = shader->getAttribLocation("u_model");
+	int offset_location = shader->getAttribLocation("a_bone_offset");
+	assert(model_location != -1 && offset_location != -1 && "shader must have the attributes mat4 u_model and float a_bone_offset");
+	if (!models.size() || model_location == -1 || offset_location == -1)
+		return;
+
+	if (!Mesh::supportsInstancing())
+	{
+		//without instancing the attributes of every instance are constant values, one draw per instance
+		for (int i = 0; i < (int)models.size(); ++i)
+		{
+			for (int k = 0; k < 4; ++k)
+				glVertexAttrib4fv(model_location + k, models[i].m + k * 4);
+			glVertexAttrib1f(offset_location, bone_offsets[i]);
+			mesh->render(primitive);
+		}
+		return;
+	}
+
+	assert(instances_buffer_id && "instances must be uploaded");
+	glBindBuffer(GL_ARRAY_BUFFER, instances_buffer_id);
+	//mat4 count as 4 different attributes of vec4
+	for (int k = 0; k < 4; ++k)
+	{
+		glEnableVertexAttribArray(model_location + k);
+		glVertexAttribPointer(model_location + k, 4, GL_FLOAT, GL_FALSE, sizeof(Matrix44), (void*)(sizeof(float) * 4 * k));
+		Mesh::setAttribDivisor(model_location + k, 1);
+	}
+	glEnableVertexAttribArray(offset_location);
+	glVertexAttribPointer(offset_location, 1, GL_FLOAT, GL_FALSE, 0, (void*)(models.size() * sizeof(Matrix44)));
+	Mesh::setAttribDivisor(offset_location, 1);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	mesh->render(primitive, -1, (int)models.size());
+
+	for (int k = 0; k < 4; ++k)
+	{
+		glDisableVertexAttribArray(model_location + k);
+		Mesh::setAttribDivisor(model_location + k, 0);
+	}
+	glDisableVertexAttribArray(offset_location);
+	Mesh::setAttribDivisor(offset_location, 0);
+}
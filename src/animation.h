@@ -1,6 +1,7 @@
 #pragma once
 
 #include <vector>
+#include <list>
 #include <cstring>
 #include <algorithm>
 #include <iostream>
@@ -8,8 +9,9 @@
 
 
 class Camera;
+class Shader;
 
-#define ANIM_BIN_VERSION 3
+#define ANIM_BIN_VERSION 4 //4: compressed TRS tracks, version 3 files (a matrix per bone and keyframe) are converted
 
 //defined layers for every body
 enum BODY_LAYERS {
@@ -27,6 +29,18 @@ enum BODY_LAYERS {
 struct cmp_str { bool operator()(char const *a, char const *b) const { return std::strcmp(a, b) < 0; } };
 
 
+class Skeleton;
+
+//skeleton bone used by every bone of a skinned mesh, found by name once for every mesh and skeleton pair
+//instead of every frame, with the bind matrices of the mesh already multiplied
+struct BoneRemap {
+	Mesh* mesh;
+	std::vector<int> skeleton_bones; //-1 if the skeleton doesn't have it (identity)
+	std::vector<Matrix44> bind_matrices; //mesh->bind_matrix * bind_pose
+
+	void build(Mesh* mesh, Skeleton* skeleton);
+};
+
 //This class contains the bone structure hierarchy
 class Skeleton {
 public:
@@ -44,6 +58,7 @@ public:
 
 	Matrix44 global_bone_matrices[128]; //transform of every bone in global coordinates (according to the 0,0,0 and not the parent)
 	std::map<const char*, int, cmp_str> bones_by_name;	//map to get the bone index from its name, required to extract the final bones array
+	std::list<BoneRemap> bone_remaps; //of the meshes used with this skeleton (a list so the crowds can keep pointers)
 
 	Skeleton();
 
@@ -54,12 +69,60 @@ public:
 
 	void renderSkeleton(Camera* camera, Matrix44 model, Vector4 color = Vector4(0.5, 0, 0.5, 1), bool render_points = false); //renders the skeleton with lines
 	void computeFinalBoneMatrices(std::vector<Matrix44>& bones, Mesh* mesh); //fills the std::vector with the bones ready for the shader
+	void computeFinalBoneMatrices(Matrix44* bones, const BoneRemap& remap); //same without updating the global matrices
+	const BoneRemap& getBoneRemap(Mesh* mesh); //built the first time
 	void assignLayer(Bone* bone, uint8 layer); //assigns a layer to a node and all its children
 };
 
 //this function takes skeleton A and blends it with skeleton B and stores the result in result
 void blendSkeleton(Skeleton* a, Skeleton* b, float w, Skeleton* result, uint8 layer = 0xFF);
 
+//channels of the tracks of an animation
+enum TRACK_CHANNEL {
+	TRACK_TRANSLATION = 0,
+	TRACK_ROTATION = 1,
+	TRACK_SCALE = 2,
+	NUM_TRACK_CHANNELS = 3
+};
+
+//where the keys of one animated bone are in the arrays of the animation. Only the keyframes that cannot be
+//interpolated from the ones around are stored (the first and the last always are, unless the channel is constant)
+struct AnimationTrack {
+	int first_key[NUM_TRACK_CHANNELS];
+	int num_keys[NUM_TRACK_CHANNELS];
+};
+
+//unit quaternion in 48 bits: the three smallest components in 15 bits each and the index of the biggest one,
+//which is recomputed from the others (it is always positive, q and -q are the same rotation)
+struct QuantizedQuat {
+	uint16 v[3];
+	void encode(const Quaternion& q);
+	void decode(float* q) const; //x,y,z,w
+};
+
+class Animation;
+
+//the segment of every channel of every track around the last sampled time, ready to be interpolated: the next sample
+//(usually a bit later) only checks it instead of searching the keys, and the rotations are decoded once per segment.
+//The tracks are in groups of four sampled together with SIMD, one lane each. One per pose sampled (a crowd keeps one
+//per character), reset it if the keys of the animation change
+struct AnimationCursor {
+	struct Group {
+		float values[10][4]; //at the key a: translation xyz, rotation xyzw and scale xyz
+		float deltas[10][4]; //to the key b (the rotation of b on the shortest path from a)
+		float start[NUM_TRACK_CHANNELS][4]; //keyframe of the key a
+		float end[NUM_TRACK_CHANNELS][4]; //of the key b, FLT_MAX if the channel is constant
+		float factor[NUM_TRACK_CHANNELS][4]; //1 / (end - start)
+		uint16 keys[NUM_TRACK_CHANNELS][4]; //a, from the first key of the track
+		float from, until; //frames where every segment of the group is valid, to skip checking them one by one
+	};
+	const Animation* animation; //the one the groups belong to, reset when it samples another one
+	std::vector<Group> groups;
+
+	AnimationCursor() { animation = NULL; }
+	void reset(const Animation* animation); //at the first keys
+};
+
 //This class contains one animation loaded from a file (it also uses a skeleton to store the current snapshot)
 class Animation {
 public:
@@ -72,13 +135,32 @@ public:
 	int num_keyframes;
 	int8 bones_map[128]; //maps from keyframe data index to bone
 
-	Matrix44* keyframes;
+	//translation, rotation and scale keys of every animated bone (same order than bones_map)
+	std::vector<AnimationTrack> tracks;
+	std::vector<uint16> key_frames[NUM_TRACK_CHANNELS]; //keyframe of every key
+	std::vector<Vector3> translation_keys;
+	std::vector<QuantizedQuat> rotation_keys;
+	std::vector<Vector3> scale_keys;
+	AnimationCursor cursor; //of the skeleton of the animation (assignTime)
+
+	//maximum error allowed when removing keys (units, radians and scale factor)
+	static float translation_tolerance;
+	static float rotation_tolerance;
+	static float scale_tolerance;
 
 	Animation();
-	~Animation();	//we need the dtor to remove the keyframes memory
 
 	//change the skeleton to the given pose according to time
 	void assignTime(float time, bool loop = true, bool interpolate = true, uint8 layers = 0xFF);
+	//only the local matrices of the animated bones of another skeleton with the same bones, so many characters
+	//can sample the animation at the same time (each one with its own cursor, searched from scratch without it)
+	void samplePose(Skeleton& pose, float time, bool loop = true, bool interpolate = true, uint8 layers = 0xFF, AnimationCursor* cursor = NULL) const;
+
+	//local matrix of the animated bone i at a keyframe (with decimals), searching its keys
+	void sampleTrack(int i, float frame, Matrix44& result) const;
+	//builds the tracks from the local matrix of every animated bone in every keyframe (keyframe * num_animated_bones + i)
+	void compressKeyframes(const Matrix44* keyframes);
+	size_t getMemorySize() const; //bytes used by the keys
 
 	//storage
 	bool load(const char* filename);
@@ -93,3 +175,78 @@ public:
 	void operator = (Animation* anim);
 };
 
+//final bone matrices of many characters in a texture buffer (four RGBA32F texels per matrix) read by the skinned
+//shaders, the matrices of every instance start at its bone offset. Only from the main thread
+class BonePalette {
+public:
+	unsigned int buffer_id;
+	unsigned int texture_id;
+	int capacity; //in matrices
+
+	BonePalette();
+	~BonePalette();
+
+	//write only, the previous content is discarded so the draws still reading it don't stall the CPU
+	Matrix44* map(int num_matrices);
+	void unmap();
+	void upload(const Matrix44* matrices, int num_matrices);
+	void bind(Shader* shader, const char* uniform_name, int slot);
+};
+
+//skinned characters that use the same mesh, drawn in one instanced call (one per instance if the context has no
+//instancing): the model of every instance and where its bone matrices start in the palette. The shader must be one of
+//the skinned ones (skinned.vs)
+class SkinnedInstances {
+public:
+	Mesh* mesh;
+	BonePalette* palette;
+	std::vector<Matrix44> models;
+	std::vector<float> bone_offsets;
+	unsigned int instances_buffer_id;
+
+	SkinnedInstances();
+	~SkinnedInstances();
+
+	void clear();
+	void add(const Matrix44& model, int first_bone);
+	void upload(); //the per instance buffer, once before rendering them
+	void render(unsigned int primitive); //with the current shader, the palette must be bound
+};
+
+//many animated characters updated at once: the workers sample and blend the animations of every character, compute
+//its global matrices and write its final bone matrices in a buffer shared by all of them, ready for the shader
+class Crowd {
+public:
+	struct Character {
+		Mesh* mesh;
+		Animation* animation;
+		float time;
+		Animation* blend_animation; //optional, blended over the first one
+		float blend_time;
+		float blend_weight;
+		uint8 blend_layers;
+		AnimationCursor cursor; //of each animation
+		AnimationCursor blend_cursor;
+		Matrix44 model;
+		Skeleton* pose;
+		const BoneRemap* remap; //shared by the characters with the same mesh and animation skeleton
+		int first_bone; //of its matrices in bone_matrices
+	};
+
+	std::vector<Character> characters;
+	std::vector<Matrix44> bone_matrices; //final bone matrices of every character, one after the other
+	BonePalette palette; //the same matrices in the GPU when using updatePalette
+
+	~Crowd();
+
+	int addCharacter(Mesh* mesh, Animation* animation, float time = 0.0f); //returns its index
+	void clear();
+	//advances the time of every character and updates all the poses and bone matrices in the workers, they are written
+	//in output if given (as many as bone_matrices)
+	void update(float elapsed_time, Matrix44* output = NULL);
+	void updateCharacter(Character& character, Matrix44* output);
+	//same but the workers write the matrices straight into the mapped palette, only from the main thread
+	void updatePalette(float elapsed_time);
+	//the characters using this mesh, to render them with the palette
+	void getInstances(Mesh* mesh, SkinnedInstances& instances);
+};
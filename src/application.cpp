@@ -10,6 +10,7 @@
 #include "prefab.h"
 #include "gltf_loader.h"
 #include "renderer.h"
+#include "scene_bvh.h"
 
 #include <cmath>
 #include <string>
@@ -17,6 +18,7 @@
 using namespace std;
 
 Application* Application::instance = nullptr;
+std::string Application::scene_filename = "data/scene.json";
 
 Camera* camera = nullptr;
 GTR::Scene* scene = nullptr;
@@ -67,7 +69,7 @@ Application::Application(int window_width, int window_height, SDL_Window* window
 	//prefab = GTR::Prefab::Get("data/prefabs/gmc/scene.gltf");
 
 	scene = new GTR::Scene();
-	if (!scene->load("data/scene.json"))
+	if (!scene->load(scene_filename.c_str()))
 		exit(1);
 	std::vector<GTR::BaseEntity*> entities = scene->entities;
 
@@ -169,6 +171,14 @@ void Application::update(double seconds_elapsed)
 		Input::centerMouse();
 		//ImGui::SetCursorPos(ImVec2(Input::mouse_position.x, Input::mouse_position.y));
 	}
+
+	//the entities that change with time (the crowds pose their characters)
+	for (GTR::BaseEntity* ent : scene->entities)
+		ent->update((float)seconds_elapsed);
+
+	//the entities may have moved, the queries of the next frame see them
+	scene->updateBroadphase();
+	scene->updateBVH();
 }
 
 void Application::renderDebugGizmo()
@@ -331,6 +341,15 @@ void Application::onMouseButtonDown( SDL_MouseButtonEvent event )
 		mouse_locked = !mouse_locked;
 		SDL_ShowCursor(!mouse_locked);
 	}
+	else if (event.button == SDL_BUTTON_LEFT && Input::isKeyPressed(SDL_SCANCODE_LCTRL)) //pick the entity under the mouse
+	{
+		Ray ray;
+		ray.origin = camera->eye;
+		ray.direction = camera->getRayDirection(event.x, event.y, window_width, window_height);
+		GTR::SceneHit hit;
+		if (scene->testRay(ray, hit))
+			selected_entity = hit.entity;
+	}
 }
 
 void Application::onMouseButtonUp(SDL_MouseButtonEvent event)
@@ -14,6 +14,7 @@ class Application
 public:
 	// Util per no haver de passar per parmetre la app --> s com una variable global, ja que noms n'hi ha una i per tant tothom hi podr accedir
 	static Application* instance;
+	static std::string scene_filename; //the scene loaded on start, data/scene.json unless one is passed in the command line
 
 	//window
 	SDL_Window* window;
@@ -0,0 +1,563 @@
+#include "bvh.h"
+#include "simd.h"
+#include "task.h"
+
+#include <cassert>
+#include <algorithm>
+#include <cfloat>
+
+int MeshBVH::max_leaf_triangles = 8;
+
+//bounds of the triangles while building
+struct sBuildBounds {
+	Vector3 min;
+	Vector3 max;
+
+	sBuildBounds() { min.set(FLT_MAX, FLT_MAX, FLT_MAX); max.set(-FLT_MAX, -FLT_MAX, -FLT_MAX); }
+	void add(const Vector3& p)
+	{
+		min.set(std::min(min.x, p.x), std::min(min.y, p.y), std::min(min.z, p.z));
+		max.set(std::max(max.x, p.x), std::max(max.y, p.y), std::max(max.z, p.z));
+	}
+	void add(const sBuildBounds& b) { add(b.min); add(b.max); }
+	float area() const //half of it, only compared
+	{
+		if (min.x > max.x)
+			return 0.0f;
+		Vector3 d = max - min;
+		return d.x * d.y + d.y * d.z + d.z * d.x;
+	}
+};
+
+void MeshBVH::clear()
+{
+	nodes.clear();
+	triangles.clear();
+	triangle_ids.clear();
+}
+
+size_t MeshBVH::getMemorySize() const
+{
+	return nodes.size() * sizeof(Node) + triangles.size() * sizeof(Vector3) + triangle_ids.size() * sizeof(int);
+}
+
+Vector3 MeshBVH::getTriangleNormal(int triangle, const Matrix44& model) const
+{
+	const Vector3* v = &triangles[triangle * 3];
+	Vector3 normal = model.rotateVector(v[1] - v[0]).cross(model.rotateVector(v[2] - v[0]));
+	float length = normal.length();
+	return length > 0.0f ? normal * (1.0f / length) : Vector3();
+}
+
+void MeshBVH::buildNodes(const Vector3* bounds, int num, int max_leaf, std::vector<Node>& nodes, std::vector<int>& order)
+{
+	assert(sizeof(Node) == 32);
+	nodes.clear();
+	order.resize(num);
+	if (num <= 0)
+		return;
+
+	std::vector<sBuildBounds> boxes(num);
+	std::vector<Vector3> centroids(num);
+	for (int i = 0; i < num; ++i)
+	{
+		boxes[i].min = bounds[i * 2];
+		boxes[i].max = bounds[i * 2 + 1];
+		centroids[i] = (boxes[i].min + boxes[i].max) * 0.5f;
+		order[i] = i;
+	}
+
+	nodes.reserve(num * 2);
+	nodes.resize(1);
+	nodes[0].first = 0;
+	nodes[0].count = num;
+
+	//nodes waiting to be split, the children are created together so they are always next to each other
+	std::vector<int> stack(1, 0);
+	while (stack.size())
+	{
+		int node_index = stack.back();
+		stack.pop_back();
+		int first = nodes[node_index].first;
+		int count = nodes[node_index].count;
+
+		sBuildBounds node_bounds, centroid_bounds;
+		for (int i = first; i < first + count; ++i)
+		{
+			node_bounds.add(boxes[order[i]]);
+			centroid_bounds.add(centroids[order[i]]);
+		}
+		Node& node = nodes[node_index];
+		for (int k = 0; k < 3; ++k)
+		{
+			node.min[k] = node_bounds.min.v[k];
+			node.max[k] = node_bounds.max.v[k];
+		}
+		if (count <= 1)
+			continue;
+
+		//SAH in bins along every axis: the cost of a split is the number of primitives at each side by its area
+		float best_cost = FLT_MAX;
+		int best_axis = -1;
+		int best_split = 0;
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			float axis_min = centroid_bounds.min.v[axis];
+			float extent = centroid_bounds.max.v[axis] - axis_min;
+			if (extent <= 0.0f)
+				continue;
+			float scale = NUM_BINS / extent;
+			sBuildBounds bins[NUM_BINS];
+			int bin_counts[NUM_BINS] = { 0 };
+			for (int i = first; i < first + count; ++i)
+			{
+				int bin = std::min((int)((centroids[order[i]].v[axis] - axis_min) * scale), NUM_BINS - 1);
+				bins[bin].add(boxes[order[i]]);
+				bin_counts[bin]++;
+			}
+
+			//areas and counts at the right of every plane, then sweep from the left
+			float right_areas[NUM_BINS];
+			int right_counts[NUM_BINS];
+			sBuildBounds right;
+			int right_count = 0;
+			for (int i = NUM_BINS - 1; i > 0; --i)
+			{
+				right.add(bins[i]);
+				right_count += bin_counts[i];
+				right_areas[i] = right.area();
+				right_counts[i] = right_count;
+			}
+			sBuildBounds left;
+			int left_count = 0;
+			for (int i = 1; i < NUM_BINS; ++i)
+			{
+				left.add(bins[i - 1]);
+				left_count += bin_counts[i - 1];
+				if (!left_count || !right_counts[i])
+					continue;
+				float cost = left.area() * left_count + right_areas[i] * right_counts[i];
+				if (cost < best_cost)
+				{
+					best_cost = cost;
+					best_axis = axis;
+					best_split = i;
+				}
+			}
+		}
+
+		//a leaf costs testing all its primitives, a split one traversal step plus the cost of the children
+		float leaf_cost = node_bounds.area() * count;
+		float split_cost = node_bounds.area() + best_cost;
+		if (count <= max_leaf && (best_axis == -1 || split_cost >= leaf_cost))
+			continue;
+
+		int middle = first + count / 2; //the centroids are all in the same place, any half is as good
+		if (best_axis != -1)
+		{
+			float axis_min = centroid_bounds.min.v[best_axis];
+			float scale = NUM_BINS / (centroid_bounds.max.v[best_axis] - axis_min);
+			int* split = std::partition(&order[first], &order[first] + count, [&](int t) {
+				return std::min((int)((centroids[t].v[best_axis] - axis_min) * scale), NUM_BINS - 1) < best_split;
+			});
+			middle = (int)(split - &order[0]);
+		}
+
+		int left_index = (int)nodes.size();
+		nodes.resize(nodes.size() + 2);
+		nodes[node_index].first = left_index;
+		nodes[node_index].count = 0;
+		nodes[left_index].first = first;
+		nodes[left_index].count = middle - first;
+		nodes[left_index + 1].first = middle;
+		nodes[left_index + 1].count = first + count - middle;
+		stack.push_back(left_index + 1);
+		stack.push_back(left_index);
+	}
+}
+
+void MeshBVH::build(const void* positions, int stride, int num_vertices, const unsigned int* indices, int num_triangles)
+{
+	clear();
+	if (num_triangles <= 0)
+		return;
+
+	const char* data = (const char*)positions;
+	std::vector<Vector3> vertices(num_triangles * 3);
+	std::vector<Vector3> bounds(num_triangles * 2);
+	for (int i = 0; i < num_triangles; ++i)
+	{
+		sBuildBounds box;
+		for (int j = 0; j < 3; ++j)
+		{
+			unsigned int index = indices ? indices[i * 3 + j] : i * 3 + j;
+			assert((int)index < num_vertices);
+			vertices[i * 3 + j] = *(const Vector3*)(data + index * stride);
+			box.add(vertices[i * 3 + j]);
+		}
+		bounds[i * 2] = box.min;
+		bounds[i * 2 + 1] = box.max;
+	}
+
+	buildNodes(&bounds[0], num_triangles, max_leaf_triangles, nodes, triangle_ids);
+
+	triangles.resize(num_triangles * 3);
+	for (int i = 0; i < num_triangles; ++i)
+		for (int j = 0; j < 3; ++j)
+			triangles[i * 3 + j] = vertices[triangle_ids[i] * 3 + j];
+}
+
+//per ray constants of the watertight ray/triangle test (Woop, Benthin and Wald 2013): the vertices are moved to a
+//space where the ray goes along +z from the origin, so the edges shared by two triangles give the same result in both
+//and no ray goes through the gap between them
+struct sWatertightRay {
+	Vector3 origin;
+	int kx, ky, kz;
+	float sx, sy, sz;
+
+	void set(const Vector3& ray_origin, const Vector3& direction)
+	{
+		origin = ray_origin;
+		Vector3 d(fabsf(direction.x), fabsf(direction.y), fabsf(direction.z));
+		kz = d.x > d.y ? (d.x > d.z ? 0 : 2) : (d.y > d.z ? 1 : 2);
+		kx = (kz + 1) % 3;
+		ky = (kx + 1) % 3;
+		if (direction.v[kz] < 0.0f) //keep the winding
+			std::swap(kx, ky);
+		sx = direction.v[kx] / direction.v[kz];
+		sy = direction.v[ky] / direction.v[kz];
+		sz = 1.0f / direction.v[kz];
+	}
+
+	bool intersect(const Vector3* vertices, float max_distance, RayHit& hit) const
+	{
+		//the components are read from the vertices, a temporary Vector3 indexed with kx would be written packed and
+		//read one float at a time, which stalls the loads
+		float az = vertices[0].v[kz] - origin.v[kz];
+		float bz = vertices[1].v[kz] - origin.v[kz];
+		float cz = vertices[2].v[kz] - origin.v[kz];
+		float ax = vertices[0].v[kx] - origin.v[kx] - sx * az;
+		float ay = vertices[0].v[ky] - origin.v[ky] - sy * az;
+		float bx = vertices[1].v[kx] - origin.v[kx] - sx * bz;
+		float by = vertices[1].v[ky] - origin.v[ky] - sy * bz;
+		float cx = vertices[2].v[kx] - origin.v[kx] - sx * cz;
+		float cy = vertices[2].v[ky] - origin.v[ky] - sy * cz;
+		float u = cx * by - cy * bx;
+		float v = ax * cy - ay * cx;
+		float w = bx * ay - by * ax;
+
+		//exactly on an edge, computed again in double so the result doesn't depend on the rounding
+		if (u == 0.0f || v == 0.0f || w == 0.0f)
+		{
+			u = (float)((double)cx * (double)by - (double)cy * (double)bx);
+			v = (float)((double)ax * (double)cy - (double)ay * (double)cx);
+			w = (float)((double)bx * (double)ay - (double)by * (double)ax);
+		}
+		if ((u < 0.0f || v < 0.0f || w < 0.0f) && (u > 0.0f || v > 0.0f || w > 0.0f))
+			return false;
+		float det = u + v + w;
+		if (det == 0.0f)
+			return false;
+
+		//the distance is compared scaled by the determinant, so the misses don't divide
+		float t = sz * (u * az + v * bz + w * cz);
+		float abs_det = fabsf(det);
+		float signed_t = det < 0.0f ? -t : t;
+		if (!(signed_t > 0.0f && signed_t < max_distance * abs_det))
+			return false;
+		float inv_det = 1.0f / det;
+		hit.distance = t * inv_det;
+		hit.u = v * inv_det;
+		hit.v = w * inv_det;
+		return true;
+	}
+};
+
+//a direction component of 0 would give 0 * inf in the slab test
+static inline float safeInverse(float f)
+{
+	return 1.0f / (fabsf(f) > 1e-20f ? f : (f < 0.0f ? -1e-20f : 1e-20f));
+}
+
+bool MeshBVH::testRay(const Vector3& origin, const Vector3& direction, float max_distance, RayHit& hit) const
+{
+	hit.triangle = -1;
+	hit.distance = max_distance;
+	if (nodes.empty())
+		return false;
+
+	sWatertightRay ray;
+	ray.set(origin, direction);
+
+	//the fourth lane is 0 in the three of them (the ints of the node would be denormals, which are very slow) so it
+	//clamps the near distance to 0, the far one ignores it
+	simd::float4 o = simd::set(origin.x, origin.y, origin.z, 0.0f);
+	simd::float4 inv = simd::set(safeInverse(direction.x), safeInverse(direction.y), safeInverse(direction.z), 0.0f);
+	simd::float4 ignore_w = simd::set(-FLT_MAX, -FLT_MAX, -FLT_MAX, FLT_MAX);
+
+	//distance to the box, FLT_MAX if it is missed
+	auto slabs = [&](const Node& node, float max_t) -> float {
+		simd::float4 t0 = simd::mul(simd::sub(simd::load3(node.min), o), inv);
+		simd::float4 t1 = simd::mul(simd::sub(simd::load3(node.max), o), inv);
+		float t_near = simd::first(simd::hmax(simd::min(t0, t1)));
+		float t_far = simd::first(simd::hmin(simd::max(simd::max(t0, t1), ignore_w)));
+		return t_near <= t_far && t_near <= max_t ? t_near : FLT_MAX;
+	};
+
+	if (slabs(nodes[0], hit.distance) == FLT_MAX)
+		return false;
+
+	//the closest child is visited first, the other one waits in the stack with its distance
+	int stack[64];
+	float stack_distances[64];
+	int stack_size = 0;
+	int node_index = 0;
+	while (true)
+	{
+		const Node& node = nodes[node_index];
+		if (node.count)
+		{
+			for (int i = node.first; i < node.first + node.count; ++i)
+				if (ray.intersect(&triangles[i * 3], hit.distance, hit))
+					hit.triangle = i;
+		}
+		else
+		{
+			float d0 = slabs(nodes[node.first], hit.distance);
+			float d1 = slabs(nodes[node.first + 1], hit.distance);
+			int near_index = node.first;
+			int far_index = node.first + 1;
+			if (d1 < d0)
+			{
+				std::swap(d0, d1);
+				std::swap(near_index, far_index);
+			}
+			if (d0 != FLT_MAX)
+			{
+				if (d1 != FLT_MAX)
+				{
+					assert(stack_size < 64);
+					stack[stack_size] = far_index;
+					stack_distances[stack_size++] = d1;
+				}
+				node_index = near_index;
+				continue;
+			}
+		}
+
+		//next node still closer than the hit
+		do {
+			if (!stack_size)
+				return hit.triangle != -1;
+			--stack_size;
+		} while (stack_distances[stack_size] > hit.distance);
+		node_index = stack[stack_size];
+	}
+}
+
+static inline int firstBit(int mask)
+{
+	int i = 0;
+	while (!(mask & (1 << i)))
+		++i;
+	return i;
+}
+
+int MeshBVH::testRayPacket(const Ray* rays, const float* max_distances, RayHit* hits) const
+{
+	sWatertightRay watertight[4];
+	float origins[3][4], inverses[3][4], distances[4];
+	for (int i = 0; i < 4; ++i)
+	{
+		watertight[i].set(rays[i].origin, rays[i].direction);
+		for (int k = 0; k < 3; ++k)
+		{
+			origins[k][i] = rays[i].origin.v[k];
+			inverses[k][i] = safeInverse(rays[i].direction.v[k]);
+		}
+		distances[i] = max_distances[i];
+		hits[i].triangle = -1;
+		hits[i].distance = max_distances[i];
+	}
+	if (nodes.empty())
+		return 0;
+
+	//one lane per ray
+	simd::float4 ox = simd::load(origins[0]), oy = simd::load(origins[1]), oz = simd::load(origins[2]);
+	simd::float4 ix = simd::load(inverses[0]), iy = simd::load(inverses[1]), iz = simd::load(inverses[2]);
+	simd::float4 max_t = simd::load(distances);
+	simd::float4 zero = simd::splat(0.0f);
+
+	int stack[64];
+	int stack_size = 0;
+	stack[stack_size++] = 0;
+	while (stack_size)
+	{
+		const Node& node = nodes[stack[--stack_size]];
+		simd::float4 tx0 = simd::mul(simd::sub(simd::splat(node.min[0]), ox), ix);
+		simd::float4 tx1 = simd::mul(simd::sub(simd::splat(node.max[0]), ox), ix);
+		simd::float4 ty0 = simd::mul(simd::sub(simd::splat(node.min[1]), oy), iy);
+		simd::float4 ty1 = simd::mul(simd::sub(simd::splat(node.max[1]), oy), iy);
+		simd::float4 tz0 = simd::mul(simd::sub(simd::splat(node.min[2]), oz), iz);
+		simd::float4 tz1 = simd::mul(simd::sub(simd::splat(node.max[2]), oz), iz);
+		simd::float4 t_near = simd::max(simd::max(simd::min(tx0, tx1), simd::min(ty0, ty1)), simd::max(simd::min(tz0, tz1), zero));
+		simd::float4 t_far = simd::min(simd::min(simd::max(tx0, tx1), simd::max(ty0, ty1)), simd::min(simd::max(tz0, tz1), max_t));
+		int mask = simd::lessEqualMask(t_near, t_far);
+		if (!mask)
+			continue;
+
+		if (!node.count)
+		{
+			//the child closer to the rays goes first, along the axis where the children are further apart and with the
+			//direction of the first active ray (they should be similar), so the rest are skipped once they hit
+			const Node& left = nodes[node.first];
+			const Node& right = nodes[node.first + 1];
+			float best = -1.0f, order = 0.0f;
+			for (int k = 0; k < 3; ++k)
+			{
+				float d = (right.min[k] + right.max[k]) - (left.min[k] + left.max[k]);
+				if (fabsf(d) > best)
+				{
+					best = fabsf(d);
+					order = d * inverses[k][firstBit(mask)];
+				}
+			}
+			assert(stack_size + 2 <= 64);
+			int near_index = order >= 0.0f ? node.first : node.first + 1;
+			stack[stack_size++] = near_index == node.first ? node.first + 1 : node.first;
+			stack[stack_size++] = near_index;
+			continue;
+		}
+
+		//the triangles are tested by every ray that reached the leaf
+		for (int r = 0; r < 4; ++r)
+		{
+			if (!(mask & (1 << r)))
+				continue;
+			for (int i = node.first; i < node.first + node.count; ++i)
+				if (watertight[r].intersect(&triangles[i * 3], hits[r].distance, hits[r]))
+					hits[r].triangle = i;
+			distances[r] = hits[r].distance;
+		}
+		max_t = simd::load(distances);
+	}
+
+	int result = 0;
+	for (int i = 0; i < 4; ++i)
+		if (hits[i].triangle != -1)
+			result |= 1 << i;
+	return result;
+}
+
+//the packets only help if the rays visit the same nodes
+static bool sameOctant(const Ray* rays)
+{
+	for (int i = 1; i < 4; ++i)
+		for (int k = 0; k < 3; ++k)
+			if ((rays[i].direction.v[k] < 0.0f) != (rays[0].direction.v[k] < 0.0f))
+				return false;
+	return true;
+}
+
+int MeshBVH::testRays(const Ray* rays, int num_rays, float max_distance, RayHit* hits) const
+{
+	const int PACKETS_PER_JOB = 16;
+	int num_packets = (num_rays + 3) / 4;
+	std::vector<int> num_hits((num_packets + PACKETS_PER_JOB - 1) / PACKETS_PER_JOB, 0);
+	parallelFor((int)num_hits.size(), [&](int job) {
+		float distances[4] = { max_distance, max_distance, max_distance, max_distance };
+		int last = std::min((job + 1) * PACKETS_PER_JOB, num_packets);
+		for (int packet = job * PACKETS_PER_JOB; packet < last; ++packet)
+		{
+			int first = packet * 4;
+			if (first + 4 <= num_rays && sameOctant(rays + first))
+			{
+				int mask = testRayPacket(rays + first, distances, hits + first);
+				for (; mask; mask &= mask - 1)
+					num_hits[job]++;
+				continue;
+			}
+			for (int i = first; i < std::min(first + 4, num_rays); ++i) //rays that go apart and the last ones
+				if (testRay(rays[i].origin, rays[i].direction, max_distance, hits[i]))
+					num_hits[job]++;
+		}
+	});
+
+	int total = 0;
+	for (int n : num_hits)
+		total += n;
+	return total;
+}
+
+//closest point of a triangle to p (Ericson, Real-Time Collision Detection 5.1.5)
+static Vector3 closestPointInTriangle(const Vector3& p, const Vector3& a, const Vector3& b, const Vector3& c)
+{
+	Vector3 ab = b - a, ac = c - a, ap = p - a;
+	float d1 = ab.dot(ap), d2 = ac.dot(ap);
+	if (d1 <= 0.0f && d2 <= 0.0f)
+		return a;
+	Vector3 bp = p - b;
+	float d3 = ab.dot(bp), d4 = ac.dot(bp);
+	if (d3 >= 0.0f && d4 <= d3)
+		return b;
+	float vc = d1 * d4 - d3 * d2;
+	if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f)
+		return a + ab * (d1 / (d1 - d3));
+	Vector3 cp = p - c;
+	float d5 = ab.dot(cp), d6 = ac.dot(cp);
+	if (d6 >= 0.0f && d5 <= d6)
+		return c;
+	float vb = d5 * d2 - d1 * d6;
+	if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f)
+		return a + ac * (d2 / (d2 - d6));
+	float va = d3 * d6 - d5 * d4;
+	if (va <= 0.0f && (d4 - d3) >= 0.0f && (d5 - d6) >= 0.0f)
+		return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+	float denom = 1.0f / (va + vb + vc);
+	return a + ab * (vb * denom) + ac * (vc * denom);
+}
+
+bool MeshBVH::testSphere(const Vector3& center, float radius, Vector3& collision, int& triangle) const
+{
+	triangle = -1;
+	if (nodes.empty())
+		return false;
+
+	float best = radius * radius;
+	int stack[64];
+	int stack_size = 0;
+	stack[stack_size++] = 0;
+	while (stack_size)
+	{
+		const Node& node = nodes[stack[--stack_size]];
+		//squared distance from the center to the box, compared with the closest triangle found
+		float distance = 0.0f;
+		for (int k = 0; k < 3; ++k)
+		{
+			float d = std::max(std::max(node.min[k] - center.v[k], center.v[k] - node.max[k]), 0.0f);
+			distance += d * d;
+		}
+		if (distance > best)
+			continue;
+
+		if (!node.count)
+		{
+			stack[stack_size++] = node.first + 1;
+			stack[stack_size++] = node.first;
+			continue;
+		}
+		for (int i = node.first; i < node.first + node.count; ++i)
+		{
+			const Vector3* v = &triangles[i * 3];
+			Vector3 p = closestPointInTriangle(center, v[0], v[1], v[2]);
+			float d = (p - center).dot(p - center);
+			if (d <= best)
+			{
+				best = d;
+				collision = p;
+				triangle = i;
+			}
+		}
+	}
+	return triangle != -1;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "framework.h"
+#include <vector>
+
+//closest hit of a ray, the distance is in units of the ray direction (it doesn't need to be normalized)
+struct RayHit {
+	float distance;
+	int triangle;	//in the order of the BVH (-1 if nothing was hit), MeshBVH::triangle_ids has the one of the mesh
+	float u, v;		//barycentric coordinates of the hit (weights of the second and the third vertex)
+};
+
+//bounding volume hierarchy over the triangles of a mesh in object space, built with the surface area heuristic
+//evaluated in bins. The triangles are copied in the order of the leaves so every leaf reads contiguous memory
+class MeshBVH {
+public:
+	//32 bytes: an inner node has its two children together starting at first, a leaf has count triangles from first
+	struct Node {
+		float min[3];
+		int first;
+		float max[3];
+		int count; //0 for inner nodes
+	};
+
+	static int max_leaf_triangles;	//a leaf can have less if the SAH says it is cheaper
+	static const int NUM_BINS = 16;
+
+	std::vector<Node> nodes;
+	std::vector<Vector3> triangles; //three vertices per triangle
+	std::vector<int> triangle_ids;
+
+	//the positions are num_vertices Vector3 separated by stride bytes, indices can be NULL (three vertices per triangle)
+	void build(const void* positions, int stride, int num_vertices, const unsigned int* indices, int num_triangles);
+	void clear();
+	//binned SAH over any kind of primitives given their boxes (min and max, two Vector3 per primitive), fills the
+	//nodes and the order of the primitives in the leaves. The scene tree uses it too
+	static void buildNodes(const Vector3* bounds, int num, int max_leaf, std::vector<Node>& nodes, std::vector<int>& order);
+	int getNumTriangles() const { return (int)triangle_ids.size(); }
+	size_t getMemorySize() const;
+	Vector3 getTriangleNormal(int triangle, const Matrix44& model) const; //normalized in the space of model, 0 if it has no area
+
+	//closest hit till max_distance
+	bool testRay(const Vector3& origin, const Vector3& direction, float max_distance, RayHit& hit) const;
+	//four rays traversing the tree together, every node is tested against all of them at once (better when they are
+	//coherent, like the pixels of a tile). Returns the mask of the rays that hit something
+	int testRayPacket(const Ray* rays, const float* max_distances, RayHit* hits) const;
+	//many rays spread among the workers, in packets of four when they go in the same direction. Returns how many hit
+	int testRays(const Ray* rays, int num_rays, float max_distance, RayHit* hits) const;
+	//closest point of the triangles to the center if it is inside the sphere
+	bool testSphere(const Vector3& center, float radius, Vector3& collision, int& triangle) const;
+};
@@ -0,0 +1,496 @@
+#include "environment.h"
+#include "texture.h"
+#include "sphericalharmonics.h"
+#include "task.h"
+#include "utils.h"
+#include "includes.h"
+#include "extra/hdre.h"
+
+#include <cassert>
+#include <cmath>
+#include <string>
+
+int PrefilteredCubemap::num_samples = 64;
+bool PrefilteredCubemap::use_hdre_levels = true;
+
+#define BRDF_LUT_SIZE 128
+#define BRDF_LUT_SAMPLES 512
+
+struct sIBLHeader {
+	char signature[4]; //"IBLC" or "BRDF"
+	int version;
+	int size;
+	int num_levels; //1 for the LUT
+	int num_samples;
+};
+
+int getHDREMipChainLevels(HDRE* hdre)
+{
+	//older versions dont go under 8
+	int levels = 0;
+	while (levels < hdre->levels && hdre->getLevelSize(levels) == std::max(hdre->width >> levels, 1))
+		levels++;
+	return levels;
+}
+
+//the worker leaves the level ready in memory (as half or with its pages read) and the main thread uploads it
+//and lowers the base level, so the samples never read a level that is not there yet
+static void streamHDRELevel(HDRE* hdre, Texture* texture, int level, long start_time)
+{
+	TaskManager::workers.addTask(new Task([hdre, texture, level, start_time]() {
+		bool half = HDRE::use_half_float && hdre->convertLevelToHalf(level);
+		if (!half)
+			hdre->prefetchLevel(level);
+
+		TaskManager::foreground.addTask(new Task([hdre, texture, level, start_time, half]() {
+			int format = hdre->header.numChannels == 3 ? GL_RGB : GL_RGBA;
+			if (half)
+				texture->uploadCubemap(format, GL_HALF_FLOAT, false, (Uint8**)hdre->getFacesh(level), 0, level);
+			else
+				texture->uploadCubemap(format, GL_FLOAT, false, (Uint8**)hdre->getFacesf(level), 0, level);
+			glBindTexture(GL_TEXTURE_CUBE_MAP, texture->texture_id);
+			glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_BASE_LEVEL, level);
+			glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+
+			if (level > 0)
+				streamHDRELevel(hdre, texture, level - 1, start_time);
+			else
+				stdlog(" + Environment streamed: " + texture->filename + " Time: " + std::to_string((getTime() - start_time) * 0.001) + "sec");
+		}));
+	}));
+}
+
+int streamHDREToCubemap(HDRE* hdre, Texture* texture, int max_levels)
+{
+	long time = getTime();
+	int num_levels = std::min(getHDREMipChainLevels(hdre), max_levels);
+	int last = num_levels - 1;
+	if (!num_levels || !hdre->getFacef(last, 0))
+		return 0;
+
+	//only the storage of the first level, the rest are uploaded from the coarsest one
+	int format = hdre->header.numChannels == 3 ? GL_RGB : GL_RGBA;
+	int internal_format = format == GL_RGB ? GL_RGB16F : GL_RGBA16F;
+	glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+	texture->createCubemap(hdre->width, hdre->height, NULL, format, GL_FLOAT, true, internal_format);
+
+	//the coarsest level is tiny, it is uploaded now so the texture can be used this frame
+	if (HDRE::use_half_float && hdre->convertLevelToHalf(last))
+		texture->uploadCubemap(format, GL_HALF_FLOAT, false, (Uint8**)hdre->getFacesh(last), 0, last);
+	else
+		texture->uploadCubemap(format, GL_FLOAT, false, (Uint8**)hdre->getFacesf(last), 0, last);
+
+	texture->mipmaps = true;
+	glBindTexture(GL_TEXTURE_CUBE_MAP, texture->texture_id);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_BASE_LEVEL, last);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, last);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+	assert(checkGLErrors() && "Error uploading HDRE level");
+	stdlog(" + Environment first level: " + texture->filename + " Time: " + std::to_string((getTime() - time) * 0.001) + "sec");
+
+	if (last > 0)
+		streamHDRELevel(hdre, texture, last - 1, time);
+	return num_levels;
+}
+
+//the source with its box filtered mips, so the samples can read the mip that covers their solid angle
+struct sSourceChain {
+	int size;
+	int num_mips;
+	std::vector< std::vector<float> > faces; //mip * 6 + face, RGB
+	int getSize(int mip) const { return std::max(size >> mip, 1); }
+};
+
+//the faces of the first level are moved into the chain
+static void buildSourceChain(int size, std::vector< std::vector<float> >& first_level, sSourceChain& chain)
+{
+	chain.size = size;
+	chain.num_mips = (int)log2(chain.size) + 1;
+	chain.faces.resize(chain.num_mips * 6);
+	for (int j = 0; j < 6; ++j)
+		chain.faces[j].swap(first_level[j]);
+
+	for (int mip = 1; mip < chain.num_mips; ++mip)
+	{
+		int size = chain.getSize(mip);
+		int prev_size = chain.getSize(mip - 1);
+		for (int j = 0; j < 6; ++j)
+		{
+			const std::vector<float>& src = chain.faces[(mip - 1) * 6 + j];
+			std::vector<float>& dst = chain.faces[mip * 6 + j];
+			dst.resize(size * size * 3);
+			for (int y = 0; y < size; ++y)
+				for (int x = 0; x < size; ++x)
+					for (int c = 0; c < 3; ++c)
+					{
+						int x0 = std::min(x * 2, prev_size - 1), x1 = std::min(x * 2 + 1, prev_size - 1);
+						int y0 = std::min(y * 2, prev_size - 1), y1 = std::min(y * 2 + 1, prev_size - 1);
+						dst[(y * size + x) * 3 + c] = 0.25f * (src[(y0 * prev_size + x0) * 3 + c] + src[(y0 * prev_size + x1) * 3 + c] +
+							src[(y1 * prev_size + x0) * 3 + c] + src[(y1 * prev_size + x1) * 3 + c]);
+					}
+		}
+	}
+}
+
+//bilinear, u and v from -1 to 1 (the edges are clamped, the faces are not stitched)
+static Vector3 fetchFace(const std::vector<float>& face, int size, float u, float v)
+{
+	float x = clamp((u * 0.5f + 0.5f) * size - 0.5f, 0.0f, (float)(size - 1));
+	float y = clamp((v * 0.5f + 0.5f) * size - 0.5f, 0.0f, (float)(size - 1));
+	int x0 = (int)x, y0 = (int)y;
+	int x1 = std::min(x0 + 1, size - 1), y1 = std::min(y0 + 1, size - 1);
+	float fx = x - x0, fy = y - y0;
+	const float* p00 = &face[(y0 * size + x0) * 3];
+	const float* p10 = &face[(y0 * size + x1) * 3];
+	const float* p01 = &face[(y1 * size + x0) * 3];
+	const float* p11 = &face[(y1 * size + x1) * 3];
+	Vector3 result;
+	for (int c = 0; c < 3; ++c)
+		result.v[c] = (p00[c] * (1 - fx) + p10[c] * fx) * (1 - fy) + (p01[c] * (1 - fx) + p11[c] * fx) * fy;
+	return result;
+}
+
+static Vector3 sampleCubemap(const sSourceChain& chain, const Vector3& dir, float lod)
+{
+	float ax = fabs(dir.x), ay = fabs(dir.y), az = fabs(dir.z);
+	int face = 0;
+	if (ax >= ay && ax >= az)
+		face = dir.x > 0 ? 0 : 1;
+	else if (ay >= az)
+		face = dir.y > 0 ? 2 : 3;
+	else
+		face = dir.z > 0 ? 4 : 5;
+
+	//the inverse of dir = x * u + y * v + z, with the axis of the face
+	Vector3* axis = cubemapFaceNormals[face];
+	float w = dir.dot(axis[2]);
+	float u = dir.dot(axis[0]) / w;
+	float v = dir.dot(axis[1]) / w;
+
+	lod = clamp(lod, 0.0f, (float)(chain.num_mips - 1));
+	int mip = (int)lod;
+	float f = lod - mip;
+	Vector3 result = fetchFace(chain.faces[mip * 6 + face], chain.getSize(mip), u, v);
+	if (f > 0.0f && mip + 1 < chain.num_mips)
+		result = lerp(result, fetchFace(chain.faces[(mip + 1) * 6 + face], chain.getSize(mip + 1), u, v), f);
+	return result;
+}
+
+static Vector2 hammersley(unsigned int i, unsigned int num)
+{
+	unsigned int bits = i;
+	bits = (bits << 16u) | (bits >> 16u);
+	bits = ((bits & 0x55555555u) << 1u) | ((bits & 0xAAAAAAAAu) >> 1u);
+	bits = ((bits & 0x33333333u) << 2u) | ((bits & 0xCCCCCCCCu) >> 2u);
+	bits = ((bits & 0x0F0F0F0Fu) << 4u) | ((bits & 0xF0F0F0F0u) >> 4u);
+	bits = ((bits & 0x00FF00FFu) << 8u) | ((bits & 0xFF00FF00u) >> 8u);
+	return Vector2(i / (float)num, bits * 2.3283064365386963e-10f);
+}
+
+//half vector around (0,0,1) with the GGX distribution
+static Vector3 importanceSampleGGX(const Vector2& xi, float roughness)
+{
+	float a = roughness * roughness;
+	float phi = 2.0f * (float)PI * xi.x;
+	float cos_theta = sqrt((1.0f - xi.y) / (1.0f + (a * a - 1.0f) * xi.y));
+	float sin_theta = sqrt(1.0f - cos_theta * cos_theta);
+	return Vector3(sin_theta * cos(phi), sin_theta * sin(phi), cos_theta);
+}
+
+//the reflected directions around (0,0,1) are the same for every texel, only rotated to its normal
+struct sGGXSample {
+	Vector3 L;
+	float weight; //NdotL
+	float lod; //mip of the source with the solid angle of the sample (filtered importance sampling)
+};
+
+bool PrefilteredCubemap::prefilter(HDRE* hdre)
+{
+	if (!hdre->getFacef(0, 0)) //the floats were released
+		return false;
+	std::vector< std::vector<float> > first_level(6);
+	int channels = hdre->header.numChannels;
+	for (int j = 0; j < 6; ++j)
+	{
+		const float* src = hdre->getFacef(0, j);
+		std::vector<float>& dst = first_level[j];
+		dst.resize(hdre->width * hdre->width * 3);
+		for (int k = 0; k < hdre->width * hdre->width; ++k)
+			memcpy(&dst[k * 3], src + k * channels, sizeof(float) * 3);
+	}
+	prefilter(hdre->width, first_level);
+	return true;
+}
+
+void PrefilteredCubemap::prefilter(int first_size, std::vector< std::vector<float> >& first_level)
+{
+	sSourceChain chain;
+	buildSourceChain(first_size, first_level, chain);
+
+	size = chain.size;
+	num_levels = std::min(IBL_NUM_LEVELS, chain.num_mips);
+	faces.resize(num_levels * 6);
+	for (int j = 0; j < 6; ++j)
+		faces[j] = chain.faces[j]; //roughness 0 is a mirror
+
+	float texel_solid_angle = 4.0f * (float)PI / (6.0f * size * size);
+	for (int level = 1; level < num_levels; ++level)
+	{
+		float roughness = level / (float)(IBL_NUM_LEVELS - 1);
+		float a2 = roughness * roughness * roughness * roughness;
+
+		std::vector<sGGXSample> samples;
+		for (int i = 0; i < num_samples; ++i)
+		{
+			Vector3 H = importanceSampleGGX(hammersley(i, num_samples), roughness);
+			sGGXSample sample;
+			sample.L = Vector3(2.0f * H.z * H.x, 2.0f * H.z * H.y, 2.0f * H.z * H.z - 1.0f); //V = N
+			sample.weight = sample.L.z;
+			if (sample.weight <= 0.0f)
+				continue;
+			float d = H.z * H.z * (a2 - 1.0f) + 1.0f;
+			float pdf = a2 / ((float)PI * d * d) * 0.25f; //D * NdotH / (4 * VdotH) with NdotH = VdotH
+			float sample_solid_angle = 1.0f / (num_samples * pdf + 0.0001f);
+			sample.lod = 0.5f * log2(sample_solid_angle / texel_solid_angle) + 1.0f;
+			samples.push_back(sample);
+		}
+
+		int level_size = getLevelSize(level);
+		for (int j = 0; j < 6; ++j)
+			faces[level * 6 + j].resize(level_size * level_size * 3);
+
+		//every row of every face is independent
+		parallelFor(6 * level_size, [&](int item) {
+			int face = item / level_size;
+			int y = item % level_size;
+			Vector3* axis = cubemapFaceNormals[face];
+			float* dst = &faces[level * 6 + face][y * level_size * 3];
+			float fV = 2.0f * (y + 0.5f) / level_size - 1.0f;
+			for (int x = 0; x < level_size; ++x, dst += 3)
+			{
+				float fU = 2.0f * (x + 0.5f) / level_size - 1.0f;
+				Vector3 N = normalize(axis[0] * fU + axis[1] * fV + axis[2]);
+				Vector3 up = fabs(N.z) < 0.999f ? Vector3(0, 0, 1) : Vector3(1, 0, 0);
+				Vector3 T = normalize(up.cross(N));
+				Vector3 B = N.cross(T);
+
+				Vector3 color;
+				float total_weight = 0.0f;
+				for (const sGGXSample& sample : samples)
+				{
+					Vector3 L = T * sample.L.x + B * sample.L.y + N * sample.L.z;
+					color += sampleCubemap(chain, L, sample.lod) * sample.weight;
+					total_weight += sample.weight;
+				}
+				color = color * (1.0f / std::max(total_weight, 0.0001f));
+				dst[0] = color.x;
+				dst[1] = color.y;
+				dst[2] = color.z;
+			}
+		});
+	}
+}
+
+bool PrefilteredCubemap::load(const char* filename)
+{
+	FILE* file = fopen(filename, "rb");
+	if (!file)
+		return false;
+
+	sIBLHeader header;
+	bool valid = fread(&header, sizeof(header), 1, file) == 1 && memcmp(header.signature, "IBLC", 4) == 0 &&
+		header.version == IBL_VERSION && header.num_samples == num_samples && header.size > 0 &&
+		header.num_levels > 0 && header.num_levels <= IBL_NUM_LEVELS;
+	if (valid)
+	{
+		size = header.size;
+		num_levels = header.num_levels;
+		faces.resize(num_levels * 6);
+		for (int i = 0; i < num_levels * 6 && valid; ++i)
+		{
+			int level_size = getLevelSize(i / 6);
+			faces[i].resize(level_size * level_size * 3);
+			valid = fread(&faces[i][0], sizeof(float) * faces[i].size(), 1, file) == 1;
+		}
+	}
+	fclose(file);
+
+	if (!valid)
+		faces.clear();
+	return valid;
+}
+
+bool PrefilteredCubemap::save(const char* filename)
+{
+	FILE* file = fopen(filename, "wb");
+	if (!file)
+		return false;
+
+	sIBLHeader header;
+	memcpy(header.signature, "IBLC", 4);
+	header.version = IBL_VERSION;
+	header.size = size;
+	header.num_levels = num_levels;
+	header.num_samples = num_samples;
+	fwrite(&header, sizeof(header), 1, file);
+	for (size_t i = 0; i < faces.size(); ++i)
+		fwrite(&faces[i][0], sizeof(float) * faces[i].size(), 1, file);
+	fclose(file);
+	return true;
+}
+
+void PrefilteredCubemap::upload(Texture* texture, int first_level)
+{
+	assert(num_levels && "nothing to upload");
+	//the filtering across the edges of the faces
+	glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+
+	Uint8* data[6];
+	for (int level = first_level; level < num_levels; ++level)
+	{
+		for (int j = 0; j < 6; ++j)
+			data[j] = (Uint8*)getFace(level, j);
+		if (level == 0)
+			texture->createCubemap(size, size, data, GL_RGB, GL_FLOAT, true, GL_RGB16F);
+		else
+			texture->uploadCubemap(GL_RGB, GL_FLOAT, false, data, GL_RGB16F, level);
+	}
+
+	//the shader picks the level of its roughness, even if the size is not a power of two
+	texture->mipmaps = true;
+	glBindTexture(GL_TEXTURE_CUBE_MAP, texture->texture_id);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, num_levels - 1);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+	assert(checkGLErrors() && "Error uploading prefiltered cubemap");
+}
+
+void integrateBRDF(int size, int num_samples, std::vector<float>& result)
+{
+	result.resize(size * size * 2);
+	parallelFor(size, [&](int y) {
+		float roughness = (y + 0.5f) / size;
+		float a = roughness * roughness;
+		float k = a * 0.5f; //Schlick-Smith for IBL
+		for (int x = 0; x < size; ++x)
+		{
+			float NdotV = (x + 0.5f) / size;
+			Vector3 V(sqrt(1.0f - NdotV * NdotV), 0.0f, NdotV);
+			float scale = 0.0f, bias = 0.0f;
+			for (int i = 0; i < num_samples; ++i)
+			{
+				Vector3 H = importanceSampleGGX(hammersley(i, num_samples), roughness);
+				float VdotH = V.dot(H);
+				Vector3 L = H * (2.0f * VdotH) - V;
+				float NdotL = L.z;
+				if (NdotL <= 0.0f)
+					continue;
+				float NdotH = std::max(H.z, 0.0f);
+				VdotH = std::max(VdotH, 0.0f);
+				float G = (NdotV / (NdotV * (1.0f - k) + k)) * (NdotL / (NdotL * (1.0f - k) + k));
+				float G_vis = G * VdotH / (NdotH * NdotV);
+				float Fc = pow(1.0f - VdotH, 5.0f);
+				scale += (1.0f - Fc) * G_vis;
+				bias += Fc * G_vis;
+			}
+			result[(y * size + x) * 2] = scale / num_samples;
+			result[(y * size + x) * 2 + 1] = bias / num_samples;
+		}
+	});
+}
+
+Texture* GetPrefilteredEnvironmentAsync(const char* filename)
+{
+	std::string name = std::string(filename) + ".ibl";
+	Texture* texture = Texture::Find(name.c_str());
+	if (texture)
+		return texture;
+
+	//register it without GL texture till it is loaded, the renderer skips it meanwhile
+	Texture* temp = new Texture();
+	temp->state = RESOURCE_LOADING;
+	temp->filename = name;
+	texture = Texture::sTexturesLoaded.add(name, temp);
+	if (texture != temp) //another thread registered it first
+	{
+		delete temp;
+		return texture;
+	}
+
+	std::string source = filename;
+	TaskManager::background.addTask(new Task([temp, name, source]() {
+		PrefilteredCubemap* cubemap = new PrefilteredCubemap();
+		if (!cubemap->load(name.c_str()))
+		{
+			HDRE* hdre = HDRE::Get(source.c_str());
+			if (hdre && PrefilteredCubemap::use_hdre_levels && getHDREMipChainLevels(hdre) >= IBL_NUM_LEVELS)
+			{
+				//the levels of the file are streamed from the coarsest one, it can be used from the first upload
+				delete cubemap;
+				TaskManager::foreground.addTask(new Task([temp, hdre]() {
+					temp->state = streamHDREToCubemap(hdre, temp, IBL_NUM_LEVELS) ? RESOURCE_READY : RESOURCE_FAILED;
+				}));
+				return;
+			}
+
+			long time = getTime();
+			if (!hdre || !cubemap->prefilter(hdre))
+			{
+				delete cubemap;
+				cubemap = NULL;
+			}
+			else
+			{
+				stdlog(" + Environment prefiltered: " + source + " Time: " + std::to_string((getTime() - time) * 0.001) + "sec");
+				cubemap->save(name.c_str());
+			}
+		}
+
+		TaskManager::foreground.addTask(new Task([temp, cubemap]() {
+			if (cubemap)
+				cubemap->upload(temp);
+			temp->state = cubemap ? RESOURCE_READY : RESOURCE_FAILED;
+			delete cubemap;
+		}));
+	}));
+
+	return temp;
+}
+
+Texture* GetBRDFLUT()
+{
+	static Texture* lut = NULL;
+	if (lut)
+		return lut;
+
+	const char* filename = "data/brdf_lut.bin";
+	std::vector<float> data(BRDF_LUT_SIZE * BRDF_LUT_SIZE * 2);
+	sIBLHeader header;
+	FILE* file = fopen(filename, "rb");
+	bool loaded = file && fread(&header, sizeof(header), 1, file) == 1 && memcmp(header.signature, "BRDF", 4) == 0 &&
+		header.version == IBL_VERSION && header.size == BRDF_LUT_SIZE && header.num_samples == BRDF_LUT_SAMPLES &&
+		fread(&data[0], sizeof(float) * data.size(), 1, file) == 1;
+	if (file)
+		fclose(file);
+
+	if (!loaded)
+	{
+		integrateBRDF(BRDF_LUT_SIZE, BRDF_LUT_SAMPLES, data);
+		memcpy(header.signature, "BRDF", 4);
+		header.version = IBL_VERSION;
+		header.size = BRDF_LUT_SIZE;
+		header.num_levels = 1;
+		header.num_samples = BRDF_LUT_SAMPLES;
+		file = fopen(filename, "wb");
+		if (file)
+		{
+			fwrite(&header, sizeof(header), 1, file);
+			fwrite(&data[0], sizeof(float) * data.size(), 1, file);
+			fclose(file);
+		}
+	}
+
+	lut = new Texture(BRDF_LUT_SIZE, BRDF_LUT_SIZE, GL_RG, GL_FLOAT, false, (Uint8*)&data[0], GL_RG16F);
+	return lut;
+}
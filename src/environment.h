@@ -0,0 +1,57 @@
+#pragma once
+
+#include "framework.h"
+#include <vector>
+#include <algorithm>
+#include "extra/hdre.h"
+
+class Texture;
+
+//Image based lighting with the split sum approximation: the environment cubemap is prefiltered with GGX for
+//an increasing roughness (one per mip) and the BRDF is integrated in a LUT with the scale and bias of F0.
+//Both are computed by the workers the first time and cached (.ibl next to the HDRE, data/brdf_lut.bin).
+
+#define IBL_VERSION 1 //this is used to regenerate the caches if the format changes
+#define IBL_NUM_LEVELS 6 //the roughness of the level i is i / (IBL_NUM_LEVELS - 1), the same levels the HDRE stores
+
+//RGB float faces of every level, in the order of cubemapFaceNormals
+class PrefilteredCubemap
+{
+public:
+	static int num_samples; //GGX samples per texel
+	static bool use_hdre_levels; //the HDREs usually store the levels already blurred, they are streamed instead of prefiltering
+
+	int size; //of the first level
+	int num_levels;
+	std::vector< std::vector<float> > faces; //level * 6 + face
+
+	PrefilteredCubemap() { size = num_levels = 0; }
+	int getLevelSize(int level) const { return std::max(size >> level, 1); }
+	float* getFace(int level, int face) { return &faces[level * 6 + face][0]; }
+
+	//importance samples the first level of the HDRE, faces and rows are spread among the workers.
+	//False if the float data of the HDRE was released
+	bool prefilter(HDRE* hdre);
+	//the same from the RGB faces of the first level of any cubemap (like a reflection probe), they are moved out
+	void prefilter(int first_size, std::vector< std::vector<float> >& first_level);
+
+	bool load(const char* filename);
+	bool save(const char* filename);
+	void upload(Texture* texture, int first_level = 0); //as a cubemap with all the levels, only from the main thread
+	//(from first_level if the texture has the previous ones already)
+};
+
+//levels of the HDRE that form a mip chain (each one half the previous one)
+int getHDREMipChainLevels(HDRE* hdre);
+//creates the cubemap with the coarsest level and streams the rest (a worker converts or reads them, the main thread
+//uploads them and lowers GL_TEXTURE_BASE_LEVEL). Only from the main thread, returns the number of levels (0 if none)
+int streamHDREToCubemap(HDRE* hdre, Texture* texture, int max_levels = N_LEVELS);
+
+//scale and bias of F0 for every (NdotV, roughness), two floats per texel row by row (roughness in y)
+void integrateBRDF(int size, int num_samples, std::vector<float>& result);
+
+//returns a cubemap in RESOURCE_LOADING state, the background thread reads the cache (or the HDRE, prefiltering it
+//if needed) and the main thread uploads it once it is done
+Texture* GetPrefilteredEnvironmentAsync(const char* filename);
+//the BRDF LUT (RG), computed the first time it is needed
+Texture* GetBRDFLUT();
@@ -5,9 +5,22 @@
 #include <algorithm>
 
 #include "../utils.h"
+#include "../framework.h"
 #include "hdre.h"
 
-std::map<std::string, HDRE*> HDRE::s_loaded_hdres;
+#ifdef WIN32
+	#define WIN32_LEAN_AND_MEAN
+	#define NOMINMAX
+	#include <windows.h>
+#else
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif
+
+ResourceRegistry<HDRE> HDRE::s_loaded_hdres;
+bool HDRE::use_half_float = true;
 
 HDRE::HDRE()
 {
@@ -24,6 +37,9 @@ HDRE::HDRE(const char* filename)
 void HDRE::init()
 {
     data = nullptr;
+    mapping = nullptr;
+    mapping_size = 0;
+    file_handle = map_handle = nullptr;
     width = height = 0;
     levels = N_MAX_LEVELS;
 
@@ -36,15 +52,13 @@ void HDRE::init()
             pixels_b[i][j] = nullptr;
         }
     }
+    for (int i = 0; i < N_MAX_LEVELS; i++)
+        level_sizes[i] = 0;
 }
 
 HDRE::~HDRE()
 {
 	clean();
-
-	auto it = s_loaded_hdres.find(filename);
-	if (it != s_loaded_hdres.end())
-	    s_loaded_hdres.erase(it);
 }
 
 /*sHDRELevel HDRE::getLevel(int n)
@@ -101,149 +115,194 @@ short* HDRE::getFaceh(int level, int face)
 }
 
 
-bool HDRE::load(const char* filename)
+bool HDRE::mapFile(const char* filename)
 {
-	assert(filename);
-
-	FILE *f = fopen(filename,"rb");
-	if (f == nullptr)
+#ifdef WIN32
+	HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER size;
+	HANDLE map = NULL;
+	if (GetFileSizeEx(file, &size) && size.QuadPart > 0)
+		map = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	void* view = map ? MapViewOfFile(map, FILE_MAP_READ, 0, 0, 0) : NULL;
+	if (!view)
+	{
+		if (map)
+			CloseHandle(map);
+		CloseHandle(file);
+		return false;
+	}
+	file_handle = file;
+	map_handle = map;
+	mapping = view;
+	mapping_size = (size_t)size.QuadPart;
+#else
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1)
+		return false;
+	struct stat info;
+	void* view = MAP_FAILED;
+	if (fstat(fd, &info) == 0 && info.st_size > 0)
+		view = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd); //the mapping keeps the file
+	if (view == MAP_FAILED)
 		return false;
+	mapping = view;
+	mapping_size = (size_t)info.st_size;
+#endif
+	return true;
+}
 
-	sHDREHeader HDREHeader;
+void HDRE::unmapFile()
+{
+	if (!mapping)
+		return;
+#ifdef WIN32
+	UnmapViewOfFile(mapping);
+	CloseHandle((HANDLE)map_handle);
+	CloseHandle((HANDLE)file_handle);
+#else
+	munmap(mapping, mapping_size);
+#endif
+	mapping = nullptr;
+	mapping_size = 0;
+	file_handle = map_handle = nullptr;
+}
 
-	fread(&HDREHeader, sizeof(sHDREHeader), 1, f);
+// Only the header is read, the faces point to the mapped file and the OS reads them when they are accessed
+bool HDRE::load(const char* filename)
+{
+	assert(filename);
 
-	if (HDREHeader.type != 3) {
-        printf("HDRE Header has wrong type: %d\n", HDREHeader.type);
-        throw ("ArrayType not supported. Please export in Float32Array.");
-    }
+	if (!mapFile(filename))
+		return false;
 
-    this->header = HDREHeader;
+	if (mapping_size < sizeof(sHDREHeader))
+	{
+		unmapFile();
+		return false;
+	}
+	memcpy(&header, mapping, sizeof(sHDREHeader));
 
-	int width = HDREHeader.width;
-	int height = HDREHeader.height;
+	if (header.type != 3) {
+		printf("HDRE Header has wrong type: %d (ArrayType not supported. Please export in Float32Array)\n", header.type);
+		unmapFile();
+		return false;
+	}
 
-	this->width = width;
-	this->height = height;
+	this->width = header.width;
+	this->height = header.height;
 
-	int dataSize = 0;
+	// the levels stored in the file (the ones cut at the end are not used)
+	size_t offset = header.headerSize;
 	int w = width;
-
-	// Get number of floats inside the HDRE
-	// Per channel & Per face
+	levels = 0;
 	for (int i = 0; i < N_LEVELS; i++)
 	{
 		int mip_level = i + 1;
-		dataSize += w * w * N_FACES * HDREHeader.numChannels;
+		size_t face_floats = (size_t)w * w * header.numChannels;
+		if (offset + face_floats * N_FACES * sizeof(float) > mapping_size)
+			break;
+
+		level_sizes[i] = w;
+		for (int j = 0; j < N_FACES; j++)
+			this->pixels_f[i][j] = (float*)((char*)mapping + offset) + face_floats * j;
+		offset += face_floats * N_FACES * sizeof(float);
+		levels++;
 
-		//w = std::max(8, (int)(width / pow(2.0, mip_level)));
+		// reassign width for next level
 		w = fmax(8, (int)(width / pow(2.0, mip_level)));
 
 		if (this->header.version > 2.0)
 			w = (int)(width / pow(2.0, mip_level));
 	}
 
-	this->data = new float[dataSize];
-
-	fseek(f, HDREHeader.headerSize, SEEK_SET);
-
-	fread(this->data, sizeof(float) * dataSize, 1, f);
-	fclose(f);
-
-	// get separated levels
-
-	w = width;
-	int mapOffset = 0;
-    int mapPrevOffset = 0;
-
-	int nFullMips = 0;
-	while (w)
-    {
-	    nFullMips++;
-	    w >>= 1;
-    }
-	assert(nFullMips <= N_MAX_LEVELS);
-	levels = nFullMips;
-	w = width;
-    printf("Load %d mips of HDRE texture\n", nFullMips);
-
-    int i;
-    for (i = 0; i < N_LEVELS; i++)
+	if (!levels)
 	{
-		int mip_level = i + 1;
-		int faceSize = w * w * HDREHeader.numChannels;
-		int mapSize = faceSize * N_FACES;
-
-		int faceOffset = 0;
-
-		for (int j = 0; j < N_FACES; j++)
-		{
-			// allocate memory
-			this->pixels_f[i][j] = new float[faceSize];
-
-			// set data
-			for (int k = 0; k < faceSize; k++) {
+		unmapFile();
+		return false;
+	}
+	this->data = (float*)((char*)mapping + header.headerSize);
 
-				float value = this->data[mapOffset + faceOffset + k];
+	std::cout << std::endl << " + '" << filename << "' (v" << this->header.version << ") mapped, " << levels << " levels" << std::endl;
+	return true;
+}
 
-				this->pixels_f[i][j][k] = value;
-			}
+size_t HDRE::getLevelBytes(int level)
+{
+	return (size_t)level_sizes[level] * level_sizes[level] * header.numChannels * N_FACES * sizeof(float);
+}
 
-			// update face offset
-			faceOffset += faceSize;
-		}
+void HDRE::prefetchLevel(int level)
+{
+	if (!pixels_f[level][0])
+		return;
+#ifndef WIN32
+	//the start of the range must be aligned to the page
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	char* start = (char*)pixels_f[level][0];
+	char* aligned = (char*)((size_t)start & ~(page - 1));
+	madvise(aligned, getLevelBytes(level) + (start - aligned), MADV_WILLNEED);
+#endif
+	//touching one value per page reads them in this thread
+	volatile float sum = 0;
+	size_t num_floats = getLevelBytes(level) / sizeof(float);
+	for (size_t i = 0; i < num_floats; i += 1024)
+		sum += pixels_f[level][0][i];
+}
 
-		// update level offset
-		mapPrevOffset = mapOffset;
-		mapOffset += mapSize;
-		// reassign width for next level
-		//w = std::max(8, (int)(width / pow(2.0, mip_level)));
-		w = fmax(8, (int)(width / pow(2.0, mip_level)));
+bool HDRE::convertLevelToHalf(int level)
+{
+	if (pixels_h[level][0])
+		return true;
+	if (!pixels_f[level][0])
+		return false;
 
-		if (this->header.version > 2.0)
-			w = (int)(width / pow(2.0, mip_level));
+	size_t face_values = (size_t)level_sizes[level] * level_sizes[level] * header.numChannels;
+	short* faces = new short[face_values * N_FACES];
+	for (int j = 0; j < N_FACES; j++)
+	{
+		const float* src = pixels_f[level][j];
+		short* dst = faces + face_values * j;
+		for (size_t k = 0; k < face_values; k++)
+			dst[k] = (short)floatToHalf(src[k]);
+		pixels_h[level][j] = dst;
 	}
-	std::cout << std::endl << " + '" << filename << "' (v" << this->header.version << ") loaded successfully" << std::endl;
 	return true;
 }
 
+void HDRE::releaseFloatData()
+{
+	for (int j = 0; j < N_FACES; j++)
+		for (int i = 0; i < N_MAX_LEVELS; i++)
+			pixels_f[i][j] = nullptr;
+	data = nullptr;
+	unmapFile();
+}
+
 bool HDRE::clean()
 {
-	try
+	// the half faces of a level share one allocation, the float ones are in the mapped file
+	for (int i = 0; i < N_MAX_LEVELS; i++)
 	{
-		if (data)
-			delete data;
-
-        for (int j = 0; j < N_FACES; j++)
-        {
-            for (int i = 0; i < N_LEVELS; i++)
-            {
-				delete pixels_h[i][j];
-				pixels_h[i][j] = nullptr;
-			}
-            for (int i = 0; i < N_LEVELS; i++)
-            {
-                delete pixels_f[i][j];
-                pixels_f[i][j] = nullptr;
-            }
+		delete[] pixels_h[i][0];
+		for (int j = 0; j < N_FACES; j++)
+		{
+			pixels_h[i][j] = nullptr;
+			pixels_f[i][j] = nullptr;
 		}
-
-		return true;
 	}
-	catch (const std::exception&)
-	{
-		std::cout << std::endl << "Error cleaning" << std::endl;
-		return false;
-	}
-
-	return false;
+	data = nullptr;
+	unmapFile();
+	return true;
 }
 
 HDRE* HDRE::Get(const char* filename)
 {
-	auto it = s_loaded_hdres.find(filename);
-	if (it != s_loaded_hdres.end())
-		return it->second;
+	HDRE* found = s_loaded_hdres.find(filename);
+	if (found)
+		return found;
 
 	HDRE* hdre = new HDRE();
 	if (!hdre->load(filename))
@@ -253,6 +312,6 @@ HDRE* HDRE::Get(const char* filename)
 	}
 	hdre->filename = filename;
 
-	s_loaded_hdres[filename] = hdre;
+	s_loaded_hdres.add(filename, hdre);
 	return hdre;
 }
\ No newline at end of file
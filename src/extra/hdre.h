@@ -6,6 +6,7 @@
 
 #include <string>
 #include <map>
+#include "../resource.h"
 
 typedef unsigned char byte;
 
@@ -45,12 +46,19 @@ typedef struct {
 
 } sHDRELevel;
 
-class HDRE {
+class HDRE : public Resource {
 
 private:
 
     std::string filename;
-	float* data; // only f32 now
+	float* data; // only f32 now, points to the mapped file (NULL once released)
+
+	// the file is memory mapped, the pages of a level are only read from disk when it is accessed
+	void* mapping;
+	size_t mapping_size;
+	void* file_handle; // only in windows
+	void* map_handle;
+	int level_sizes[N_MAX_LEVELS];
 
     float* pixels_f[N_MAX_LEVELS][N_FACES]; // Xpos, Xneg, Ypos, Yneg, Zpos, Zneg
     short* pixels_h[N_MAX_LEVELS][N_FACES]; // Xpos, Xneg, Ypos, Yneg, Zpos, Zneg
@@ -58,14 +66,17 @@ private:
 
 	bool clean();
 	void init();
+	bool mapFile(const char* filename);
+	void unmapFile();
 
 public:
-	static std::map<std::string, HDRE*> s_loaded_hdres;
+	static ResourceRegistry<HDRE> s_loaded_hdres;
+	static bool use_half_float; // the streamed levels are converted to half floats in a worker (half the upload size)
 
 	sHDREHeader header;
 	int width;
 	int height;
-    int levels = N_MAX_LEVELS;
+    int levels = N_MAX_LEVELS; // stored in the file
 
 	HDRE();
 	HDRE(const char* filename);
@@ -84,6 +95,12 @@ public:
 	}
 
 	float* getData(); // All pixel data
+	int getLevelSize(int level) { return level_sizes[level]; }
+	size_t getLevelBytes(int level); // of the six float faces
+
+	void prefetchLevel(int level);		// reads the pages of a level, so the thread that uses it doesnt wait for the disk
+	bool convertLevelToHalf(int level); // fills the half faces of a level from the float ones (thread safe for different levels)
+	void releaseFloatData();			// unmaps the file, only the levels converted to half remain
 
 	float* getFacef(int level, int face);	// Specific level and face
 	float** getFacesf(int level = 0);		// [[]]: Array per face with all level data
@@ -1,4 +1,5 @@
 #include "framework.h"
+#include "simd.h"
 
 //#include "includes.h"
 
@@ -72,23 +73,23 @@ Vector2 operator - (const Vector2& a, const Vector2& b) { return Vector2(a.x - b
 
 // **************************************
 
-double Vector3::length() 
+float Vector3::length() 
 {
-	return sqrt(x*x + y*y + z*z);
+	return sqrtf(x*x + y*y + z*z);
 }
 
-double Vector3::length() const
+float Vector3::length() const
 {
-	return sqrt(x*x + y*y + z*z);
+	return sqrtf(x*x + y*y + z*z);
 }
 
 Vector3& Vector3::normalize()
 {
-	double len = length();
-	assert(len > 0.00000000001 && "Cannot normalize a vector with module 0");
-	x = (float)(x / len);
-	y = (float)(y / len);
-	z = (float)(z / len);
+	float len = length();
+	assert(len > 0.0f && "Cannot normalize a vector with module 0");
+	x = x / len;
+	y = y / len;
+	z = z / len;
 	return *this;
 }
 
@@ -437,19 +438,24 @@ Vector3 Matrix44::project(const Vector3& v)
 
 
 //Multiply a matrix by another and returns the result
+//every row of the result is the rows of the other matrix weighted by the row of this one, added in the same order
+//as the scalar version (the results are the same)
 Matrix44 Matrix44::operator*(const Matrix44& matrix) const
 {
+	using namespace simd;
 	Matrix44 ret;
+	float4 b0 = simd::load(matrix.m);
+	float4 b1 = simd::load(matrix.m + 4);
+	float4 b2 = simd::load(matrix.m + 8);
+	float4 b3 = simd::load(matrix.m + 12);
 
-	unsigned int i,j,k;
-	for (i=0;i<4;i++) 	
+	for (int i = 0; i < 4; i++)
 	{
-		for (j=0;j<4;j++) 
-		{
-			ret.M[i][j]=0.0;
-			for (k=0;k<4;k++) 
-				ret.M[i][j] += M[i][k] * matrix.M[k][j];
-		}
+		float4 row = mul(splat(M[i][0]), b0);
+		row = add(row, mul(splat(M[i][1]), b1));
+		row = add(row, mul(splat(M[i][2]), b2));
+		row = add(row, mul(splat(M[i][3]), b3));
+		store(ret.M[i], row);
 	}
 
 	return ret;
@@ -547,77 +553,107 @@ void Matrix44::setFrontAndOrthonormalize(Vector3 front)
 	
 }
 
+// 2x2 matrices in a register (row by row), for the block inverse
+static inline simd::float4 mat2Mul(simd::float4 a, simd::float4 b) //a * b
+{
+	using namespace simd;
+	return add(mul(a, swizzle<0, 3, 0, 3>(b)), mul(swizzle<1, 0, 3, 2>(a), swizzle<2, 1, 2, 1>(b)));
+}
+
+static inline simd::float4 mat2AdjMul(simd::float4 a, simd::float4 b) //adjugate(a) * b
+{
+	using namespace simd;
+	return sub(mul(swizzle<3, 3, 0, 0>(a), b), mul(swizzle<1, 1, 2, 2>(a), swizzle<2, 3, 0, 1>(b)));
+}
+
+static inline simd::float4 mat2MulAdj(simd::float4 a, simd::float4 b) //a * adjugate(b)
+{
+	using namespace simd;
+	return sub(mul(a, swizzle<3, 0, 3, 0>(b)), mul(swizzle<1, 0, 3, 2>(a), swizzle<2, 1, 2, 1>(b)));
+}
+
+//the matrix is split in four 2x2 blocks | A B |, the inverse is built from their adjugates and determinants
+//                                       | C D |
 bool Matrix44::inverse()
 {
-   unsigned int i, j, k, swap;
-   float t;
-   Matrix44 temp, final;
-   final.setIdentity();
+	using namespace simd;
+	float4 r0 = simd::load(m);
+	float4 r1 = simd::load(m + 4);
+	float4 r2 = simd::load(m + 8);
+	float4 r3 = simd::load(m + 12);
+
+	float4 A = shuffle<0, 1, 0, 1>(r0, r1);
+	float4 B = shuffle<2, 3, 2, 3>(r0, r1);
+	float4 C = shuffle<0, 1, 0, 1>(r2, r3);
+	float4 D = shuffle<2, 3, 2, 3>(r2, r3);
+
+	// |A| |B| |C| |D|
+	float4 det_sub = sub(mul(shuffle<0, 2, 0, 2>(r0, r2), shuffle<1, 3, 1, 3>(r1, r3)),
+		mul(shuffle<1, 3, 1, 3>(r0, r2), shuffle<0, 2, 0, 2>(r1, r3)));
+	float4 det_A = broadcast<0>(det_sub);
+	float4 det_B = broadcast<1>(det_sub);
+	float4 det_C = broadcast<2>(det_sub);
+	float4 det_D = broadcast<3>(det_sub);
+
+	float4 D_C = mat2AdjMul(D, C);
+	float4 A_B = mat2AdjMul(A, B);
+	float4 X = sub(mul(det_D, A), mat2Mul(B, D_C));
+	float4 W = sub(mul(det_A, D), mat2Mul(C, A_B));
+	float4 Y = sub(mul(det_B, C), mat2MulAdj(D, A_B));
+	float4 Z = sub(mul(det_C, B), mat2MulAdj(A, D_C));
+
+	// |M| = |A||D| + |B||C| - tr((A#B)(D#C))
+	float4 det = add(mul(det_A, det_D), mul(det_B, det_C));
+	det = sub(det, sum(mul(A_B, swizzle<0, 2, 1, 3>(D_C))));
+	if (first(det) == 0.0f)
+		return false;
 
-   temp = (*this);
+	float4 inv_det = div(simd::set(1.0f, -1.0f, -1.0f, 1.0f), det);
+	X = mul(X, inv_det);
+	Y = mul(Y, inv_det);
+	Z = mul(Z, inv_det);
+	W = mul(W, inv_det);
+
+	//the adjugate of the blocks and the rows in one shuffle
+	store(m, shuffle<3, 1, 3, 1>(X, Y));
+	store(m + 4, shuffle<2, 0, 2, 0>(X, Y));
+	store(m + 8, shuffle<3, 1, 3, 1>(Z, W));
+	store(m + 12, shuffle<2, 0, 2, 0>(Z, W));
+	return true;
+}
 
-   unsigned int m,n;
-   m = n = 4;
-	
-   for (i = 0; i < m; i++)
-   {
-      // Look for largest element in column
-
-      swap = i;
-      for (j = i + 1; j < m; j++)// m or n
-	  {
-		 if ( fabs(temp.M[j][i]) > fabs( temp.M[swap][i]) )
-            swap = j;
-	  }
-   
-      if (swap != i)
-      {
-         // Swap rows.
-         for (k = 0; k < n; k++)
-         {
-			 std::swap( temp.M[i][k],temp.M[swap][k]);
-			 std::swap( final.M[i][k], final.M[swap][k]);
-         }
-      }
-
-      // No non-zero pivot.  The CMatrix is singular, which shouldn't
-      // happen.  This means the user gave us a bad CMatrix.
-
-
-#define MATRIX_SINGULAR_THRESHOLD 0.00001 //change this if you experience problems with matrices
-
-      if ( fabsf(temp.M[i][i]) <= MATRIX_SINGULAR_THRESHOLD)
-	  {
-		  final.setIdentity();
-         return false;
-	  }
-#undef MATRIX_SINGULAR_THRESHOLD
-
-      t = 1.0f/temp.M[i][i];
-
-      for (k = 0; k < n; k++)//m or n
-      {
-         temp.M[i][k] *= t;
-         final.M[i][k] *= t;
-      }
-
-      for (j = 0; j < m; j++) // m or n
-      {
-         if (j != i)
-         {
-            t = temp.M[j][i];
-            for (k = 0; k < n; k++)//m or n
-            {
-               temp.M[j][k] -= (temp.M[i][k] * t);
-               final.M[j][k] -= (final.M[i][k] * t);
-            }
-         }
-      }
-   }
-
-   *this = final;
-
-   return true;
+//the rows of the inverse of the 3x3 part are the cross products of its rows (transposed) divided by the determinant,
+//the translation is the old one rotated by it and negated
+bool Matrix44::affineInverse()
+{
+	using namespace simd;
+	float4 r0 = load3(m);
+	float4 r1 = load3(m + 4);
+	float4 r2 = load3(m + 8);
+
+	float4 c0 = cross(r1, r2);
+	float4 c1 = cross(r2, r0);
+	float4 c2 = cross(r0, r1);
+	float4 det = sum(mul(r0, c0));
+	if (first(det) == 0.0f)
+		return false;
+	float4 inv_det = div(splat(1.0f), det);
+
+	float4 zero = splat(0.0f);
+	float4 t0 = shuffle<0, 1, 0, 1>(c0, c1);
+	float4 t1 = shuffle<2, 3, 2, 3>(c0, c1);
+	float4 t2 = shuffle<0, 1, 0, 1>(c2, zero);
+	float4 t3 = shuffle<2, 3, 2, 3>(c2, zero);
+	float4 i0 = mul(shuffle<0, 2, 0, 2>(t0, t2), inv_det);
+	float4 i1 = mul(shuffle<1, 3, 1, 3>(t0, t2), inv_det);
+	float4 i2 = mul(shuffle<0, 2, 0, 2>(t1, t3), inv_det);
+
+	float4 translation = add(add(mul(splat(m[12]), i0), mul(splat(m[13]), i1)), mul(splat(m[14]), i2));
+	store(m, i0);
+	store(m + 4, i1);
+	store(m + 8, i2);
+	store(m + 12, sub(simd::set(0.0f, 0.0f, 0.0f, 1.0f), translation));
+	return true;
 }
 
 #ifdef FIXEDPIPELINE
@@ -971,6 +1007,46 @@ void Quaternion::toMatrix(Matrix44& matrix) const
 	*/
 }
 
+//inverse of toMatrix, using the biggest diagonal term to avoid dividing by a small number
+void Quaternion::fromMatrix(const Matrix44& matrix)
+{
+	const float* m = matrix.m;
+	float trace = m[0] + m[5] + m[10];
+	if (trace > 0)
+	{
+		float s = 0.5f / sqrtf(trace + 1.0f);
+		w = 0.25f / s;
+		x = (m[6] - m[9]) * s;
+		y = (m[8] - m[2]) * s;
+		z = (m[1] - m[4]) * s;
+	}
+	else if (m[0] > m[5] && m[0] > m[10])
+	{
+		float s = 2.0f * sqrtf(1.0f + m[0] - m[5] - m[10]);
+		x = 0.25f * s;
+		y = (m[1] + m[4]) / s;
+		z = (m[2] + m[8]) / s;
+		w = (m[6] - m[9]) / s;
+	}
+	else if (m[5] > m[10])
+	{
+		float s = 2.0f * sqrtf(1.0f + m[5] - m[0] - m[10]);
+		x = (m[1] + m[4]) / s;
+		y = 0.25f * s;
+		z = (m[6] + m[9]) / s;
+		w = (m[8] - m[2]) / s;
+	}
+	else
+	{
+		float s = 2.0f * sqrtf(1.0f + m[10] - m[0] - m[5]);
+		x = (m[2] + m[8]) / s;
+		y = (m[6] + m[9]) / s;
+		z = 0.25f * s;
+		w = (m[1] - m[4]) / s;
+	}
+	normalize();
+}
+
 Vector3 transformQuat(const Vector3& a, const Quaternion& q)
 {
 	// benchmarks: https://jsperf.com/quaternion-transform-vec3-implementations-fixed
@@ -1306,25 +1382,85 @@ float signedDistanceToPlane( const Vector4& plane, const Vector3& point )
 	return dot(plane.xyz(), point) + plane.w;
 }
 
-const Vector3 corners[] = { {1,1,1},  {1,1,-1},  {1,-1,1},  {1,-1,-1},  {-1,1,1},  {-1,1,-1},  {-1,-1,1},  {-1,-1,-1} };
-
+//the center is transformed as a point, the halfsize by the absolute value of the rotation and scale
+//(the same box as the one around the eight transformed corners)
 BoundingBox transformBoundingBox(const Matrix44 m, const BoundingBox& box)
 {
-	Vector3 box_min(10000000.0f,1000000.0f, 1000000.0f);
-	Vector3 box_max(-10000000.0f, -1000000.0f, -1000000.0f);
+	BoundingBox result;
+	transformBoundingBoxes(m, &box, &result, 1);
+	return result;
+}
 
-	for (int i = 0; i < 8; ++i)
+void transformPoints(const Matrix44& m, const Vector3* points, Vector3* result, int count)
+{
+	using namespace simd;
+	float4 r0 = load(m.m);
+	float4 r1 = load(m.m + 4);
+	float4 r2 = load(m.m + 8);
+	float4 r3 = load(m.m + 12);
+	for (int i = 0; i < count; ++i)
 	{
-		Vector3 corner = corners[i];
-		corner = box.halfsize * corner;
-		corner = corner + box.center;
-		corner = m * corner;
-		box_min.setMin(corner);
-		box_max.setMax(corner);
+		float4 p = load3(points[i].v);
+		float4 v = mul(broadcast<0>(p), r0);
+		v = add(v, mul(broadcast<1>(p), r1));
+		v = add(v, mul(broadcast<2>(p), r2));
+		store3(result[i].v, add(v, r3));
 	}
+}
 
-	Vector3 halfsize = (box_max - box_min) * 0.5;
-	return BoundingBox(box_max - halfsize, halfsize );
+void transformNormals(const Matrix44& m, const Vector3* normals, Vector3* result, int count)
+{
+	using namespace simd;
+	//the rows of the inverse transpose are the cross products of the rows, the determinant only changes the length
+	float4 r0 = load3(m.m);
+	float4 r1 = load3(m.m + 4);
+	float4 r2 = load3(m.m + 8);
+	float4 c0 = cross(r1, r2);
+	float4 c1 = cross(r2, r0);
+	float4 c2 = cross(r0, r1);
+	if (first(sum(mul(r0, c0))) < 0.0f) //mirrored
+	{
+		float4 minus_one = splat(-1.0f);
+		c0 = mul(c0, minus_one);
+		c1 = mul(c1, minus_one);
+		c2 = mul(c2, minus_one);
+	}
+
+	for (int i = 0; i < count; ++i)
+	{
+		float4 n = load3(normals[i].v);
+		float4 v = mul(broadcast<0>(n), c0);
+		v = add(v, mul(broadcast<1>(n), c1));
+		v = add(v, mul(broadcast<2>(n), c2));
+		float len = sqrtf(first(sum(mul(v, v))));
+		store3(result[i].v, len > 0.0f ? div(v, splat(len)) : v);
+	}
+}
+
+void transformBoundingBoxes(const Matrix44& m, const BoundingBox* boxes, BoundingBox* result, int count)
+{
+	using namespace simd;
+	float4 r0 = load(m.m);
+	float4 r1 = load(m.m + 4);
+	float4 r2 = load(m.m + 8);
+	float4 r3 = load(m.m + 12);
+	float4 a0 = abs(r0);
+	float4 a1 = abs(r1);
+	float4 a2 = abs(r2);
+	for (int i = 0; i < count; ++i)
+	{
+		float4 c = load3(boxes[i].center.v);
+		float4 h = load3(boxes[i].halfsize.v);
+		float4 center = mul(broadcast<0>(c), r0);
+		center = add(center, mul(broadcast<1>(c), r1));
+		center = add(center, mul(broadcast<2>(c), r2));
+		center = add(center, r3);
+		float4 halfsize = mul(broadcast<0>(h), a0);
+		halfsize = add(halfsize, mul(broadcast<1>(h), a1));
+		halfsize = add(halfsize, mul(broadcast<2>(h), a2));
+		store3(result[i].center.v, center);
+		store3(result[i].halfsize.v, halfsize);
+	}
 }
 
 BoundingBox mergeBoundingBoxes(const BoundingBox& a, const BoundingBox& b)
@@ -1448,4 +1584,63 @@ bool BoundingBoxSphereOverlap(const BoundingBox& box, const Vector3& center, flo
 	}
 
 	return false; //OUTSIDE;
-}
\ No newline at end of file
+}
+
+uint16 floatToHalf(float f)
+{
+	union { float f; uint32 u; } v;
+	v.f = f;
+	uint32 sign = (v.u >> 16) & 0x8000;
+	int exponent = (int)((v.u >> 23) & 0xFF) - 127 + 15;
+	uint32 mantissa = v.u & 0x007FFFFF;
+
+	if ( ((v.u >> 23) & 0xFF) == 0xFF ) //inf or nan
+		return (uint16)(sign | 0x7C00 | (mantissa ? 0x200 : 0));
+	if (exponent >= 31) //overflow, clamp to inf
+		return (uint16)(sign | 0x7C00);
+	if (exponent <= 0) //denormal or zero
+	{
+		if (exponent < -10)
+			return (uint16)sign;
+		mantissa |= 0x00800000;
+		uint32 shift = 14 - exponent;
+		uint32 half_mantissa = mantissa >> shift;
+		if ((mantissa >> (shift - 1)) & 1) //round
+			half_mantissa++;
+		return (uint16)(sign | half_mantissa);
+	}
+	uint32 result = sign | (exponent << 10) | (mantissa >> 13);
+	if (mantissa & 0x1000) //round to nearest, can carry into the exponent
+		result++;
+	return (uint16)result;
+}
+
+float halfToFloat(uint16 h)
+{
+	union { float f; uint32 u; } v;
+	uint32 sign = (h & 0x8000) << 16;
+	uint32 exponent = (h >> 10) & 0x1F;
+	uint32 mantissa = h & 0x3FF;
+
+	if (exponent == 0)
+	{
+		if (mantissa == 0)
+			v.u = sign;
+		else //denormal, normalize it
+		{
+			exponent = 127 - 15 + 1;
+			while (!(mantissa & 0x400))
+			{
+				mantissa <<= 1;
+				exponent--;
+			}
+			mantissa &= 0x3FF;
+			v.u = sign | (exponent << 23) | (mantissa << 13);
+		}
+	}
+	else if (exponent == 31)
+		v.u = sign | 0x7F800000 | (mantissa << 13);
+	else
+		v.u = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+	return v.f;
+}
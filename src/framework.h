@@ -96,8 +96,8 @@ public:
 	Vector3() { x = y = z = 0.0f; }
 	Vector3(float x, float y, float z) { this->x = x; this->y = y; this->z = z;	}
 
-	double length();
-	double length() const;
+	float length();
+	float length() const;
 
 	void set(float x, float y, float z) { this->x = x; this->y = y; this->z = z; }
 
@@ -228,7 +228,8 @@ class Matrix44
 		Vector3 topVector() { return Vector3(m[4],m[5],m[6]); }
 		Vector3 frontVector() { return Vector3(m[8],m[9],m[10]); }
 
-		bool inverse();
+		bool inverse(); //false if it is singular (then it is not modified)
+		bool affineInverse(); //faster, only for matrices without projection (the fourth column is 0,0,0,1)
 		void setUpAndOrthonormalize(Vector3 up);
 		void setFrontAndOrthonormalize(Vector3 front);
 
@@ -335,6 +336,7 @@ public:
 	float squaredLength() const;
 	float length() const;
 	void toMatrix(Matrix44 &) const;
+	void fromMatrix(const Matrix44 &); //the rotation of the 3x3 part, it must be orthonormal
 
 	void toEulerAngles(Vector3 &euler) const;
 
@@ -374,6 +376,11 @@ public:
 BoundingBox mergeBoundingBoxes(const BoundingBox& a, const BoundingBox& b);
 BoundingBox transformBoundingBox(const Matrix44 m, const BoundingBox& box);
 
+//batch versions of the transforms (in and out can be the same array)
+void transformPoints(const Matrix44& m, const Vector3* points, Vector3* result, int count); //same as m * point
+void transformNormals(const Matrix44& m, const Vector3* normals, Vector3* result, int count); //by the inverse transpose, normalized
+void transformBoundingBoxes(const Matrix44& m, const BoundingBox* boxes, BoundingBox* result, int count);
+
 float signedDistanceToPlane(const Vector4& plane, const Vector3& point);
 int planeBoxOverlap( const Vector4& plane, const Vector3& center, const Vector3& halfsize );
 float ComputeSignedAngle( Vector2 a, Vector2 b); //returns the angle between both vectors in radians
@@ -386,6 +393,10 @@ Vector3 reflect(const Vector3& I, const Vector3& N);
 //value between 0 and 1
 inline float random(float range = 1.0f, int offset = 0) { return ((rand() % 1000) / (1000.0f)) * range + offset; }
 
+//half float (16 bits) conversion, used when packing vertex data
+uint16 floatToHalf(float f);
+float halfToFloat(uint16 h);
+
 
 typedef Vector2 vec2;
 typedef Vector3 vec3;
@@ -9,9 +9,13 @@
 #include "texture.h"
 #include "material.h"
 #include "prefab.h"
+#include "mesh_optimizer.h"
 #include "utils.h"
+#include "task.h"
 
 #include <iostream>
+#include <chrono>
+#include <algorithm>
 
 //** PARSING GLTF IS UGLY
 std::string base_folder;
@@ -34,25 +38,27 @@ void parseGLTFBufferVector3(std::vector<Vector3>& container, cgltf_accessor* acc
 		assert(!"TO DO");
 	}
 	int num_elements = acc->count;
-	std::vector<Vector3> unindexed;
-	unindexed.resize(num_elements);
 	assert(acc->component_type == cgltf_component_type_r_32f && acc->type == cgltf_type_vec3);
+
+	//not indexed, read straight into the container
+	std::vector<Vector3> unindexed;
+	std::vector<Vector3>& target = indices_acc ? unindexed : container;
+	target.resize(num_elements);
+	if (!num_elements)
+		return;
 	if (acc->stride == sizeof(Vector3))
-		memcpy(&unindexed[0], data, num_elements * sizeof(Vector3));
+		memcpy(&target[0], data, num_elements * sizeof(Vector3));
 	else
 	{
 		for (int i = 0; i < num_elements; ++i)
 		{
-			memcpy(&unindexed[i], data, sizeof(Vector3));
+			memcpy(&target[i], data, sizeof(Vector3));
 			data += acc->stride;
 		}
 	}
 
 	if (!indices_acc)
-	{
-		container = unindexed;
 		return;
-	}
 
 	container.resize(indices_acc->count);
 
@@ -85,25 +91,27 @@ void parseGLTFBufferVector2(std::vector<Vector2>& container, cgltf_accessor* acc
 		assert(!"TO DO");
 	}
 	int num_elements = acc->count;
-	std::vector<Vector2> unindexed;
-	unindexed.resize(num_elements);
 	assert(acc->component_type == cgltf_component_type_r_32f && acc->type == cgltf_type_vec2);
+
+	//not indexed, read straight into the container
+	std::vector<Vector2> unindexed;
+	std::vector<Vector2>& target = indices_acc ? unindexed : container;
+	target.resize(num_elements);
+	if (!num_elements)
+		return;
 	if (acc->stride == sizeof(Vector2))
-		memcpy(&unindexed[0], data, num_elements * sizeof(Vector2));
+		memcpy(&target[0], data, num_elements * sizeof(Vector2));
 	else
 	{
 		for (int i = 0; i < num_elements; ++i)
 		{
-			memcpy(&unindexed[i], data, sizeof(Vector2));
+			memcpy(&target[i], data, sizeof(Vector2));
 			data += acc->stride;
 		}
 	}
 
 	if (!indices_acc)
-	{
-		container = unindexed;
 		return;
-	}
 
 	container.resize(indices_acc->count);
 
@@ -152,79 +160,207 @@ void parseGLTFBufferIndices(std::vector<unsigned int>& container, cgltf_accessor
 	}
 }
 
-std::vector<Mesh*> parseGLTFMesh(cgltf_mesh* meshdata)
+//decodes the streams of a primitive, it doesnt use OpenGL or the managers so it can be called from any thread
+Mesh* parseGLTFPrimitive(cgltf_primitive* primitive)
 {
-	std::vector<Mesh*> result;
+	Mesh* mesh = new Mesh();
 
-	if (meshdata->name)
-		stdlog( std::string("\t<- MESH: ") + meshdata->name);
-
-    //submeshes
-	for (int i = 0; i < meshdata->primitives_count; ++i)
+	//streams
+	for (int j = 0; j < primitive->attributes_count; ++j)
 	{
-		cgltf_primitive* primitive = &meshdata->primitives[i];
-		Mesh* mesh = NULL;
+		cgltf_attribute* attr = &primitive->attributes[j];
 
-		std::string submesh_name;
-		if (meshdata->name)
+		//std::string attrname = attr->name;
+		if (attr->type == cgltf_attribute_type_position)
 		{
-			submesh_name = std::string(meshdata->name) + std::string("::") + std::to_string(i);
-			mesh = Mesh::Get(submesh_name.c_str(), true);
-			if (mesh)
+			parseGLTFBufferVector3(mesh->vertices, attr->data);
+			if (attr->data->has_min && attr->data->has_max)
 			{
-				result.push_back(mesh);
-				continue;
+				mesh->aabb_min = attr->data->min;
+				mesh->aabb_max = attr->data->max;
+				mesh->box.center = (mesh->aabb_max + mesh->aabb_min) * 0.5f;
+				mesh->box.halfsize = mesh->aabb_max - mesh->box.center;
 			}
+			else
+				mesh->updateBoundingBox();
+		}
+		else
+		if (attr->type == cgltf_attribute_type_normal)
+			parseGLTFBufferVector3(mesh->normals, attr->data);
+		else
+		if (attr->type == cgltf_attribute_type_texcoord)
+		{
+			if (strcmp(attr->name,"TEXCOORD_1") == 0) //secondary UV set
+				parseGLTFBufferVector2(mesh->m_uvs1, attr->data);
+			else
+				parseGLTFBufferVector2(mesh->uvs, attr->data);
+		}
+	}
+
+	if (primitive->indices && primitive->indices->count)
+		parseGLTFBufferIndices(mesh->m_indices, primitive->indices);
+
+	//indices in the file are not sorted for the vertex cache
+	if (Mesh::optimize_meshes && primitive->type == cgltf_primitive_type_triangles)
+	{
+		sVertexCacheStats before, after;
+		if (mesh->optimize(&before, &after))
+			stdlog("\t\tACMR: " + std::to_string(before.acmr) + " -> " + std::to_string(after.acmr) + " ATVR: " + std::to_string(before.atvr) + " -> " + std::to_string(after.atvr));
+	}
+
+	return mesh;
+}
+
+//state of a prefab while it is being loaded, the file is parsed and the primitives decoded by a worker,
+//then the main thread uploads the meshes to the GPU and builds the nodes
+struct sGLTFLoadJob {
+	std::string filename;
+	cgltf_options options;
+	cgltf_data* data;
+	Handle<GTR::Prefab> prefab; //keeps it alive till the job ends, even if nothing else references it anymore
+	std::vector< std::vector<Mesh*> > meshes; //decoded primitives of every mesh in data->meshes
+	std::vector<Image*> images; //decoded embedded images of data->images (NULL if external or not needed)
+	std::vector<Texture*> textures; //created from the embedded images, shared by the materials using them
+	int num_uploaded; //meshes already uploaded to the GPU
+};
+
+//decodes an image stored in the buffers, straight from them (no copies)
+Image* decodeGLTFImage(cgltf_image* image)
+{
+	const uint8* buffer = (const uint8*)image->buffer_view->buffer->data + image->buffer_view->offset;
+	Image* img = new Image();
+	if (!img->loadFromMemory(buffer, image->buffer_view->size) || !img->width)
+	{
+		stdlog(std::string("image format not supported or with errors: ") + (image->mime_type ? image->mime_type : ""));
+		delete img;
+		return NULL;
+	}
+	return img;
+}
+
+//reads the file and the buffers and decodes all the primitives (in parallel), no OpenGL here
+bool parseGLTFJob(sGLTFLoadJob* job)
+{
+	cgltf_result result;
+	if (!job->data)
+	{
+		result = cgltf_parse_file(&job->options, job->filename.c_str(), &job->data);
+		if (result != cgltf_result_success) {
+			stdlog(std::string("[NOT FOUND]:") + job->filename);
+			job->data = NULL;
+			return false;
 		}
+	}
+
+	result = cgltf_load_buffers(&job->options, job->data, job->filename.c_str());
+	if (result != cgltf_result_success) {
+		stdlog(std::string("[BIN NOT FOUND]:") + job->filename);
+		return false;
+	}
 
-		mesh = new Mesh();
+	cgltf_data* data = job->data;
 
-        //streams
-		for (int j = 0; j < primitive->attributes_count; ++j)
+	//embedded images are decoded by the workers too (the external ones are loaded by Texture::GetAsync)
+	std::vector<int> images;
+	job->images.resize(data->images_count, NULL);
+	job->textures.resize(data->images_count, NULL);
+	if (load_textures)
+	{
+		size_t slash = job->filename.rfind('/');
+		std::string folder = slash != std::string::npos ? job->filename.substr(0, slash) : job->filename;
+		for (int i = 0; i < data->textures_count; ++i)
 		{
-			cgltf_attribute* attr = &primitive->attributes[j];
+			cgltf_texture* texture = &data->textures[i];
+			if (!texture->image || !texture->image->buffer_view)
+				continue;
+			if (texture->name && Texture::Find((folder + "/" + texture->name).c_str()))
+				continue; //already loaded by another prefab
+			int index = (int)(texture->image - data->images);
+			if (std::find(images.begin(), images.end(), index) == images.end())
+				images.push_back(index);
+		}
+	}
+	if (images.size())
+	{
+		auto start = std::chrono::steady_clock::now();
+		parallelFor((int)images.size(), [&](int i) {
+			job->images[images[i]] = decodeGLTFImage(&data->images[images[i]]);
+		});
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+		double mbytes = 0;
+		for (int index : images)
+			if (job->images[index])
+				mbytes += job->images[index]->width * job->images[index]->height * job->images[index]->num_channels / (1024.0 * 1024.0);
+		stdlog(" + Decoded " + std::to_string(images.size()) + " images: " + std::to_string(mbytes) + " MB in " + std::to_string(elapsed.count()) + "sec (" + std::to_string(elapsed.count() > 0 ? mbytes / elapsed.count() : 0) + " MB/s)");
+	}
 
-            //std::string attrname = attr->name;
-			if (attr->type == cgltf_attribute_type_position)
+	std::vector<cgltf_primitive*> primitives;
+	std::vector<Mesh**> decoded;
+	job->meshes.resize(data->meshes_count);
+	for (int i = 0; i < data->meshes_count; ++i)
+	{
+		job->meshes[i].resize(data->meshes[i].primitives_count, NULL);
+		for (int j = 0; j < data->meshes[i].primitives_count; ++j)
+		{
+			primitives.push_back(&data->meshes[i].primitives[j]);
+			decoded.push_back(&job->meshes[i][j]);
+		}
+	}
+
+	parallelFor((int)primitives.size(), [&](int i) {
+		*decoded[i] = parseGLTFPrimitive(primitives[i]);
+	});
+	return true;
+}
+
+//uploads the decoded meshes to the GPU till max_time (in ms) is spent, returns true once all are uploaded
+//if max_time is 0 it uploads all of them. Must be called from the main thread.
+bool uploadGLTFJob(sGLTFLoadJob* job, float max_time = 0)
+{
+	auto start = std::chrono::steady_clock::now();
+	while (job->num_uploaded < job->meshes.size())
+	{
+		cgltf_mesh* meshdata = &job->data->meshes[job->num_uploaded];
+		std::vector<Mesh*>& meshes = job->meshes[job->num_uploaded];
+
+		if (meshdata->name)
+			stdlog(std::string("\t<- MESH: ") + meshdata->name);
+
+		//submeshes
+		for (int i = 0; i < meshes.size(); ++i)
+		{
+			if (!meshdata->name)
 			{
-				parseGLTFBufferVector3(mesh->vertices, attr->data);
-				if (attr->data->has_min && attr->data->has_max)
-				{
-					mesh->aabb_min = attr->data->min;
-					mesh->aabb_max = attr->data->max;
-					mesh->box.center = (mesh->aabb_max + mesh->aabb_min) * 0.5f;
-					mesh->box.halfsize = mesh->aabb_max - mesh->box.center;
-				}
-				else
-					mesh->updateBoundingBox();
+				meshes[i]->uploadToVRAM();
+				continue;
 			}
-			else
-			if (attr->type == cgltf_attribute_type_normal)
-				parseGLTFBufferVector3(mesh->normals, attr->data);
-			else
-			if (attr->type == cgltf_attribute_type_texcoord)
+
+			//already loaded by another prefab
+			std::string submesh_name = std::string(meshdata->name) + std::string("::") + std::to_string(i);
+			Mesh* mesh = Mesh::Get(submesh_name.c_str(), false, true);
+			if (mesh)
 			{
-				if (strcmp(attr->name,"TEXCOORD_1") == 0) //secondary UV set
-					parseGLTFBufferVector2(mesh->m_uvs1, attr->data);
-				else
-					parseGLTFBufferVector2(mesh->uvs, attr->data);
+				delete meshes[i];
+				meshes[i] = mesh;
+				continue;
 			}
 
-			if (primitive->indices && primitive->indices->count)
-				parseGLTFBufferIndices(mesh->m_indices, primitive->indices);
+			meshes[i]->uploadToVRAM();
+			meshes[i]->registerMesh(submesh_name);
 		}
-		mesh->uploadToVRAM();
-		if (meshdata->name)
-			mesh->registerMesh(submesh_name);
-		result.push_back(mesh);
-	}
+		job->num_uploaded++;
 
-	return result;
+		std::chrono::duration<float, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+		if (max_time && elapsed.count() > max_time)
+			break;
+	}
+	return job->num_uploaded == job->meshes.size();
 }
 
 int GLTF_TEXTURE_LAST_ID = 1;
 
-Texture* parseGLTFTexture(cgltf_image* image, const char* filename)
+Texture* parseGLTFTexture(cgltf_image* image, const char* filename, sGLTFLoadJob* job, eTextureUsage usage = TEXTURE_COLOR)
 {
 	if (!load_textures || !image )
 		return NULL;
@@ -232,7 +368,12 @@ Texture* parseGLTFTexture(cgltf_image* image, const char* filename)
 	std::string fullpath = filename ? filename : "";
 
 	if (image->uri)
-		return Texture::GetAsync((std::string(base_folder) + "/" + image->uri).c_str());
+	{
+		Texture* texture = Texture::GetAsync((std::string(base_folder) + "/" + image->uri).c_str(), true, true, usage);
+		if (texture)
+			TextureArrayPool::packWhenReady(texture);
+		return texture;
+	}
 	else
 	if (filename)
 	{
@@ -250,27 +391,19 @@ Texture* parseGLTFTexture(cgltf_image* image, const char* filename)
 
 	if (image->buffer_view)
 	{
-		Image img;
-		std::vector<unsigned char> buffer;
-		buffer.resize(image->buffer_view->size);
-		memcpy(&buffer[0], (char*)image->buffer_view->buffer->data + image->buffer_view->offset, image->buffer_view->size);
-
-		if (!strcmp(image->mime_type, "image/png"))
-			img.loadPNG(buffer);
-		else if (!strcmp(image->mime_type, "image/jpeg"))
-			img.loadJPG(buffer);
-		else
-		{
-			stdlog(std::string("image format not supported: ") + image->mime_type);
-			return NULL;
-		}
-		if (!img.width)
-		{
-			stdlog(std::string("image encoding has error: ") + image->mime_type);
+		//already decoded by parseGLTFJob, the uploader takes the image
+		size_t index = image - job->data->images;
+		if (job->textures[index])
+			return job->textures[index];
+		Image* img = job->images[index];
+		if (!img)
 			return NULL;
-		}
 		Texture* tex = new Texture();
-		tex->loadFromImage(&img);
+		tex->state = RESOURCE_LOADING;
+		tex->packable = true;
+		TextureUploader::upload(tex, img);
+		job->images[index] = NULL;
+		job->textures[index] = tex;
 		if (filename)
 		{
 			tex->setName(fullpath.c_str());
@@ -286,7 +419,7 @@ Texture* parseGLTFTexture(cgltf_image* image, const char* filename)
 	return NULL;
 }
 
-GTR::Material* parseGLTFMaterial(cgltf_material* matdata)
+GTR::Material* parseGLTFMaterial(cgltf_material* matdata, sGLTFLoadJob* job)
 {
 	GTR::Material* material = matdata->name ? GTR::Material::Get(matdata->name) : NULL;
 	if (material)
@@ -303,7 +436,7 @@ GTR::Material* parseGLTFMaterial(cgltf_material* matdata)
 	//normalmap
 	if (matdata->normal_texture.texture)
 	{
-		material->normal_texture.texture = parseGLTFTexture( matdata->normal_texture.texture->image, matdata->normal_texture.texture->name);
+		material->normal_texture.texture = parseGLTFTexture( matdata->normal_texture.texture->image, matdata->normal_texture.texture->name, job, TEXTURE_NORMALMAP);
 		material->normal_texture.uv_channel = matdata->normal_texture.texcoord;
 	}
 
@@ -311,7 +444,7 @@ GTR::Material* parseGLTFMaterial(cgltf_material* matdata)
 	material->emissive_factor = matdata->emissive_factor;
 	if (matdata->emissive_texture.texture)
 	{
-		material->emissive_texture.texture = parseGLTFTexture(matdata->emissive_texture.texture->image, matdata->emissive_texture.texture->name);
+		material->emissive_texture.texture = parseGLTFTexture(matdata->emissive_texture.texture->image, matdata->emissive_texture.texture->name, job);
 		material->emissive_texture.uv_channel = matdata->emissive_texture.texcoord;
 	}
 
@@ -320,7 +453,7 @@ GTR::Material* parseGLTFMaterial(cgltf_material* matdata)
 	if (matdata->has_pbr_specular_glossiness)
 	{
 		if (matdata->pbr_specular_glossiness.diffuse_texture.texture)
-			material->color_texture.texture = parseGLTFTexture(matdata->pbr_specular_glossiness.diffuse_texture.texture->image, matdata->pbr_specular_glossiness.diffuse_texture.texture->name);
+			material->color_texture.texture = parseGLTFTexture(matdata->pbr_specular_glossiness.diffuse_texture.texture->image, matdata->pbr_specular_glossiness.diffuse_texture.texture->name, job);
 	}
 	if (matdata->has_pbr_metallic_roughness)
 	{
@@ -332,12 +465,12 @@ GTR::Material* parseGLTFMaterial(cgltf_material* matdata)
 		{
 			if (matdata->pbr_metallic_roughness.base_color_texture.texture)
 			{
-				material->color_texture.texture = parseGLTFTexture(matdata->pbr_metallic_roughness.base_color_texture.texture->image, matdata->pbr_metallic_roughness.base_color_texture.texture->name);
+				material->color_texture.texture = parseGLTFTexture(matdata->pbr_metallic_roughness.base_color_texture.texture->image, matdata->pbr_metallic_roughness.base_color_texture.texture->name, job);
 				material->color_texture.uv_channel = matdata->pbr_metallic_roughness.base_color_texture.texcoord;
 			}
 			if (matdata->pbr_metallic_roughness.metallic_roughness_texture.texture)
 			{
-				material->metallic_roughness_texture.texture = parseGLTFTexture(matdata->pbr_metallic_roughness.metallic_roughness_texture.texture->image, matdata->pbr_metallic_roughness.metallic_roughness_texture.texture->name);
+				material->metallic_roughness_texture.texture = parseGLTFTexture(matdata->pbr_metallic_roughness.metallic_roughness_texture.texture->image, matdata->pbr_metallic_roughness.metallic_roughness_texture.texture->name, job, TEXTURE_DATA);
 				material->metallic_roughness_texture.uv_channel = matdata->pbr_metallic_roughness.metallic_roughness_texture.texcoord;
 			}
 		}
@@ -345,7 +478,7 @@ GTR::Material* parseGLTFMaterial(cgltf_material* matdata)
 
 	if (matdata->occlusion_texture.texture)
 	{
-		material->occlusion_texture.texture = parseGLTFTexture(matdata->occlusion_texture.texture->image, matdata->occlusion_texture.texture->name);
+		material->occlusion_texture.texture = parseGLTFTexture(matdata->occlusion_texture.texture->image, matdata->occlusion_texture.texture->name, job, TEXTURE_MASK);
 		material->occlusion_texture.uv_channel = matdata->occlusion_texture.texcoord;
 	}
 
@@ -373,7 +506,7 @@ void parseGLTFTransform(cgltf_node* node, Matrix44 &model)
 }
 
 //GLTF PARSING: you can pass the node or it will create it
-GTR::Node* parseGLTFNode(cgltf_node* node, GTR::Node* scenenode = NULL)
+GTR::Node* parseGLTFNode(cgltf_node* node, sGLTFLoadJob* job, GTR::Node* scenenode = NULL)
 {
 	if (scenenode == NULL)
 		scenenode = new GTR::Node();
@@ -388,58 +521,58 @@ GTR::Node* parseGLTFNode(cgltf_node* node, GTR::Node* scenenode = NULL)
 
     if (node->mesh)
 	{
+		//already uploaded by uploadGLTFJob
+		std::vector<Mesh*>& meshes = job->meshes[node->mesh - job->data->meshes];
+
         //split in subnodes
 		if (node->mesh->primitives_count > 1)
 		{
-			std::vector<Mesh*> meshes;
-			meshes = parseGLTFMesh(node->mesh);
-
 			for (int i = 0; i < node->mesh->primitives_count; ++i)
 			{
 				GTR::Node* subnode = new GTR::Node();
 				subnode->mesh = meshes[i];
 				if (node->mesh->primitives[i].material)
-					subnode->material = parseGLTFMaterial(node->mesh->primitives[i].material);
+					subnode->material = parseGLTFMaterial(node->mesh->primitives[i].material, job);
 				scenenode->addChild(subnode);
 			}
 		}
 		else //single primitive
 		{
-			if (node->mesh->name)
-				scenenode->mesh = Mesh::Get(node->mesh->name, true);
-
-			if (!scenenode->mesh)
-			{
-				std::vector<Mesh*> meshes;
-				meshes = parseGLTFMesh(node->mesh);
-				//printf("Parsed GLTF mesh %s (success)\n", node->name);
-				//return nullptr;
-				if(meshes.size())
-					scenenode->mesh = meshes[0];
-			}
+			if(meshes.size())
+				scenenode->mesh = meshes[0];
 
 			if (node->mesh->primitives->material)
-				scenenode->material = parseGLTFMaterial(node->mesh->primitives->material);
+				scenenode->material = parseGLTFMaterial(node->mesh->primitives->material, job);
 		}
 	}
 
 	for (int i = 0; i < node->children_count; ++i)
-		scenenode->addChild(parseGLTFNode(node->children[i]));
+		scenenode->addChild(parseGLTFNode(node->children[i], job));
 
 	return scenenode;
 }
 
+//reads the file straight into the buffer that cgltf will free (with free)
 cgltf_result internalOpenFile(const struct cgltf_memory_options* memory_options, const struct cgltf_file_options* file_options, const char* path, cgltf_size* size, void** data)
 {
 	stdlog(std::string(" <- ") + path);
-    std::vector<unsigned char> buffer;
-    if (!readFileBin(path, buffer))
-        return cgltf_result_file_not_found;
-    *size = buffer.size();
-    char* file_data = new char[*size];
-    memcpy(file_data, &buffer[0], *size);
-    *data = file_data;
-    return cgltf_result_success;
+	FILE* file = fopen(path, "rb");
+	if (!file)
+		return cgltf_result_file_not_found;
+	fseek(file, 0, SEEK_END);
+	long file_size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	char* file_data = (char*)malloc(file_size);
+	if (!file_data || fread(file_data, 1, file_size, file) != file_size)
+	{
+		free(file_data);
+		fclose(file);
+		return cgltf_result_io_error;
+	}
+	fclose(file);
+	*size = file_size;
+	*data = file_data;
+	return cgltf_result_success;
 }
 
 std::vector<unsigned char> g_buffer;
@@ -448,7 +581,7 @@ cgltf_result internalOpenMemory(const struct cgltf_memory_options* memory_option
 {
 	stdlog(std::string(" <- ") + path);
 	*size = g_buffer.size();
-	char* file_data = new char[*size];
+	char* file_data = (char*)malloc(*size);
 	memcpy(file_data, &g_buffer[0], *size);
 	*data = file_data;
 
@@ -457,9 +590,11 @@ cgltf_result internalOpenMemory(const struct cgltf_memory_options* memory_option
 	return cgltf_result_success;
 }
 
-GTR::Prefab* loadGLTF(const char *filename, cgltf_data *data, cgltf_options& options)
+//builds the nodes once the meshes are uploaded and frees the gltf data. Must be called from the main thread.
+void finishGLTFJob(sGLTFLoadJob* job)
 {
-	cgltf_result result;
+	cgltf_data* data = job->data;
+	GTR::Prefab* prefab = job->prefab;
 
 	if (data->scenes_count > 1)
 		std::cout << "[WARN] more than one scene, skipping the rest" << std::endl;
@@ -468,36 +603,24 @@ GTR::Prefab* loadGLTF(const char *filename, cgltf_data *data, cgltf_options& opt
 	cgltf_scene* scene = &data->scenes[0];
 
 	char folder[1024];
-	strcpy(folder, filename);
+	strcpy(folder, job->filename.c_str());
 	char* name_start = strrchr(folder, '/');
-	*name_start = '\0';
+	if(name_start)
+		*name_start = '\0';
 	base_folder = folder; //global
 
-	{
-		result = cgltf_load_buffers(&options, data, filename);
-		if (result != cgltf_result_success) {
-			stdlog(std::string("[BIN NOT FOUND]:") + filename);
-			return NULL;
-		}
-	}
-
-	GTR::Prefab* prefab = new GTR::Prefab();
-
 	{
 		if (scene->nodes_count > 1)
 		{
-			cgltf_node *root = nullptr;
-			float fiTotal = 1.0f / (float) scene->nodes_count;
 			for (int i = 0; i < scene->nodes_count; ++i)
 			{
-				float fProgress = ((float) i * fiTotal) * 100.0f;
-				GTR::Node *node = parseGLTFNode(scene->nodes[i]);
+				GTR::Node *node = parseGLTFNode(scene->nodes[i], job);
 				prefab->root.addChild(node);
 			}
 		}
 		else
 		{
-			parseGLTFNode(scene->nodes[0], &prefab->root);
+			parseGLTFNode(scene->nodes[0], job, &prefab->root);
 		}
 	}
 
@@ -519,50 +642,99 @@ GTR::Prefab* loadGLTF(const char *filename, cgltf_data *data, cgltf_options& opt
 	//prefab->root.model = model;
 
 	prefab->updateNodesByName();
+	prefab->hierarchy.build(&prefab->root);
+	prefab->hierarchy.update();
 	prefab->updateBounding();
+	prefab->state = RESOURCE_READY;
 
 	//frees all data, including bin
 	cgltf_free(data);
+	job->data = NULL;
+	for (Image* img : job->images)
+		delete img;
+	job->images.clear();
+
+    stdlog( std::string(" - Loaded ") + job->filename );
+}
 
-    stdlog( std::string(" - Loaded ") + filename );
+GTR::Prefab* loadGLTF(sGLTFLoadJob& job)
+{
+	if (!parseGLTFJob(&job))
+	{
+		if (job.data)
+			cgltf_free(job.data);
+		return NULL;
+	}
 
-    return prefab;
+	job.prefab = new GTR::Prefab();
+	uploadGLTFJob(&job);
+	finishGLTFJob(&job);
+	return job.prefab;
 }
 
 GTR::Prefab* loadGLTF(const std::vector<unsigned char>& dat, const std::string& path)
 {
-	cgltf_options options;
-	memset(&options, 0, sizeof(cgltf_options));
-	cgltf_data *data = NULL;
+	sGLTFLoadJob job;
+	memset(&job.options, 0, sizeof(cgltf_options));
+	job.filename = path;
+	job.data = NULL;
+	job.num_uploaded = 0;
 
 	g_buffer = dat;
-	options.file.read = internalOpenMemory;
-	cgltf_result result = cgltf_parse_file(&options, path.c_str(), &data);
+	job.options.file.read = internalOpenMemory;
+	cgltf_result result = cgltf_parse_file(&job.options, path.c_str(), &job.data);
 
 	if (result != cgltf_result_success) {
 		std::cout << "[NOT FOUND]" << std::endl;
 		return NULL;
 	}
-	return loadGLTF(path.c_str(), data, options);
+	return loadGLTF(job);
 }
 
 GTR::Prefab* loadGLTF(const char* filename)
 {
 	stdlog(std::string("loading gltf... ") + filename);
-	cgltf_options options;
-	memset(&options, 0, sizeof(cgltf_options));
-	cgltf_data *data = NULL;
+	sGLTFLoadJob job;
+	memset(&job.options, 0, sizeof(cgltf_options));
+	job.options.file.read = internalOpenFile;
+	job.filename = filename;
+	job.data = NULL;
+	job.num_uploaded = 0;
+	return loadGLTF(job);
+}
 
+//uploads a slice of the meshes and enqueues itself again till the prefab is done
+void uploadGLTFStep(sGLTFLoadJob* job)
+{
+	if (!uploadGLTFJob(job, GTR::Prefab::upload_budget))
 	{
-		options.file.read = internalOpenFile;
-		cgltf_result result = cgltf_parse_file(&options, filename, &data);
-
-		if (result != cgltf_result_success) {
-			std::cout << "[NOT FOUND]" << std::endl;
-			return NULL;
-		}
+		TaskManager::foreground.addTask(new Task([job]() { uploadGLTFStep(job); }));
+		return;
 	}
-
-	return loadGLTF(filename, data, options);
+	finishGLTFJob(job);
+	delete job;
 }
 
+void loadGLTFAsync(const char* filename, GTR::Prefab* prefab)
+{
+	stdlog(std::string("loading gltf async... ") + filename);
+	sGLTFLoadJob* job = new sGLTFLoadJob();
+	memset(&job->options, 0, sizeof(cgltf_options));
+	job->options.file.read = internalOpenFile;
+	job->filename = filename;
+	job->data = NULL;
+	job->prefab = prefab;
+	job->num_uploaded = 0;
+
+	TaskManager::workers.addTask(new Task([job]() {
+		if (parseGLTFJob(job))
+		{
+			TaskManager::foreground.addTask(new Task([job]() { uploadGLTFStep(job); }));
+			return;
+		}
+		if (job->data)
+			cgltf_free(job->data);
+		//the prefab stays empty
+		TaskManager::foreground.addTask(new Task([job]() { job->prefab->state = RESOURCE_FAILED; delete job; }));
+	}));
+}
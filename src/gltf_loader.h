@@ -5,3 +5,5 @@
 GTR::Prefab* loadGLTF(const char* filename);
 //GTR::Prefab* loadGLTF(const char* filename, cgltf_data* data, cgltf_options& options);
 GTR::Prefab* loadGLTF(const std::vector<unsigned char>& data, const std::string& path);
+//parses the file and decodes the meshes in the workers, then fills the prefab from the main thread and sets it RESOURCE_READY
+void loadGLTFAsync(const char* filename, GTR::Prefab* prefab);
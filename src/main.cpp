@@ -16,6 +16,9 @@
 #include "input.h"
 #include "application.h"
 #include "task.h"
+#include "resource.h"
+#include "texture_streamer.h"
+#include "texture_uploader.h"
 
 #include <iostream> //to output
 
@@ -200,8 +203,17 @@ void mainLoop(SDL_Window* window)
 		//update app logic
 		app->update(elapsed_time);
 
-		//execute a task in the main task manager (blocking)
-		TaskManager::foreground.fetchTask();
+		//execute the tasks of the main task manager (blocking) for a few ms
+		TaskManager::foreground.fetchTasks(4.0f);
+
+		//destroy the resources whose last handle was released
+		Resource::processPendingDestruction();
+
+		//load or drop texture mips with the requests of this frame
+		TextureStreamer::update();
+
+		//upload the decoded images that fit in the budget of this frame
+		TextureUploader::update();
 
 		//check errors in opengl only when working in debug
 		#ifdef _DEBUG
@@ -255,7 +267,13 @@ int main(int argc, char **argv)
 
 	Input::init(window);
 
-	//launch the application (app is a global variable)
+	//worker threads for parallel tasks (one core is left for the main thread)
+	int num_cores = std::thread::hardware_concurrency();
+	TaskManager::workers.startThreads(num_cores > 1 ? num_cores - 1 : 1);
+
+	//launch the application (app is a global variable), the first argument is the scene to load (like data/crowd.json)
+	if (argc > 1)
+		Application::scene_filename = argv[1];
 	app = new Application(window_width, window_height, window);
 
 	//main loop, application gets inside here till user closes it
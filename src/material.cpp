@@ -6,21 +6,18 @@
 
 using namespace GTR;
 
-std::map<std::string, Material*> Material::sMaterials;
+ResourceRegistry<Material> Material::sMaterials;
 
 Material* Material::Get(const char* name)
 {
 	assert(name);
-	std::map<std::string, Material*>::iterator it = sMaterials.find(name);
-	if (it != sMaterials.end())
-		return it->second;
-	return NULL;
+	return sMaterials.find(name);
 }
 
 void Material::registerMaterial(const char* name)
 {
 	this->name = name;
-	sMaterials[name] = this;
+	sMaterials.add(name, this);
 
 	// Ugly Hack for clouds sorting problem
 	if (!strcmp(name, "Clouds"))
@@ -32,29 +29,12 @@ void Material::registerMaterial(const char* name)
 
 Material::~Material()
 {
-	if (name.size())
-	{
-		auto it = sMaterials.find(name);
-		if (it != sMaterials.end())
-			sMaterials.erase(it);
-	}
+	//the textures are released by the samplers and it is unregistered by ~Resource
 }
 
 void Material::Release()
 {
-	std::vector<Material *>mats;
-
-	for (auto mp : sMaterials)
-	{
-		Material *m = mp.second;
-		mats.push_back(m);
-	}
-
-	for (Material *m : mats)
-	{
-		delete m;
-	}
-	sMaterials.clear();
+	sMaterials.releaseAll();
 }
 
 
@@ -68,9 +48,16 @@ void Material::renderInMenu()
 	ImGui::ColorEdit4("Color", color.v); // Edit 4 floats representing a color + alpha
 	if (color_texture.texture && ImGui::TreeNode(color_texture.texture, "Color Texture"))
 	{
-		int w = ImGui::GetColumnWidth();
-		float aspect = color_texture.texture->width / (float)color_texture.texture->height;
-		ImGui::Image((void*)(intptr_t)color_texture.texture->texture_id, ImVec2(w, w * aspect));
+		Texture* texture = color_texture.texture;
+		//a packed texture has no 2D copy to show, ImGui cannot draw a layer of the array
+		if (texture->array_pool)
+			ImGui::Text("Packed: layer %d of a %dx%d array", texture->array_layer, texture->array_pool->width, texture->array_pool->height);
+		else
+		{
+			int w = ImGui::GetColumnWidth();
+			float aspect = texture->width / (float)texture->height;
+			ImGui::Image((void*)(intptr_t)texture->texture_id, ImVec2(w, w * aspect));
+		}
 		ImGui::TreePop();
 	}
 #endif
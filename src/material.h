@@ -1,6 +1,8 @@
 #pragma once
 
 #include "framework.h"
+#include "resource.h"
+#include "texture.h"
 #include <cassert>
 #include <map>
 #include <string>
@@ -28,17 +30,17 @@ namespace GTR {
 	};
 
 	struct Sampler {
-		Texture* texture;
+		Handle<Texture> texture;
 		int uv_channel;
 
 		Sampler() { texture = NULL; uv_channel = 0; }
 	};
 
 	//this class contains all info relevant of how something must be rendered
-	class Material {
+	class Material : public Resource {
 	public:
 		//static manager to reuse materials
-		static std::map<std::string, Material*> sMaterials;
+		static ResourceRegistry<Material> sMaterials;
 		static Material* Get(const char* name);
 		std::string name;
 		void registerMaterial(const char* name);
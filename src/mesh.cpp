@@ -8,20 +8,26 @@
 #include <cassert>
 #include <iostream>
 #include <limits>
+#include <algorithm>
 #include <sys/stat.h>
+#include <charconv>
 
 #include "camera.h"
 #include "texture.h"
+#include "mesh_optimizer.h"
+#include "task.h"
 //#include "animation.h"
-#include "extra/coldet/coldet.h"
+#include "bvh.h"
 
 //#include "engine/application.h"
 
 bool Mesh::use_binary = false;			//checks if there is .wbin, it there is one tries to read it instead of the other file
 bool Mesh::auto_upload_to_vram = true;	//uploads the mesh to the GPU VRAM to speed up rendering
 bool Mesh::interleave_meshes = true;	//places the geometry in an interleaved array
+bool Mesh::quantize_meshes = true;		//stores normals, uvs, colors and weights in compact formats when uploading
+bool Mesh::optimize_meshes = true;		//welds vertices and reorders triangles after loading, the result is stored in the .mbin
 
-std::map<std::string, Mesh*> Mesh::sMeshesLoaded;
+ResourceRegistry<Mesh> Mesh::sMeshesLoaded;
 long Mesh::num_meshes_rendered = 0;
 long Mesh::num_triangles_rendered = 0;
 
@@ -30,11 +36,74 @@ long Mesh::num_triangles_rendered = 0;
 #define FORMAT_MBIN 3
 #define FORMAT_MESH 4
 
+#ifndef GL_INT_2_10_10_10_REV
+	#define GL_INT_2_10_10_10_REV 0x8D9F
+#endif
+
+struct sVertexFormatInfo {
+	int components;
+	unsigned int type;
+	bool normalized;
+	int size;
+};
+
+//must match the order in eVertexFormat
+const sVertexFormatInfo vertex_formats_info[] = {
+	{ 2, GL_FLOAT, false, 8 },					//VF_FLOAT2
+	{ 3, GL_FLOAT, false, 12 },					//VF_FLOAT3
+	{ 4, GL_FLOAT, false, 16 },					//VF_FLOAT4
+	{ 2, GL_HALF_FLOAT, false, 4 },				//VF_HALF2
+	{ 2, GL_UNSIGNED_SHORT, true, 4 },			//VF_UNORM16_2
+	{ 4, GL_INT_2_10_10_10_REV, true, 4 },		//VF_SNORM10_3
+	{ 4, GL_UNSIGNED_BYTE, true, 4 },			//VF_UNORM8_4
+	{ 4, GL_UNSIGNED_BYTE, false, 4 }			//VF_UBYTE4
+};
+
+void VertexLayout::add(eVertexAttribute attribute, eVertexFormat format)
+{
+	assert(num_attributes < VA_COUNT && !find(attribute));
+	sVertexAttribute& attr = attributes[num_attributes++];
+	attr.attribute = attribute;
+	attr.format = format;
+	attr.offset = stride;
+	stride += getFormatSize(format); //all formats are multiple of 4 bytes so no padding is needed
+}
+
+const sVertexAttribute* VertexLayout::find(eVertexAttribute attribute) const
+{
+	for (int i = 0; i < num_attributes; ++i)
+		if (attributes[i].attribute == attribute)
+			return &attributes[i];
+	return NULL;
+}
+
+int VertexLayout::getFormatSize(eVertexFormat format)
+{
+	return vertex_formats_info[format].size;
+}
+
+const char* VertexLayout::getAttributeName(eVertexAttribute attribute)
+{
+	switch (attribute)
+	{
+		case VA_POSITION: return "a_vertex";
+		case VA_NORMAL: return "a_normal";
+		case VA_UV: return "a_coord";
+		case VA_UV1: return "a_coord1";
+		case VA_COLOR: return "a_color";
+		case VA_BONES: return "a_bones";
+		case VA_WEIGHTS: return "a_weights";
+		default: return "";
+	}
+}
+
 Mesh::Mesh()
 {
 	radius = 0;
 	vertices_vbo_id = uvs_vbo_id = uvs1_vbo_id = normals_vbo_id = colors_vbo_id = interleaved_vbo_id = indices_vbo_id = bones_vbo_id = weights_vbo_id = 0;
-	collision_model = NULL;
+	packed_vbo_id = 0;
+	bvh = NULL;
+	revision = 0;
 
 	clear();
 }
@@ -67,6 +136,8 @@ void Mesh::clear()
 			glDeleteBuffersARB(1, &weights_vbo_id);
 		if (uvs1_vbo_id)
 			glDeleteBuffersARB(1, &uvs1_vbo_id);
+		if (packed_vbo_id)
+			glDeleteBuffersARB(1, &packed_vbo_id);
     #else
 	if (vertices_vbo_id)
 		glDeleteBuffers(1,&vertices_vbo_id);
@@ -86,11 +157,19 @@ void Mesh::clear()
 		glDeleteBuffers(1, &weights_vbo_id);
 	if (uvs1_vbo_id)
 		glDeleteBuffers(1, &uvs1_vbo_id);
+	if (packed_vbo_id)
+		glDeleteBuffers(1, &packed_vbo_id);
     #endif
 
 
 	//VBOs ids
 	vertices_vbo_id = uvs_vbo_id = normals_vbo_id = colors_vbo_id = interleaved_vbo_id = indices_vbo_id = weights_vbo_id = bones_vbo_id = uvs1_vbo_id = 0;
+	packed_vbo_id = 0;
+	layout.clear();
+	uv_density = 0;
+	delete bvh;
+	bvh = NULL;
+	revision++;
 
 	//buffers
 	vertices.clear();
@@ -103,8 +182,7 @@ void Mesh::clear()
 	weights.clear();
 	m_uvs1.clear();
 
-	if (collision_model)
-		delete (CollisionModel3D*)collision_model;
+	delete bvh;
 }
 
 int vertex_location = -1;
@@ -114,9 +192,32 @@ int uv1_location = -1;
 int color_location = -1;
 int bones_location = -1;
 int weights_location = -1;
+int packed_locations[VA_COUNT];
+int num_packed_locations = 0;
 
 void Mesh::enableBuffers(Shader* sh)
 {
+	//packed buffer, the layout tells where is every attribute
+	if (packed_vbo_id)
+	{
+		vertex_location = normal_location = uv_location = uv1_location = color_location = bones_location = weights_location = -1;
+		num_packed_locations = 0;
+		glBindBuffer(GL_ARRAY_BUFFER, packed_vbo_id);
+		for (int i = 0; i < layout.num_attributes; ++i)
+		{
+			const sVertexAttribute& attr = layout.attributes[i];
+			int location = sh->getAttribLocation(VertexLayout::getAttributeName((eVertexAttribute)attr.attribute));
+			if (location == -1)
+				continue;
+			const sVertexFormatInfo& info = vertex_formats_info[attr.format];
+			glEnableVertexAttribArray(location);
+			glVertexAttribPointer(location, info.components, info.type, info.normalized, layout.stride, (void*)(size_t)attr.offset);
+			packed_locations[num_packed_locations++] = location;
+		}
+		checkGLErrors();
+		return;
+	}
+
 	vertex_location = sh->getAttribLocation("a_vertex");
 	/*
 	assert(vertex_location != -1 && "No a_vertex found in shader");
@@ -280,6 +381,59 @@ void Mesh::render(unsigned int primitive, int submesh_id, int num_instances)
 	checkGLErrors();
 }
 
+//the instanced functions are core since GL 3.3 (and ES3), before they come from GL_ARB_instanced_arrays and GL_ARB_draw_instanced
+typedef void (APIENTRY* AttribDivisorFunc)(GLuint index, GLuint divisor);
+typedef void (APIENTRY* DrawElementsInstancedFunc)(GLenum mode, GLsizei count, GLenum type, const void* indices, GLsizei instances);
+typedef void (APIENTRY* DrawArraysInstancedFunc)(GLenum mode, GLint first, GLsizei count, GLsizei instances);
+static AttribDivisorFunc attribDivisor = NULL;
+static DrawElementsInstancedFunc drawElementsInstanced = NULL;
+static DrawArraysInstancedFunc drawArraysInstanced = NULL;
+static int instancing = -1; //-1 until checked
+
+bool Mesh::supportsInstancing()
+{
+	if (instancing == -1)
+	{
+#ifdef OPENGL_ES3
+		attribDivisor = glVertexAttribDivisor;
+		drawElementsInstanced = glDrawElementsInstanced;
+		drawArraysInstanced = glDrawArraysInstanced;
+#else
+		int major = 0, minor = 0;
+		const char* version = (const char*)glGetString(GL_VERSION);
+		if (version)
+			sscanf(version, "%d.%d", &major, &minor);
+#ifdef USE_GLEW
+		bool extensions = GLEW_ARB_instanced_arrays && GLEW_ARB_draw_instanced;
+#else
+		bool extensions = SDL_GL_ExtensionSupported("GL_ARB_instanced_arrays") && SDL_GL_ExtensionSupported("GL_ARB_draw_instanced");
+#endif
+		if (major > 3 || (major == 3 && minor >= 3))
+		{
+			attribDivisor = (AttribDivisorFunc)SDL_GL_GetProcAddress("glVertexAttribDivisor");
+			drawElementsInstanced = (DrawElementsInstancedFunc)SDL_GL_GetProcAddress("glDrawElementsInstanced");
+			drawArraysInstanced = (DrawArraysInstancedFunc)SDL_GL_GetProcAddress("glDrawArraysInstanced");
+		}
+		else if (extensions)
+		{
+			attribDivisor = (AttribDivisorFunc)SDL_GL_GetProcAddress("glVertexAttribDivisorARB");
+			drawElementsInstanced = (DrawElementsInstancedFunc)SDL_GL_GetProcAddress("glDrawElementsInstancedARB");
+			drawArraysInstanced = (DrawArraysInstancedFunc)SDL_GL_GetProcAddress("glDrawArraysInstancedARB");
+		}
+#endif
+		instancing = attribDivisor && drawElementsInstanced && drawArraysInstanced ? 1 : 0;
+		if (!instancing)
+			std::cout << " - Instanced draws not supported" << std::endl;
+	}
+	return instancing == 1;
+}
+
+void Mesh::setAttribDivisor(unsigned int location, unsigned int divisor)
+{
+	assert(supportsInstancing() && "instancing not supported");
+	attribDivisor(location, divisor);
+}
+
 void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances)
 {
 	int start = 0; //in primitives
@@ -295,21 +449,22 @@ void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances)
 		assert(submesh_id < submeshes.size() && "this mesh doesnt have as many submeshes");
 		sSubmeshInfo& submesh = submeshes[submesh_id];
 		start = submesh.start;
-		size = submesh.start + submesh.length;
+		size = submesh.length;
 	}
 
 	//DRAW
+	if (num_instances > 0 && !supportsInstancing())
+	{
+		assert(0 && "instancing not supported, check Mesh::supportsInstancing");
+		return;
+	}
 	if (m_indices.size())
 	{
 		if (num_instances > 0)
 		{
 			assert(indices_vbo_id && "indices must be uploaded to the GPU");
 			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
-			#ifdef OPENGL_ES3
-				glDrawElementsInstanced(primitive, size, GL_UNSIGNED_INT, (void*)(start + sizeof(Vector3u)), num_instances);
-            #else
-				assert(0 && "not supported in OpenGL ES2");
-            #endif
+			drawElementsInstanced(primitive, size, GL_UNSIGNED_INT, (void*)(start * sizeof(unsigned int)), num_instances);
 			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 		}
 		else
@@ -318,25 +473,19 @@ void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances)
 			{
 				/*if (size != 90)*/ {
 					glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
-					glDrawElements(primitive, size, GL_UNSIGNED_INT,(void *) (start * sizeof(Vector3u)));
+					glDrawElements(primitive, size, GL_UNSIGNED_INT,(void *) (start * sizeof(unsigned int)));
 					glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 				}
 				checkGLErrors();
 			}
 			else
-				glDrawElements(primitive, size, GL_UNSIGNED_INT, (void*)(&m_indices[0] + start)); //no multiply, its a vector3u pointer)
+				glDrawElements(primitive, size, GL_UNSIGNED_INT, (void*)(&m_indices[0] + start)); //no multiply, its an unsigned int pointer
 		}
 	}
 	else
 	{
 		if (num_instances > 0)
-		{
-			#ifdef OPENGL_ES3
-				glDrawArraysInstanced(primitive, start, size, num_instances);
-            #else
-				assert(0 && "not supported in OpenGL ES2");
-            #endif
-		}
+			drawArraysInstanced(primitive, start, size, num_instances);
 		else
 			glDrawArrays(primitive, start, size);
 	}
@@ -347,6 +496,9 @@ void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances)
 
 void Mesh::disableBuffers(Shader* shader)
 {
+	for (int i = 0; i < num_packed_locations; ++i)
+		glDisableVertexAttribArray(packed_locations[i]);
+	num_packed_locations = 0;
 	if (vertex_location != -1) glDisableVertexAttribArray(vertex_location);
 	if (normal_location != -1) glDisableVertexAttribArray(normal_location);
 	if (uv_location != -1) glDisableVertexAttribArray(uv_location);
@@ -499,84 +651,142 @@ void Mesh::renderAnimated( unsigned int primitive, Skeleton* skeleton )
 #define GL_ARRAY_BUFFER_ARB GL_ARRAY_BUFFER
 #define GL_STATIC_DRAW_ARB GL_STATIC_DRAW
 
-void Mesh::uploadToVRAM()
+void Mesh::buildVertexLayout(VertexLayout& layout, bool quantize)
 {
-	assert(vertices.size() || interleaved.size());
+	layout.clear();
+	layout.add(VA_POSITION, VF_FLOAT3);
 
-	if (glGenBuffersARB == nullptr)
-	{
-		std::cout << "Error: your graphics cards dont support VBOs. Sorry." << std::endl;
-		exit(0);
-	}
+	if (interleaved.size() || normals.size())
+		layout.add(VA_NORMAL, quantize ? VF_SNORM10_3 : VF_FLOAT3);
 
-	if (interleaved.size())
-	{
-		// Vertex,Normal,UV
-		if (interleaved_vbo_id == 0)
-			glGenBuffersARB(1, &interleaved_vbo_id);
-		glBindBufferARB(GL_ARRAY_BUFFER_ARB, interleaved_vbo_id);
-		glBufferDataARB(GL_ARRAY_BUFFER_ARB, interleaved.size() * sizeof(tInterleaved), &interleaved[0], GL_STATIC_DRAW_ARB);
-	}
-	else
+	if (interleaved.size() || uvs.size())
 	{
-		// Vertices
-		if (vertices_vbo_id == 0)
-			glGenBuffersARB(1, &vertices_vbo_id);
-		glBindBufferARB(GL_ARRAY_BUFFER_ARB, vertices_vbo_id);
-		glBufferDataARB(GL_ARRAY_BUFFER_ARB, vertices.size() * sizeof(Vector3), &vertices[0], GL_STATIC_DRAW_ARB);
-
-		// UVs
-		if (uvs.size())
+		eVertexFormat format = VF_FLOAT2;
+		if (quantize)
 		{
-			if (uvs_vbo_id == 0)
-				glGenBuffersARB(1, &uvs_vbo_id);
-			glBindBufferARB(GL_ARRAY_BUFFER_ARB, uvs_vbo_id);
-			glBufferDataARB(GL_ARRAY_BUFFER_ARB, uvs.size() * sizeof(Vector2), &uvs[0], GL_STATIC_DRAW_ARB);
+			//unorm16 when the uvs fit in 0..1, half when they are small enough to keep precision
+			Vector2 uv_min(1, 1), uv_max(0, 0);
+			unsigned int num = getNumVertices();
+			for (unsigned int i = 0; i < num; ++i)
+			{
+				const Vector2& uv = interleaved.size() ? interleaved[i].uv : uvs[i];
+				uv_min.x = std::min(uv_min.x, uv.x); uv_min.y = std::min(uv_min.y, uv.y);
+				uv_max.x = std::max(uv_max.x, uv.x); uv_max.y = std::max(uv_max.y, uv.y);
+			}
+			if (uv_min.x >= 0 && uv_min.y >= 0 && uv_max.x <= 1 && uv_max.y <= 1)
+				format = VF_UNORM16_2;
+			else if (uv_min.x >= -2 && uv_min.y >= -2 && uv_max.x <= 2 && uv_max.y <= 2)
+				format = VF_HALF2;
 		}
+		layout.add(VA_UV, format);
+	}
 
-		// Normals
-		if (normals.size())
+	if (m_uvs1.size())
+		layout.add(VA_UV1, quantize ? VF_HALF2 : VF_FLOAT2);
+	if (colors.size())
+		layout.add(VA_COLOR, quantize ? VF_UNORM8_4 : VF_FLOAT4);
+	if (bones.size())
+		layout.add(VA_BONES, VF_UBYTE4);
+	if (weights.size())
+		layout.add(VA_WEIGHTS, quantize ? VF_UNORM8_4 : VF_FLOAT4);
+}
+
+static void packAttribute(uint8* dst, eVertexFormat format, const float* src)
+{
+	switch (format)
+	{
+		case VF_FLOAT2: memcpy(dst, src, sizeof(float) * 2); break;
+		case VF_FLOAT3: memcpy(dst, src, sizeof(float) * 3); break;
+		case VF_FLOAT4: memcpy(dst, src, sizeof(float) * 4); break;
+		case VF_HALF2:
+			((uint16*)dst)[0] = floatToHalf(src[0]);
+			((uint16*)dst)[1] = floatToHalf(src[1]);
+			break;
+		case VF_UNORM16_2:
+			((uint16*)dst)[0] = (uint16)(clamp(src[0], 0.0f, 1.0f) * 65535.0f + 0.5f);
+			((uint16*)dst)[1] = (uint16)(clamp(src[1], 0.0f, 1.0f) * 65535.0f + 0.5f);
+			break;
+		case VF_SNORM10_3:
 		{
-			if (normals_vbo_id == 0)
-				glGenBuffersARB(1, &normals_vbo_id);
-			glBindBufferARB(GL_ARRAY_BUFFER_ARB, normals_vbo_id);
-			glBufferDataARB(GL_ARRAY_BUFFER_ARB, normals.size() * sizeof(Vector3), &normals[0], GL_STATIC_DRAW_ARB);
+			uint32 packed = 0;
+			for (int i = 0; i < 3; ++i)
+			{
+				int v = (int)floor(clamp(src[i], -1.0f, 1.0f) * 511.0f + 0.5f);
+				packed |= ((uint32)v & 0x3FF) << (i * 10);
+			}
+			*(uint32*)dst = packed;
+			break;
 		}
+		case VF_UNORM8_4:
+			for (int i = 0; i < 4; ++i)
+				dst[i] = (uint8)(clamp(src[i], 0.0f, 1.0f) * 255.0f + 0.5f);
+			break;
+		default:
+			assert(0 && "format cannot be packed from floats");
 	}
+}
 
-	// UVs
-	if (m_uvs1.size())
-	{
-		if (uvs1_vbo_id == 0)
-			glGenBuffersARB(1, &uvs1_vbo_id);
-		glBindBufferARB(GL_ARRAY_BUFFER_ARB, uvs1_vbo_id);
-		glBufferDataARB(GL_ARRAY_BUFFER_ARB, m_uvs1.size() * sizeof(Vector2), &m_uvs1[0], GL_STATIC_DRAW_ARB);
-	}
+void Mesh::packVertices(const VertexLayout& layout, std::vector<uint8>& buffer)
+{
+	unsigned int num = getNumVertices();
+	buffer.resize(num * layout.stride);
+	uint8* data = &buffer[0];
 
-	// Colors
-	if (colors.size())
+	for (unsigned int i = 0; i < num; ++i, data += layout.stride)
 	{
-		if (colors_vbo_id == 0)
-			glGenBuffersARB(1, &colors_vbo_id);
-		glBindBufferARB(GL_ARRAY_BUFFER_ARB, colors_vbo_id);
-		glBufferDataARB(GL_ARRAY_BUFFER_ARB, colors.size() * sizeof(Vector4), &colors[0], GL_STATIC_DRAW_ARB);
+		for (int j = 0; j < layout.num_attributes; ++j)
+		{
+			const sVertexAttribute& attr = layout.attributes[j];
+			eVertexFormat format = (eVertexFormat)attr.format;
+			uint8* dst = data + attr.offset;
+			switch (attr.attribute)
+			{
+				case VA_POSITION: packAttribute(dst, format, interleaved.size() ? interleaved[i].vertex.v : vertices[i].v); break;
+				case VA_NORMAL: packAttribute(dst, format, interleaved.size() ? interleaved[i].normal.v : normals[i].v); break;
+				case VA_UV: packAttribute(dst, format, interleaved.size() ? interleaved[i].uv.value : uvs[i].value); break;
+				case VA_UV1: packAttribute(dst, format, m_uvs1[i].value); break;
+				case VA_COLOR: packAttribute(dst, format, colors[i].v); break;
+				case VA_BONES: memcpy(dst, &bones[i], sizeof(Vector4ub)); break;
+				case VA_WEIGHTS:
+					packAttribute(dst, format, weights[i].v);
+					if (format == VF_UNORM8_4) //keep the sum of weights at exactly 1 after rounding
+					{
+						int sum = dst[0] + dst[1] + dst[2] + dst[3];
+						if (sum)
+						{
+							int max_index = 0;
+							for (int k = 1; k < 4; ++k)
+								if (dst[k] > dst[max_index])
+									max_index = k;
+							dst[max_index] = (uint8)clamp((float)(dst[max_index] + 255 - sum), 0.0f, 255.0f);
+						}
+					}
+					break;
+			}
+		}
 	}
+}
 
-	if (bones.size())
-	{
-		if (bones_vbo_id == 0)
-			glGenBuffersARB(1, &bones_vbo_id);
-		glBindBufferARB(GL_ARRAY_BUFFER_ARB, bones_vbo_id);
-		glBufferDataARB(GL_ARRAY_BUFFER_ARB, bones.size() * sizeof(Vector4ub), &bones[0], GL_STATIC_DRAW_ARB);
-	}
-	if (weights.size())
+void Mesh::uploadToVRAM()
+{
+	assert(vertices.size() || interleaved.size());
+	uv_density = computeUVDensity();
+
+	if (glGenBuffersARB == nullptr)
 	{
-		if (weights_vbo_id == 0)
-			glGenBuffersARB(1, &weights_vbo_id);
-		glBindBufferARB(GL_ARRAY_BUFFER_ARB, weights_vbo_id);
-		glBufferDataARB(GL_ARRAY_BUFFER_ARB, weights.size() * sizeof(Vector4), &weights[0], GL_STATIC_DRAW_ARB);
+		std::cout << "Error: your graphics cards dont support VBOs. Sorry." << std::endl;
+		exit(0);
 	}
 
+	//all the streams go to a single buffer, quantized if possible
+	std::vector<uint8> packed;
+	buildVertexLayout(layout, quantize_meshes);
+	packVertices(layout, packed);
+
+	if (packed_vbo_id == 0)
+		glGenBuffersARB(1, &packed_vbo_id);
+	glBindBufferARB(GL_ARRAY_BUFFER_ARB, packed_vbo_id);
+	glBufferDataARB(GL_ARRAY_BUFFER_ARB, packed.size(), &packed[0], GL_STATIC_DRAW_ARB);
 	glBindBufferARB(GL_ARRAY_BUFFER_ARB, 0);
 
 	// Indices
@@ -593,122 +803,93 @@ void Mesh::uploadToVRAM()
 	//clear buffers to save memory
 }
 
-bool Mesh::createCollisionModel(bool is_static)
+MeshBVH* Mesh::getBVH()
 {
-	if (collision_model)
-		return true;
-
-	CollisionModel3D* collision_model = newCollisionModel3D(is_static);
+	if (bvh)
+		return bvh;
 
-	if (m_indices.size()) //indexed
-	{
-		collision_model->setTriangleNumber((int)m_indices.size() / 3);
-
-		if (interleaved.size())
-			for (unsigned int i = 0; i < m_indices.size(); i+=3)
-			{
-				auto v1 = interleaved[m_indices[i+0]];
-				auto v2 = interleaved[m_indices[i+1]];
-				auto v3 = interleaved[m_indices[i+2]];
-				collision_model->addTriangle(v1.vertex.v, v2.vertex.v, v3.vertex.v);
-			}
-		else
-		for (unsigned int i = 0; i < m_indices.size(); i+=3)
-		{
-			auto v1 = vertices[m_indices[i+0]];
-			auto v2 = vertices[m_indices[i+1]];
-			auto v3 = vertices[m_indices[i+2]];
-			collision_model->addTriangle(v1.v, v2.v, v3.v);
-		}
-	}
-	else if (interleaved.size()) //is interleaved
+	const void* positions = NULL;
+	int stride = 0;
+	int num_vertices = 0;
+	if (interleaved.size())
 	{
-		collision_model->setTriangleNumber(interleaved.size() / 3);
-		for (unsigned int i = 0; i < interleaved.size(); i+=3)
-		{
-			auto v1 = interleaved[i];
-			auto v2 = interleaved[i+1];
-			auto v3 = interleaved[i+2];
-			collision_model->addTriangle(v1.vertex.v, v2.vertex.v, v3.vertex.v);
-		}
+		positions = &interleaved[0].vertex;
+		stride = sizeof(tInterleaved);
+		num_vertices = (int)interleaved.size();
 	}
-	else if (vertices.size()) //non interleaved
+	else if (vertices.size())
 	{
-		collision_model->setTriangleNumber((int)vertices.size() / 3);
-		for (unsigned int i = 0; i < (int)vertices.size(); i+=3)
-		{
-			auto v1 = vertices[i];
-			auto v2 = vertices[i + 1];
-			auto v3 = vertices[i + 2];
-			collision_model->addTriangle(v1.v, v2.v, v3.v);
-		}
+		positions = &vertices[0];
+		stride = sizeof(Vector3);
+		num_vertices = (int)vertices.size();
 	}
 	else
 	{
 		assert(0 && "mesh without vertices, cannot create collision model");
-		return false;
+		return NULL;
 	}
-	collision_model->finalize();
-	this->collision_model = collision_model;
-	return true;
+
+	bvh = new MeshBVH();
+	if (m_indices.size()) //indexed
+		bvh->build(positions, stride, num_vertices, &m_indices[0], (int)m_indices.size() / 3);
+	else
+		bvh->build(positions, stride, num_vertices, NULL, num_vertices / 3);
+	return bvh;
 }
 
 //help: model is the transform of the mesh, ray origin and direction, a Vector3 where to store the collision if found, a Vector3 where to store the normal if there was a collision, max ray distance in case the ray should go to infintiy, and in_object_space to get the collision point in object space or world space
 bool Mesh::testRayCollision(Matrix44 model, Vector3 start, Vector3 front, Vector3& collision, Vector3& normal, float max_ray_dist, bool in_object_space )
 {
-	if (!this->collision_model)
-		if (!createCollisionModel())
-			return false;
-
-	CollisionModel3D* collision_model = (CollisionModel3D*)this->collision_model;
-	assert(collision_model && "CollisionModel3D must be created before using it, call createCollisionModel");
-
-	collision_model->setTransform( model.m );
-	if (collision_model->rayCollision( start.v , front.v, true,0.0, max_ray_dist) == false)
+	MeshBVH* bvh = getBVH();
+	if (!bvh)
 		return false;
 
-	collision_model->getCollisionPoint( collision.v, in_object_space);
-
-	float t1[9],t2[9];
-	collision_model->getCollidingTriangles(t1,t2, in_object_space);
+	//the ray is moved to object space, the direction keeps the scale so the distances are still in world units
+	Matrix44 inverse = model;
+	if (!inverse.affineInverse())
+		return false;
+	Vector3 origin = inverse * start;
+	Vector3 direction = inverse.rotateVector(front);
 
-	Vector3 v1;
-	Vector3 v2;
-	v1=Vector3(t1[3]-t1[0],t1[4]-t1[1],t1[5]-t1[2]);
-	v2=Vector3(t1[6]-t1[0],t1[7]-t1[1],t1[8]-t1[2]);
-	v1.normalize();
-	v2.normalize();
-	normal = v1.cross(v2);
+	RayHit hit;
+	if (!bvh->testRay(origin, direction, max_ray_dist, hit))
+		return false;
 
+	collision = origin + direction * hit.distance;
+	if (in_object_space)
+		normal = bvh->getTriangleNormal(hit.triangle, Matrix44());
+	else
+	{
+		collision = model * collision;
+		normal = bvh->getTriangleNormal(hit.triangle, model);
+	}
 	return true;
 }
 
 bool Mesh::testSphereCollision(Matrix44 model, Vector3 center, float radius, Vector3& collision, Vector3& normal)
 {
-	if (!this->collision_model)
-		if (!createCollisionModel())
-			return false;
-
-	CollisionModel3D* collision_model = (CollisionModel3D*)this->collision_model;
-	assert(collision_model && "CollisionModel3D must be created before using it, call createCollisionModel");
-
-	collision_model->setTransform(model.m);
-	if (collision_model->sphereCollision(center.v, radius) == false)
+	MeshBVH* bvh = getBVH();
+	if (!bvh)
 		return false;
 
-	collision_model->getCollisionPoint(collision.v, false);
+	Matrix44 inverse = model;
+	if (!inverse.affineInverse())
+		return false;
 
-	float t1[9], t2[9];
-	collision_model->getCollidingTriangles(t1, t2, false);
+	//with a non uniform scale the sphere is an ellipsoid in object space, it is searched with the smallest scale
+	//(the biggest radius) and the closest point is tested again in world space
+	float scale = std::min(std::min(model.rotateVector(Vector3(1, 0, 0)).length(), model.rotateVector(Vector3(0, 1, 0)).length()), model.rotateVector(Vector3(0, 0, 1)).length());
+	if (scale <= 0.0f)
+		return false;
 
-	Vector3 v1;
-	Vector3 v2;
-	v1 = Vector3(t1[3] - t1[0], t1[4] - t1[1], t1[5] - t1[2]);
-	v2 = Vector3(t1[6] - t1[0], t1[7] - t1[1], t1[8] - t1[2]);
-	v1.normalize();
-	v2.normalize();
-	normal = v1.cross(v2);
+	int triangle;
+	if (!bvh->testSphere(inverse * center, radius / scale, collision, triangle))
+		return false;
+	collision = model * collision;
+	if (collision.distance(center) > radius)
+		return false;
 
+	normal = bvh->getTriangleNormal(triangle, model);
 	return true;
 }
 
@@ -735,6 +916,106 @@ bool Mesh::interleaveBuffers()
 	return true;
 }
 
+template<typename T> void remapStream(std::vector<T>& stream, const std::vector<unsigned int>& remap, unsigned int num)
+{
+	if (stream.empty())
+		return;
+	std::vector<T> result(num);
+	for (size_t i = 0; i < remap.size(); ++i)
+		if (remap[i] < num) //unused vertices are skipped
+			result[remap[i]] = stream[i];
+	stream.swap(result);
+}
+
+bool Mesh::optimize(sVertexCacheStats* stats_before, sVertexCacheStats* stats_after)
+{
+	unsigned int num_vertices = getNumVertices();
+	if (!num_vertices)
+		return false;
+
+	//unindexed meshes use every vertex once
+	std::vector<unsigned int> indices = m_indices;
+	if (indices.empty())
+	{
+		indices.resize(num_vertices);
+		for (unsigned int i = 0; i < num_vertices; ++i)
+			indices[i] = i;
+	}
+	if (indices.size() % 3)
+		return false; //only triangles
+
+	if (stats_before)
+		*stats_before = analyzeVertexCache(&indices[0], (unsigned int)indices.size(), num_vertices);
+
+	//weld identical vertices, comparing all the streams
+	VertexLayout full_layout;
+	std::vector<uint8> packed;
+	std::vector<unsigned int> remap;
+	buildVertexLayout(full_layout, false);
+	packVertices(full_layout, packed);
+	unsigned int num_unique = generateVertexRemap(remap, &packed[0], num_vertices, full_layout.stride);
+	packed.clear();
+
+	for (size_t i = 0; i < indices.size(); ++i)
+		indices[i] = remap[indices[i]];
+	remapStream(interleaved, remap, num_unique);
+	remapStream(vertices, remap, num_unique);
+	remapStream(normals, remap, num_unique);
+	remapStream(uvs, remap, num_unique);
+	remapStream(m_uvs1, remap, num_unique);
+	remapStream(colors, remap, num_unique);
+	remapStream(bones, remap, num_unique);
+	remapStream(weights, remap, num_unique);
+
+	//reorder triangles inside every submesh, so the ranges are still valid
+	std::vector<Vector3> positions(num_unique);
+	for (unsigned int i = 0; i < num_unique; ++i)
+		positions[i] = interleaved.size() ? interleaved[i].vertex : vertices[i];
+
+	std::vector<unsigned int> temp(indices.size());
+	std::vector<sSubmeshInfo> ranges = submeshes;
+	if (ranges.empty())
+	{
+		sSubmeshInfo range;
+		memset(&range, 0, sizeof(range));
+		range.length = (int)indices.size();
+		ranges.push_back(range);
+	}
+
+	for (size_t i = 0; i < ranges.size(); ++i)
+	{
+		unsigned int start = ranges[i].start;
+		unsigned int length = ranges[i].length;
+		if (!length || start + length > indices.size() || length % 3)
+			continue;
+		optimizeVertexCache(&temp[start], &indices[start], length, num_unique);
+		optimizeOverdraw(&indices[start], &temp[start], length, &positions[0], num_unique);
+	}
+
+	//store the vertices in the order they are used
+	unsigned int num_used = optimizeVertexFetchRemap(remap, &indices[0], (unsigned int)indices.size(), num_unique);
+	for (size_t i = 0; i < indices.size(); ++i)
+		indices[i] = remap[indices[i]];
+	remapStream(interleaved, remap, num_used);
+	remapStream(vertices, remap, num_used);
+	remapStream(normals, remap, num_used);
+	remapStream(uvs, remap, num_used);
+	remapStream(m_uvs1, remap, num_used);
+	remapStream(colors, remap, num_used);
+	remapStream(bones, remap, num_used);
+	remapStream(weights, remap, num_used);
+	m_indices.swap(indices);
+
+	//triangles have changed
+	delete bvh;
+	bvh = NULL;
+	revision++;
+
+	if (stats_after)
+		*stats_after = analyzeVertexCache(&m_indices[0], (unsigned int)m_indices.size(), num_used);
+	return true;
+}
+
 typedef struct 
 {
 	int version;
@@ -826,7 +1107,7 @@ bool Mesh::readBin(const char* filename, bool bFromNetwork)
 	{
 		m_indices.resize(info.num_indices);
 		memcpy((void*)&m_indices[0], pos, sizeof(unsigned int) * info.num_indices);
-		pos += sizeof(Vector3u) * info.num_indices;
+		pos += sizeof(unsigned int) * info.num_indices;
 	}
 
 	if (info.streams[5] == 'B')
@@ -865,10 +1146,11 @@ bool Mesh::readBin(const char* filename, bool bFromNetwork)
 	bind_matrix = info.bind_matrix;
 
 	submeshes.resize(info.num_submeshes);
-	memcpy(&submeshes[0], pos, sizeof(sSubmeshInfo) * info.num_submeshes);
+	if (info.num_submeshes)
+		memcpy(&submeshes[0], pos, sizeof(sSubmeshInfo) * info.num_submeshes);
 	pos += sizeof(sSubmeshInfo) * info.num_submeshes;
 
-	createCollisionModel();
+	delete[] data;
 	return true;
 }
 
@@ -937,12 +1219,13 @@ bool Mesh::writeBin(const char* filename)
 		fwrite((void*)&bones[0], bones.size() * sizeof(Vector4ub), 1, f);
 	if (weights.size())
 		fwrite((void*)&weights[0], weights.size() * sizeof(Vector4), 1, f);
-	if (bones_info.size())
-		fwrite((void*)&bones_info[0], bones_info.size() * sizeof(BoneInfo), 1, f);
 	if (m_uvs1.size())
 		fwrite((void*)&m_uvs1[0], m_uvs1.size() * sizeof(Vector2), 1, f);
+	if (bones_info.size()) //same order used in readBin
+		fwrite((void*)&bones_info[0], bones_info.size() * sizeof(BoneInfo), 1, f);
 
-	fwrite((void*)&submeshes[0], submeshes.size() * sizeof(sSubmeshInfo), 1, f);
+	if (submeshes.size())
+		fwrite((void*)&submeshes[0], submeshes.size() * sizeof(sSubmeshInfo), 1, f);
 
 	fclose(f);
 	return true;
@@ -1078,139 +1361,399 @@ bool Mesh::loadASE(const char* filename)
 	return true;
 }
 
-bool Mesh::loadOBJ(const char* filename)
-{
-	std::string data;
-	if(!readFile(filename,data))
-		return false;
-	char* pos = &data[0];
-	char line[255];
-	int i = 0;
+//OBJ parser: the file is split in chunks of whole lines that are parsed in parallel,
+//afterwards the chunks are merged and the corners (position/uv/normal) are welded to build an indexed mesh
+
+#define OBJ_CHUNK_SIZE (1 << 20) //bytes per chunk
+
+struct sOBJCorner {
+	int index[3]; //position, uv, normal
+	uint8 flags; //bits 0-2: index is present, bits 3-5: index is relative to the start of the chunk, bit 6: an index is 0
+};
+#define OBJ_CORNER_ZERO_INDEX (1 << 6)
+
+struct sOBJEvent {
+	bool is_group; //"g" or "usemtl"
+	unsigned int corner; //number of corners in the chunk when it appeared
+	char name[64];
+};
+
+struct sOBJChunk {
+	const char* start;
+	const char* end;
+	std::vector<Vector3> positions;
+	std::vector<Vector2> uvs;
+	std::vector<Vector3> normals;
+	std::vector<sOBJCorner> corners; //three per triangle
+	std::vector<sOBJEvent> events;
+	Vector3 aabb_min;
+	Vector3 aabb_max;
+	unsigned int position_base, uv_base, normal_base; //number of elements in the previous chunks
+};
 
-	std::vector<Vector3> indexed_positions;
-	std::vector<Vector3> indexed_normals;
-	std::vector<Vector2> indexed_uvs;
+static inline const char* skipOBJSpaces(const char* pos, const char* end)
+{
+	while (pos < end && (*pos == ' ' || *pos == '\t'))
+		++pos;
+	return pos;
+}
 
-	const float max_float = 10000000;
-	const float min_float = -10000000;
-	aabb_min.set(max_float,max_float,max_float);
-	aabb_max.set(min_float,min_float,min_float);
+static inline const char* skipOBJLine(const char* pos, const char* end)
+{
+	while (pos < end && *pos != '\n')
+		++pos;
+	return pos < end ? pos + 1 : end;
+}
 
-	unsigned int vertex_i = 0;
+static inline const char* parseOBJFloat(const char* pos, const char* end, float& value)
+{
+	pos = skipOBJSpaces(pos, end);
+	if (pos < end && *pos == '+') //from_chars does not accept it
+		++pos;
+	std::from_chars_result result = std::from_chars(pos, end, value);
+	if (result.ec != std::errc())
+	{
+		value = 0;
+		return pos;
+	}
+	return result.ptr;
+}
 
-	sSubmeshInfo submesh_info;
-	int last_submesh_vertex = 0;
-	memset(&submesh_info, 0, sizeof(submesh_info));
+static inline const char* parseOBJName(const char* pos, const char* end, char* name, int max_length)
+{
+	pos = skipOBJSpaces(pos, end);
+	int length = 0;
+	while (pos < end && *pos != '\n' && *pos != '\r' && *pos != ' ' && *pos != '\t')
+	{
+		if (length < max_length - 1)
+			name[length++] = *pos;
+		++pos;
+	}
+	name[length] = 0;
+	return pos;
+}
 
-	//parse file
-	while(*pos != 0)
+//parses a face corner like "v", "v/t", "v//n" or "v/t/n". Returns NULL if there is no corner
+static inline const char* parseOBJCorner(const char* pos, const char* end, sOBJCorner& corner, const unsigned int* local_counts)
+{
+	pos = skipOBJSpaces(pos, end);
+	corner.flags = 0;
+	for (int i = 0; i < 3; ++i)
 	{
-		if (*pos == '\n') pos++;
-		if (*pos == '\r') pos++;
+		corner.index[i] = 0;
+		if (i > 0)
+		{
+			if (pos >= end || *pos != '/')
+				break;
+			++pos;
+		}
+		int value = 0;
+		std::from_chars_result result = std::from_chars(pos, end, value);
+		if (result.ec != std::errc())
+		{
+			if (i == 0)
+				return NULL;
+			continue; //empty index, like in "v//n"
+		}
+		pos = result.ptr;
+		if (value > 0) //absolute, starting at 1
+			corner.index[i] = value - 1;
+		else if (value < 0) //relative to the last element, resolved when merging the chunks
+		{
+			corner.index[i] = (int)local_counts[i] + value;
+			corner.flags |= 1 << (i + 3);
+		}
+		else //there is no index 0, the face is discarded
+			corner.flags |= OBJ_CORNER_ZERO_INDEX;
+		corner.flags |= 1 << i;
+	}
+	return pos;
+}
 
-		//read one line
-		i = 0;
-		while(i < 255 && pos[i] != '\n' && pos[i] != '\r' && pos[i] != 0) i++;
-		memcpy(line,pos,i);
-		line[i] = 0;
-		pos = pos + i;
+static void parseOBJChunk(sOBJChunk& chunk)
+{
+	const char* pos = chunk.start;
+	const char* end = chunk.end;
 
-		//std::cout << "Line: \"" << line << "\"" << std::endl;
-		if (*line == '#' || *line == 0) continue; //comment
+	//rough estimation to avoid reallocations
+	size_t estimated = (end - pos) / 40;
+	chunk.positions.reserve(estimated);
+	chunk.corners.reserve(estimated * 2);
 
-		//tokenize line
-		std::vector<std::string> tokens = tokenize(line," ");
+	const float max_float = 10000000;
+	chunk.aabb_min.set(max_float, max_float, max_float);
+	chunk.aabb_max.set(-max_float, -max_float, -max_float);
 
-		if (tokens.empty()) continue;
+	unsigned int local_counts[3];
+	sOBJCorner polygon[3];
+	sOBJEvent event;
 
-		if (tokens[0] == "v" && tokens.size() == 4)
-		{
-			Vector3 v((float)atof(tokens[1].c_str()), (float)atof(tokens[2].c_str()), (float)atof(tokens[3].c_str()) );
-			indexed_positions.push_back(v);
+	while (pos < end)
+	{
+		pos = skipOBJSpaces(pos, end);
+		if (pos >= end)
+			break;
 
-			aabb_min.setMin( v );
-			aabb_max.setMax( v );
-		}
-		else if (tokens[0] == "vt" && tokens.size() >= 3)
+		const char* next = pos + 1;
+		if (pos[0] == 'v' && next < end && (*next == ' ' || *next == '\t'))
 		{
-			Vector2 v((float)atof(tokens[1].c_str()), 1.0 - (float)atof(tokens[2].c_str()) );
-			indexed_uvs.push_back(v);
+			Vector3 v;
+			pos = parseOBJFloat(next, end, v.x);
+			pos = parseOBJFloat(pos, end, v.y);
+			pos = parseOBJFloat(pos, end, v.z);
+			chunk.positions.push_back(v);
+			chunk.aabb_min.setMin(v);
+			chunk.aabb_max.setMax(v);
 		}
-		else if (tokens[0] == "vn" && tokens.size() == 4)
+		else if (pos[0] == 'v' && next + 1 < end && *next == 't' && (next[1] == ' ' || next[1] == '\t'))
 		{
-			Vector3 v((float)atof(tokens[1].c_str()), (float)atof(tokens[2].c_str()), (float)atof(tokens[3].c_str()) );
-			indexed_normals.push_back(v);
+			Vector2 uv;
+			pos = parseOBJFloat(next + 1, end, uv.x);
+			pos = parseOBJFloat(pos, end, uv.y);
+			uv.y = 1.0f - uv.y;
+			chunk.uvs.push_back(uv);
 		}
-		else if (tokens[0] == "s") //surface? it appears one time before the faces
+		else if (pos[0] == 'v' && next + 1 < end && *next == 'n' && (next[1] == ' ' || next[1] == '\t'))
 		{
-			//process mesh: ????
-			//if (uvs.size() == 0 && indexed_uvs.size() )
-			//	uvs.resize(1);
+			Vector3 n;
+			pos = parseOBJFloat(next + 1, end, n.x);
+			pos = parseOBJFloat(pos, end, n.y);
+			pos = parseOBJFloat(pos, end, n.z);
+			chunk.normals.push_back(n);
 		}
-		else if (tokens[0] == "usemtl") //surface? it appears one time before the faces
+		else if (pos[0] == 'f' && next < end && (*next == ' ' || *next == '\t'))
 		{
-			if (last_submesh_vertex != vertices.size())
+			local_counts[0] = (unsigned int)chunk.positions.size();
+			local_counts[1] = (unsigned int)chunk.uvs.size();
+			local_counts[2] = (unsigned int)chunk.normals.size();
+
+			//polygons are converted to a triangle fan
+			int num_corners = 0;
+			pos = next;
+			sOBJCorner corner;
+			while ((next = parseOBJCorner(pos, end, corner, local_counts)) != NULL)
 			{
-				submesh_info.length = vertices.size() - submesh_info.start;
-				last_submesh_vertex = vertices.size();
-				submeshes.push_back(submesh_info);
-				memset(&submesh_info, 0, sizeof(submesh_info));
-				strcpy(submesh_info.name, tokens[1].c_str());
-				submesh_info.start = last_submesh_vertex;
+				pos = next;
+				if (num_corners < 3)
+					polygon[num_corners] = corner;
+				else
+				{
+					polygon[1] = polygon[2];
+					polygon[2] = corner;
+				}
+				num_corners++;
+				if (num_corners >= 3)
+				{
+					chunk.corners.push_back(polygon[0]);
+					chunk.corners.push_back(polygon[1]);
+					chunk.corners.push_back(polygon[2]);
+				}
 			}
-			else
-				strcpy(submesh_info.material, tokens[1].c_str());
 		}
-		else if (tokens[0] == "g") //surface? it appears one time before the faces
+		else if (pos[0] == 'g' && next < end && (*next == ' ' || *next == '\t'))
 		{
-			if (last_submesh_vertex != vertices.size())
-			{
-				submesh_info.length = vertices.size() - submesh_info.start;
-				last_submesh_vertex = vertices.size();
-				submeshes.push_back(submesh_info);
-				memset(&submesh_info, 0, sizeof(submesh_info));
-				strcpy( submesh_info.name, tokens[1].c_str());
-				submesh_info.start = last_submesh_vertex;
-			}
+			event.is_group = true;
+			event.corner = (unsigned int)chunk.corners.size();
+			pos = parseOBJName(next, end, event.name, sizeof(event.name));
+			chunk.events.push_back(event);
 		}
-		else if (tokens[0] == "f" && tokens.size() >= 4)
+		else if (end - pos > 7 && strncmp(pos, "usemtl", 6) == 0 && (pos[6] == ' ' || pos[6] == '\t'))
 		{
-			Vector3 v1,v2,v3;
-			v1.parseFromText( tokens[1].c_str(), '/' );
+			event.is_group = false;
+			event.corner = (unsigned int)chunk.corners.size();
+			pos = parseOBJName(pos + 6, end, event.name, sizeof(event.name));
+			chunk.events.push_back(event);
+		}
 
-			for (unsigned int iPoly = 2; iPoly < tokens.size() - 1; iPoly++)
-			{
-				v2.parseFromText( tokens[iPoly].c_str(), '/' );
-				v3.parseFromText( tokens[iPoly+1].c_str(), '/' );
+		pos = skipOBJLine(pos, end); //comments and unsupported lines are skipped too
+	}
+}
+
+bool Mesh::loadOBJ(const char* filename)
+{
+	std::string data;
+	if(!readFile(filename,data))
+		return false;
 
-				vertices.push_back( indexed_positions[ (unsigned int)(v1.x) -1 ] );
-				vertices.push_back( indexed_positions[ (unsigned int)(v2.x) -1] );
-				vertices.push_back( indexed_positions[ (unsigned int)(v3.x) -1] );
-				//triangles.push_back( VECTOR_INDICES_TYPE(vertex_i, vertex_i+1, vertex_i+2) ); //not needed
-				vertex_i += 3;
+	const char* file_start = data.c_str();
+	const char* file_end = file_start + data.size();
 
-				if (indexed_uvs.size() > 0)
+	//split in chunks, every chunk ends at the end of a line
+	std::vector<sOBJChunk> chunks;
+	int num_chunks = (int)(data.size() / OBJ_CHUNK_SIZE) + 1;
+	chunks.resize(num_chunks);
+	const char* pos = file_start;
+	for (int i = 0; i < num_chunks; ++i)
+	{
+		chunks[i].start = pos;
+		pos = i == num_chunks - 1 ? file_end : std::max(pos, file_start + (data.size() * (i + 1)) / num_chunks); //a long line could have passed it
+		while (pos < file_end && pos[-1] != '\n')
+			++pos;
+		chunks[i].end = pos;
+	}
+
+	parallelFor(num_chunks, [&chunks](int i) { parseOBJChunk(chunks[i]); });
+
+	//offsets of every chunk
+	unsigned int num_positions = 0, num_uvs = 0, num_normals = 0, num_corners = 0;
+	for (int i = 0; i < num_chunks; ++i)
+	{
+		sOBJChunk& chunk = chunks[i];
+		chunk.position_base = num_positions;
+		chunk.uv_base = num_uvs;
+		chunk.normal_base = num_normals;
+		num_positions += (unsigned int)chunk.positions.size();
+		num_uvs += (unsigned int)chunk.uvs.size();
+		num_normals += (unsigned int)chunk.normals.size();
+		num_corners += (unsigned int)chunk.corners.size();
+	}
+
+	if (!num_positions)
+		return false;
+
+	std::vector<Vector3> indexed_positions;
+	std::vector<Vector2> indexed_uvs;
+	std::vector<Vector3> indexed_normals;
+	indexed_positions.reserve(num_positions);
+	indexed_uvs.reserve(num_uvs);
+	indexed_normals.reserve(num_normals);
+
+	const float max_float = 10000000;
+	aabb_min.set(max_float, max_float, max_float);
+	aabb_max.set(-max_float, -max_float, -max_float);
+	for (int i = 0; i < num_chunks; ++i)
+	{
+		sOBJChunk& chunk = chunks[i];
+		indexed_positions.insert(indexed_positions.end(), chunk.positions.begin(), chunk.positions.end());
+		indexed_uvs.insert(indexed_uvs.end(), chunk.uvs.begin(), chunk.uvs.end());
+		indexed_normals.insert(indexed_normals.end(), chunk.normals.begin(), chunk.normals.end());
+		if (chunk.positions.size())
+		{
+			aabb_min.setMin(chunk.aabb_min);
+			aabb_max.setMax(chunk.aabb_max);
+		}
+		std::vector<Vector3>().swap(chunk.positions);
+		std::vector<Vector2>().swap(chunk.uvs);
+		std::vector<Vector3>().swap(chunk.normals);
+	}
+
+	//weld the corners that use the same position, uv and normal
+	unsigned int table_size = 1;
+	while (table_size < num_corners * 2)
+		table_size *= 2;
+	std::vector<unsigned int> table(table_size, 0xFFFFFFFF);
+	std::vector<int> vertex_keys; //three per vertex
+	vertex_keys.reserve(num_positions * 3);
+	vertices.reserve(num_positions);
+	if (num_uvs)
+		uvs.reserve(num_positions);
+	if (num_normals)
+		normals.reserve(num_positions);
+	m_indices.reserve(num_corners);
+
+	sSubmeshInfo submesh_info;
+	memset(&submesh_info, 0, sizeof(submesh_info));
+	unsigned int last_submesh_index = 0;
+	unsigned int invalid_faces = 0;
+
+	for (int i = 0; i < num_chunks; ++i)
+	{
+		sOBJChunk& chunk = chunks[i];
+		const unsigned int bases[3] = { chunk.position_base, chunk.uv_base, chunk.normal_base };
+		const unsigned int counts[3] = { num_positions, num_uvs, num_normals };
+		size_t current_event = 0;
+
+		for (unsigned int j = 0; j <= chunk.corners.size(); j += 3)
+		{
+			//submeshes, same rules than the previous parser
+			while (current_event < chunk.events.size() && chunk.events[current_event].corner == j)
+			{
+				sOBJEvent& event = chunk.events[current_event++];
+				if (last_submesh_index != m_indices.size())
 				{
-					uvs.push_back( indexed_uvs[(unsigned int)(v1.y) -1] );
-					uvs.push_back( indexed_uvs[(unsigned int)(v2.y) -1] );
-					uvs.push_back( indexed_uvs[(unsigned int)(v3.y) -1] );
+					submesh_info.length = (int)m_indices.size() - submesh_info.start;
+					last_submesh_index = (unsigned int)m_indices.size();
+					submeshes.push_back(submesh_info);
+					memset(&submesh_info, 0, sizeof(submesh_info));
+					strcpy(submesh_info.name, event.name);
+					submesh_info.start = last_submesh_index;
 				}
+				else if (!event.is_group)
+					strcpy(submesh_info.material, event.name);
+			}
+			if (j == chunk.corners.size())
+				break;
 
-				if (indexed_normals.size() > 0)
+			//resolve the indices of the triangle
+			int keys[3][3];
+			bool valid = true;
+			for (int k = 0; k < 3; ++k)
+			{
+				const sOBJCorner& corner = chunk.corners[j + k];
+				//every corner needs a position
+				if (!(corner.flags & 1) || (corner.flags & OBJ_CORNER_ZERO_INDEX))
+					valid = false;
+				for (int l = 0; l < 3; ++l)
 				{
-					normals.push_back( indexed_normals[(unsigned int)(v1.z) -1] );
-					normals.push_back( indexed_normals[(unsigned int)(v2.z) -1] );
-					normals.push_back( indexed_normals[(unsigned int)(v3.z) -1] );
+					int index = -1;
+					if (corner.flags & (1 << l))
+					{
+						index = corner.index[l];
+						if (corner.flags & (1 << (l + 3)))
+							index += (int)bases[l];
+						if (index < 0 || index >= (int)counts[l])
+							valid = false;
+					}
+					keys[k][l] = index;
+				}
+			}
+			if (!valid)
+			{
+				invalid_faces++;
+				continue;
+			}
+
+			for (int k = 0; k < 3; ++k)
+			{
+				const int* key = keys[k];
+				unsigned int hash = (unsigned int)key[0] * 73856093u ^ (unsigned int)key[1] * 19349663u ^ (unsigned int)key[2] * 83492791u;
+				unsigned int slot = hash & (table_size - 1);
+				while (true)
+				{
+					unsigned int index = table[slot];
+					if (index == 0xFFFFFFFF) //new vertex
+					{
+						index = (unsigned int)vertices.size();
+						table[slot] = index;
+						vertex_keys.insert(vertex_keys.end(), key, key + 3);
+						vertices.push_back(indexed_positions[key[0]]);
+						if (num_uvs)
+							uvs.push_back(key[1] != -1 ? indexed_uvs[key[1]] : Vector2(0, 0));
+						if (num_normals)
+							normals.push_back(key[2] != -1 ? indexed_normals[key[2]] : Vector3(0, 0, 0));
+						m_indices.push_back(index);
+						break;
+					}
+					const int* other = &vertex_keys[index * 3];
+					if (other[0] == key[0] && other[1] == key[1] && other[2] == key[2])
+					{
+						m_indices.push_back(index);
+						break;
+					}
+					slot = (slot + 1) & (table_size - 1);
 				}
 			}
 		}
 	}
 
+	if (invalid_faces)
+		std::cout << "[WARN] " << invalid_faces << " faces with invalid indices ";
+
 	box.center = (aabb_max + aabb_min) * 0.5;
 	box.halfsize = (aabb_max - box.center);
 	radius = (float)fmax( aabb_max.length(), aabb_min.length() );
 
-	submesh_info.length = vertices.size() - last_submesh_vertex;
+	submesh_info.length = (int)m_indices.size() - last_submesh_index;
 	submeshes.push_back(submesh_info);
 	return true;
 }
@@ -1293,6 +1836,8 @@ bool Mesh::loadMESH(const char* filename)
 
 	delete[] data;
 
+	updateBoundingBox();
+	radius = (float)fmax(aabb_max.length(), aabb_min.length());
 	return true;
 }
 
@@ -1458,6 +2003,11 @@ void Mesh::displace(Image* heightmap, float altitude)
 	box.center.y += altitude*0.5f;
 	box.halfsize.y += altitude*0.5f;
 	radius = box.halfsize.length();
+
+	//triangles have changed
+	delete bvh;
+	bvh = NULL;
+	revision++;
 }
 
 
@@ -1505,6 +2055,35 @@ void Mesh::updateBoundingBox()
 	box.halfsize = aabb_max - box.center;
 }
 
+float Mesh::computeUVDensity()
+{
+	bool use_interleaved = interleaved.size() > 0;
+	if (!use_interleaved && uvs.size() != vertices.size())
+		return 0;
+
+	size_t num_vertices = use_interleaved ? interleaved.size() : vertices.size();
+	size_t num = m_indices.size() ? m_indices.size() : num_vertices;
+	double surface_area = 0;
+	double uv_area = 0;
+	for (size_t i = 0; i + 2 < num; i += 3)
+	{
+		unsigned int index[3];
+		for (int j = 0; j < 3; ++j)
+			index[j] = m_indices.size() ? m_indices[i + j] : (unsigned int)(i + j);
+		Vector3 a = use_interleaved ? interleaved[index[0]].vertex : vertices[index[0]];
+		Vector3 b = use_interleaved ? interleaved[index[1]].vertex : vertices[index[1]];
+		Vector3 c = use_interleaved ? interleaved[index[2]].vertex : vertices[index[2]];
+		Vector2 ta = use_interleaved ? interleaved[index[0]].uv : uvs[index[0]];
+		Vector2 tb = use_interleaved ? interleaved[index[1]].uv : uvs[index[1]];
+		Vector2 tc = use_interleaved ? interleaved[index[2]].uv : uvs[index[2]];
+		surface_area += (b - a).cross(c - a).length();
+		uv_area += fabs((tb.x - ta.x) * (tc.y - ta.y) - (tc.x - ta.x) * (tb.y - ta.y));
+	}
+	if (surface_area <= 0)
+		return 0;
+	return (float)sqrt(uv_area / surface_area);
+}
+
 Mesh* wire_box = NULL;
 
 void Mesh::renderBounding( const Matrix44& model, bool world_bounding )
@@ -1559,9 +2138,9 @@ Mesh* Mesh::getQuad()
 Mesh* Mesh::Get(const char* filename, bool bFromNetwork, bool skip_load)
 {
 	assert(filename);
-	std::map<std::string, Mesh*>::iterator it = sMeshesLoaded.find(filename);
-	if (it != sMeshesLoaded.end())
-		return it->second;
+	Mesh* found = sMeshesLoaded.find(filename);
+	if (found)
+		return found;
 
 	if (skip_load)
 		return NULL;
@@ -1609,8 +2188,8 @@ Mesh* Mesh::Get(const char* filename, bool bFromNetwork, bool skip_load)
 			m->uploadToVRAM();
 		}
 
-		std::cout << "[OK BIN]  Faces: " << (m->interleaved.size() ? m->interleaved.size() : m->vertices.size()) / 3 << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
-		sMeshesLoaded[filename] = m;
+		std::cout << "[OK BIN]  Faces: " << (m->m_indices.size() ? m->m_indices.size() : m->getNumVertices()) / 3 << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
+		m->registerMesh(filename);
 		return m;
 	}
 
@@ -1632,6 +2211,14 @@ Mesh* Mesh::Get(const char* filename, bool bFromNetwork, bool skip_load)
 		return NULL;
 	}
 
+	//weld and reorder for the vertex cache, the bin will store the optimized version
+	if (optimize_meshes)
+	{
+		sVertexCacheStats before, after;
+		if (m->optimize(&before, &after))
+			std::cout << "[OPT ACMR: " << before.acmr << " -> " << after.acmr << " ATVR: " << before.atvr << " -> " << after.atvr << "] ";
+	}
+
 	//to optimize, interleave the meshes
 	if (interleave_meshes)
 	{
@@ -1646,7 +2233,7 @@ Mesh* Mesh::Get(const char* filename, bool bFromNetwork, bool skip_load)
 		m->uploadToVRAM();
 	}
 
-	std::cout << "[OK]  Faces: " << m->vertices.size() / 3 << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
+	std::cout << "[OK]  Faces: " << (m->m_indices.size() ? m->m_indices.size() : m->getNumVertices()) / 3 << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
 	if (use_binary)
 	{
 		std::cout << "\t\t Writing .BIN ... ";
@@ -1661,15 +2248,12 @@ Mesh* Mesh::Get(const char* filename, bool bFromNetwork, bool skip_load)
 void Mesh::registerMesh( std::string name )
 {
 	this->name = name;
-	sMeshesLoaded[name] = this;
+	sMeshesLoaded.add(name, this);
 }
 
 void Mesh::Release()
 {
-	for (auto m : sMeshesLoaded)
-	{
-        stdlog("Destroy mesh: " + m.first );
-		delete m.second;
-	}
-	sMeshesLoaded.clear();
+	for (Mesh* m : sMeshesLoaded.getAll())
+		stdlog("Destroy mesh: " + m->name );
+	sMeshesLoaded.releaseAll();
 }
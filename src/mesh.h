@@ -3,6 +3,7 @@
 
 #include <vector>
 #include "framework.h"
+#include "resource.h"
 
 #include <map>
 #include <string>
@@ -10,15 +11,65 @@
 class Shader; //for binding
 class Image; //for displace
 class Skeleton; //for skinned meshes
+class MeshBVH; //for collisions
+struct sVertexCacheStats; //for optimize
 
-//version from 11/5/2020
-#define MESH_BIN_VERSION 11 //this is used to regenerate bins if the format changes
+//version from 19/10/2026, indices are optimized
+#define MESH_BIN_VERSION 12 //this is used to regenerate bins if the format changes
 
 struct BoneInfo {
 	char name[32]; //max 32 chars per bone name
 	Matrix44 bind_pose;
 };
 
+//attributes that can be stored in the packed vertex buffer
+enum eVertexAttribute {
+	VA_POSITION,
+	VA_NORMAL,
+	VA_UV,
+	VA_UV1,
+	VA_COLOR,
+	VA_BONES,
+	VA_WEIGHTS,
+	VA_COUNT
+};
+
+//how every attribute is stored in memory
+enum eVertexFormat {
+	VF_FLOAT2,
+	VF_FLOAT3,
+	VF_FLOAT4,
+	VF_HALF2,		//16 bits float, for uvs outside the 0..1 range
+	VF_UNORM16_2,	//16 bits normalized, for uvs inside the 0..1 range
+	VF_SNORM10_3,	//10:10:10:2 signed normalized, for normals
+	VF_UNORM8_4,	//8 bits normalized, for colors and weights
+	VF_UBYTE4		//8 bits integer, for bone indices
+};
+
+struct sVertexAttribute
+{
+	uint8 attribute; //eVertexAttribute
+	uint8 format; //eVertexFormat
+	uint16 offset; //in bytes from the start of the vertex
+};
+
+//describes the layout of a vertex inside the packed buffer
+class VertexLayout
+{
+public:
+	sVertexAttribute attributes[VA_COUNT];
+	int num_attributes;
+	int stride; //in bytes
+
+	VertexLayout() { clear(); }
+	void clear() { num_attributes = 0; stride = 0; }
+	void add(eVertexAttribute attribute, eVertexFormat format);
+	const sVertexAttribute* find(eVertexAttribute attribute) const;
+
+	static int getFormatSize(eVertexFormat format);
+	static const char* getAttributeName(eVertexAttribute attribute); //name of the attribute in the shader
+};
+
 struct sSubmeshInfo
 {
 	char name[64];
@@ -27,13 +78,15 @@ struct sSubmeshInfo
 	int length;//in primitive
 };
 
-class Mesh
+class Mesh : public Resource
 {
 public:
-	static std::map<std::string, Mesh*> sMeshesLoaded;
+	static ResourceRegistry<Mesh> sMeshesLoaded;
 	static bool use_binary; //always load the binary version of a mesh when possible
 	static bool interleave_meshes; //loaded meshes will me automatically interleaved
 	static bool auto_upload_to_vram; //loaded meshes will be stored in the VRAM
+	static bool quantize_meshes; //uploaded meshes use compact formats (half uvs, 10 bits normals, 8 bits colors)
+	static bool optimize_meshes; //loaded meshes are welded and reordered for the vertex cache
 	static long num_meshes_rendered;
 	static long num_triangles_rendered;
 
@@ -68,6 +121,7 @@ public:
 	BoundingBox box;
 
 	float radius;
+	float uv_density; //sqrt(uv area / surface area), texels per unit = texture size * uv_density (used to stream the textures)
 
 	unsigned int vertices_vbo_id;
 	unsigned int uvs_vbo_id;
@@ -80,12 +134,19 @@ public:
 	unsigned int weights_vbo_id;
 	unsigned int uvs1_vbo_id;
 
+	//all the streams packed in a single buffer following the layout
+	VertexLayout layout;
+	unsigned int packed_vbo_id;
+
 	Mesh();
 	~Mesh();
 
 	void clear();
 
 	void render( unsigned int primitive, int submesh_id = -1, int num_instances = 0 );
+	//instanced draws and per instance attributes need GL 3.3 or GL_ARB_instanced_arrays, checked the first time with the context
+	static bool supportsInstancing();
+	static void setAttribDivisor(unsigned int location, unsigned int divisor);
 	void renderInstanced(unsigned int primitive, const Matrix44* instanced_models, int number);
 	void renderBounding( const Matrix44& model, bool world_bounding = true );
 	void renderFixedPipeline(int primitive); //sloooooooow
@@ -101,9 +162,10 @@ public:
 	unsigned int getNumSubmeshes() { return (unsigned int)submeshes.size(); }
 	unsigned int getNumVertices() { return (unsigned int)interleaved.size() ? (unsigned int)interleaved.size() : (unsigned int)vertices.size(); }
 
-	//collision testing
-	void* collision_model;
-	bool createCollisionModel(bool is_static = false); //is_static sets if the inv matrix should be computed after setTransform (true) or before rayCollision (false)
+	//collision testing, the tree is built from the triangles the first time it is needed (and again if they change)
+	MeshBVH* bvh;
+	unsigned int revision; //increased every time the triangles change (and the tree is deleted), for those that keep data of them
+	MeshBVH* getBVH();
 	//help: model is the transform of the mesh, ray origin and direction, a Vector3 where to store the collision if found, a Vector3 where to store the normal if there was a collision, max ray distance in case the ray should go to infintiy, and in_object_space to get the collision point in object space or world space
 	bool testRayCollision( Matrix44 model, Vector3 ray_origin, Vector3 ray_direction, Vector3& collision, Vector3& normal, float max_ray_dist = 3.4e+38F, bool in_object_space = false );
 	bool testSphereCollision(Matrix44 model, Vector3 center, float radius, Vector3& collision, Vector3& normal);
@@ -124,10 +186,14 @@ public:
 	static Mesh* getQuad(); //get global quad
 
 	void updateBoundingBox();
+	float computeUVDensity();
 
 	//optimize meshes
 	void uploadToVRAM();
+	void buildVertexLayout(VertexLayout& layout, bool quantize);
+	void packVertices(const VertexLayout& layout, std::vector<uint8>& buffer);
 	bool interleaveBuffers();
+	bool optimize(sVertexCacheStats* stats_before = NULL, sVertexCacheStats* stats_after = NULL); //weld vertices and reorder for the GPU caches
 
 private:
 	bool loadASE(const char* filename);
@@ -0,0 +1,381 @@
+#include "mesh_optimizer.h"
+
+#include <cassert>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <mutex>
+
+#define INVALID_INDEX 0xFFFFFFFF
+
+// VERTEX WELDING *******************************
+
+static unsigned int hashVertex(const unsigned char* data, unsigned int size)
+{
+	//FNV-1a
+	unsigned int hash = 2166136261u;
+	for (unsigned int i = 0; i < size; ++i)
+		hash = (hash ^ data[i]) * 16777619u;
+	return hash;
+}
+
+unsigned int generateVertexRemap(std::vector<unsigned int>& remap, const void* vertices, unsigned int num_vertices, unsigned int vertex_size)
+{
+	const unsigned char* data = (const unsigned char*)vertices;
+	remap.resize(num_vertices);
+
+	//open addressing table, at least twice the number of vertices to keep the chains short
+	unsigned int table_size = 1;
+	while (table_size < num_vertices * 2)
+		table_size *= 2;
+	std::vector<unsigned int> table(table_size, INVALID_INDEX);
+
+	unsigned int num_unique = 0;
+	for (unsigned int i = 0; i < num_vertices; ++i)
+	{
+		const unsigned char* vertex = data + i * vertex_size;
+		unsigned int slot = hashVertex(vertex, vertex_size) & (table_size - 1);
+		while (true)
+		{
+			unsigned int index = table[slot];
+			if (index == INVALID_INDEX) //new vertex
+			{
+				table[slot] = i;
+				remap[i] = num_unique++;
+				break;
+			}
+			if (memcmp(data + index * vertex_size, vertex, vertex_size) == 0) //already seen
+			{
+				remap[i] = remap[index];
+				break;
+			}
+			slot = (slot + 1) & (table_size - 1);
+		}
+	}
+
+	return num_unique;
+}
+
+// VERTEX CACHE (Tom Forsyth, Linear-Speed Vertex Cache Optimisation) *******************************
+
+#define FORSYTH_CACHE_SIZE 32
+#define FORSYTH_MAX_VALENCE_SCORES 64
+
+static float forsyth_cache_scores[FORSYTH_CACHE_SIZE];
+static float forsyth_valence_scores[FORSYTH_MAX_VALENCE_SCORES];
+static std::once_flag forsyth_tables_once; //meshes can be optimized from several threads
+
+static void computeForsythTables()
+{
+	const float cache_decay_power = 1.5f;
+	const float last_triangle_score = 0.75f;
+	const float valence_boost_scale = 2.0f;
+	const float valence_boost_power = 0.5f;
+
+	for (int i = 0; i < FORSYTH_CACHE_SIZE; ++i)
+	{
+		if (i < 3) //the vertices of the last triangle have a fixed score to avoid using them again right away
+			forsyth_cache_scores[i] = last_triangle_score;
+		else
+			forsyth_cache_scores[i] = pow(1.0f - (i - 3) / (float)(FORSYTH_CACHE_SIZE - 3), cache_decay_power);
+	}
+
+	//vertices with few triangles left get a boost so they are finished and leave the cache
+	forsyth_valence_scores[0] = 0;
+	for (int i = 1; i < FORSYTH_MAX_VALENCE_SCORES; ++i)
+		forsyth_valence_scores[i] = valence_boost_scale * pow((float)i, -valence_boost_power);
+
+}
+
+static inline float forsythVertexScore(int cache_position, unsigned int live_triangles)
+{
+	if (live_triangles == 0)
+		return -1.0f; //no triangles left using this vertex
+	float score = cache_position >= 0 ? forsyth_cache_scores[cache_position] : 0.0f;
+	if (live_triangles < FORSYTH_MAX_VALENCE_SCORES)
+		score += forsyth_valence_scores[live_triangles];
+	return score;
+}
+
+void optimizeVertexCache(unsigned int* destination, const unsigned int* indices, unsigned int num_indices, unsigned int num_vertices)
+{
+	assert(destination != indices);
+	assert(num_indices % 3 == 0);
+	std::call_once(forsyth_tables_once, computeForsythTables);
+
+	unsigned int num_triangles = num_indices / 3;
+	if (!num_triangles)
+		return;
+
+	//adjacency: triangles using every vertex
+	std::vector<unsigned int> live_triangles(num_vertices, 0);
+	for (unsigned int i = 0; i < num_indices; ++i)
+		live_triangles[indices[i]]++;
+
+	std::vector<unsigned int> offsets(num_vertices + 1, 0);
+	for (unsigned int i = 0; i < num_vertices; ++i)
+		offsets[i + 1] = offsets[i] + live_triangles[i];
+
+	std::vector<unsigned int> adjacency(num_indices);
+	std::vector<unsigned int> fill(offsets.begin(), offsets.end() - 1);
+	for (unsigned int i = 0; i < num_indices; ++i)
+		adjacency[fill[indices[i]]++] = i / 3;
+
+	std::vector<float> vertex_score(num_vertices);
+	for (unsigned int i = 0; i < num_vertices; ++i)
+		vertex_score[i] = forsythVertexScore(-1, live_triangles[i]);
+
+	std::vector<float> triangle_score(num_triangles);
+	std::vector<bool> emitted(num_triangles, false);
+	for (unsigned int i = 0; i < num_triangles; ++i)
+		triangle_score[i] = vertex_score[indices[i * 3]] + vertex_score[indices[i * 3 + 1]] + vertex_score[indices[i * 3 + 2]];
+
+	//the cache holds 3 extra entries for the vertices pushed out by the last triangle
+	unsigned int cache[FORSYTH_CACHE_SIZE + 3];
+	unsigned int new_cache[FORSYTH_CACHE_SIZE + 3];
+	unsigned int cache_size = 0;
+
+	unsigned int next_candidate = 0; //used when the cache does not give any candidate
+	int best_triangle = -1;
+	unsigned int num_emitted = 0;
+
+	while (num_emitted < num_triangles)
+	{
+		if (best_triangle == -1)
+		{
+			while (emitted[next_candidate])
+				next_candidate++;
+			best_triangle = next_candidate;
+		}
+
+		const unsigned int* triangle = indices + best_triangle * 3;
+		memcpy(destination + num_emitted * 3, triangle, sizeof(unsigned int) * 3);
+		emitted[best_triangle] = true;
+		num_emitted++;
+
+		//remove the triangle from the adjacency of its vertices
+		for (int k = 0; k < 3; ++k)
+		{
+			unsigned int v = triangle[k];
+			unsigned int* list = &adjacency[offsets[v]];
+			unsigned int count = live_triangles[v];
+			for (unsigned int j = 0; j < count; ++j)
+				if (list[j] == (unsigned int)best_triangle)
+				{
+					list[j] = list[count - 1];
+					break;
+				}
+			live_triangles[v]--;
+		}
+
+		//put the triangle vertices at the front of the cache
+		unsigned int new_cache_size = 0;
+		for (int k = 0; k < 3; ++k)
+			new_cache[new_cache_size++] = triangle[k];
+		for (unsigned int j = 0; j < cache_size; ++j)
+		{
+			unsigned int v = cache[j];
+			if (v != triangle[0] && v != triangle[1] && v != triangle[2])
+				new_cache[new_cache_size++] = v;
+		}
+
+		//update the scores of the vertices in the cache and of their triangles
+		for (unsigned int j = 0; j < new_cache_size; ++j)
+		{
+			unsigned int v = new_cache[j];
+			int position = j < FORSYTH_CACHE_SIZE ? (int)j : -1;
+			float score = forsythVertexScore(position, live_triangles[v]);
+			float delta = score - vertex_score[v];
+			vertex_score[v] = score;
+
+			const unsigned int* list = &adjacency[offsets[v]];
+			for (unsigned int t = 0; t < live_triangles[v]; ++t)
+				triangle_score[list[t]] += delta;
+		}
+
+		//the next triangle is the best one using a vertex in the cache
+		best_triangle = -1;
+		float best_score = -1.0f;
+		for (unsigned int j = 0; j < new_cache_size && j < FORSYTH_CACHE_SIZE; ++j)
+		{
+			unsigned int v = new_cache[j];
+			const unsigned int* list = &adjacency[offsets[v]];
+			for (unsigned int t = 0; t < live_triangles[v]; ++t)
+				if (triangle_score[list[t]] > best_score)
+				{
+					best_score = triangle_score[list[t]];
+					best_triangle = list[t];
+				}
+		}
+
+		cache_size = std::min(new_cache_size, (unsigned int)FORSYTH_CACHE_SIZE);
+		memcpy(cache, new_cache, cache_size * sizeof(unsigned int));
+	}
+}
+
+// OVERDRAW (Sander et al, Fast Triangle Reordering for Vertex Locality and Reduced Overdraw) *******************************
+
+struct sCluster {
+	unsigned int start; //in triangles
+	unsigned int count;
+	float sort_key;
+};
+
+void optimizeOverdraw(unsigned int* destination, const unsigned int* indices, unsigned int num_indices, const Vector3* positions, unsigned int num_vertices, float threshold)
+{
+	assert(destination != indices);
+	unsigned int num_triangles = num_indices / 3;
+	if (!num_triangles)
+		return;
+
+	const unsigned int cache_size = 16;
+	std::vector<unsigned int> timestamps(num_vertices, 0);
+	unsigned int time = cache_size + 1;
+
+	//hard boundaries: triangles where the cache is flushed (all vertices missed)
+	std::vector<unsigned int> boundaries;
+	for (unsigned int i = 0; i < num_triangles; ++i)
+	{
+		unsigned int misses = 0;
+		for (int k = 0; k < 3; ++k)
+		{
+			unsigned int v = indices[i * 3 + k];
+			if (time - timestamps[v] > cache_size)
+			{
+				timestamps[v] = time++;
+				misses++;
+			}
+		}
+		if (misses == 3 || i == 0)
+			boundaries.push_back(i);
+	}
+	boundaries.push_back(num_triangles);
+
+	//soft boundaries: split the hard clusters while their local ACMR stays close to the global one
+	sVertexCacheStats stats = analyzeVertexCache(indices, num_indices, num_vertices, cache_size);
+	float max_acmr = stats.acmr * threshold;
+
+	std::vector<sCluster> clusters;
+	std::fill(timestamps.begin(), timestamps.end(), 0);
+	time = cache_size + 1;
+	for (size_t b = 0; b + 1 < boundaries.size(); ++b)
+	{
+		unsigned int start = boundaries[b];
+		unsigned int end = boundaries[b + 1];
+		unsigned int cluster_start = start;
+		unsigned int misses = 0;
+		for (unsigned int i = start; i < end; ++i)
+		{
+			for (int k = 0; k < 3; ++k)
+			{
+				unsigned int v = indices[i * 3 + k];
+				if (time - timestamps[v] > cache_size)
+				{
+					timestamps[v] = time++;
+					misses++;
+				}
+			}
+			unsigned int count = i + 1 - cluster_start;
+			if (i + 1 < end && count >= 8 && misses <= max_acmr * count)
+			{
+				sCluster cluster = { cluster_start, count, 0 };
+				clusters.push_back(cluster);
+				cluster_start = i + 1;
+				misses = 0;
+				time += cache_size + 1; //the next cluster starts with a cold cache
+			}
+		}
+		sCluster cluster = { cluster_start, end - cluster_start, 0 };
+		clusters.push_back(cluster);
+	}
+
+	//mesh centroid
+	Vector3 mesh_center(0, 0, 0);
+	for (unsigned int i = 0; i < num_indices; ++i)
+		mesh_center = mesh_center + positions[indices[i]];
+	mesh_center = mesh_center * (1.0f / num_indices);
+
+	//sort key: clusters far from the center and facing outwards are more likely to occlude the rest
+	for (size_t c = 0; c < clusters.size(); ++c)
+	{
+		sCluster& cluster = clusters[c];
+		Vector3 center(0, 0, 0);
+		Vector3 normal(0, 0, 0);
+		float total_area = 0;
+		for (unsigned int i = cluster.start; i < cluster.start + cluster.count; ++i)
+		{
+			const Vector3& a = positions[indices[i * 3]];
+			const Vector3& b = positions[indices[i * 3 + 1]];
+			const Vector3& c = positions[indices[i * 3 + 2]];
+			Vector3 n = (b - a).cross(c - a); //length is twice the area
+			float area = (float)n.length();
+			center = center + (a + b + c) * (area / 3.0f);
+			normal = normal + n;
+			total_area += area;
+		}
+		if (total_area > 0)
+			center = center * (1.0f / total_area);
+		float length = (float)normal.length();
+		if (length > 0)
+			normal = normal * (1.0f / length);
+		cluster.sort_key = (center - mesh_center).dot(normal);
+	}
+
+	std::stable_sort(clusters.begin(), clusters.end(), [](const sCluster& a, const sCluster& b) { return a.sort_key > b.sort_key; });
+
+	unsigned int pos = 0;
+	for (size_t c = 0; c < clusters.size(); ++c)
+	{
+		memcpy(destination + pos, indices + clusters[c].start * 3, clusters[c].count * 3 * sizeof(unsigned int));
+		pos += clusters[c].count * 3;
+	}
+}
+
+// VERTEX FETCH *******************************
+
+unsigned int optimizeVertexFetchRemap(std::vector<unsigned int>& remap, const unsigned int* indices, unsigned int num_indices, unsigned int num_vertices)
+{
+	remap.assign(num_vertices, INVALID_INDEX);
+	unsigned int next = 0;
+	for (unsigned int i = 0; i < num_indices; ++i)
+	{
+		unsigned int v = indices[i];
+		if (remap[v] == INVALID_INDEX)
+			remap[v] = next++;
+	}
+	return next;
+}
+
+// STATS *******************************
+
+sVertexCacheStats analyzeVertexCache(const unsigned int* indices, unsigned int num_indices, unsigned int num_vertices, unsigned int cache_size)
+{
+	sVertexCacheStats stats;
+	memset(&stats, 0, sizeof(stats));
+
+	std::vector<unsigned int> timestamps(num_vertices, 0);
+	std::vector<bool> used(num_vertices, false);
+	unsigned int time = cache_size + 1;
+	unsigned int num_used = 0;
+
+	for (unsigned int i = 0; i < num_indices; ++i)
+	{
+		unsigned int v = indices[i];
+		if (time - timestamps[v] > cache_size)
+		{
+			timestamps[v] = time++;
+			stats.vertices_transformed++;
+		}
+		if (!used[v])
+		{
+			used[v] = true;
+			num_used++;
+		}
+	}
+
+	if (num_indices)
+		stats.acmr = stats.vertices_transformed / (num_indices / 3.0f);
+	if (num_used)
+		stats.atvr = stats.vertices_transformed / (float)num_used;
+	return stats;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "framework.h"
+#include <vector>
+
+//Functions to prepare the index and vertex buffers of a mesh for the GPU:
+//welding of duplicated vertices, reordering of triangles for the post-transform cache (Forsyth)
+//and to reduce overdraw, and reordering of vertices to match the fetch order.
+
+struct sVertexCacheStats {
+	unsigned int vertices_transformed;
+	float acmr; //average cache miss ratio: vertices transformed per triangle (0.5 is ideal, 3 is the worst)
+	float atvr; //average transformed vertex ratio: vertices transformed per unique vertex (1 is ideal)
+};
+
+//finds identical vertices (byte by byte), fills remap with the new index of every vertex and returns the number of unique vertices
+unsigned int generateVertexRemap(std::vector<unsigned int>& remap, const void* vertices, unsigned int num_vertices, unsigned int vertex_size);
+
+//reorders the triangles to reuse the vertices already in the post-transform cache
+void optimizeVertexCache(unsigned int* destination, const unsigned int* indices, unsigned int num_indices, unsigned int num_vertices);
+
+//splits the cache optimized triangles in clusters and sorts them so the outer ones are rendered first
+//threshold is how much the ACMR is allowed to degrade to get smaller clusters (1.05 = 5%)
+void optimizeOverdraw(unsigned int* destination, const unsigned int* indices, unsigned int num_indices, const Vector3* positions, unsigned int num_vertices, float threshold = 1.05f);
+
+//fills remap with the new index of every vertex so they are stored in the order they are fetched, returns the number of used vertices
+unsigned int optimizeVertexFetchRemap(std::vector<unsigned int>& remap, const unsigned int* indices, unsigned int num_indices, unsigned int num_vertices);
+
+//simulates a FIFO post-transform cache
+sVertexCacheStats analyzeVertexCache(const unsigned int* indices, unsigned int num_indices, unsigned int num_vertices, unsigned int cache_size = 16);
@@ -18,7 +18,7 @@ using namespace GTR;
 
 int Node::s_NodeID = 0;
 
-Node::Node() : parent(NULL), mesh(NULL), material(NULL), visible(true), layers(0xFF)
+Node::Node() : parent(NULL), mesh(NULL), material(NULL), visible(true), layers(0xFF), hierarchy(NULL), hierarchy_index(-1)
 {
 	m_Id = s_NodeID++;
 }
@@ -35,17 +35,43 @@ Node::~Node()
 	material = nullptr;
 }
 
+//the subtree of the node leaves the arrays, they are built again in the next update
+static void detachFromHierarchy(Node* node)
+{
+	NodeHierarchy* hierarchy = node->hierarchy;
+	if (!hierarchy)
+		return;
+	for (int i = node->hierarchy_index; i < hierarchy->subtree_end[node->hierarchy_index]; ++i)
+	{
+		Node* descendant = hierarchy->nodes[i];
+		if (!descendant)
+			continue;
+		descendant->hierarchy = NULL;
+		descendant->hierarchy_index = -1;
+		hierarchy->nodes[i] = NULL;
+	}
+	hierarchy->must_rebuild = true;
+}
+
 void Node::clear()
 {
 	//delete children
 	for (int i = 0; i < children.size(); ++i)
 	{
+		detachFromHierarchy(children[i]);
 		children[i]->parent = NULL;
 		delete children[i];
 	}
 	children.resize(0);
 }
 
+void Node::setModel(const Matrix44& model)
+{
+	this->model = model;
+	if (hierarchy)
+		hierarchy->setLocal(hierarchy_index, model);
+}
+
 BoundingBox Node::getBoundingBox()
 {
 	aabb.center.set(0, 0, 0);
@@ -65,6 +91,7 @@ void Node::removeChild(Node* child)
 		Node* node = children[i];
 		if (node != child)
 			continue;
+		detachFromHierarchy(child);
 		child->parent = NULL;
 		children.erase(children.begin() + i);
 		return;
@@ -131,7 +158,7 @@ void Node::operator = (const Node& node)
 	name = node.name;
 	visible = node.visible;
 	layers = node.layers;
-	model = node.model;
+	setModel(node.model);
 	aabb = node.aabb;
 
 	//clone children
@@ -152,7 +179,10 @@ void Node::renderInMenu()
 	ImGui::PushStyleColor(ImGuiCol_Text, ImVec4(0.75f, 0.75f, 0.75f, 1.0f));
 
 	//Model edit
+	Matrix44 old_model = model;
 	ImGuiMatrix44(model, "Model");
+	if (memcmp(old_model.m, model.m, sizeof(model.m)) != 0)
+		setModel(model);
 
 	//Material
 	if (material && ImGui::TreeNode(material, "Material"))
@@ -177,18 +207,98 @@ void Node::renderInMenu()
 #endif
 }
 
-Prefab::Prefab()
+// --- NodeHierarchy ---
+
+static void addToHierarchy(NodeHierarchy& hierarchy, Node* node, int parent)
 {
+	int index = hierarchy.size();
+	node->hierarchy = &hierarchy;
+	node->hierarchy_index = index;
+	hierarchy.nodes.push_back(node);
+	hierarchy.parents.push_back(parent);
+	hierarchy.subtree_end.push_back(index + 1);
+	hierarchy.locals.push_back(node->model);
+	for (int i = 0; i < node->children.size(); ++i)
+		addToHierarchy(hierarchy, node->children[i], index);
+	hierarchy.subtree_end[index] = hierarchy.size();
 }
 
-Prefab::~Prefab()
+void NodeHierarchy::build(Node* root)
+{
+	clear();
+	addToHierarchy(*this, root, -1);
+	globals.resize(nodes.size());
+	dirty.assign(nodes.size(), 0);
+
+	//all the globals are computed in the first update
+	dirty[0] = 1;
+	first_dirty = 0;
+	last_dirty = 1;
+}
+
+void NodeHierarchy::clear()
+{
+	for (int i = 0; i < nodes.size(); ++i)
+		if (nodes[i])
+		{
+			nodes[i]->hierarchy = NULL;
+			nodes[i]->hierarchy_index = -1;
+		}
+	nodes.clear();
+	parents.clear();
+	subtree_end.clear();
+	locals.clear();
+	globals.clear();
+	dirty.clear();
+	first_dirty = last_dirty = 0;
+	must_rebuild = false;
+}
+
+void NodeHierarchy::setLocal(int index, const Matrix44& model)
+{
+	locals[index] = model;
+	dirty[index] = 1;
+	if (first_dirty == last_dirty)
+	{
+		first_dirty = index;
+		last_dirty = index + 1;
+	}
+	first_dirty = std::min(first_dirty, index);
+	last_dirty = std::max(last_dirty, index + 1);
+}
+
+//the parents are always before, so they are already updated when their children are computed
+void NodeHierarchy::update()
 {
-	if (name.size())
+	if (must_rebuild && nodes.size() && nodes[0])
+		build(nodes[0]);
+
+	for (int i = first_dirty; i < last_dirty; )
 	{
-		auto it = sPrefabsLoaded.find(name);
-		if (it != sPrefabsLoaded.end())
-			sPrefabsLoaded.erase(it);
+		if (!dirty[i])
+		{
+			++i;
+			continue;
+		}
+		int end = subtree_end[i];
+		for (int j = i; j < end; ++j)
+		{
+			int parent = parents[j];
+			globals[j] = parent == -1 ? locals[j] : locals[j] * globals[parent];
+			dirty[j] = 0;
+		}
+		i = end;
 	}
+	first_dirty = last_dirty = 0;
+}
+
+Prefab::Prefab()
+{
+}
+
+Prefab::~Prefab()
+{
+	//the nodes release their meshes and materials, and ~Resource unregisters it
 }
 
 void Prefab::updateBounding()
@@ -196,18 +306,18 @@ void Prefab::updateBounding()
 	bounding = root.getBoundingBox();
 }
 
-std::map<std::string, Prefab*> Prefab::sPrefabsLoaded;
+ResourceRegistry<Prefab> Prefab::sPrefabsLoaded;
+float Prefab::upload_budget = 2.0f;
 
 // Usar managers nos salvan bastante la ejecucin, para no tener que acceder al disco duro cada vez que 
 // queremos cargar un fichero y tampoco tener que cargarlo todo en variables y luego ir a buscarlas
 Prefab* Prefab::Get(const char* filename)
 {
 	assert(filename);
-	std::map<std::string, Prefab*>::iterator it = sPrefabsLoaded.find(filename);
-	if (it != sPrefabsLoaded.end())
-		return it->second;
+	Prefab* prefab = sPrefabsLoaded.find(filename);
+	if (prefab)
+		return prefab;
 
-	Prefab* prefab = nullptr;
 	{
 		if (!prefab)
 			prefab = loadGLTF(filename);
@@ -223,10 +333,31 @@ Prefab* Prefab::Get(const char* filename)
 	return prefab;
 }
 
+Prefab* Prefab::GetAsync(const char* filename)
+{
+	assert(filename);
+	Prefab* prefab = sPrefabsLoaded.find(filename);
+	if (prefab)
+		return prefab;
+
+	//registered right away so it is not loaded twice
+	prefab = new Prefab();
+	prefab->state = RESOURCE_LOADING;
+	prefab->name = filename;
+	Prefab* registered = sPrefabsLoaded.add(filename, prefab);
+	if (registered != prefab) //another thread was faster
+	{
+		delete prefab;
+		return registered;
+	}
+	loadGLTFAsync(filename, prefab);
+	return prefab;
+}
+
 void Prefab::registerPrefab(std::string name)
 {
 	this->name = name;
-	sPrefabsLoaded[name] = this;
+	sPrefabsLoaded.add(name, this);
 }
 
 Node* Prefab::getNodeByName(const char* name)
@@ -5,6 +5,8 @@
 #include <map>
 #include <string>
 
+#include "resource.h"
+#include "mesh.h"
 #include "material.h"
 #include "scene.h"
 
@@ -22,6 +24,33 @@ namespace GTR {
 		int prim;
 	};
 
+	class Node;
+
+	//The nodes of a tree in flat arrays, every parent before its children (depth first), so the subtree of a node is the
+	//range [index, subtree_end). The global matrices are updated in one pass that only visits the dirty subtrees
+	class NodeHierarchy
+	{
+	public:
+		std::vector<Node*> nodes;
+		std::vector<int> parents;		//-1 for the root
+		std::vector<int> subtree_end;	//one after the last descendant
+		std::vector<Matrix44> locals;
+		std::vector<Matrix44> globals;
+		std::vector<uint8> dirty;		//the local matrix changed, the globals of its subtree must be updated
+		int first_dirty;				//the dirty flags are only in [first_dirty, last_dirty)
+		int last_dirty;
+		bool must_rebuild;				//nodes were added or removed
+
+		NodeHierarchy() { first_dirty = last_dirty = 0; must_rebuild = false; }
+		~NodeHierarchy() { clear(); }
+
+		int size() const { return (int)nodes.size(); }
+		void build(Node* root); //call it again after changing the tree
+		void clear();
+		void setLocal(int index, const Matrix44& model);
+		void update(); //the globals of the dirty nodes and their descendants
+	};
+
 	//A node represents a part of a prefab, that has a mesh, a material, and a transform matrix
 	class Node
 	{
@@ -37,9 +66,9 @@ namespace GTR {
 		bool visible;
 		int layers;
 
-		Mesh* mesh;
+		Handle<Mesh> mesh;
 		//std::vector<Primitive*> primitives;
-		Material* material;
+		Handle<Material> material;
 
 		Matrix44 model;	//the matrix that defines where is the object (in relation to its parent)
 		Matrix44 global_model;	//the matrix that defines where is the object (in relation to the world)
@@ -50,6 +79,10 @@ namespace GTR {
 		Node* parent;
 		std::vector<Node*> children;
 
+		//once compiled the matrices are read from the hierarchy (use setModel to change the local one)
+		NodeHierarchy* hierarchy;
+		int hierarchy_index;
+
 		//ctor
 		Node();
 
@@ -70,12 +103,21 @@ namespace GTR {
 			assert(child->parent == NULL);
 			children.push_back(child);
 			child->parent = this;
+			if (hierarchy)
+				hierarchy->must_rebuild = true;
 		}
 		void removeChild(Node* child);
 
+		void setModel(const Matrix44& model);
+
 		//compute the global matrix taking into account its parent
 		Matrix44 getGlobalMatrix(bool fast = false) { 
-			if (parent)
+			if (hierarchy)
+			{
+				hierarchy->update();
+				global_model = hierarchy->globals[hierarchy_index];
+			}
+			else if (parent)
 				global_model = model * (fast ? parent->global_model : parent->getGlobalMatrix());
 			else
 				global_model = model;
@@ -90,7 +132,7 @@ namespace GTR {
 
 	//a Prefab represent a set of objects in a tree structure
 	//used to load info from GLTF files
-	class Prefab
+	class Prefab : public Resource
 	{
 	public:
 
@@ -100,6 +142,7 @@ namespace GTR {
 
 		//root node which contains the tree
 		Node root;
+		NodeHierarchy hierarchy; //the tree compiled to arrays, built once it is loaded
 		BoundingBox bounding;
 
 		//dtor
@@ -113,8 +156,10 @@ namespace GTR {
 		//Manager to cache loaded prefabs
 		// Estas dos funciones son estaticas --> no es necesario hacer una instancia de prefab para usarla,
 		// pero est aqu por que as es ms fcil encontrarla. Es como una funcin global, todos pueden acceder
-		static std::map<std::string, Prefab*> sPrefabsLoaded;
+		static ResourceRegistry<Prefab> sPrefabsLoaded;
 		static Prefab* Get(const char* filename);
+		static Prefab* GetAsync(const char* filename); //returns an empty prefab in RESOURCE_LOADING state, filled once loaded
+		static float upload_budget; //ms per slice spent uploading the meshes of an async prefab
 		void registerPrefab(std::string name);
 	};
 
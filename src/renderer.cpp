@@ -11,14 +11,24 @@
 #include "utils.h"
 #include "scene.h"
 #include "extra/hdre.h"
+#include "sphericalharmonics.h"
+#include "task.h"
+#include "environment.h"
+#include "animation.h"
+#include "simd.h"
 
 #include <iostream>
 #include <algorithm>
 #include <vector>  
+#include <memory>
+#include <atomic>
+#include <thread>
 
 
 using namespace GTR;
 
+static bool isSceneLoaded(GTR::Scene* scene);
+
 
 GTR::Renderer::Renderer()
 {
@@ -27,7 +37,27 @@ GTR::Renderer::Renderer()
 	debug_texture = eTextureType::COMPLETE;
 	fbo = NULL;
 	shadowmap = NULL;
+	use_irradiance = true;
+	irradiance = NULL;
+	capture_fbo = NULL;
+	use_environment = true;
+	brdf_lut = NULL;
+	use_reflection_probes = true;
+	probe_update_budget = 2.0f;
+	next_dynamic_probe = 0;
+	num_probe_faces_updated = 0;
 	max_lights = 10;
+	use_light_lists = true;
+	current_call = NULL;
+	num_object_lights = 0;
+	num_object_lights_culled = 0;
+	use_light_scissor = true;
+	num_light_passes_scissored = 0;
+	num_light_passes_skipped = 0;
+	num_texture_binds = 0;
+	num_texture_binds_skipped = 0;
+	skinned_instances = NULL;
+	resetTextureBindings();
 }
 
 // --- Rendercalls manager functions ---
@@ -50,28 +80,37 @@ void GTR::Renderer::createRenderCalls(GTR::Scene* scene, Camera* camera)
 		if (ent->entity_type == PREFAB)
 		{
 			PrefabEntity* pent = (GTR::PrefabEntity*)ent;
-			// First take the root node
-			if (pent->prefab) {
-				GTR::Node* curr_node = &pent->prefab->root;
-				Matrix44 node_model = curr_node->getGlobalMatrix(true) * ent->model;
-				// Pass the global matrix for this node and the root one to compute the global matrix for the rest of children
-				addRenderCall_node(scene, camera, curr_node, node_model, ent->model);
-			}
+			if (pent->prefab)
+				addRenderCalls_prefab(scene, pent->prefab, ent->model);
 		}
 	}
 }
 
-// Recursive function to add a rendercall node with its children
-void GTR::Renderer::addRenderCall_node(GTR::Scene* scene, Camera* camera, Node* node, Matrix44 curr_model, Matrix44 root_model) {
-	RenderCall rc;
-	// If the node doesn't have mesh or material do not add it
-	if (node->material && node->mesh) {
-		Vector3 nodepos = curr_model.getTranslation();
+// The nodes are in the order of the hierarchy arrays, the global matrices are already there
+void GTR::Renderer::addRenderCalls_prefab(GTR::Scene* scene, Prefab* prefab, const Matrix44& model) {
+	NodeHierarchy& hierarchy = prefab->hierarchy;
+	if (!hierarchy.size()) // not built by the loader
+		hierarchy.build(&prefab->root);
+	hierarchy.update();
+
+	for (int i = 0; i < hierarchy.size(); ++i) {
+		Node* node = hierarchy.nodes[i];
+		// A hidden node hides its subtree
+		if (!node->visible) {
+			i = hierarchy.subtree_end[i] - 1;
+			continue;
+		}
+		// If the node doesn't have mesh or material do not add it
+		if (!node->material || !node->mesh)
+			continue;
+
+		RenderCall rc;
 		rc.mesh = node->mesh;
 		rc.material = node->material;
-		rc.model = curr_model;
-		rc.distance_to_camera = nodepos.distance(scene->main_camera.eye);
-		rc.world_bounding = transformBoundingBox(curr_model, node->mesh->box);
+		rc.model = hierarchy.globals[i] * model;
+		rc.distance_to_camera = rc.model.getTranslation().distance(scene->main_camera.eye);
+		rc.world_bounding = transformBoundingBox(rc.model, node->mesh->box);
+		rc.first_light = rc.num_lights = 0;
 		// If the material is opaque add a distance factor to sort it at the end of the vector
 		if (rc.material->alpha_mode == GTR::eAlphaMode::BLEND)
 		{
@@ -80,15 +119,6 @@ void GTR::Renderer::addRenderCall_node(GTR::Scene* scene, Camera* camera, Node*
 		}
 		render_calls.push_back(rc);
 	}
-
-
-	// Add also all the childrens of this node
-	for (int j = 0; j < node->children.size(); ++j) {
-		GTR::Node* curr_node = node->children[j];
-		// Compute global matrix
-		Matrix44 node_model = node->getGlobalMatrix(true) * root_model;
-		addRenderCall_node(scene, camera, curr_node, node_model, root_model);
-	}
 }
 
 // Sort rendercalls by distance
@@ -96,6 +126,120 @@ void GTR::Renderer::sortRenderCalls() {
 	std::sort(render_calls.begin(), render_calls.end(), compare_distances);
 }
 
+// Four point or spot lights in the lanes, the empty lanes have a negative radius so they reach nothing
+struct LightVolumes {
+	float x[4], y[4], z[4];
+	float radius2[4];
+	float dir_x[4], dir_y[4], dir_z[4];	// spot direction
+	float cone_sin[4];
+	float cone_cos2[4];					// 0 for the point lights and the cones of 90 degrees or more, they are not tested
+	int lights[4];
+};
+
+// Lanes of the lights whose volume reaches the box. The sphere (max_distance) is tested against the box and the cone
+// against the sphere around the box: with d from the light to its center, the sphere is outside the cone if
+// cos * |d x dir| - sin * (d . dir) > radius (squared to avoid the square root) or it is behind the apex
+static int testLightVolumes(const LightVolumes& volumes, const BoundingBox& box)
+{
+	using namespace simd;
+	float4 zero = splat(0.0f);
+	float4 dx = sub(splat(box.center.x), load(volumes.x));
+	float4 dy = sub(splat(box.center.y), load(volumes.y));
+	float4 dz = sub(splat(box.center.z), load(volumes.z));
+
+	float4 ox = max(sub(abs(dx), splat(box.halfsize.x)), zero);
+	float4 oy = max(sub(abs(dy), splat(box.halfsize.y)), zero);
+	float4 oz = max(sub(abs(dz), splat(box.halfsize.z)), zero);
+	float4 distance2 = add(add(mul(ox, ox), mul(oy, oy)), mul(oz, oz));
+	int mask = lessEqualMask(distance2, load(volumes.radius2));
+	if (!mask)
+		return 0;
+
+	float4 along = add(add(mul(dx, load(volumes.dir_x)), mul(dy, load(volumes.dir_y))), mul(dz, load(volumes.dir_z)));
+	float4 length2 = add(add(mul(dx, dx), mul(dy, dy)), mul(dz, dz));
+	float4 across2 = max(sub(length2, mul(along, along)), zero);
+	float4 radius = splat(box.halfsize.length());
+	float4 limit = add(radius, mul(along, load(volumes.cone_sin)));
+	mask &= lessEqualMask(sub(zero, radius), along);
+	mask &= lessEqualMask(zero, limit);
+	mask &= lessEqualMask(mul(load(volumes.cone_cos2), across2), mul(limit, limit));
+	return mask;
+}
+
+// The directional lights reach everything, the others are packed in groups of four and tested against every box
+void GTR::Renderer::assignLights()
+{
+	visible_lights.clear();
+	light_indices.clear();
+
+	std::vector<int> directional;
+	std::vector<int> others;
+	for (int i = 0; i < lights.size(); ++i) {
+		LightEntity* light = lights[i];
+		if (!light->visible || light->light_type == LightEntity::eTypeOfLight::NONE)
+			continue;
+		visible_lights.push_back(i);
+		if (light->light_type == LightEntity::eTypeOfLight::DIRECTIONAL)
+			directional.push_back(i);
+		else
+			others.push_back(i);
+	}
+
+	std::vector<LightVolumes> groups((others.size() + 3) / 4);
+	for (int i = 0; i < groups.size(); ++i) {
+		LightVolumes& volumes = groups[i];
+		memset(&volumes, 0, sizeof(LightVolumes));
+		for (int lane = 0; lane < 4; ++lane) {
+			volumes.radius2[lane] = -1.0f;
+			volumes.lights[lane] = -1;
+			if (i * 4 + lane >= others.size())
+				continue;
+			LightEntity* light = lights[others[i * 4 + lane]];
+			Vector3 position = light->model.getTranslation();
+			volumes.x[lane] = position.x;
+			volumes.y[lane] = position.y;
+			volumes.z[lane] = position.z;
+			volumes.radius2[lane] = light->max_distance * light->max_distance;
+			if (light->light_type == LightEntity::eTypeOfLight::SPOT && light->cone_angle < 90.0f) {
+				Vector3 direction = light->model.rotateVector(Vector3(0.0, 0.0, -1.0)).normalize();
+				float cone_cos = (float)cos(light->cone_angle * DEG2RAD);
+				volumes.dir_x[lane] = direction.x;
+				volumes.dir_y[lane] = direction.y;
+				volumes.dir_z[lane] = direction.z;
+				volumes.cone_sin[lane] = (float)sin(light->cone_angle * DEG2RAD);
+				volumes.cone_cos2[lane] = cone_cos * cone_cos;
+			}
+			volumes.lights[lane] = others[i * 4 + lane];
+		}
+	}
+
+	for (int i = 0; i < render_calls.size(); ++i) {
+		RenderCall& rc = render_calls[i];
+		rc.first_light = (int)light_indices.size();
+		light_indices.insert(light_indices.end(), directional.begin(), directional.end());
+		for (int j = 0; j < groups.size(); ++j) {
+			int mask = testLightVolumes(groups[j], rc.world_bounding);
+			for (int lane = 0; lane < 4; ++lane)
+				if (mask & (1 << lane))
+					light_indices.push_back(groups[j].lights[lane]);
+		}
+		rc.num_lights = (int)light_indices.size() - rc.first_light;
+	}
+}
+
+int GTR::Renderer::getObjectLights(const int*& indices)
+{
+	int num = (int)visible_lights.size();
+	indices = visible_lights.data();
+	if (use_light_lists && current_call) {
+		num = current_call->num_lights;
+		indices = light_indices.data() + current_call->first_light;
+	}
+	num_object_lights += num;
+	num_object_lights_culled += (int)visible_lights.size() - num;
+	return num;
+}
+
 
 // --- Shadowmap functions ---
 
@@ -156,6 +300,8 @@ void GTR::Renderer::generateShadowmap(LightEntity* light)
 	// clear depth buffer to avoid ghosting artifacts
 	glClear(GL_DEPTH_BUFFER_BIT);
 
+	renderCrowds(light_camera, true);
+
 	// paint all rendercalls
 	for (int i = 0; i < render_calls.size(); i++) {
 		RenderCall& rc = render_calls[i];
@@ -199,6 +345,7 @@ void Renderer::renderScene(GTR::Scene* scene, Camera* camera)
 	// Clear the color and the depth buffer
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 	checkGLErrors();
+	resetTextureBindings();
 
 	//render entities
 	for (int i = 0; i < scene->entities.size(); ++i)
@@ -220,23 +367,58 @@ void Renderer::renderScene(GTR::Scene* scene, Camera* camera)
 
 // To render the scene according to the rendercalls vector
 void Renderer::renderScene_RenderCalls(GTR::Scene* scene, Camera* camera){
-	//set the clear color (the background color)
-	glClearColor(scene->background_color.x, scene->background_color.y, scene->background_color.z, 1.0);
+	prepareScene(scene, camera);
 
-	// Clear the color and the depth buffer
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-	checkGLErrors();
+	// The volumes without a valid file are baked once all the scene is loaded, the first one is used
+	irradiance = NULL;
+	for (int i = 0; i < scene->entities.size(); i++) {
+		BaseEntity* ent = scene->entities[i];
+		if (ent->entity_type != GTR::eEntityType::IRRADIANCE_VOLUME || !ent->visible)
+			continue;
+		IrradianceEntity* volume = (IrradianceEntity*)ent;
+		if (volume->must_bake && isSceneLoaded(scene))
+			bakeIrradiance(scene, volume);
+		if (volume->probes.empty())
+			continue;
+		if (!volume->texture)
+			volume->uploadToTexture();
+		if (!irradiance)
+			irradiance = volume;
+	}
+
+	updateReflectionProbes(scene);
+
+	renderRenderCalls(scene, camera);
+
+	// show shadowmap if activated
+	if (show_shadowmap) 
+		showShadowmap(lights[debug_shadowmap]);
+}
 
+void Renderer::prepareScene(GTR::Scene* scene, Camera* camera)
+{
 	// Create the lights vector
 	lights.clear();
+	crowds.clear();
 	for (int i = 0; i < scene->entities.size(); i++){
 		BaseEntity* ent = scene->entities[i];
 		if (ent->entity_type == GTR::eEntityType::LIGHT) {
 			LightEntity* light = (LightEntity*)ent;
 			lights.push_back(light);
 		}
+		else if (ent->entity_type == GTR::eEntityType::CROWD && ent->visible)
+			crowds.push_back((CrowdEntity*)ent);
 	}
 
+	// Create the vector of nodes
+	createRenderCalls(scene, camera);
+
+	// Sort the objects by distance to the camera
+	sortRenderCalls();
+
+	// The lights that reach every object
+	assignLights();
+
 	// Generate shadowmaps
 	for (int i = 0; i < lights.size(); i++) {
 		LightEntity* light = lights[i];
@@ -244,28 +426,43 @@ void Renderer::renderScene_RenderCalls(GTR::Scene* scene, Camera* camera){
 			generateShadowmap(light);
 		}
 	}
+}
 
-	// Create the vector of nodes
-	createRenderCalls(scene, camera);
+void Renderer::renderRenderCalls(GTR::Scene* scene, Camera* camera)
+{
+	//set the clear color (the background color)
+	glClearColor(scene->background_color.x, scene->background_color.y, scene->background_color.z, 1.0);
 
-	// Sort the objects by distance to the camera
-	sortRenderCalls();
+	// Clear the color and the depth buffer
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	checkGLErrors();
+
+	// Nothing else binds textures while the rendercalls are drawn, so the binds can be skipped when they dont change
+	Texture::getWhiteTexture();
+	Texture::getBlackTexture();
+	resetTextureBindings();
+	num_texture_binds = num_texture_binds_skipped = 0;
+	num_object_lights = num_object_lights_culled = 0;
+	num_light_passes_scissored = num_light_passes_skipped = 0;
+
+	// The crowds are opaque, before the rendercalls so the transparent ones are blended over them
+	renderCrowds(camera);
 
 	//render rendercalls
 	for (int i = 0; i < render_calls.size(); ++i) {
 		// Instead of rendering the entities vector, render the render_calls vector
-		RenderCall rc = render_calls[i];
+		RenderCall& rc = render_calls[i];
 
 		// if rendercall has mesh and material, render it
 		if (rc.mesh && rc.material) {
 			// test if node inside the frustum of the camera
-			if (camera->testBoxInFrustum(rc.world_bounding.center, rc.world_bounding.halfsize))
+			if (camera->testBoxInFrustum(rc.world_bounding.center, rc.world_bounding.halfsize)) {
+				current_call = &rc;
 				renderMeshWithMaterial(rc.model, rc.mesh, rc.material, camera);
+			}
 		}
 	}
-	// show shadowmap if activated
-	if (show_shadowmap) 
-		showShadowmap(lights[debug_shadowmap]);
+	current_call = NULL;
 }
 
 //renders all the prefab
@@ -313,6 +510,9 @@ void Renderer::renderMeshWithMaterial(const Matrix44 model, Mesh* mesh, GTR::Mat
 		return;
     assert(glGetError() == GL_NO_ERROR);
 
+	//the big mips are only loaded if the object is close enough to need them
+	requestTextureLevels(model, mesh, material, camera);
+
 	Shader* shader = NULL;
 
 	//select if render both sides of the triangles
@@ -325,9 +525,9 @@ void Renderer::renderMeshWithMaterial(const Matrix44 model, Mesh* mesh, GTR::Mat
 	//chose a shader
 	Scene* scene = Scene::instance;
 	if (scene->typeOfRender == Scene::eRenderPipeline::SINGLEPASS)
-		shader = Shader::Get("single_pass");
+		shader = Shader::Get(skinned_instances ? "single_pass_skinned" : "single_pass");
 	else if (scene->typeOfRender == Scene::eRenderPipeline::MULTIPASS)
-		shader = Shader::Get("multi_pass");
+		shader = Shader::Get(skinned_instances ? "multi_pass_skinned" : "multi_pass");
 
     assert(glGetError() == GL_NO_ERROR);
 
@@ -346,6 +546,13 @@ void Renderer::renderMeshWithMaterial(const Matrix44 model, Mesh* mesh, GTR::Mat
 	shader->setUniform("u_color", material->color);
 	// pass textures to the shader
 	setTextures(material, shader);
+	setIrradianceUniforms(shader);
+	setEnvironmentUniforms(material, shader, model * mesh->box.center);
+	if (skinned_instances)
+	{
+		skinned_instances->palette->bind(shader, "u_bones", BONES_TEXTURE_UNIT);
+		bound_textures[BONES_TEXTURE_UNIT] = skinned_instances->palette->texture_id;
+	}
 
 	//this is used to say which is the alpha threshold to what we should not paint a pixel on the screen (to cut polygons according to texture alpha)
 	shader->setUniform("u_alpha_cutoff", material->alpha_mode == GTR::eAlphaMode::MASK ? material->alpha_cutoff : 0);
@@ -355,7 +562,7 @@ void Renderer::renderMeshWithMaterial(const Matrix44 model, Mesh* mesh, GTR::Mat
 		setSinglepass_parameters(material, shader, mesh);
 	}
 	else if (scene->typeOfRender == Scene::eRenderPipeline::MULTIPASS) {
-		setMultipassParameters(material, shader, mesh);
+		setMultipassParameters(material, shader, mesh, model, camera);
 	}
 
 	//disable shader
@@ -366,7 +573,73 @@ void Renderer::renderMeshWithMaterial(const Matrix44 model, Mesh* mesh, GTR::Mat
 	glDepthFunc(GL_LESS);
 }
 
+//the same as renderMeshWithMaterial (or renderFlatMesh for shadowmaps) but every draw call renders all the instances,
+//the bone matrices come from their palette so there is no skinning in the CPU
+void Renderer::renderSkinnedInstances(SkinnedInstances* instances, GTR::Material* material, Camera* camera, bool flat)
+{
+	if (!instances->mesh || !instances->models.size() || !instances->palette || !instances->palette->texture_id)
+		return;
+
+	instances->upload();
+	skinned_instances = instances;
+	//the first instance is used for the texture levels and the closest reflection probe
+	if (flat)
+		renderFlatMesh(instances->models[0], instances->mesh, material, camera);
+	else
+		renderMeshWithMaterial(instances->models[0], instances->mesh, material, camera);
+	skinned_instances = NULL;
+}
+
+void Renderer::renderCrowds(Camera* camera, bool flat)
+{
+	for (CrowdEntity* crowd : crowds) {
+		BoundingBox box;
+		if (crowd->getWorldBounds(box) && camera->testBoxInFrustum(box.center, box.halfsize))
+			renderSkinnedInstances(crowd->instances, crowd->material, camera, flat);
+	}
+}
+
+void Renderer::drawMesh(Mesh* mesh)
+{
+	if (skinned_instances)
+		skinned_instances->render(GL_TRIANGLES);
+	else
+		mesh->render(GL_TRIANGLES);
+}
+
 // to pass the textures to the shader
+//tells the streamer the mip each texture needs: the texels per pixel at the closest point of the mesh
+void Renderer::requestTextureLevels(const Matrix44& model, Mesh* mesh, GTR::Material* material, Camera* camera)
+{
+	if (mesh->uv_density <= 0)
+		return;
+
+	float scale = (float)Vector3(model.m[0], model.m[1], model.m[2]).length();
+	float window_height = (float)Application::instance->window_height;
+	float pixels_per_unit = 0;
+	if (camera->type == Camera::ORTHOGRAPHIC)
+		pixels_per_unit = window_height / fabs(camera->top - camera->bottom);
+	else
+	{
+		Vector3 center = model * mesh->box.center;
+		float distance = (float)(center - camera->eye).length() - (float)mesh->box.halfsize.length() * scale;
+		distance = std::max(distance, camera->near_plane);
+		pixels_per_unit = window_height / (2.0f * distance * tan(camera->fov * 0.5f * DEG2RAD));
+	}
+	float texels_per_pixel = mesh->uv_density / (scale * pixels_per_unit); //for a texture of size 1
+
+	Sampler* samplers[] = { &material->color_texture, &material->emissive_texture, &material->opacity_texture,
+		&material->metallic_roughness_texture, &material->occlusion_texture, &material->normal_texture };
+	for (Sampler* sampler : samplers)
+	{
+		Texture* texture = sampler->texture;
+		if (!texture || !texture->stream)
+			continue;
+		float texels = std::max(texture->width, texture->height) * texels_per_pixel;
+		TextureStreamer::requestLevel(texture, texels > 1.0f ? (int)log2(texels) : 0);
+	}
+}
+
 void Renderer::setTextures(GTR::Material* material, Shader* shader) {
 	Texture* texture = NULL;
 	Texture* normal_texture = NULL;
@@ -381,41 +654,81 @@ void Renderer::setTextures(GTR::Material* material, Shader* shader) {
 	met_rough_texture = material->metallic_roughness_texture.texture;
 	occlusion_texture = material->occlusion_texture.texture;
 
+	//textures still loading in the background are skipped till they are ready
+	if (texture && !texture->isReady())
+		texture = NULL;
+	if (normal_texture && !normal_texture->isReady())
+		normal_texture = NULL;
+	if (emissive_texture && !emissive_texture->isReady())
+		emissive_texture = NULL;
+	if (met_rough_texture && !met_rough_texture->isReady())
+		met_rough_texture = NULL;
+	if (occlusion_texture && !occlusion_texture->isReady())
+		occlusion_texture = NULL;
+
 	if (texture == NULL)
 		texture = Texture::getWhiteTexture(); //a 1x1 white texture
-
-	// pass textures
-	if (texture)
-		shader->setUniform("u_texture", texture, 0);
-
-	if (emissive_texture)
-		shader->setUniform("u_emissive_texture", emissive_texture, 1);
 	// black texture will not add additional light
-	else
-		shader->setUniform("u_emissive_texture", Texture::getBlackTexture(), 1);
-	
-	if (occlusion_texture)
-		shader->setUniform("u_occlusion_texture", occlusion_texture, 2);
+	if (emissive_texture == NULL)
+		emissive_texture = Texture::getBlackTexture();
 	// white texture will take into account all light, namely no occlusion
-	else
-		shader->setUniform("u_occlusion_texture", Texture::getWhiteTexture(), 2);
-	
-	if (met_rough_texture)
-		shader->setUniform("u_met_rough_texture", met_rough_texture, 3);
-	else
-		shader->setUniform("u_met_rough_texture", Texture::getWhiteTexture(), 3);
-
-	if (normal_texture) {
-		shader->setUniform("u_normal_texture", normal_texture, 4);
-		shader->setUniform("u_normal_text_bool", 1);
+	if (occlusion_texture == NULL)
+		occlusion_texture = Texture::getWhiteTexture();
+	if (met_rough_texture == NULL)
+		met_rough_texture = Texture::getWhiteTexture();
+
+	// pass textures, the ones packed in arrays are sampled by layer from units 10 to 14
+	static const char* names[] = { "u_texture", "u_emissive_texture", "u_occlusion_texture", "u_met_rough_texture", "u_normal_texture" };
+	static const char* array_names[] = { "u_texture_array", "u_emissive_texture_array", "u_occlusion_texture_array", "u_met_rough_texture_array", "u_normal_texture_array" };
+	Texture* textures[] = { texture, emissive_texture, occlusion_texture, met_rough_texture, normal_texture };
+	float layers[5];
+	for (int i = 0; i < 5; ++i)
+	{
+		//both samplers need their own unit even if unused, samplers of different type cannot share one
+		shader->setUniform(names[i], i);
+		shader->setUniform(array_names[i], 10 + i);
+		layers[i] = -1;
+		Texture* tex = textures[i];
+		if (!tex)
+			continue;
+		if (tex->array_pool)
+		{
+			layers[i] = (float)tex->array_layer;
+			bindTexture(tex->array_pool->array, 10 + i);
+		}
+		else
+			bindTexture(tex, i);
 	}
+	shader->setUniform1Array("u_texture_layers", layers, 5);
+
 	// if the material do not have normal texture as the floor, we set the boolean to false to avoid artifacts
-	else
-		shader->setUniform("u_normal_text_bool", 0);
+	shader->setUniform("u_normal_text_bool", normal_texture ? 1 : 0);
 
 	shader->setUniform("u_texture2show", debug_texture);
 }
 
+//binds the texture only if it is not already bound to that unit
+void Renderer::bindTexture(Texture* texture, int slot)
+{
+	assert(slot < MAX_CACHED_TEXTURE_UNITS);
+	assert(!texture->array_pool && "packed texture, bind its array_pool->array");
+	if (bound_textures[slot] != texture->texture_id)
+	{
+		glActiveTexture(GL_TEXTURE0 + slot);
+		glBindTexture(texture->texture_type, texture->texture_id);
+		bound_textures[slot] = texture->texture_id;
+		num_texture_binds++;
+	}
+	else
+		num_texture_binds_skipped++;
+}
+
+void Renderer::resetTextureBindings()
+{
+	for (int i = 0; i < MAX_CACHED_TEXTURE_UNITS; ++i)
+		bound_textures[i] = -1;
+}
+
 void Renderer::setSinglepass_parameters(GTR::Material* material, Shader* shader, Mesh* mesh) {
 	//select the blending
 	if (material->alpha_mode == GTR::eAlphaMode::BLEND)
@@ -443,14 +756,11 @@ void Renderer::setSinglepass_parameters(GTR::Material* material, Shader* shader,
 	std::vector<float> lights_shadow_bias;
 
 
-	// Iterate and store the information
-	for (int i = 0; i < max_lights; i++) {
-		LightEntity* light;
-		// if the light is not created, pass an empty light to the shader to avoid taking trash information
-		if (i < lights.size() && lights[i]->visible)
-			light = lights[i];
-		else
-			light = new LightEntity();
+	// Iterate and store the information of the lights that reach the object, the shader only reads those
+	const int* indices;
+	int num_lights = std::min(getObjectLights(indices), max_lights);
+	for (int i = 0; i < num_lights; i++) {
+		LightEntity* light = lights[indices[i]];
 
 		// add the information to the vectors
 		lights_type.push_back(light->light_type);
@@ -484,24 +794,29 @@ void Renderer::setSinglepass_parameters(GTR::Material* material, Shader* shader,
 	// Pass to the shader
 	Scene* scene = Scene::instance;
 
-	shader->setUniform("u_lights_type", lights_type);
 	shader->setUniform("u_ambient_light", scene->ambient_light);
-	shader->setUniform("u_lights_position", lights_position);
-	shader->setUniform("u_lights_color", lights_color);
-	shader->setUniform("u_lights_max_distance", lights_max_distance);
+	shader->setUniform("u_num_lights", num_lights);
+	if (num_lights) {
+		shader->setUniform("u_lights_type", lights_type);
+		shader->setUniform("u_lights_position", lights_position);
+		shader->setUniform("u_lights_color", lights_color);
+		shader->setUniform("u_lights_max_distance", lights_max_distance);
 
-	// Use the cosine to compare it directly to NdotL
-	shader->setUniform("u_lights_cone_cos", lights_cone_cos);
-	shader->setUniform("u_lights_cone_exp", lights_cone_exp);
-	shader->setUniform("u_lights_direction", lights_direction);
+		// Use the cosine to compare it directly to NdotL
+		shader->setUniform("u_lights_cone_cos", lights_cone_cos);
+		shader->setUniform("u_lights_cone_exp", lights_cone_exp);
+		shader->setUniform("u_lights_direction", lights_direction);
 
-	shader->setUniform("u_lights_cast_shadows", lights_cast_shadows);
-	shader->setUniform("u_light_shadowmap", lights_shadowmap, 8);
-	shader->setUniform("u_light_shadowmap_vpm", lights_shadowmap_vpm);
-	shader->setUniform("u_light_shadow_bias", lights_shadow_bias);
+		shader->setUniform("u_lights_cast_shadows", lights_cast_shadows);
+	}
+	if (lights_shadowmap.size()) {
+		shader->setUniform("u_light_shadowmap", lights_shadowmap, 8);
+		shader->setUniform("u_light_shadowmap_vpm", lights_shadowmap_vpm);
+		shader->setUniform("u_light_shadow_bias", lights_shadow_bias);
+	}
 
 	//do the draw call that renders the mesh into the screen
-	mesh->render(GL_TRIANGLES);
+	drawMesh(mesh);
 
 	// clear all vectors
 	lights_type.clear();
@@ -517,7 +832,69 @@ void Renderer::setSinglepass_parameters(GTR::Material* material, Shader* shader,
 	lights_shadow_bias.clear();
 }
 
-void Renderer::setMultipassParameters(GTR::Material* material, Shader* shader, Mesh* mesh) {
+// GL_EXT_depth_bounds_test discards the fragments whose depth in the buffer is outside a range, in the additive passes
+// it is the depth written by the first pass of the same mesh
+#ifndef GL_DEPTH_BOUNDS_TEST_EXT
+	#define GL_DEPTH_BOUNDS_TEST_EXT 0x8890
+#endif
+typedef void (APIENTRY* DepthBoundsFunc)(double zmin, double zmax);
+static DepthBoundsFunc depthBounds = NULL;
+static int depth_bounds_test = -1; //-1 until checked
+
+static bool supportsDepthBounds()
+{
+	if (depth_bounds_test == -1)
+	{
+#ifdef USE_GLEW
+		bool supported = GLEW_EXT_depth_bounds_test ? true : false;
+#else
+		bool supported = SDL_GL_ExtensionSupported("GL_EXT_depth_bounds_test") ? true : false;
+#endif
+		if (supported)
+			depthBounds = (DepthBoundsFunc)SDL_GL_GetProcAddress("glDepthBoundsEXT");
+		depth_bounds_test = depthBounds ? 1 : 0;
+	}
+	return depth_bounds_test == 1;
+}
+
+// Part of the viewport (in pixels) and of the depth range (0..1) that a box can cover
+struct ScreenBounds {
+	float min_x, min_y, max_x, max_y;
+	float min_depth, max_depth;
+};
+
+// from its eight corners, false if some of them is behind the camera, then it can cover any part of the screen
+// bounds is left untouched if the box crosses the camera plane
+static bool projectBox(const Matrix44& viewprojection, const Vector3& center, const Vector3& halfsize, const int viewport[4], ScreenBounds& bounds)
+{
+	ScreenBounds ndc;
+	ndc.min_x = ndc.min_y = ndc.min_depth = 1.0f;
+	ndc.max_x = ndc.max_y = ndc.max_depth = -1.0f;
+	for (int i = 0; i < 8; ++i) {
+		Vector4 corner(center.x + (i & 1 ? halfsize.x : -halfsize.x), center.y + (i & 2 ? halfsize.y : -halfsize.y), center.z + (i & 4 ? halfsize.z : -halfsize.z), 1.0f);
+		Vector4 clip = viewprojection * corner;
+		if (clip.w < 0.0001f)
+			return false;
+		float x = clip.x / clip.w, y = clip.y / clip.w, z = clip.z / clip.w;
+		ndc.min_x = std::min(ndc.min_x, x);
+		ndc.max_x = std::max(ndc.max_x, x);
+		ndc.min_y = std::min(ndc.min_y, y);
+		ndc.max_y = std::max(ndc.max_y, y);
+		ndc.min_depth = std::min(ndc.min_depth, z);
+		ndc.max_depth = std::max(ndc.max_depth, z);
+	}
+
+	// from normalized device coordinates, clamped to the viewport
+	bounds.min_x = viewport[0] + (clamp(ndc.min_x, -1.0f, 1.0f) * 0.5f + 0.5f) * viewport[2];
+	bounds.max_x = viewport[0] + (clamp(ndc.max_x, -1.0f, 1.0f) * 0.5f + 0.5f) * viewport[2];
+	bounds.min_y = viewport[1] + (clamp(ndc.min_y, -1.0f, 1.0f) * 0.5f + 0.5f) * viewport[3];
+	bounds.max_y = viewport[1] + (clamp(ndc.max_y, -1.0f, 1.0f) * 0.5f + 0.5f) * viewport[3];
+	bounds.min_depth = clamp(ndc.min_depth, -1.0f, 1.0f) * 0.5f + 0.5f;
+	bounds.max_depth = clamp(ndc.max_depth, -1.0f, 1.0f) * 0.5f + 0.5f;
+	return true;
+}
+
+void Renderer::setMultipassParameters(GTR::Material* material, Shader* shader, Mesh* mesh, const Matrix44& model, Camera* camera) {
 	// paint if value is less or equal to the one in the depth buffer
 	glDepthFunc(GL_LEQUAL);
 
@@ -528,16 +905,36 @@ void Renderer::setMultipassParameters(GTR::Material* material, Shader* shader, M
 
 	Vector3 ambient_light = scene->ambient_light;
 
-	// To know if there is any light visible
-	bool any_visible = false;
-	// to know if we are in first iteration of a visible light, since the first light can be disabled and therefore blending will not be activated for transparent materials
+	// to know if we are in first iteration, only the first pass uses the blending of the material
 	bool is_first = true;
 
-	for (int i = 0; i < lights.size(); ++i) {
-		LightEntity* light = lights[i];
+	// only the lights that reach the object are rendered, without any the ambient is rendered with an empty light
+	const int* indices;
+	int num_lights = getObjectLights(indices);
+	static LightEntity no_light;
+	no_light.max_distance = 1.0f; // the shader divides by it
+
+	// the screen bounds of the object, the ones of every light are intersected with them (all the instances of the
+	// skinned ones are drawn at once, they use the whole viewport)
+	bool scissor = use_light_scissor && num_lights > 1 && debug_texture == eTextureType::COMPLETE;
+	bool depth_bounds = scissor && supportsDepthBounds();
+	int viewport[4];
+	ScreenBounds object_bounds;
+	if (scissor) {
+		glGetIntegerv(GL_VIEWPORT, viewport);
+		BoundingBox box = current_call ? current_call->world_bounding : transformBoundingBox(model, mesh->box);
+		if (skinned_instances || !projectBox(camera->viewprojection_matrix, box.center, box.halfsize, viewport, object_bounds)) {
+			object_bounds.min_x = (float)viewport[0];
+			object_bounds.min_y = (float)viewport[1];
+			object_bounds.max_x = (float)(viewport[0] + viewport[2]);
+			object_bounds.max_y = (float)(viewport[1] + viewport[3]);
+			object_bounds.min_depth = 0.0f;
+			object_bounds.max_depth = 1.0f;
+		}
+	}
 
-		if (!lights[i]->visible)
-			continue;
+	for (int i = 0; i < std::max(num_lights, 1); ++i) {
+		LightEntity* light = num_lights ? lights[indices[i]] : &no_light;
 
 		if (is_first) {
 			// select the blending
@@ -554,8 +951,34 @@ void Renderer::setMultipassParameters(GTR::Material* material, Shader* shader, M
 		else if (debug_texture != eTextureType::COMPLETE)
 			continue;
 
-		// There is at least one visible light
-		any_visible = true;
+		// the first pass has the ambient of all the object, the others only need the part the light reaches
+		else if (scissor) {
+			ScreenBounds bounds = object_bounds;
+			float radius = light->max_distance;
+			if (light->light_type != LightEntity::eTypeOfLight::DIRECTIONAL &&
+				projectBox(camera->viewprojection_matrix, light->model.getTranslation(), Vector3(radius, radius, radius), viewport, bounds)) {
+				bounds.min_x = std::max(bounds.min_x, object_bounds.min_x);
+				bounds.max_x = std::min(bounds.max_x, object_bounds.max_x);
+				bounds.min_y = std::max(bounds.min_y, object_bounds.min_y);
+				bounds.max_y = std::min(bounds.max_y, object_bounds.max_y);
+				bounds.min_depth = std::max(bounds.min_depth, object_bounds.min_depth);
+				bounds.max_depth = std::min(bounds.max_depth, object_bounds.max_depth);
+				if (bounds.min_x > bounds.max_x || bounds.min_y > bounds.max_y || bounds.min_depth > bounds.max_depth) {
+					num_light_passes_skipped++;
+					continue;
+				}
+				num_light_passes_scissored++;
+			}
+			int x = (int)floor(bounds.min_x);
+			int y = (int)floor(bounds.min_y);
+			glEnable(GL_SCISSOR_TEST);
+			glScissor(x, y, (int)floor(bounds.max_x) + 1 - x, (int)floor(bounds.max_y) + 1 - y);
+			if (depth_bounds) {
+				glEnable(GL_DEPTH_BOUNDS_TEST_EXT);
+				depthBounds(bounds.min_depth, bounds.max_depth);
+			}
+		}
+
 		// we already passed first light
 		is_first = false;
 
@@ -585,7 +1008,7 @@ void Renderer::setMultipassParameters(GTR::Material* material, Shader* shader, M
 			shader->setUniform("u_light_cast_shadows", 0);
 
 		//do the draw call that renders the mesh into the screen
-		mesh->render(GL_TRIANGLES);
+		drawMesh(mesh);
 
 		// Activate blending again for the rest of lights to do the interpolation
 		glEnable(GL_BLEND);
@@ -594,12 +1017,264 @@ void Renderer::setMultipassParameters(GTR::Material* material, Shader* shader, M
 
 		// Reset ambient light to add it only once
 		ambient_light = vec3(0.0, 0.0, 0.0);
+		shader->setUniform("u_irradiance_enabled", 0);
+		shader->setUniform("u_environment_enabled", 0);
 	}
 
-	// If no light is visible, pass only the ambient light to the shader
-	if (any_visible == false) {
-		shader->setUniform("u_ambient_light", ambient_light);
+	if (scissor) {
+		glDisable(GL_SCISSOR_TEST);
+		if (depth_bounds)
+			glDisable(GL_DEPTH_BOUNDS_TEST_EXT);
+	}
+}
+
+// --- Irradiance functions ---
+
+// the probes must not be baked till the prefabs and their textures are loaded
+static bool isSceneLoaded(GTR::Scene* scene)
+{
+	for (int i = 0; i < scene->entities.size(); i++) {
+		BaseEntity* ent = scene->entities[i];
+		if (ent->entity_type == PREFAB && ((PrefabEntity*)ent)->prefab && !((PrefabEntity*)ent)->prefab.isReady())
+			return false;
 	}
+	TaskManager* managers[] = { &TaskManager::foreground, &TaskManager::background };
+	for (TaskManager* manager : managers) {
+		std::lock_guard<std::mutex> lock(manager->tasks_mutex);
+		if (!manager->pending_tasks.empty())
+			return false;
+	}
+	return true;
+}
+
+void Renderer::renderToCubemap(GTR::Scene* scene, const Vector3& position, int size, FloatImage faces[6])
+{
+	if (!capture_fbo || capture_fbo->color_textures[0]->width != size) {
+		delete capture_fbo;
+		capture_fbo = new FBO();
+		capture_fbo->create(size, size, 1, GL_RGB, GL_FLOAT);
+	}
+
+	Camera* view_camera = Camera::current;
+	Camera capture_camera;
+	capture_camera.setPerspective(90, 1, view_camera ? view_camera->near_plane : 1.0f, view_camera ? view_camera->far_plane : 10000.0f);
+
+	for (int i = 0; i < 6; ++i) {
+		// the camera right and up are the x and y axis of the face, so the pixels are in the order the projection expects
+		Vector3 front = cubemapFaceNormals[i][2];
+		capture_camera.lookAt(position, position + front, cubemapFaceNormals[i][1]);
+		capture_fbo->bind();
+		capture_camera.enable();
+		renderRenderCalls(scene, &capture_camera);
+		capture_fbo->unbind();
+		faces[i].fromTexture(capture_fbo->color_textures[0]);
+	}
+
+	if (view_camera)
+		view_camera->enable();
+}
+
+void Renderer::bakeIrradiance(GTR::Scene* scene, IrradianceEntity* volume)
+{
+	long start_time = getTime();
+
+	// one slot per thread, the main thread renders the next probe while the workers project the previous ones
+	struct ProbeCapture {
+		FloatImage faces[6];
+		std::atomic<bool> busy;
+		ProbeCapture() { busy = false; }
+	};
+	int num_slots = TaskManager::workers.getNumThreads() + 1;
+	std::unique_ptr<ProbeCapture[]> slots(new ProbeCapture[num_slots]);
+	std::vector<SphericalHarmonics> probes(volume->getNumProbes());
+
+	// the probes see the lights and the ambient, not the old irradiance
+	IrradianceEntity* prev_irradiance = irradiance;
+	irradiance = NULL;
+
+	int index = 0;
+	for (int z = 0; z < volume->dims[2]; ++z)
+		for (int y = 0; y < volume->dims[1]; ++y)
+			for (int x = 0; x < volume->dims[0]; ++x, ++index) {
+				ProbeCapture* slot = NULL;
+				while (!slot) {
+					for (int i = 0; i < num_slots && !slot; ++i)
+						if (!slots[i].busy)
+							slot = &slots[i];
+					// help with the projections while all the slots are waiting
+					if (!slot && !TaskManager::workers.fetchTask())
+						std::this_thread::yield();
+				}
+
+				renderToCubemap(scene, volume->getProbePosition(x, y, z), volume->probe_resolution, slot->faces);
+				slot->busy = true;
+				SphericalHarmonics* probe = &probes[index];
+				TaskManager::workers.addTask(new Task([slot, probe]() {
+					*probe = projectSH(slot->faces, 2);
+					slot->busy = false;
+				}));
+			}
+
+	for (int i = 0; i < num_slots; ++i)
+		while (slots[i].busy)
+			if (!TaskManager::workers.fetchTask())
+				std::this_thread::yield();
+
+	irradiance = prev_irradiance;
+	volume->probes.swap(probes);
+	volume->must_bake = false;
+	volume->uploadToTexture();
+	volume->bake_time = (getTime() - start_time) / 1000.0f;
+	std::cout << " + Irradiance baked: " << volume->getNumProbes() << " probes in " << volume->bake_time << "s" << std::endl;
+
+	if (volume->filename.size() && !volume->save((std::string("data/") + volume->filename).c_str()))
+		std::cout << " - Cannot save irradiance file: " << volume->filename << std::endl;
+}
+
+// the sampler needs its own unit even if it is disabled, unit 9 is not used by the material textures
+void Renderer::setIrradianceUniforms(Shader* shader)
+{
+	shader->setUniform("u_irradiance_texture", 9);
+	if (!use_irradiance || !irradiance || !irradiance->texture) {
+		shader->setUniform("u_irradiance_enabled", 0);
+		return;
+	}
+
+	bindTexture(irradiance->texture, 9);
+	shader->setUniform("u_irradiance_enabled", 1);
+	shader->setUniform("u_irradiance_start", irradiance->getStart());
+	shader->setUniform("u_irradiance_delta", irradiance->getDelta());
+	shader->setUniform("u_irradiance_dims", Vector3((float)irradiance->dims[0], (float)irradiance->dims[1], (float)irradiance->dims[2]));
+}
+
+// the reflections are added in the first pass, the units 6 and 7 are not used by anything else.
+// The closest probe to the object replaces the environment
+void Renderer::setEnvironmentUniforms(GTR::Material* material, Shader* shader, const Vector3& position)
+{
+	shader->setUniform("u_environment_texture", 6);
+	shader->setUniform("u_brdf_lut", 7);
+	Texture* environment = Scene::instance->environment;
+	ReflectionProbeEntity* probe = getClosestProbe(position);
+	if (probe)
+		environment = probe->texture;
+	if (!use_environment || !environment || !environment->isReady()) {
+		shader->setUniform("u_environment_enabled", 0);
+		return;
+	}
+
+	if (!brdf_lut)
+		brdf_lut = GetBRDFLUT();
+	bindTexture(environment, 6);
+	bindTexture(brdf_lut, 7);
+	int num_levels = std::min(IBL_NUM_LEVELS, (int)log2(environment->width) + 1);
+	shader->setUniform("u_environment_enabled", 1);
+	shader->setUniform("u_environment_levels", (float)num_levels);
+	shader->setUniform("u_roughness", material->roughness_factor);
+	shader->setUniform("u_metallic", material->metallic_factor);
+}
+
+// --- Reflection probe functions ---
+
+void Renderer::updateReflectionProbes(GTR::Scene* scene)
+{
+	reflection_probes.clear();
+	num_probe_faces_updated = 0;
+	if (!use_reflection_probes)
+		return;
+
+	std::vector<ReflectionProbeEntity*> dynamic_probes;
+	for (int i = 0; i < scene->entities.size(); i++) {
+		BaseEntity* ent = scene->entities[i];
+		if (ent->entity_type != GTR::eEntityType::REFLECTION_PROBE || !ent->visible)
+			continue;
+		ReflectionProbeEntity* probe = (ReflectionProbeEntity*)ent;
+		if (!probe->texture && (probe->dynamic || !probe->filename.size() || !probe->load((std::string("data/") + probe->filename).c_str())))
+			probe->createTexture();
+
+		// all the faces are captured once the scene is loaded, like the irradiance, then only the dynamic ones are updated
+		if (probe->must_capture && isSceneLoaded(scene)) {
+			long start_time = getTime();
+			for (int face = 0; face < 6; ++face)
+				captureProbeFace(scene, probe, face);
+			probe->must_capture = false;
+			probe->must_prefilter = true;
+			probe->capture_time = (getTime() - start_time) / 1000.0f;
+		}
+		if (probe->must_capture)
+			continue;
+
+		// the rough levels are prefiltered in the background once per complete capture (a dynamic probe that completes
+		// another one meanwhile waits for it)
+		probe->uploadLevels();
+		if (probe->must_prefilter && probe->prefilter(probe->dynamic || !probe->filename.size() ? "" : "data/" + probe->filename))
+			probe->must_prefilter = false;
+
+		if (probe->dynamic)
+			dynamic_probes.push_back(probe);
+		reflection_probes.push_back(probe);
+	}
+
+	// one face of a probe at a time, the next frame continues where this one stopped. No face is updated twice in a frame
+	// (the time is measured in the CPU, the GPU may still be working on the faces)
+	long start_time = getTime();
+	int max_faces = (int)dynamic_probes.size() * 6;
+	while (num_probe_faces_updated < max_faces) {
+		ReflectionProbeEntity* probe = dynamic_probes[next_dynamic_probe % dynamic_probes.size()];
+		if (probe->next_face == 0)
+			probe->capture_time = 0;
+		long face_start = getTime();
+		captureProbeFace(scene, probe, probe->next_face);
+		probe->capture_time += (getTime() - face_start) / 1000.0f;
+		num_probe_faces_updated++;
+
+		probe->next_face = (probe->next_face + 1) % 6;
+		if (probe->next_face == 0) {
+			probe->must_prefilter = true;
+			next_dynamic_probe = (next_dynamic_probe + 1) % dynamic_probes.size();
+		}
+		if (getTime() - start_time >= probe_update_budget)
+			break;
+	}
+}
+
+// the faces see the environment, not the probes (they would see themselves)
+void Renderer::captureProbeFace(GTR::Scene* scene, ReflectionProbeEntity* probe, int face)
+{
+	if (!probe->fbo)
+		probe->fbo = new FBO();
+	probe->fbo->setTexture(probe->texture, face);
+
+	Camera* view_camera = Camera::current;
+	Camera capture_camera;
+	capture_camera.setPerspective(90, 1, view_camera ? view_camera->near_plane : 1.0f, view_camera ? view_camera->far_plane : 10000.0f);
+	Vector3 position = probe->getPosition();
+	// the camera right and up are the x and y axis of the face, as in renderToCubemap
+	capture_camera.lookAt(position, position + cubemapFaceNormals[face][2], cubemapFaceNormals[face][1]);
+
+	std::vector<ReflectionProbeEntity*> probes;
+	probes.swap(reflection_probes);
+	probe->fbo->bind();
+	capture_camera.enable();
+	renderRenderCalls(scene, &capture_camera);
+	probe->fbo->unbind();
+	probes.swap(reflection_probes);
+
+	if (view_camera)
+		view_camera->enable();
+}
+
+ReflectionProbeEntity* Renderer::getClosestProbe(const Vector3& position)
+{
+	ReflectionProbeEntity* closest = NULL;
+	float min_distance = 0;
+	for (ReflectionProbeEntity* probe : reflection_probes) {
+		float distance = probe->getPosition().distance(position);
+		if (!closest || distance < min_distance) {
+			closest = probe;
+			min_distance = distance;
+		}
+	}
+	return closest;
 }
 
 // to save fbo with depth buffer
@@ -621,7 +1296,7 @@ void Renderer::renderFlatMesh(const Matrix44 model, Mesh* mesh, GTR::Material* m
 
 	//chose a shader
 	Scene* scene = Scene::instance;
-	shader = Shader::Get("flat");
+	shader = Shader::Get(skinned_instances ? "flat_skinned" : "flat");
 
 
 	assert(glGetError() == GL_NO_ERROR);
@@ -634,6 +1309,11 @@ void Renderer::renderFlatMesh(const Matrix44 model, Mesh* mesh, GTR::Material* m
 	//upload uniforms
 	shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
 	shader->setUniform("u_model", model);
+	if (skinned_instances)
+	{
+		skinned_instances->palette->bind(shader, "u_bones", BONES_TEXTURE_UNIT);
+		bound_textures[BONES_TEXTURE_UNIT] = skinned_instances->palette->texture_id;
+	}
 
 	//this is used to say which is the alpha threshold to what we should not paint a pixel on the screen (to cut polygons according to texture alpha)
 	shader->setUniform("u_alpha_cutoff", material->alpha_mode == GTR::eAlphaMode::MASK ? material->alpha_cutoff : 0);
@@ -642,7 +1322,7 @@ void Renderer::renderFlatMesh(const Matrix44 model, Mesh* mesh, GTR::Material* m
 	glDepthFunc(GL_LESS);
 	glDisable(GL_BLEND);
 
-	mesh->render(GL_TRIANGLES);
+	drawMesh(mesh);
 	//disable shader
 	shader->disable();
 }
@@ -651,6 +1331,19 @@ void GTR::Renderer::renderInMenu() {
 	ImGui::Checkbox("Show Shadowmap", &show_shadowmap);
 	ImGui::Combo("Shadowmaps", &debug_shadowmap, "SPOT1\0SPOT2\0POINT1\0POINT2\0POINT3\0POINT4\0POINT5\0DIRECTIONAL");
 	ImGui::Combo("Textures", &debug_texture, "COMPLETE\0NORMAL\0OCCLUSION\0EMISSIVE");
+	ImGui::Checkbox("Irradiance", &use_irradiance);
+	ImGui::Checkbox("Environment reflections", &use_environment);
+	ImGui::Checkbox("Reflection probes", &use_reflection_probes);
+	ImGui::SliderFloat("Probe budget (ms)", &probe_update_budget, 0.0f, 16.0f);
+	ImGui::Text("Probe faces updated: %d", num_probe_faces_updated);
+	TextureStreamer::renderInMenu();
+	TextureUploader::renderInMenu();
+	TextureArrayPool::renderInMenu();
+	ImGui::Text("Texture binds: %d  Skipped: %d", num_texture_binds, num_texture_binds_skipped);
+	ImGui::Checkbox("Light lists", &use_light_lists);
+	ImGui::Text("Object lights: %d  Culled: %d", num_object_lights, num_object_lights_culled);
+	ImGui::Checkbox("Light scissor", &use_light_scissor);
+	ImGui::Text("Light passes scissored: %d  Skipped: %d", num_light_passes_scissored, num_light_passes_skipped);
 }
 
 Texture* GTR::CubemapFromHDRE(const char* filename)
@@ -659,24 +1352,14 @@ Texture* GTR::CubemapFromHDRE(const char* filename)
 	if (!hdre)
 		return NULL;
 
+	//usable from the coarsest level, the others arrive in the next frames
 	Texture* texture = new Texture();
-	if (hdre->getFacesf(0))
+	texture->filename = filename;
+	if (!streamHDREToCubemap(hdre, texture))
 	{
-		texture->createCubemap(hdre->width, hdre->height, (Uint8**)hdre->getFacesf(0),
-			hdre->header.numChannels == 3 ? GL_RGB : GL_RGBA, GL_FLOAT);
-		for (int i = 1; i < hdre->levels; ++i)
-			texture->uploadCubemap(texture->format, texture->type, false,
-				(Uint8**)hdre->getFacesf(i), GL_RGBA32F, i);
+		delete texture;
+		return NULL;
 	}
-	else
-		if (hdre->getFacesh(0))
-		{
-			texture->createCubemap(hdre->width, hdre->height, (Uint8**)hdre->getFacesh(0),
-				hdre->header.numChannels == 3 ? GL_RGB : GL_RGBA, GL_HALF_FLOAT);
-			for (int i = 1; i < hdre->levels; ++i)
-				texture->uploadCubemap(texture->format, texture->type, false,
-					(Uint8**)hdre->getFacesh(i), GL_RGBA16F, i);
-		}
 	return texture;
 }
 
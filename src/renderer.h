@@ -6,6 +6,7 @@
 
 //forward declarations
 class Camera;
+class SkinnedInstances;
 
 namespace GTR {
 
@@ -19,6 +20,9 @@ namespace GTR {
 		Matrix44 model;
 		float distance_to_camera;
 		BoundingBox world_bounding;
+		// range of Renderer::light_indices with the lights that reach it
+		int first_light;
+		int num_lights;
 
 		RenderCall() {}
 		virtual ~RenderCall() {}
@@ -40,23 +44,69 @@ namespace GTR {
 		std::vector<RenderCall> render_calls;
 		// Save all lights in the scene
 		std::vector<LightEntity*> lights;
+		// The visible crowds, drawn with their skinned instances after the shadowmaps and before the rendercalls
+		std::vector<CrowdEntity*> crowds;
 
 		int max_lights;
 
+		// Lights that reach every rendercall, from their spheres and cones against the world boxes
+		bool use_light_lists;
+		std::vector<int> visible_lights;	// indices of lights, the ones used without light lists
+		std::vector<int> light_indices;		// the ranges of the rendercalls
+		RenderCall* current_call;			// being rendered, NULL when rendering without rendercalls
+		int num_object_lights;				// lights used by the objects in the last frame (draw calls in multipass)
+		int num_object_lights_culled;		// the visible lights that didn't reach them
+
+		// The additive passes of the point and spot lights are limited to the screen rectangle and depth range of their
+		// sphere, and skipped when it doesn't overlap the object
+		bool use_light_scissor;
+		int num_light_passes_scissored;		// in the last frame
+		int num_light_passes_skipped;
+
 		FBO* fbo;
 		Texture* shadowmap;
 
+		// Irradiance volume used by the shaders in this frame (NULL while baking)
+		bool use_irradiance;
+		IrradianceEntity* irradiance;
+		FBO* capture_fbo;
+
+		// Reflections of the scene environment (prefiltered cubemap and BRDF LUT)
+		bool use_environment;
+		Texture* brdf_lut;
+
+		// Reflection probes, the dynamic ones are updated face by face in round robin till the budget is spent
+		bool use_reflection_probes;
+		std::vector<ReflectionProbeEntity*> reflection_probes; // already captured, used in this frame
+		float probe_update_budget;		// ms per frame for the dynamic probes (at least one face is updated)
+		int next_dynamic_probe;
+		int num_probe_faces_updated;	// in the last frame
+
 		// Imgui debug parameters
 		bool show_shadowmap;
 		int debug_shadowmap;
 		int debug_texture;
 
+		// Textures bound to each unit while rendering the rendercalls, to skip the binds that dont change
+		static const int MAX_CACHED_TEXTURE_UNITS = 16;
+		unsigned int bound_textures[MAX_CACHED_TEXTURE_UNITS];
+		int num_texture_binds;			//in the last frame
+		int num_texture_binds_skipped;
+
+		// Skinned characters drawn in one instanced call (NULL when rendering regular meshes)
+		SkinnedInstances* skinned_instances;
+		static const int BONES_TEXTURE_UNIT = 15;
+
 		Renderer();
 
 		// -- Rendercalls manager functions--
 		void createRenderCalls(GTR::Scene* scene, Camera* camera);
-		void addRenderCall_node(GTR::Scene* scene, Camera* camera, Node* node, Matrix44 curr_model, Matrix44 parent_model);
+		void addRenderCalls_prefab(GTR::Scene* scene, Prefab* prefab, const Matrix44& model);
 		void sortRenderCalls();
+		// fills the light ranges of the rendercalls
+		void assignLights();
+		// the lights of current_call (all the visible ones without it), returns how many
+		int getObjectLights(const int*& indices);
 		// operator used to sort rendercalls vector
 		static bool compare_distances(const RenderCall rc1, const RenderCall rc2) { return (rc1.distance_to_camera < rc2.distance_to_camera); }
 
@@ -64,20 +114,47 @@ namespace GTR {
 		void showShadowmap(LightEntity* light);
 		void generateShadowmap(LightEntity* light);
 
+		// -- Irradiance functions --
+		// renders the six faces of a cubemap (in the order of cubemapFaceNormals) to float images
+		void renderToCubemap(GTR::Scene* scene, const Vector3& position, int size, FloatImage faces[6]);
+		// captures every probe and projects it to SH in the workers, then saves the file
+		void bakeIrradiance(GTR::Scene* scene, IrradianceEntity* volume);
+		void setIrradianceUniforms(Shader* shader);
+		void setEnvironmentUniforms(GTR::Material* material, Shader* shader, const Vector3& position);
+
+		// -- Reflection probe functions --
+		// captures the static probes that need it and some faces of the dynamic ones
+		void updateReflectionProbes(GTR::Scene* scene);
+		void captureProbeFace(GTR::Scene* scene, ReflectionProbeEntity* probe, int face);
+		ReflectionProbeEntity* getClosestProbe(const Vector3& position);
+
 		// -- Render functions --
 		//renders several elements of the scene
 		void renderScene(GTR::Scene* scene, Camera* camera);
 		// to render the scene using rendercalls vector
 		void renderScene_RenderCalls(GTR::Scene* scene, Camera* camera);
+		// lights, shadowmaps and sorted rendercalls, they do not depend on the camera
+		void prepareScene(GTR::Scene* scene, Camera* camera);
+		// clears and renders the prepared rendercalls
+		void renderRenderCalls(GTR::Scene* scene, Camera* camera);
 		//to render a whole prefab (with all its nodes)
 		void renderPrefab(const Matrix44& model, GTR::Prefab* prefab, Camera* camera);
 		//to render one node from the prefab and its children
 		void renderNode(const Matrix44& model, GTR::Node* node, Camera* camera);
 		//to render one mesh given its material and transformation matrix
 		void renderMeshWithMaterial(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera);
+		//to render many skinned characters with the same mesh and material, with the skinned shaders
+		void renderSkinnedInstances(SkinnedInstances* instances, GTR::Material* material, Camera* camera, bool flat = false);
+		//the crowds inside the frustum of the camera
+		void renderCrowds(Camera* camera, bool flat = false);
+		//the draw call of the mesh being rendered, instanced if rendering skinned instances
+		void drawMesh(Mesh* mesh);
 		void setTextures(GTR::Material* material, Shader* shader);
+		void bindTexture(Texture* texture, int slot);
+		void resetTextureBindings();
+		void requestTextureLevels(const Matrix44& model, Mesh* mesh, GTR::Material* material, Camera* camera);
 		void setSinglepass_parameters(GTR::Material* material, Shader* shader, Mesh* mesh);
-		void setMultipassParameters(GTR::Material* material, Shader* shader, Mesh* mesh);
+		void setMultipassParameters(GTR::Material* material, Shader* shader, Mesh* mesh, const Matrix44& model, Camera* camera);
 		// to render flat objects for generating the shadowmaps
 		void renderFlatMesh(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera);
 
@@ -0,0 +1,80 @@
+#include "resource.h"
+#include "task.h"
+
+#include <chrono>
+
+//static initialization happens in the main thread
+std::thread::id Resource::main_thread_id = std::this_thread::get_id();
+
+//resources whose last handle was released, by key so stale entries are harmless
+struct sPendingDestruction {
+	ResourceRegistryBase* registry;
+	std::string key;
+	Resource* res; //only compared, it could be already deleted
+};
+
+static std::mutex pending_mutex;
+static std::vector<sPendingDestruction> pending_destruction;
+
+Resource::~Resource()
+{
+	if (registry)
+		registry->unregister(this);
+}
+
+void Resource::release()
+{
+	int count = ref_count.fetch_sub(1) - 1;
+	assert(count >= 0 && "resource released more times than referenced");
+	if (count != 0 || !registry)
+		return; //not registered ones belong to whoever created them
+
+	std::lock_guard<std::mutex> lock(pending_mutex);
+	pending_destruction.push_back({ registry, resource_key, this });
+}
+
+int Resource::processPendingDestruction()
+{
+	assert(isMainThread());
+	int num = 0;
+
+	//destroying a resource can release others (a prefab releases its meshes), so loop till empty
+	std::vector<sPendingDestruction> deferred;
+	while (true)
+	{
+		std::vector<sPendingDestruction> pending;
+		{
+			std::lock_guard<std::mutex> lock(pending_mutex);
+			pending.swap(pending_destruction);
+		}
+		if (pending.empty())
+			break;
+		for (sPendingDestruction& item : pending)
+		{
+			ResourceRegistryBase::eDestroyResult result = item.registry->destroyIfUnused(item.key, item.res);
+			if (result == ResourceRegistryBase::DESTROYED)
+				num++;
+			else if (result == ResourceRegistryBase::DEFERRED)
+				deferred.push_back(item);
+		}
+	}
+
+	//the ones still loading are tried again in the next call
+	if (deferred.size())
+	{
+		std::lock_guard<std::mutex> lock(pending_mutex);
+		pending_destruction.insert(pending_destruction.end(), deferred.begin(), deferred.end());
+	}
+	return num;
+}
+
+void waitForResource(Resource* res)
+{
+	while (res->isLoading())
+	{
+		//the main thread may be the one that has to finish it
+		if (Resource::isMainThread() && TaskManager::foreground.fetchTask())
+			continue;
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+}
@@ -0,0 +1,206 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <cassert>
+
+//Shared assets (meshes, textures, materials, prefabs, hdres) inherit from Resource and are stored
+//in a ResourceRegistry by name. Handles keep them alive: once the last Handle of a registered
+//resource is released it is queued and destroyed later from the main thread (it may own GL objects),
+//or in a later call if it is still loading (a loader thread is using it).
+//Raw pointers returned by the Get functions dont count, they are valid while something holds a Handle
+//or till the registry is released at exit.
+
+enum eResourceState {
+	RESOURCE_LOADING,	//registered but still being loaded in another thread
+	RESOURCE_READY,
+	RESOURCE_FAILED
+};
+
+class ResourceRegistryBase;
+
+class Resource
+{
+public:
+	std::atomic<int> ref_count;
+	std::atomic<int> state; //eResourceState
+	ResourceRegistryBase* registry; //where it is registered (NULL if not)
+	std::string resource_key;
+
+	Resource() { ref_count = 0; state = RESOURCE_READY; registry = NULL; }
+	Resource(const Resource& res) : Resource() { state.store(res.state.load()); } //copies are not registered
+	virtual ~Resource();
+	void operator = (const Resource& res) { state.store(res.state.load()); }
+
+	void addRef() { ref_count.fetch_add(1); }
+	void release();
+
+	bool isReady() const { return state == RESOURCE_READY; }
+	bool isLoading() const { return state == RESOURCE_LOADING; }
+	bool hasFailed() const { return state == RESOURCE_FAILED; }
+
+	//destroys the registered resources that are no longer referenced, must be called from the main thread
+	static int processPendingDestruction();
+	static bool isMainThread() { return std::this_thread::get_id() == main_thread_id; }
+	static std::thread::id main_thread_id;
+};
+
+class ResourceRegistryBase
+{
+public:
+	virtual ~ResourceRegistryBase() {}
+	enum eDestroyResult { KEPT, DESTROYED, DEFERRED };
+
+	virtual void unregister(Resource* res) = 0;
+	virtual eDestroyResult destroyIfUnused(const std::string& key, Resource* res) = 0;
+};
+
+//Name -> resource map split in shards with their own mutex, so threads loading different
+//assets rarely wait for each other. The key is hashed once to pick the shard.
+template<typename T> class ResourceRegistry : public ResourceRegistryBase
+{
+public:
+	static const int NUM_SHARDS = 16;
+
+	struct sShard {
+		std::mutex mutex;
+		std::unordered_map<std::string, T*> items;
+	};
+	sShard shards[NUM_SHARDS];
+
+	sShard& getShard(const std::string& key) { return shards[(std::hash<std::string>()(key) >> 4) % NUM_SHARDS]; }
+
+	//returns NULL if not found
+	T* find(const std::string& key)
+	{
+		sShard& shard = getShard(key);
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		auto it = shard.items.find(key);
+		return it != shard.items.end() ? it->second : NULL;
+	}
+
+	//registers res, if another one was registered with the same key first it returns that one instead
+	T* add(const std::string& key, T* res)
+	{
+		assert(res);
+		sShard& shard = getShard(key);
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		auto it = shard.items.find(key);
+		if (it != shard.items.end() && it->second != res)
+			return it->second;
+		if (res->registry && (res->registry != this || res->resource_key != key))
+			res->registry->unregister(res); //renamed
+		shard.items[key] = res;
+		res->registry = this;
+		res->resource_key = key;
+		return res;
+	}
+
+	void unregister(Resource* res)
+	{
+		if (res->registry != this)
+			return;
+		sShard& shard = getShard(res->resource_key);
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		auto it = shard.items.find(res->resource_key);
+		if (it != shard.items.end() && it->second == res)
+			shard.items.erase(it);
+		res->registry = NULL;
+	}
+
+	//called with the keys queued by Resource::release
+	eDestroyResult destroyIfUnused(const std::string& key, Resource* res)
+	{
+		{
+			sShard& shard = getShard(key);
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			auto it = shard.items.find(key);
+			if (it == shard.items.end() || it->second != res || res->ref_count > 0)
+				return KEPT; //already destroyed or referenced again
+			if (res->isLoading())
+				return DEFERRED; //the loader may still write to it
+			shard.items.erase(it);
+			res->registry = NULL;
+		}
+		delete res;
+		return DESTROYED;
+	}
+
+	std::vector<T*> getAll()
+	{
+		std::vector<T*> result;
+		for (int i = 0; i < NUM_SHARDS; ++i)
+		{
+			std::lock_guard<std::mutex> lock(shards[i].mutex);
+			for (auto& it : shards[i].items)
+				result.push_back(it.second);
+		}
+		return result;
+	}
+
+	size_t size()
+	{
+		size_t num = 0;
+		for (int i = 0; i < NUM_SHARDS; ++i)
+		{
+			std::lock_guard<std::mutex> lock(shards[i].mutex);
+			num += shards[i].items.size();
+		}
+		return num;
+	}
+
+	//deletes all the resources, referenced or not (used at exit)
+	void releaseAll()
+	{
+		std::vector<T*> all = getAll();
+		for (T* res : all)
+		{
+			unregister(res);
+			delete res;
+		}
+	}
+};
+
+//Reference to a resource, it can be used like a pointer. It can be polled with isReady
+//or waited for if the resource is still loading in another thread.
+template<typename T> class Handle
+{
+public:
+	T* ptr;
+
+	Handle() { ptr = NULL; }
+	Handle(T* res) { ptr = res; if (ptr) ptr->addRef(); }
+	Handle(const Handle& h) : Handle(h.ptr) {}
+	Handle(Handle&& h) { ptr = h.ptr; h.ptr = NULL; }
+	~Handle() { if (ptr) ptr->release(); }
+
+	Handle& operator = (T* res) {
+		if (res) res->addRef(); //before releasing in case it is the same
+		if (ptr) ptr->release();
+		ptr = res;
+		return *this;
+	}
+	Handle& operator = (const Handle& h) { return *this = h.ptr; }
+
+	T* get() const { return ptr; }
+	T* operator -> () const { return ptr; }
+	operator T* () const { return ptr; }
+
+	bool isReady() const { return ptr && ptr->isReady(); }
+
+	//blocks till it is loaded (or failed), in the main thread it keeps executing foreground tasks meanwhile
+	T* wait() const;
+};
+
+void waitForResource(Resource* res);
+
+template<typename T> T* Handle<T>::wait() const
+{
+	if (ptr)
+		waitForResource(ptr);
+	return ptr;
+}
@@ -3,7 +3,15 @@
 
 #include "prefab.h"
 #include "light.h"
+#include "texture.h"
+#include "fbo.h"
+#include "environment.h"
+#include "scene_bvh.h"
+#include "mesh.h"
+#include "animation.h"
 #include "extra/cJSON.h"
+
+#include <algorithm>
   
 
 GTR::Scene* GTR::Scene::instance = NULL;
@@ -13,6 +21,8 @@ GTR::Scene::Scene()
 	instance = this;
 	// Start with singlepass
 	typeOfRender = Scene::eRenderPipeline::MULTIPASS;
+	environment = NULL;
+	bvh = NULL;
 }
 
 void GTR::Scene::clear()
@@ -23,6 +33,9 @@ void GTR::Scene::clear()
 		delete ent;
 	}
 	entities.resize(0);
+	broadphase.clear();
+	if (bvh)
+		bvh->clear();
 }
 
 void GTR::Scene::addEntity(BaseEntity* entity)
@@ -30,6 +43,85 @@ void GTR::Scene::addEntity(BaseEntity* entity)
 	entities.push_back(entity); entity->scene = this;
 }
 
+void GTR::Scene::updateBroadphase()
+{
+	for (int i = 0; i < entities.size(); ++i)
+	{
+		BaseEntity* ent = entities[i];
+		BoundingBox box;
+		if (!ent->getWorldBounds(box))
+		{
+			if (ent->broadphase_proxy != -1)
+				broadphase.destroyProxy(ent->broadphase_proxy);
+			ent->broadphase_proxy = -1;
+			continue;
+		}
+
+		Vector3 min = box.center - box.halfsize;
+		Vector3 max = box.center + box.halfsize;
+		if (ent->broadphase_proxy == -1)
+			ent->broadphase_proxy = broadphase.createProxy(min, max, ent);
+		else
+			broadphase.moveProxy(ent->broadphase_proxy, min, max, box.center - ent->broadphase_center);
+		ent->broadphase_center = box.center;
+	}
+}
+
+void GTR::Scene::findEntities(const Vector3& min, const Vector3& max, std::vector<BaseEntity*>& result)
+{
+	broadphase.query(min, max, [&](int proxy) { result.push_back((BaseEntity*)broadphase.getUserData(proxy)); return true; });
+}
+
+void GTR::Scene::findEntities(const Vector3& center, float radius, std::vector<BaseEntity*>& result)
+{
+	std::vector<int> proxies;
+	broadphase.querySphere(center, radius, proxies);
+	for (int i = 0; i < proxies.size(); ++i)
+		result.push_back((BaseEntity*)broadphase.getUserData(proxies[i]));
+}
+
+void GTR::Scene::updateBVH()
+{
+	if (!bvh)
+		bvh = new SceneBVH();
+	bvh->update(this);
+}
+
+bool GTR::Scene::testRay(const Ray& ray, SceneHit& hit, float max_distance, int layers)
+{
+	if (!bvh)
+		updateBVH();
+	return bvh->testRay(ray, max_distance, hit, layers);
+}
+
+int GTR::Scene::testRays(const Ray* rays, int num_rays, SceneHit* hits, float max_distance, int layers)
+{
+	if (!bvh)
+		updateBVH();
+	return bvh->testRays(rays, num_rays, max_distance, hits, layers);
+}
+
+void GTR::Scene::overlapSphere(const Vector3& center, float radius, std::vector<SceneHit>& result, int layers)
+{
+	if (!bvh)
+		updateBVH();
+	bvh->overlapSphere(center, radius, result, layers);
+}
+
+void GTR::Scene::overlapBox(const Vector3& min, const Vector3& max, std::vector<SceneHit>& result, int layers)
+{
+	if (!bvh)
+		updateBVH();
+	bvh->overlapBox(min, max, result, layers);
+}
+
+bool GTR::Scene::closestPoint(const Vector3& point, SceneHit& hit, float max_distance, int layers)
+{
+	if (!bvh)
+		updateBVH();
+	return bvh->closestPoint(point, max_distance, hit, layers);
+}
+
 bool GTR::Scene::load(const char* filename)
 {
 	std::string content;
@@ -58,6 +150,11 @@ bool GTR::Scene::load(const char* filename)
 	main_camera.center = readJSONVector3(json, "camera_target", main_camera.center);
 	main_camera.fov = readJSONNumber(json, "camera_fov", main_camera.fov);
 
+	//it is prefiltered in the background, the reflections are skipped till it is ready
+	environment_filename = readJSONString(json, "environment", "");
+	if (environment_filename.size())
+		environment = GetPrefilteredEnvironmentAsync((std::string("data/") + environment_filename).c_str());
+
 	//entities
 	cJSON* entities_json = cJSON_GetObjectItemCaseSensitive(json, "entities");
 	cJSON* entity_json;
@@ -149,6 +246,15 @@ GTR::BaseEntity* GTR::Scene::createEntity(std::string type)
 	if (type == "LIGHT")
 		return new GTR::LightEntity();
 
+	if (type == "IRRADIANCE_VOLUME")
+		return new GTR::IrradianceEntity();
+
+	if (type == "REFLECTION_PROBE")
+		return new GTR::ReflectionProbeEntity();
+
+	if (type == "CROWD")
+		return new GTR::CrowdEntity();
+
 	return NULL;
 }
 
@@ -174,10 +280,18 @@ void GTR::PrefabEntity::configure(cJSON* json)
 	if (cJSON_GetObjectItem(json, "filename"))
 	{
 		filename = cJSON_GetObjectItem(json, "filename")->valuestring;
-		prefab = GTR::Prefab::Get( (std::string("data/") + filename).c_str());
+		prefab = GTR::Prefab::GetAsync( (std::string("data/") + filename).c_str());
 	}
 }
 
+bool GTR::PrefabEntity::getWorldBounds(BoundingBox& box)
+{
+	if (!prefab || !prefab->isReady())
+		return false;
+	box = transformBoundingBox(model, prefab->bounding);
+	return true;
+}
+
 void GTR::PrefabEntity::renderInMenu()
 {
 	BaseEntity::renderInMenu();
@@ -250,6 +364,15 @@ void GTR::LightEntity::renderInMenu() {
 
 }
 
+bool GTR::LightEntity::getWorldBounds(BoundingBox& box)
+{
+	if (light_type != eTypeOfLight::POINT && light_type != eTypeOfLight::SPOT)
+		return false;
+	box.center = model.getTranslation();
+	box.halfsize.set(max_distance, max_distance, max_distance);
+	return true;
+}
+
 void GTR::LightEntity::configure(cJSON* json)
 {
 	// Read parameters
@@ -272,3 +395,379 @@ void GTR::LightEntity::configure(cJSON* json)
 	cast_shadows = readJSONBool(json, "cast_shadows", false);
 	shadow_bias = readJSONNumber(json, "shadow_bias", shadow_bias);
 }
+
+//header of the binary with the baked probes, followed by the 9 coefficients (Vector3) of every probe
+struct sIrradianceHeader {
+	char magic[4]; //"IRRV"
+	int version;
+	int dims[3];
+	float start[3];
+	float delta[3];
+	int num_coeffs;
+};
+
+#define IRRADIANCE_FILE_VERSION 1
+
+GTR::IrradianceEntity::IrradianceEntity()
+{
+	entity_type = IRRADIANCE_VOLUME;
+	size.set(100, 100, 100);
+	dims[0] = dims[1] = dims[2] = 2;
+	probe_resolution = 64;
+	texture = NULL;
+	must_bake = true;
+	bake_time = 0;
+}
+
+GTR::IrradianceEntity::~IrradianceEntity()
+{
+	delete texture;
+}
+
+Vector3 GTR::IrradianceEntity::getDelta()
+{
+	//a single probe in one axis has no distance to the next one
+	return Vector3(dims[0] > 1 ? size.x / (dims[0] - 1) : 1.0f,
+		dims[1] > 1 ? size.y / (dims[1] - 1) : 1.0f,
+		dims[2] > 1 ? size.z / (dims[2] - 1) : 1.0f);
+}
+
+Vector3 GTR::IrradianceEntity::getProbePosition(int x, int y, int z)
+{
+	Vector3 delta = getDelta();
+	return getStart() + Vector3(x * delta.x, y * delta.y, z * delta.z);
+}
+
+//only accepted if it was baked for the same grid, otherwise it has to be baked again
+bool GTR::IrradianceEntity::load(const char* filename)
+{
+	FILE* file = fopen(filename, "rb");
+	if (!file)
+		return false;
+
+	sIrradianceHeader header;
+	Vector3 start = getStart();
+	Vector3 delta = getDelta();
+	bool valid = fread(&header, sizeof(header), 1, file) == 1 && memcmp(header.magic, "IRRV", 4) == 0 &&
+		header.version == IRRADIANCE_FILE_VERSION && header.num_coeffs == 9 &&
+		header.dims[0] == dims[0] && header.dims[1] == dims[1] && header.dims[2] == dims[2] &&
+		start.distance(Vector3(header.start[0], header.start[1], header.start[2])) < 0.01f &&
+		delta.distance(Vector3(header.delta[0], header.delta[1], header.delta[2])) < 0.01f;
+
+	std::vector<SphericalHarmonics> loaded(valid ? getNumProbes() : 0);
+	for (int i = 0; i < (int)loaded.size() && valid; ++i)
+		valid = fread(loaded[i].coeffs, sizeof(Vector3) * 9, 1, file) == 1;
+	fclose(file);
+
+	if (!valid)
+	{
+		std::cout << " - Irradiance file does not match the grid: " << filename << std::endl;
+		return false;
+	}
+	probes.swap(loaded);
+	must_bake = false;
+	delete texture; //uploaded again by the renderer
+	texture = NULL;
+	return true;
+}
+
+bool GTR::IrradianceEntity::save(const char* filename)
+{
+	assert(probes.size() == getNumProbes());
+	FILE* file = fopen(filename, "wb");
+	if (!file)
+		return false;
+
+	sIrradianceHeader header;
+	memcpy(header.magic, "IRRV", 4);
+	header.version = IRRADIANCE_FILE_VERSION;
+	Vector3 start = getStart();
+	Vector3 delta = getDelta();
+	for (int i = 0; i < 3; ++i)
+	{
+		header.dims[i] = dims[i];
+		header.start[i] = start.v[i];
+		header.delta[i] = delta.v[i];
+	}
+	header.num_coeffs = 9;
+	fwrite(&header, sizeof(header), 1, file);
+	for (SphericalHarmonics& probe : probes)
+		fwrite(probe.coeffs, sizeof(Vector3) * 9, 1, file);
+	fclose(file);
+	return true;
+}
+
+//the coefficient i of the probe (x,y,z) goes to the texel (x, y, z + i * dims[2]), so the trilinear filter
+//interpolates the neighbour probes without mixing coefficients. They are convolved with the cosine lobe and
+//divided by PI, the shader only has to evaluate the basis with the normal
+void GTR::IrradianceEntity::uploadToTexture()
+{
+	const float band_weights[9] = { 1.0f, 2.0f / 3.0f, 2.0f / 3.0f, 2.0f / 3.0f, 0.25f, 0.25f, 0.25f, 0.25f, 0.25f };
+	std::vector<Vector3> data(getNumProbes() * 9);
+	for (int z = 0; z < dims[2]; ++z)
+		for (int y = 0; y < dims[1]; ++y)
+			for (int x = 0; x < dims[0]; ++x)
+			{
+				SphericalHarmonics& probe = probes[x + (y + z * dims[1]) * dims[0]];
+				for (int i = 0; i < 9; ++i)
+					data[x + (y + (z + i * dims[2]) * dims[1]) * dims[0]] = probe.coeffs[i] * band_weights[i];
+			}
+
+	if (!texture)
+		texture = new Texture();
+	texture->create3D(dims[0], dims[1], dims[2] * 9, GL_RGB, GL_FLOAT, false, (Uint8*)&data[0], GL_RGB32F);
+}
+
+void GTR::IrradianceEntity::renderInMenu()
+{
+	BaseEntity::renderInMenu();
+
+#ifndef SKIP_IMGUI
+	ImGui::Text("filename: %s", filename.c_str());
+	ImGui::Text("Probes: %d x %d x %d  Resolution: %d", dims[0], dims[1], dims[2], probe_resolution);
+	ImGui::Text("Bake time: %.2f s", bake_time);
+	if (ImGui::Button("Bake"))
+		must_bake = true;
+#endif
+}
+
+void GTR::IrradianceEntity::configure(cJSON* json)
+{
+	size = readJSONVector3(json, "size", size);
+	std::vector<float> values;
+	if (readJSONVector(json, "dimensions", values) && values.size() == 3)
+		for (int i = 0; i < 3; ++i)
+			dims[i] = std::max((int)values[i], 1);
+	probe_resolution = (int)readJSONNumber(json, "probe_resolution", (float)probe_resolution);
+	filename = readJSONString(json, "filename", "");
+
+	//the renderer bakes it if there is no valid file
+	if (filename.size())
+		load((std::string("data/") + filename).c_str());
+}
+
+GTR::ReflectionProbeEntity::ReflectionProbeEntity()
+{
+	entity_type = REFLECTION_PROBE;
+	resolution = 128;
+	dynamic = false;
+	texture = NULL;
+	fbo = NULL;
+	must_capture = true;
+	must_prefilter = false;
+	has_ggx_levels = false;
+	next_face = 0;
+	capture_time = 0;
+}
+
+struct GTR::ReflectionProbeEntity::sPrefilter {
+	PrefilteredCubemap cubemap;
+	std::atomic<bool> done;
+	sPrefilter() { done = false; }
+};
+
+GTR::ReflectionProbeEntity::~ReflectionProbeEntity()
+{
+	delete fbo;
+	delete texture;
+}
+
+//the same roughness levels as the environment, the small mips are too blurry
+int GTR::ReflectionProbeEntity::getNumLevels()
+{
+	return std::min(IBL_NUM_LEVELS, (int)log2(resolution) + 1);
+}
+
+void GTR::ReflectionProbeEntity::createTexture()
+{
+	if (!texture)
+		texture = new Texture();
+	glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+	texture->createCubemap(resolution, resolution, NULL, GL_RGB, GL_FLOAT, true, GL_RGB16F);
+	glBindTexture(GL_TEXTURE_CUBE_MAP, texture->texture_id);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, getNumLevels() - 1);
+	glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+	texture->generateMipmaps();
+	texture->mipmaps = true;
+}
+
+
+//the levels are stored like a prefiltered environment, the texture is created again with the size of the file
+bool GTR::ReflectionProbeEntity::load(const char* filename)
+{
+	PrefilteredCubemap cubemap;
+	if (!cubemap.load(filename))
+		return false;
+	if (!texture)
+		texture = new Texture();
+	resolution = cubemap.size;
+	cubemap.upload(texture);
+	must_capture = false;
+	has_ggx_levels = true;
+	return true;
+}
+
+//the same GGX prefilter as the environment, once per complete capture. It is too slow for the main thread, the first
+//time the levels are box filtered till it ends (the rough reflections would be black)
+bool GTR::ReflectionProbeEntity::prefilter(const std::string& save_filename)
+{
+	assert(texture && texture->texture_id);
+	if (prefiltering)
+		return false;
+
+	std::shared_ptr<sPrefilter> task = std::make_shared<sPrefilter>();
+	std::vector< std::vector<float> > first_level(6);
+	glBindTexture(GL_TEXTURE_CUBE_MAP, texture->texture_id);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	for (int j = 0; j < 6; ++j)
+	{
+		first_level[j].resize(resolution * resolution * 3);
+		glGetTexImage(GL_TEXTURE_CUBE_MAP_POSITIVE_X + j, 0, GL_RGB, GL_FLOAT, &first_level[j][0]);
+	}
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	if (!has_ggx_levels)
+		texture->generateMipmaps();
+	glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+
+	prefiltering = task;
+	int size = resolution;
+	TaskManager::background.addTask(new Task([task, size, first_level, save_filename]() mutable {
+		task->cubemap.prefilter(size, first_level);
+		if (save_filename.size() && !task->cubemap.save(save_filename.c_str()))
+			std::cout << " - Cannot save reflection probe: " << save_filename << std::endl;
+		task->done = true;
+	}));
+	return true;
+}
+
+void GTR::ReflectionProbeEntity::uploadLevels()
+{
+	if (!prefiltering || !prefiltering->done)
+		return;
+	//the first level may have newer faces already
+	if (texture && prefiltering->cubemap.size == resolution)
+	{
+		prefiltering->cubemap.upload(texture, 1);
+		has_ggx_levels = true;
+	}
+	prefiltering.reset();
+}
+
+void GTR::ReflectionProbeEntity::renderInMenu()
+{
+	BaseEntity::renderInMenu();
+
+#ifndef SKIP_IMGUI
+	ImGui::Text("filename: %s", filename.c_str());
+	ImGui::Text("Resolution: %d  Capture time: %.2f ms", resolution, capture_time * 1000.0f);
+	ImGui::Checkbox("Dynamic", &dynamic);
+	if (!dynamic && ImGui::Button("Capture"))
+		must_capture = true;
+#endif
+}
+
+void GTR::ReflectionProbeEntity::configure(cJSON* json)
+{
+	resolution = (int)readJSONNumber(json, "resolution", (float)resolution);
+	dynamic = readJSONBool(json, "dynamic", dynamic);
+	filename = readJSONString(json, "filename", "");
+	//the texture and the file are loaded by the renderer, they need the main thread
+}
+
+// --- Crowds ---
+
+GTR::CrowdEntity::CrowdEntity()
+{
+	entity_type = CROWD;
+	rows = columns = 4;
+	spacing = 20;
+	speed = 1;
+	animation = NULL;
+	material = new Material();
+	crowd = new Crowd();
+	instances = new SkinnedInstances();
+	reach = 0;
+}
+
+GTR::CrowdEntity::~CrowdEntity()
+{
+	delete instances;
+	delete crowd;
+	delete material;
+}
+
+//out of phase so they don't move together
+void GTR::CrowdEntity::createCharacters()
+{
+	crowd->clear();
+	for (int i = 0; i < rows * columns; ++i)
+		crowd->addCharacter(mesh, animation, i * 0.37f);
+
+	//the bones can turn the mesh around the origin of the character, but not take it further
+	reach = (float)(mesh->box.center.length() + mesh->box.halfsize.length());
+}
+
+Matrix44 GTR::CrowdEntity::getCharacterModel(int index)
+{
+	Matrix44 offset;
+	offset.setTranslation((index % columns) * spacing, 0.0f, (index / columns) * spacing);
+	return offset * model;
+}
+
+void GTR::CrowdEntity::renderInMenu()
+{
+	BaseEntity::renderInMenu();
+
+#ifndef SKIP_IMGUI
+	ImGui::Text("Mesh: %s  Animation: %s", mesh_filename.c_str(), animation_filename.c_str());
+	ImGui::Text("Characters: %d  Bone matrices: %d", (int)crowd->characters.size(), (int)crowd->bone_matrices.size());
+	ImGui::SliderFloat("Speed", &speed, 0.0f, 4.0f);
+	ImGui::ColorEdit3("Color", material->color.v);
+#endif
+}
+
+void GTR::CrowdEntity::configure(cJSON* json)
+{
+	rows = std::max((int)readJSONNumber(json, "rows", (float)rows), 1);
+	columns = std::max((int)readJSONNumber(json, "columns", (float)columns), 1);
+	spacing = readJSONNumber(json, "spacing", spacing);
+	speed = readJSONNumber(json, "speed", speed);
+	Vector3 color = readJSONVector3(json, "color", Vector3(1, 1, 1));
+	material->color.set(color.x, color.y, color.z, 1.0f);
+	material->roughness_factor = readJSONNumber(json, "roughness", material->roughness_factor);
+
+	mesh_filename = readJSONString(json, "mesh", "");
+	animation_filename = readJSONString(json, "animation", "");
+	if (mesh_filename.size() && animation_filename.size())
+	{
+		mesh = Mesh::Get((std::string("data/") + mesh_filename).c_str(), false);
+		animation = Animation::Get((std::string("data/") + animation_filename).c_str());
+	}
+	if (!mesh || !animation)
+	{
+		std::cout << " - Crowd without mesh or animation: " << name << std::endl;
+		return;
+	}
+	createCharacters();
+}
+
+void GTR::CrowdEntity::update(float elapsed_time)
+{
+	if (!visible || !crowd->characters.size())
+		return;
+	for (int i = 0; i < (int)crowd->characters.size(); ++i)
+		crowd->characters[i].model = getCharacterModel(i);
+	crowd->updatePalette(elapsed_time * speed);
+	crowd->getInstances(mesh, *instances);
+}
+
+bool GTR::CrowdEntity::getWorldBounds(BoundingBox& box)
+{
+	if (!crowd->characters.size())
+		return false;
+	BoundingBox grid;
+	grid.center.set((columns - 1) * spacing * 0.5f, 0.0f, (rows - 1) * spacing * 0.5f);
+	grid.halfsize = grid.center + Vector3(reach, reach, reach);
+	box = transformBoundingBox(model, grid);
+	return true;
+}
@@ -4,12 +4,20 @@
 #include "framework.h"
 #include "camera.h"
 #include "material.h"
+#include "resource.h"
+#include "sphericalharmonics.h"
+#include "aabb_tree.h"
 #include <string>
+#include <memory>
 
 //forward declaration
 class cJSON; 
 class FBO;
 class Texture;
+class Mesh;
+class Animation;
+class Crowd;
+class SkinnedInstances;
 
 //our namespace
 namespace GTR {
@@ -19,13 +27,17 @@ namespace GTR {
 		LIGHT = 2,
 		CAMERA = 3,
 		REFLECTION_PROBE = 4,
-		DECALL = 5
+		DECALL = 5,
+		IRRADIANCE_VOLUME = 6,
+		CROWD = 7
 	};
 
 	class Scene;
 	class Prefab;
 	//class Light;
 	class Node;
+	class SceneBVH;
+	struct SceneHit;
 
 	//represents one element of the scene (could be lights, prefabs, cameras, etc)
 	class BaseEntity
@@ -37,11 +49,16 @@ namespace GTR {
 		Matrix44 model;
 		bool visible;
 
-		BaseEntity() { entity_type = NONE; visible = true; }
+		int broadphase_proxy;		// in Scene::broadphase, -1 if it is not there
+		Vector3 broadphase_center;	// of the bounds in the last update, to know how much it moved
+
+		BaseEntity() { entity_type = NONE; visible = true; broadphase_proxy = -1; }
 		virtual ~BaseEntity() {}
 
 		virtual void renderInMenu();
 		virtual void configure(cJSON* json) {}
+		virtual void update(float elapsed_time) {} // once per frame from the main thread
+		virtual bool getWorldBounds(BoundingBox& box) { return false; } // false if it has no volume
 	};
 
 	//represents one prefab in the scene
@@ -49,11 +66,12 @@ namespace GTR {
 	{
 	public:
 		std::string filename;
-		Prefab* prefab;
+		Handle<Prefab> prefab;
 		
 		PrefabEntity();
 		virtual void renderInMenu();
 		virtual void configure(cJSON* json);
+		virtual bool getWorldBounds(BoundingBox& box);
 	};
 
 	// represent a light in the scene
@@ -86,10 +104,105 @@ namespace GTR {
 
 		LightEntity();
 
+		virtual void renderInMenu();
+		virtual void configure(cJSON* json);
+		virtual bool getWorldBounds(BoundingBox& box); // the sphere it reaches, the directional ones have none
+	};
+
+	// grid of probes with the irradiance that reaches them, baked from the scene and interpolated by the shaders
+	class IrradianceEntity : public GTR::BaseEntity {
+	public:
+		std::string filename;	// binary with the baked probes, so they are not baked again
+		Vector3 size;			// extent of the grid, it starts at the entity position
+		int dims[3];			// probes in every axis
+		int probe_resolution;	// size of the cubemap faces captured for every probe
+
+		std::vector<SphericalHarmonics> probes; // x first, then y and z
+		Texture* texture;		// 3D with the 9 coefficients of the probes stacked in z
+		bool must_bake;			// no valid file, baked by the renderer once the scene is loaded
+		float bake_time;		// in seconds
+
+		IrradianceEntity();
+		virtual ~IrradianceEntity();
+
+		int getNumProbes() { return dims[0] * dims[1] * dims[2]; }
+		Vector3 getStart() { return model.getTranslation(); }
+		Vector3 getDelta(); // distance between probes
+		Vector3 getProbePosition(int x, int y, int z);
+
+		bool load(const char* filename);
+		bool save(const char* filename);
+		void uploadToTexture();
+
 		virtual void renderInMenu();
 		virtual void configure(cJSON* json);
 	};
 
+	// captures the scene around it in a cubemap, the render calls use the closest one for their reflections
+	class ReflectionProbeEntity : public GTR::BaseEntity {
+	public:
+		std::string filename;	// cache of the static probes, so they are not captured again
+		int resolution;			// size of the cubemap faces
+		bool dynamic;			// captured again continuously, one face at a time by the renderer
+
+		Texture* texture;		// cubemap with the GGX levels for the rough reflections, like the environment (NULL till it is created)
+		FBO* fbo;				// to render to the faces
+		bool must_capture;		// all the faces have to be captured (the first time or the static probes without a valid file)
+		bool must_prefilter;	// a capture was completed, its levels have to be prefiltered
+		bool has_ggx_levels;	// false till the first prefilter is uploaded (the levels are box filtered meanwhile)
+		int next_face;			// the next face a dynamic probe updates
+		float capture_time;		// of the last complete capture, in seconds
+
+		struct sPrefilter;
+		std::shared_ptr<sPrefilter> prefiltering; // shared with the background thread, the probe can be deleted before it ends
+
+		ReflectionProbeEntity();
+		virtual ~ReflectionProbeEntity();
+
+		Vector3 getPosition() { return model.getTranslation(); }
+		int getNumLevels(); // mips read by the shader
+		void createTexture();
+
+		// only from the main thread, the faces are read from or uploaded to the texture
+		bool load(const char* filename);
+		// the first level is read back and prefiltered in the background thread (saved there if there is a filename),
+		// false if the previous one is still busy
+		bool prefilter(const std::string& save_filename);
+		void uploadLevels(); // those of the last prefilter once it ends, the texture keeps the previous ones meanwhile
+
+		virtual void renderInMenu();
+		virtual void configure(cJSON* json);
+	};
+
+	// a grid of skinned characters playing the same animation out of phase, posed by the workers into the bone palette
+	// and drawn in one instanced call
+	class CrowdEntity : public GTR::BaseEntity {
+	public:
+		std::string mesh_filename;
+		std::string animation_filename;
+		int rows, columns;		// of the grid, it starts at the entity position
+		float spacing;			// between the characters
+		float speed;			// of the animation
+
+		Handle<Mesh> mesh;
+		Animation* animation;
+		Material* material;
+		Crowd* crowd;
+		SkinnedInstances* instances; // of the last update, ready for the renderer
+		float reach;			// from the origin of a character, for the bounds
+
+		CrowdEntity();
+		virtual ~CrowdEntity();
+
+		void createCharacters();
+		Matrix44 getCharacterModel(int index);
+
+		virtual void renderInMenu();
+		virtual void configure(cJSON* json);
+		virtual void update(float elapsed_time);
+		virtual bool getWorldBounds(BoundingBox& box);
+	};
+
 	//contains all entities of the scene
 	class Scene
 	{
@@ -105,6 +218,9 @@ namespace GTR {
 		Vector3 ambient_light;
 		Camera main_camera;
 
+		std::string environment_filename;
+		Texture* environment; //prefiltered cubemap for the reflections, NULL if there is none
+
 		int typeOfRender;
 
 		Scene();
@@ -118,6 +234,21 @@ namespace GTR {
 
 		bool load(const char* filename);
 		BaseEntity* createEntity(std::string type);
+
+		// bounds of the entities kept across frames, for the questions about what is near something
+		AABBTree broadphase;
+		void updateBroadphase(); // once per frame after moving the entities, only the ones that left their fat box move in the tree
+		void findEntities(const Vector3& min, const Vector3& max, std::vector<BaseEntity*>& result);
+		void findEntities(const Vector3& center, float radius, std::vector<BaseEntity*>& result);
+
+		// queries against the meshes of the prefabs (see scene_bvh.h), the tree is built by the first update
+		SceneBVH* bvh;
+		void updateBVH(); // once per frame after moving the entities, before the queries
+		bool testRay(const Ray& ray, SceneHit& hit, float max_distance = 3.4e+38F, int layers = 0xFF);
+		int testRays(const Ray* rays, int num_rays, SceneHit* hits, float max_distance = 3.4e+38F, int layers = 0xFF); // on the workers
+		void overlapSphere(const Vector3& center, float radius, std::vector<SceneHit>& result, int layers = 0xFF);
+		void overlapBox(const Vector3& min, const Vector3& max, std::vector<SceneHit>& result, int layers = 0xFF);
+		bool closestPoint(const Vector3& point, SceneHit& hit, float max_distance = 3.4e+38F, int layers = 0xFF);
 	};
 };
 
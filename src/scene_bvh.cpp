@@ -0,0 +1,436 @@
+#include "scene_bvh.h"
+#include "scene.h"
+#include "prefab.h"
+#include "mesh.h"
+#include "simd.h"
+#include "task.h"
+
+#include <cassert>
+#include <cfloat>
+#include <algorithm>
+
+float GTR::SceneBVH::rebuild_factor = 2.0f;
+
+//half the area of a box, only compared
+static float boxArea(const float* min, const float* max)
+{
+	float x = max[0] - min[0], y = max[1] - min[1], z = max[2] - min[2];
+	return x * y + y * z + z * x;
+}
+
+static void setNodeBounds(MeshBVH::Node& node, const Vector3& min, const Vector3& max)
+{
+	for (int k = 0; k < 3; ++k)
+	{
+		node.min[k] = min.v[k];
+		node.max[k] = max.v[k];
+	}
+}
+
+static void mergeNodeBounds(MeshBVH::Node& node, const float* min, const float* max)
+{
+	for (int k = 0; k < 3; ++k)
+	{
+		node.min[k] = std::min(node.min[k], min[k]);
+		node.max[k] = std::max(node.max[k], max[k]);
+	}
+}
+
+//squared distance from p to the box, 0 inside
+static float boxDistance2(const float* min, const float* max, const Vector3& p)
+{
+	float distance = 0.0f;
+	for (int k = 0; k < 3; ++k)
+	{
+		float d = std::max(std::max(min[k] - p.v[k], p.v[k] - max[k]), 0.0f);
+		distance += d * d;
+	}
+	return distance;
+}
+
+void GTR::SceneBVH::clear()
+{
+	instances.clear();
+	nodes.clear();
+	leaf_instances.clear();
+	built_area = 0.0f;
+}
+
+void GTR::SceneBVH::update(Scene* scene)
+{
+	//the instances are compared with the ones of the last update in the same order: if they are the same nodes with
+	//the same meshes only the ones that moved are updated and the tree is refitted, otherwise it is built again
+	bool changed = false;
+	bool moved = false;
+	int num = 0;
+	for (int e = 0; e < scene->entities.size(); ++e)
+	{
+		BaseEntity* ent = scene->entities[e];
+		if (ent->entity_type != PREFAB)
+			continue;
+		PrefabEntity* pent = (PrefabEntity*)ent;
+		Prefab* prefab = pent->prefab;
+		if (!prefab || !prefab->isReady())
+			continue;
+
+		NodeHierarchy& hierarchy = prefab->hierarchy;
+		if (!hierarchy.size()) // not built by the loader
+			hierarchy.build(&prefab->root);
+		hierarchy.update();
+
+		int hidden_end = 0; //a hidden node hides its subtree
+		for (int i = 0; i < hierarchy.size(); ++i)
+		{
+			Node* node = hierarchy.nodes[i];
+			if (!node->visible)
+				hidden_end = std::max(hidden_end, hierarchy.subtree_end[i]);
+			Mesh* mesh = node->mesh;
+			if (!mesh || !mesh->getNumVertices())
+				continue;
+
+			if (num == instances.size())
+				instances.resize(num + 1);
+			SceneInstance& instance = instances[num++];
+			if (instance.entity != pent || instance.node != node || instance.mesh != mesh || instance.mesh_revision != mesh->revision)
+			{
+				changed = true;
+				instance.entity = pent;
+				instance.node = node;
+				instance.mesh = mesh;
+				instance.mesh_revision = mesh->revision;
+				instance.model.m[15] = 0.0f; //so it is computed below
+			}
+			instance.layers = node->layers;
+			instance.visible = ent->visible && i >= hidden_end;
+
+			Matrix44 model = hierarchy.globals[i] * ent->model;
+			if (memcmp(model.m, instance.model.m, sizeof(model.m)) == 0)
+				continue;
+			moved = true;
+			instance.model = model;
+			instance.inverse_model = model;
+			instance.inverse_model.affineInverse();
+			instance.min_scale = std::min(std::min(model.rotateVector(Vector3(1, 0, 0)).length(), model.rotateVector(Vector3(0, 1, 0)).length()), model.rotateVector(Vector3(0, 0, 1)).length());
+			BoundingBox box = transformBoundingBox(model, mesh->box);
+			instance.min = box.center - box.halfsize;
+			instance.max = box.center + box.halfsize;
+		}
+	}
+	if (num != instances.size())
+	{
+		changed = true;
+		instances.resize(num);
+	}
+
+	if (changed)
+		build();
+	else if (moved)
+		refit();
+}
+
+void GTR::SceneBVH::build()
+{
+	num_rebuilds++;
+	nodes.clear();
+	leaf_instances.clear();
+	built_area = 0.0f;
+	if (instances.empty())
+		return;
+
+	std::vector<Vector3> bounds(instances.size() * 2);
+	for (int i = 0; i < instances.size(); ++i)
+	{
+		bounds[i * 2] = instances[i].min;
+		bounds[i * 2 + 1] = instances[i].max;
+	}
+	//one instance per leaf, testing one costs much more than a node
+	MeshBVH::buildNodes(&bounds[0], (int)instances.size(), 1, nodes, leaf_instances);
+	built_area = boxArea(nodes[0].min, nodes[0].max);
+
+	//the trees of the meshes are built now by the workers, so the queries (maybe from several threads) never build them
+	std::vector<Mesh*> meshes;
+	for (int i = 0; i < instances.size(); ++i)
+		if (!instances[i].mesh->bvh)
+			meshes.push_back(instances[i].mesh);
+	std::sort(meshes.begin(), meshes.end());
+	meshes.erase(std::unique(meshes.begin(), meshes.end()), meshes.end());
+	parallelFor((int)meshes.size(), [&](int i) { meshes[i]->getBVH(); });
+}
+
+void GTR::SceneBVH::refit()
+{
+	num_refits++;
+	//the children are always after their parent
+	for (int i = (int)nodes.size() - 1; i >= 0; --i)
+	{
+		MeshBVH::Node& node = nodes[i];
+		if (node.count)
+		{
+			const SceneInstance& first = instances[leaf_instances[node.first]];
+			setNodeBounds(node, first.min, first.max);
+			for (int j = node.first + 1; j < node.first + node.count; ++j)
+				mergeNodeBounds(node, instances[leaf_instances[j]].min.v, instances[leaf_instances[j]].max.v);
+			continue;
+		}
+		node.min[0] = node.min[1] = node.min[2] = FLT_MAX;
+		node.max[0] = node.max[1] = node.max[2] = -FLT_MAX;
+		mergeNodeBounds(node, nodes[node.first].min, nodes[node.first].max);
+		mergeNodeBounds(node, nodes[node.first + 1].min, nodes[node.first + 1].max);
+	}
+
+	//the boxes that moved far overlap a lot, a new tree is better
+	if (nodes.size() && boxArea(nodes[0].min, nodes[0].max) > built_area * rebuild_factor)
+		build();
+}
+
+bool GTR::SceneBVH::testInstance(const SceneInstance& instance, int layers) const
+{
+	return instance.visible && (instance.layers & layers) && instance.mesh->bvh;
+}
+
+void GTR::SceneBVH::fillHit(const SceneInstance& instance, SceneHit& hit) const
+{
+	hit.entity = instance.entity;
+	hit.node = instance.node;
+	hit.mesh = instance.mesh;
+}
+
+//a direction component of 0 would give 0 * inf in the slab test
+static inline float safeInverse(float f)
+{
+	return 1.0f / (fabsf(f) > 1e-20f ? f : (f < 0.0f ? -1e-20f : 1e-20f));
+}
+
+bool GTR::SceneBVH::testRay(const Ray& ray, float max_distance, SceneHit& hit, int layers) const
+{
+	if (nodes.empty())
+		return false;
+
+	//same slab test as MeshBVH::testRay
+	simd::float4 o = simd::set(ray.origin.x, ray.origin.y, ray.origin.z, 0.0f);
+	simd::float4 inv = simd::set(safeInverse(ray.direction.x), safeInverse(ray.direction.y), safeInverse(ray.direction.z), 0.0f);
+	simd::float4 ignore_w = simd::set(-FLT_MAX, -FLT_MAX, -FLT_MAX, FLT_MAX);
+	auto slabs = [&](const MeshBVH::Node& node, float max_t) -> float {
+		simd::float4 t0 = simd::mul(simd::sub(simd::load3(node.min), o), inv);
+		simd::float4 t1 = simd::mul(simd::sub(simd::load3(node.max), o), inv);
+		float t_near = simd::first(simd::hmax(simd::min(t0, t1)));
+		float t_far = simd::first(simd::hmin(simd::max(simd::max(t0, t1), ignore_w)));
+		return t_near <= t_far && t_near <= max_t ? t_near : FLT_MAX;
+	};
+
+	float best = max_distance;
+	int best_instance = -1;
+	int best_triangle = -1;
+	if (slabs(nodes[0], best) == FLT_MAX)
+		return false;
+
+	int stack[64];
+	float stack_distances[64];
+	int stack_size = 0;
+	int node_index = 0;
+	while (true)
+	{
+		const MeshBVH::Node& node = nodes[node_index];
+		if (node.count)
+		{
+			for (int i = node.first; i < node.first + node.count; ++i)
+			{
+				const SceneInstance& instance = instances[leaf_instances[i]];
+				if (!testInstance(instance, layers))
+					continue;
+				//in object space the direction keeps the scale, so the distance is the same
+				RayHit mesh_hit;
+				if (!instance.mesh->bvh->testRay(instance.inverse_model * ray.origin, instance.inverse_model.rotateVector(ray.direction), best, mesh_hit))
+					continue;
+				best = mesh_hit.distance;
+				best_instance = leaf_instances[i];
+				best_triangle = mesh_hit.triangle;
+			}
+		}
+		else
+		{
+			float d0 = slabs(nodes[node.first], best);
+			float d1 = slabs(nodes[node.first + 1], best);
+			int near_index = node.first;
+			int far_index = node.first + 1;
+			if (d1 < d0)
+			{
+				std::swap(d0, d1);
+				std::swap(near_index, far_index);
+			}
+			if (d0 != FLT_MAX)
+			{
+				if (d1 != FLT_MAX)
+				{
+					assert(stack_size < 64);
+					stack[stack_size] = far_index;
+					stack_distances[stack_size++] = d1;
+				}
+				node_index = near_index;
+				continue;
+			}
+		}
+
+		//next node still closer than the hit
+		while (stack_size && stack_distances[stack_size - 1] > best)
+			--stack_size;
+		if (!stack_size)
+			break;
+		node_index = stack[--stack_size];
+	}
+
+	if (best_instance == -1)
+		return false;
+	const SceneInstance& instance = instances[best_instance];
+	fillHit(instance, hit);
+	hit.distance = best;
+	hit.position = ray.origin + ray.direction * best;
+	hit.normal = instance.mesh->bvh->getTriangleNormal(best_triangle, instance.model);
+	return true;
+}
+
+int GTR::SceneBVH::testRays(const Ray* rays, int num_rays, float max_distance, SceneHit* hits, int layers) const
+{
+	const int RAYS_PER_JOB = 64;
+	std::vector<int> num_hits((num_rays + RAYS_PER_JOB - 1) / RAYS_PER_JOB, 0);
+	parallelFor((int)num_hits.size(), [&](int job) {
+		int last = std::min((job + 1) * RAYS_PER_JOB, num_rays);
+		for (int i = job * RAYS_PER_JOB; i < last; ++i)
+		{
+			hits[i].entity = NULL;
+			if (testRay(rays[i], max_distance, hits[i], layers))
+				num_hits[job]++;
+		}
+	});
+
+	int total = 0;
+	for (int n : num_hits)
+		total += n;
+	return total;
+}
+
+void GTR::SceneBVH::overlapSphere(const Vector3& center, float radius, std::vector<SceneHit>& result, int layers) const
+{
+	if (nodes.empty())
+		return;
+
+	int stack[64];
+	int stack_size = 0;
+	stack[stack_size++] = 0;
+	while (stack_size)
+	{
+		const MeshBVH::Node& node = nodes[stack[--stack_size]];
+		if (boxDistance2(node.min, node.max, center) > radius * radius)
+			continue;
+		if (!node.count)
+		{
+			stack[stack_size++] = node.first + 1;
+			stack[stack_size++] = node.first;
+			continue;
+		}
+		for (int i = node.first; i < node.first + node.count; ++i)
+		{
+			const SceneInstance& instance = instances[leaf_instances[i]];
+			if (!testInstance(instance, layers) || instance.min_scale <= 0.0f)
+				continue;
+			//with a non uniform scale the sphere is searched with the biggest radius and the point tested in world space
+			Vector3 collision;
+			int triangle;
+			if (!instance.mesh->bvh->testSphere(instance.inverse_model * center, radius / instance.min_scale, collision, triangle))
+				continue;
+			collision = instance.model * collision;
+			float distance = collision.distance(center);
+			if (distance > radius)
+				continue;
+			SceneHit hit;
+			fillHit(instance, hit);
+			hit.distance = distance;
+			hit.position = collision;
+			hit.normal = instance.mesh->bvh->getTriangleNormal(triangle, instance.model);
+			result.push_back(hit);
+		}
+	}
+}
+
+void GTR::SceneBVH::overlapBox(const Vector3& min, const Vector3& max, std::vector<SceneHit>& result, int layers) const
+{
+	if (nodes.empty())
+		return;
+
+	int stack[64];
+	int stack_size = 0;
+	stack[stack_size++] = 0;
+	while (stack_size)
+	{
+		const MeshBVH::Node& node = nodes[stack[--stack_size]];
+		if (node.min[0] > max.x || node.max[0] < min.x || node.min[1] > max.y || node.max[1] < min.y || node.min[2] > max.z || node.max[2] < min.z)
+			continue;
+		if (!node.count)
+		{
+			stack[stack_size++] = node.first + 1;
+			stack[stack_size++] = node.first;
+			continue;
+		}
+		for (int i = node.first; i < node.first + node.count; ++i)
+		{
+			const SceneInstance& instance = instances[leaf_instances[i]];
+			if (!instance.visible || !(instance.layers & layers))
+				continue;
+			SceneHit hit;
+			fillHit(instance, hit);
+			hit.distance = 0.0f;
+			hit.position = (instance.min + instance.max) * 0.5f;
+			hit.normal.set(0, 0, 0);
+			result.push_back(hit);
+		}
+	}
+}
+
+bool GTR::SceneBVH::closestPoint(const Vector3& point, float max_distance, SceneHit& hit, int layers) const
+{
+	if (nodes.empty())
+		return false;
+
+	float best = max_distance;
+	bool found = false;
+	int stack[64];
+	int stack_size = 0;
+	stack[stack_size++] = 0;
+	while (stack_size)
+	{
+		const MeshBVH::Node& node = nodes[stack[--stack_size]];
+		if (boxDistance2(node.min, node.max, point) > best * best)
+			continue;
+		if (!node.count)
+		{
+			//the closest child last so it is visited first and shrinks the search
+			const MeshBVH::Node& left = nodes[node.first];
+			const MeshBVH::Node& right = nodes[node.first + 1];
+			bool left_first = boxDistance2(left.min, left.max, point) <= boxDistance2(right.min, right.max, point);
+			stack[stack_size++] = left_first ? node.first + 1 : node.first;
+			stack[stack_size++] = left_first ? node.first : node.first + 1;
+			continue;
+		}
+		for (int i = node.first; i < node.first + node.count; ++i)
+		{
+			const SceneInstance& instance = instances[leaf_instances[i]];
+			if (!testInstance(instance, layers) || instance.min_scale <= 0.0f)
+				continue;
+			Vector3 collision;
+			int triangle;
+			if (!instance.mesh->bvh->testSphere(instance.inverse_model * point, best / instance.min_scale, collision, triangle))
+				continue;
+			collision = instance.model * collision;
+			float distance = collision.distance(point);
+			if (distance > best)
+				continue;
+			best = distance;
+			found = true;
+			fillHit(instance, hit);
+			hit.distance = distance;
+			hit.position = collision;
+			hit.normal = instance.mesh->bvh->getTriangleNormal(triangle, instance.model);
+		}
+	}
+	return found;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "framework.h"
+#include "bvh.h"
+#include <vector>
+
+class Mesh;
+
+namespace GTR {
+
+	class Scene;
+	class PrefabEntity;
+	class Node;
+
+	//a node with a mesh of a prefab entity, the leaves of the scene tree point to them
+	struct SceneInstance {
+		PrefabEntity* entity;
+		Node* node;
+		Mesh* mesh;
+		unsigned int mesh_revision; //the tree of the mesh is built again (and the box updated) if its triangles change
+		Matrix44 model;			//node global * entity model
+		Matrix44 inverse_model;	//to move the queries to the space of the mesh tree
+		float min_scale;		//of the model, the spheres are searched with it in object space
+		Vector3 min;			//world AABB
+		Vector3 max;
+		int layers;
+		bool visible;			//the entity and all the nodes above are visible
+	};
+
+	//result of a query, distance is along the ray (or from the point in closestPoint)
+	struct SceneHit {
+		PrefabEntity* entity;
+		Node* node;
+		Mesh* mesh;
+		float distance;
+		Vector3 position;
+		Vector3 normal;
+	};
+
+	//Two levels: a tree over the world boxes of the instances, whose leaves use the tree of every mesh (MeshBVH) with
+	//the query moved to object space. update() refits the boxes that moved and only rebuilds when the prefabs change
+	//(or the triangles of a mesh) or the refitted tree has grown too much
+	class SceneBVH {
+	public:
+		static float rebuild_factor; //rebuilt when the area of the root is this many times the one it had when built
+
+		std::vector<SceneInstance> instances; //in the order of the entities and their hierarchies
+		std::vector<MeshBVH::Node> nodes;
+		std::vector<int> leaf_instances; //the leaves have ranges of this
+		float built_area;
+		int num_refits;
+		int num_rebuilds;
+
+		SceneBVH() { built_area = 0.0f; num_refits = num_rebuilds = 0; }
+
+		void clear();
+		void update(Scene* scene); //call it once per frame, before the queries
+		void build();
+		void refit();
+
+		//closest hit of the visible instances till max_distance
+		bool testRay(const Ray& ray, float max_distance, SceneHit& hit, int layers = 0xFF) const;
+		//many rays spread among the workers, returns how many hit something
+		int testRays(const Ray* rays, int num_rays, float max_distance, SceneHit* hits, int layers = 0xFF) const;
+		//instances with triangles inside the sphere, position is the closest point of each one
+		void overlapSphere(const Vector3& center, float radius, std::vector<SceneHit>& result, int layers = 0xFF) const;
+		//instances whose world box overlaps the box (only the boxes are tested)
+		void overlapBox(const Vector3& min, const Vector3& max, std::vector<SceneHit>& result, int layers = 0xFF) const;
+		//closest point of the triangles to point within max_distance (exact with uniform scales)
+		bool closestPoint(const Vector3& point, float max_distance, SceneHit& hit, int layers = 0xFF) const;
+
+	private:
+		bool testInstance(const SceneInstance& instance, int layers) const;
+		void fillHit(const SceneInstance& instance, SceneHit& hit) const;
+	};
+};
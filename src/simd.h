@@ -0,0 +1,155 @@
+#pragma once
+
+//Four floats in a register with the same operations in SSE, NEON or plain C++ (define FRAMEWORK_NO_SIMD to force it).
+//The multiplications and additions are never fused, so a kernel that does them in the same order as the scalar
+//code gives the same results.
+
+#if !defined(FRAMEWORK_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+	#define SIMD_SSE
+	#include <emmintrin.h>
+#elif !defined(FRAMEWORK_NO_SIMD) && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+	#define SIMD_NEON
+	#include <arm_neon.h>
+#else
+	#define SIMD_SCALAR
+	#include <cmath>
+#endif
+
+namespace simd {
+
+#if defined(SIMD_SSE)
+
+	typedef __m128 float4;
+
+	inline float4 load(const float* p) { return _mm_loadu_ps(p); }
+	inline void store(float* p, float4 v) { _mm_storeu_ps(p, v); }
+	//three floats, the fourth lane is 0 (nothing is read or written after p[2])
+	inline float4 load3(const float* p) { return _mm_movelh_ps(_mm_loadl_pi(_mm_setzero_ps(), (const __m64*)p), _mm_load_ss(p + 2)); }
+	inline void store3(float* p, float4 v) { _mm_storel_pi((__m64*)p, v); _mm_store_ss(p + 2, _mm_movehl_ps(v, v)); }
+	inline float4 set(float x, float y, float z, float w) { return _mm_setr_ps(x, y, z, w); }
+	inline float4 splat(float f) { return _mm_set1_ps(f); }
+	inline float first(float4 v) { return _mm_cvtss_f32(v); }
+
+	inline float4 add(float4 a, float4 b) { return _mm_add_ps(a, b); }
+	inline float4 sub(float4 a, float4 b) { return _mm_sub_ps(a, b); }
+	inline float4 mul(float4 a, float4 b) { return _mm_mul_ps(a, b); }
+	inline float4 div(float4 a, float4 b) { return _mm_div_ps(a, b); }
+	inline float4 abs(float4 v) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), v); }
+	inline float4 min(float4 a, float4 b) { return _mm_min_ps(a, b); }
+	inline float4 max(float4 a, float4 b) { return _mm_max_ps(a, b); }
+	//bit i set if a[i] <= b[i]
+	inline int lessEqualMask(float4 a, float4 b) { return _mm_movemask_ps(_mm_cmple_ps(a, b)); }
+
+	//(a[X], a[Y], b[Z], b[W])
+	template<int X, int Y, int Z, int W> inline float4 shuffle(float4 a, float4 b) { return _mm_shuffle_ps(a, b, _MM_SHUFFLE(W, Z, Y, X)); }
+
+#elif defined(SIMD_NEON)
+
+	typedef float32x4_t float4;
+
+	inline float4 load(const float* p) { return vld1q_f32(p); }
+	inline void store(float* p, float4 v) { vst1q_f32(p, v); }
+	inline float4 load3(const float* p) { return vcombine_f32(vld1_f32(p), vset_lane_f32(p[2], vdup_n_f32(0.0f), 0)); }
+	inline void store3(float* p, float4 v) { vst1_f32(p, vget_low_f32(v)); vst1q_lane_f32(p + 2, v, 2); }
+	inline float4 set(float x, float y, float z, float w) { float v[4] = { x, y, z, w }; return vld1q_f32(v); }
+	inline float4 splat(float f) { return vdupq_n_f32(f); }
+	inline float first(float4 v) { return vgetq_lane_f32(v, 0); }
+
+	inline float4 add(float4 a, float4 b) { return vaddq_f32(a, b); }
+	inline float4 sub(float4 a, float4 b) { return vsubq_f32(a, b); }
+	inline float4 mul(float4 a, float4 b) { return vmulq_f32(a, b); }
+#if defined(__aarch64__)
+	inline float4 div(float4 a, float4 b) { return vdivq_f32(a, b); }
+#else
+	inline float4 div(float4 a, float4 b) //no division in ARMv7, the reciprocal estimate is not exact
+	{
+		float x[4], y[4];
+		vst1q_f32(x, a);
+		vst1q_f32(y, b);
+		return set(x[0] / y[0], x[1] / y[1], x[2] / y[2], x[3] / y[3]);
+	}
+#endif
+	inline float4 abs(float4 v) { return vabsq_f32(v); }
+	inline float4 min(float4 a, float4 b) { return vminq_f32(a, b); }
+	inline float4 max(float4 a, float4 b) { return vmaxq_f32(a, b); }
+	inline int lessEqualMask(float4 a, float4 b)
+	{
+		uint32x4_t r = vcleq_f32(a, b);
+		return (vgetq_lane_u32(r, 0) & 1) | (vgetq_lane_u32(r, 1) & 2) | (vgetq_lane_u32(r, 2) & 4) | (vgetq_lane_u32(r, 3) & 8);
+	}
+
+	template<int X, int Y, int Z, int W> inline float4 shuffle(float4 a, float4 b)
+	{
+		float4 r = vdupq_n_f32(vgetq_lane_f32(a, X));
+		r = vsetq_lane_f32(vgetq_lane_f32(a, Y), r, 1);
+		r = vsetq_lane_f32(vgetq_lane_f32(b, Z), r, 2);
+		return vsetq_lane_f32(vgetq_lane_f32(b, W), r, 3);
+	}
+
+#else
+
+	struct float4 { float v[4]; };
+
+	inline float4 set(float x, float y, float z, float w) { float4 r = { { x, y, z, w } }; return r; }
+	inline float4 load(const float* p) { return set(p[0], p[1], p[2], p[3]); }
+	inline void store(float* p, float4 v) { p[0] = v.v[0]; p[1] = v.v[1]; p[2] = v.v[2]; p[3] = v.v[3]; }
+	inline float4 load3(const float* p) { return set(p[0], p[1], p[2], 0.0f); }
+	inline void store3(float* p, float4 v) { p[0] = v.v[0]; p[1] = v.v[1]; p[2] = v.v[2]; }
+	inline float4 splat(float f) { return set(f, f, f, f); }
+	inline float first(float4 v) { return v.v[0]; }
+
+	inline float4 add(float4 a, float4 b) { return set(a.v[0] + b.v[0], a.v[1] + b.v[1], a.v[2] + b.v[2], a.v[3] + b.v[3]); }
+	inline float4 sub(float4 a, float4 b) { return set(a.v[0] - b.v[0], a.v[1] - b.v[1], a.v[2] - b.v[2], a.v[3] - b.v[3]); }
+	inline float4 mul(float4 a, float4 b) { return set(a.v[0] * b.v[0], a.v[1] * b.v[1], a.v[2] * b.v[2], a.v[3] * b.v[3]); }
+	inline float4 div(float4 a, float4 b) { return set(a.v[0] / b.v[0], a.v[1] / b.v[1], a.v[2] / b.v[2], a.v[3] / b.v[3]); }
+	inline float4 abs(float4 a) { return set(fabsf(a.v[0]), fabsf(a.v[1]), fabsf(a.v[2]), fabsf(a.v[3])); }
+	inline float4 min(float4 a, float4 b) { return set(a.v[0] < b.v[0] ? a.v[0] : b.v[0], a.v[1] < b.v[1] ? a.v[1] : b.v[1], a.v[2] < b.v[2] ? a.v[2] : b.v[2], a.v[3] < b.v[3] ? a.v[3] : b.v[3]); }
+	inline float4 max(float4 a, float4 b) { return set(a.v[0] > b.v[0] ? a.v[0] : b.v[0], a.v[1] > b.v[1] ? a.v[1] : b.v[1], a.v[2] > b.v[2] ? a.v[2] : b.v[2], a.v[3] > b.v[3] ? a.v[3] : b.v[3]); }
+	inline int lessEqualMask(float4 a, float4 b) { return (a.v[0] <= b.v[0]) | ((a.v[1] <= b.v[1]) << 1) | ((a.v[2] <= b.v[2]) << 2) | ((a.v[3] <= b.v[3]) << 3); }
+
+	template<int X, int Y, int Z, int W> inline float4 shuffle(float4 a, float4 b) { return set(a.v[X], a.v[Y], b.v[Z], b.v[W]); }
+
+#endif
+
+	//(v[X], v[Y], v[Z], v[W])
+	template<int X, int Y, int Z, int W> inline float4 swizzle(float4 v) { return shuffle<X, Y, Z, W>(v, v); }
+	template<int I> inline float4 broadcast(float4 v) { return shuffle<I, I, I, I>(v, v); }
+
+	//the sum of the four lanes in all of them
+	inline float4 sum(float4 v)
+	{
+		v = add(v, swizzle<2, 3, 0, 1>(v));
+		return add(v, swizzle<1, 0, 3, 2>(v));
+	}
+
+	//the smallest and biggest lane in all of them
+	inline float4 hmin(float4 v)
+	{
+		v = min(v, swizzle<2, 3, 0, 1>(v));
+		return min(v, swizzle<1, 0, 3, 2>(v));
+	}
+	inline float4 hmax(float4 v)
+	{
+		v = max(v, swizzle<2, 3, 0, 1>(v));
+		return max(v, swizzle<1, 0, 3, 2>(v));
+	}
+
+	//of the 4x4 matrix with a,b,c,d as rows: a ends with the first lane of the four, b with the second...
+	inline void transpose(float4& a, float4& b, float4& c, float4& d)
+	{
+		float4 t0 = shuffle<0, 1, 0, 1>(a, b);
+		float4 t1 = shuffle<0, 1, 0, 1>(c, d);
+		float4 t2 = shuffle<2, 3, 2, 3>(a, b);
+		float4 t3 = shuffle<2, 3, 2, 3>(c, d);
+		a = shuffle<0, 2, 0, 2>(t0, t1);
+		b = shuffle<1, 3, 1, 3>(t0, t1);
+		c = shuffle<0, 2, 0, 2>(t2, t3);
+		d = shuffle<1, 3, 1, 3>(t2, t3);
+	}
+
+	//of the xyz lanes, the w of the result is 0 if the ones of a and b are 0
+	inline float4 cross(float4 a, float4 b)
+	{
+		return sub(mul(swizzle<1, 2, 0, 3>(a), swizzle<2, 0, 1, 3>(b)), mul(swizzle<2, 0, 1, 3>(a), swizzle<1, 2, 0, 3>(b)));
+	}
+}
@@ -1,4 +1,16 @@
 #include "sphericalharmonics.h"
+#include "task.h"
+
+#include <cassert>
+#include <cmath>
+#include <map>
+#include <memory>
+#include <mutex>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #define SH_USE_SSE
+    #include <emmintrin.h>
+#endif
 
 //system axis
 Vector3 cubemapFaceNormals[6][3] = {
@@ -12,9 +24,121 @@ Vector3 cubemapFaceNormals[6][3] = {
     {{-1, 0, 0},{0, -1, 0},{0, 0, -1}}  // negz
 };
 
-const int sh_length = 9;
-std::vector< std::vector<Vector3> > cubeMapVecs;
-int cubeMapVecs_size = 0;
+#define SH_ROWS_PER_CHUNK 8 //rows of a face processed by the same task (fixed so the sum order never changes)
+
+//four texels at once, with SSE when available
+#ifdef SH_USE_SSE
+struct float4 {
+    __m128 v;
+    float4() {}
+    float4(__m128 v) { this->v = v; }
+    float4(float f) { v = _mm_set1_ps(f); }
+};
+inline float4 operator + (const float4& a, const float4& b) { return _mm_add_ps(a.v, b.v); }
+inline float4 operator - (const float4& a, const float4& b) { return _mm_sub_ps(a.v, b.v); }
+inline float4 operator * (const float4& a, const float4& b) { return _mm_mul_ps(a.v, b.v); }
+inline float4 operator / (const float4& a, const float4& b) { return _mm_div_ps(a.v, b.v); }
+inline float4 load4(const float* p) { return _mm_loadu_ps(p); }
+inline float sum4(const float4& a) { float f[4]; _mm_storeu_ps(f, a.v); return f[0] + f[1] + f[2] + f[3]; }
+
+//x^2.2 as x^2 * x^0.2, the fifth root starts with an approximation from the float bits and is refined with Newton
+inline float4 degamma4(float4 x)
+{
+    x = _mm_max_ps(x.v, _mm_setzero_ps());
+    __m128i one = _mm_set1_epi32(0x3F800000);
+    __m128 e = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_castps_si128(x.v), one));
+    float4 y = _mm_castsi128_ps(_mm_add_epi32(_mm_cvtps_epi32(_mm_mul_ps(e, _mm_set1_ps(0.2f))), one));
+    for (int i = 0; i < 3; ++i)
+    {
+        float4 y2 = y * y;
+        y = (float4(4.0f) * y + x / (y2 * y2)) * float4(0.2f);
+    }
+    return x * x * y;
+}
+#else
+struct float4 {
+    float v[4];
+    float4() {}
+    float4(float f) { v[0] = v[1] = v[2] = v[3] = f; }
+};
+inline float4 operator + (const float4& a, const float4& b) { float4 r; for (int i = 0; i < 4; ++i) r.v[i] = a.v[i] + b.v[i]; return r; }
+inline float4 operator - (const float4& a, const float4& b) { float4 r; for (int i = 0; i < 4; ++i) r.v[i] = a.v[i] - b.v[i]; return r; }
+inline float4 operator * (const float4& a, const float4& b) { float4 r; for (int i = 0; i < 4; ++i) r.v[i] = a.v[i] * b.v[i]; return r; }
+inline float4 operator / (const float4& a, const float4& b) { float4 r; for (int i = 0; i < 4; ++i) r.v[i] = a.v[i] / b.v[i]; return r; }
+inline float4 load4(const float* p) { float4 r; for (int i = 0; i < 4; ++i) r.v[i] = p[i]; return r; }
+inline float sum4(const float4& a) { return a.v[0] + a.v[1] + a.v[2] + a.v[3]; }
+inline float4 degamma4(float4 x) { for (int i = 0; i < 4; ++i) x.v[i] = x.v[i] > 0.0f ? powf(x.v[i], 2.2f) : 0.0f; return x; }
+#endif
+
+//real SH basis up to order 4, the same code for one direction (float) or four (float4)
+template<typename T> void evalBasis(int order, const T& x, const T& y, const T& z, T* out)
+{
+    out[0] = T(0.282094792f);
+    if (order < 1)
+        return;
+    out[1] = T(0.488602512f) * y;
+    out[2] = T(0.488602512f) * z;
+    out[3] = T(0.488602512f) * x;
+    if (order < 2)
+        return;
+    T x2 = x * x, y2 = y * y, z2 = z * z;
+    out[4] = T(1.092548431f) * x * y;
+    out[5] = T(1.092548431f) * y * z;
+    out[6] = T(0.315391565f) * (T(3.0f) * z2 - T(1.0f));
+    out[7] = T(1.092548431f) * x * z;
+    out[8] = T(0.546274215f) * (x2 - y2);
+    if (order < 3)
+        return;
+    T z5 = T(5.0f) * z2;
+    out[9] = T(0.590043589f) * y * (T(3.0f) * x2 - y2);
+    out[10] = T(2.890611442f) * x * y * z;
+    out[11] = T(0.457045799f) * y * (z5 - T(1.0f));
+    out[12] = T(0.373176333f) * z * (z5 - T(3.0f));
+    out[13] = T(0.457045799f) * x * (z5 - T(1.0f));
+    out[14] = T(1.445305721f) * z * (x2 - y2);
+    out[15] = T(0.590043589f) * x * (x2 - T(3.0f) * y2);
+    if (order < 4)
+        return;
+    T z7 = T(7.0f) * z2;
+    out[16] = T(2.503342942f) * x * y * (x2 - y2);
+    out[17] = T(1.770130837f) * y * z * (T(3.0f) * x2 - y2);
+    out[18] = T(0.946174696f) * x * y * (z7 - T(1.0f));
+    out[19] = T(0.669046544f) * y * z * (z7 - T(3.0f));
+    out[20] = T(0.105785547f) * (T(35.0f) * z2 * z2 - T(30.0f) * z2 + T(3.0f));
+    out[21] = T(0.669046544f) * x * z * (z7 - T(3.0f));
+    out[22] = T(0.473087348f) * (x2 - y2) * (z7 - T(1.0f));
+    out[23] = T(1.770130837f) * x * z * (x2 - T(3.0f) * y2);
+    out[24] = T(0.625835735f) * (x2 * (x2 - T(3.0f) * y2) - y2 * (T(3.0f) * x2 - y2));
+}
+
+void evaluateSHBasis(const Vector3& dir, int order, float* out)
+{
+    assert(order >= 0 && order <= SH_MAX_ORDER);
+    evalBasis<float>(order, dir.x, dir.y, dir.z, out);
+}
+
+Vector3 SphericalHarmonics::evaluate(const Vector3& dir) const
+{
+    float basis[SH_MAX_COEFFS];
+    evaluateSHBasis(dir, order, basis);
+    Vector3 result;
+    for (int i = 0; i < getNumCoeffs(); ++i)
+        result = result + coeffs[i] * basis[i];
+    return result;
+}
+
+Vector3 SphericalHarmonics::evaluateIrradiance(const Vector3& normal) const
+{
+    //convolution of every band with the cosine lobe (Ramamoorthi and Hanrahan)
+    const float band_factors[SH_MAX_ORDER + 1] = { PI, 2.0f * PI / 3.0f, PI / 4.0f, 0.0f, -PI / 24.0f };
+    float basis[SH_MAX_COEFFS];
+    evaluateSHBasis(normal, order, basis);
+    Vector3 result;
+    for (int l = 0; l <= order; ++l)
+        for (int i = l * l; i < (l + 1) * (l + 1); ++i)
+            result = result + coeffs[i] * (basis[i] * band_factors[l]);
+    return result;
+}
 
 float areaElement(float x, float y) {
     return atan2(x * y, sqrtf(x * x + y * y + 1.0f));
@@ -40,86 +164,162 @@ float texelSolidAngle(float aU, float aV, float width, float height) {
     return angle;
 }
 
-// give me a cubemap, its size and number of channels
-// and i'll give you spherical harmonics
-SphericalHarmonics computeSH( FloatImage images[], bool degamma ) {
-	assert(images[0].width == images[0].height && images[0].width != 0 && "Image is not square");
-    int size = images[0].width;
-    int channels = 3;
-    SphericalHarmonics sh;
+//solid angle and direction of every texel of a face, the same for all the faces (only the axis change).
+//Rows are padded to a multiple of 4 with texels of weight 0.
+struct sSHWeightTable {
+    int size;
+    int stride;
+    std::vector<float> weight;
+    std::vector<float> u, v, w; //normalized direction in the axis of the face
+};
 
-    // generate cube map vectors
-    if (cubeMapVecs_size != size)
-    {
-        cubeMapVecs_size = size;
-        cubeMapVecs.clear();
-        for (int index = 0; index < 6; ++index)
+static std::shared_ptr<sSHWeightTable> getWeightTable(int size)
+{
+    static std::mutex mutex;
+    static std::map<int, std::shared_ptr<sSHWeightTable>> tables;
+    std::lock_guard<std::mutex> lock(mutex);
+    std::shared_ptr<sSHWeightTable>& table = tables[size];
+    if (table)
+        return table;
+
+    table = std::make_shared<sSHWeightTable>();
+    table->size = size;
+    table->stride = (size + 3) & ~3;
+    int num = table->stride * size;
+    table->weight.resize(num, 0.0f);
+    table->u.resize(num, 0.0f);
+    table->v.resize(num, 0.0f);
+    table->w.resize(num, 1.0f);
+    for (int y = 0; y < size; y++)
+        for (int x = 0; x < size; x++)
         {
-            std::vector<Vector3> faceVecs;
-            for (int v = 0; v < size; v++) {
-                for (int u = 0; u < size; u++)
-                {
-                    float fU = (2.0 * u / (size - 1.0)) - 1.0;
-                    float fV = (2.0 * v / (size - 1.0)) - 1.0;
-
-                    Vector3 vecX = cubemapFaceNormals[index][0] * fU;
-                    Vector3 vecY = cubemapFaceNormals[index][1] * fV;
-                    Vector3 vecZ = cubemapFaceNormals[index][2];
-
-                    Vector3 res = normalize(vecX + vecY + vecZ);
-                    faceVecs.push_back(res);
-                }
-            }
-            cubeMapVecs.push_back(faceVecs);
+            float fU = (2.0 * (x + 0.5) / size) - 1.0;
+            float fV = (2.0 * (y + 0.5) / size) - 1.0;
+            Vector3 dir = normalize(Vector3(fU, fV, 1.0f));
+            int index = y * table->stride + x;
+            table->weight[index] = texelSolidAngle(x, y, size, size);
+            table->u[index] = dir.x;
+            table->v[index] = dir.y;
+            table->w[index] = dir.z;
         }
-    }
+    return table;
+}
+
+//weighted sums of some rows of a face: 3 values per coefficient and the total weight at the end
+static void projectRows(const sSHWeightTable& table, FloatImage& face, const Vector3* axis, int first_row, int last_row, int order, bool degamma, double* result)
+{
+    int num_coeffs = (order + 1) * (order + 1);
+    int size = table.size;
+    int stride = table.stride;
+    int channels = face.num_channels;
+
+    float4 sums[SH_MAX_COEFFS * 3];
+    for (int i = 0; i < num_coeffs * 3; ++i)
+        sums[i] = float4(0.0f);
+    float4 weight_sum(0.0f);
 
-    // generate spherical harmonics
-    float weightAccum = 0;
+    //the direction in the cubemap is the one in the face axis rotated
+    float4 ax[3], ay[3], az[3];
+    for (int i = 0; i < 3; ++i)
+    {
+        ax[i] = float4(axis[0].v[i]);
+        ay[i] = float4(axis[1].v[i]);
+        az[i] = float4(axis[2].v[i]);
+    }
 
-    for (int index = 0; index < 6; ++index)
+    std::vector<float> red(stride, 0.0f), green(stride, 0.0f), blue(stride, 0.0f);
+    for (int y = first_row; y < last_row; ++y)
     {
-        FloatImage& face = images[index];
-        float* pixels = face.data;
-        bool gammaCorrect = degamma;
-        for (int y = 0; y < size; y++) {
-            for (int x = 0; x < size; x++) {
-                Vector3 texelVect = cubeMapVecs[index][y * size + x];
-                float weight = texelSolidAngle(x, y, size, size);
-                    // forsyths weights
-                float weight1 = weight * 4 / 17;
-                float weight2 = weight * 8 / 17;
-                float weight3 = weight * 15 / 17;
-                float weight4 = weight * 5 / 68;
-                float weight5 = weight * 15 / 68;
-
-                float dx = texelVect[0];
-                float dy = texelVect[1];
-                float dz = texelVect[2];
-
-                Vector3 value = face.getPixel(x,y).xyz();
-                if (gammaCorrect)
-                    value = Vector3(pow(value.x, 2.2), pow(value.y, 2.2), pow(value.z, 2.2));
-                    
-                sh.coeffs[0] += value * weight1;
-                sh.coeffs[1] += value * weight2 * dy;
-                sh.coeffs[2] += value * weight2 * dz;
-                sh.coeffs[3] += value * weight2 * dx;
-
-                sh.coeffs[4] += value * weight3 * dx * dy;
-                sh.coeffs[5] += value * weight3 * dy * dz;
-                sh.coeffs[6] += value * weight4 * (3.0f * dz * dz - 1.0f);
-
-                sh.coeffs[7] += value * weight3 * dx * dz;
-                sh.coeffs[8] += value * weight5 * (dx * dx - dy * dy);
-
-                weightAccum += weight * 3.0f;
+        //channels to separate arrays
+        const float* pixels = face.data + (size_t)y * size * channels;
+        for (int x = 0; x < size; ++x)
+        {
+            red[x] = pixels[x * channels];
+            green[x] = pixels[x * channels + 1];
+            blue[x] = pixels[x * channels + 2];
+        }
+
+        const float* weights = &table.weight[y * stride];
+        const float* us = &table.u[y * stride];
+        const float* vs = &table.v[y * stride];
+        const float* ws = &table.w[y * stride];
+        for (int x = 0; x < stride; x += 4)
+        {
+            float4 weight = load4(weights + x);
+            float4 u = load4(us + x), v = load4(vs + x), w = load4(ws + x);
+            float4 dir[3];
+            for (int i = 0; i < 3; ++i)
+                dir[i] = ax[i] * u + ay[i] * v + az[i] * w;
+
+            float4 r = load4(&red[x]), g = load4(&green[x]), b = load4(&blue[x]);
+            if (degamma)
+            {
+                r = degamma4(r);
+                g = degamma4(g);
+                b = degamma4(b);
+            }
+            r = r * weight;
+            g = g * weight;
+            b = b * weight;
+
+            float4 basis[SH_MAX_COEFFS];
+            evalBasis<float4>(order, dir[0], dir[1], dir[2], basis);
+            for (int i = 0; i < num_coeffs; ++i)
+            {
+                sums[i * 3] = sums[i * 3] + basis[i] * r;
+                sums[i * 3 + 1] = sums[i * 3 + 1] + basis[i] * g;
+                sums[i * 3 + 2] = sums[i * 3 + 2] + basis[i] * b;
             }
+            weight_sum = weight_sum + weight;
         }
-    };
+    }
+
+    for (int i = 0; i < num_coeffs * 3; ++i)
+        result[i] = sum4(sums[i]);
+    result[num_coeffs * 3] = sum4(weight_sum);
+}
+
+SphericalHarmonics projectSH( FloatImage images[], int order, bool degamma ) {
+    assert(images[0].width == images[0].height && images[0].width != 0 && "Image is not square");
+    assert(order >= 0 && order <= SH_MAX_ORDER);
+    int size = images[0].width;
+    for (int i = 1; i < 6; ++i)
+        assert(images[i].width == size && images[i].height == size && images[i].num_channels >= 3 && "faces must match");
+
+    std::shared_ptr<sSHWeightTable> table = getWeightTable(size);
+    int num_coeffs = (order + 1) * (order + 1);
+    int num_values = num_coeffs * 3 + 1;
+    int chunks_per_face = (size + SH_ROWS_PER_CHUNK - 1) / SH_ROWS_PER_CHUNK;
+    int num_chunks = chunks_per_face * 6;
+
+    //every chunk writes its own sums, they are added in order after so the result doesnt depend on the threads
+    std::vector<double> partial((size_t)num_chunks * num_values);
+    parallelFor(num_chunks, [&](int chunk) {
+        int face = chunk / chunks_per_face;
+        int first_row = (chunk % chunks_per_face) * SH_ROWS_PER_CHUNK;
+        int last_row = std::min(first_row + SH_ROWS_PER_CHUNK, size);
+        projectRows(*table, images[face], cubemapFaceNormals[face], first_row, last_row, order, degamma, &partial[(size_t)chunk * num_values]);
+    });
+
+    std::vector<double> total(num_values, 0.0);
+    for (int chunk = 0; chunk < num_chunks; ++chunk)
+        for (int i = 0; i < num_values; ++i)
+            total[i] += partial[(size_t)chunk * num_values + i];
+
+    SphericalHarmonics sh(order);
+    double scale = 4.0 * PI / total[num_coeffs * 3];
+    for (int i = 0; i < num_coeffs; ++i)
+        sh.coeffs[i] = Vector3((float)(total[i * 3] * scale), (float)(total[i * 3 + 1] * scale), (float)(total[i * 3 + 2] * scale));
+    return sh;
+}
+
+SphericalHarmonics computeSH( FloatImage images[], bool degamma ) {
+    //the same projection with the basis constants replaced by forsyth weights (and the 1/3 the original code had)
+    const float forsyth_weights[9] = { 4.0f / 17.0f, 8.0f / 17.0f, 8.0f / 17.0f, 8.0f / 17.0f, 15.0f / 17.0f, 15.0f / 17.0f, 5.0f / 68.0f, 15.0f / 17.0f, 15.0f / 68.0f };
+    const float basis_constants[9] = { 0.282094792f, 0.488602512f, 0.488602512f, 0.488602512f, 1.092548431f, 1.092548431f, 0.315391565f, 1.092548431f, 0.546274215f };
 
-    SphericalHarmonics linear_sh;
-    for (int i = 0; i < sh_length; i++)
-        linear_sh.coeffs[i] = sh.coeffs[i] * (4 * PI / weightAccum);
-    return linear_sh;
+    SphericalHarmonics sh = projectSH(images, 2, degamma);
+    for (int i = 0; i < 9; i++)
+        sh.coeffs[i] = sh.coeffs[i] * (forsyth_weights[i] / (3.0f * basis_constants[i]));
+    return sh;
 }
@@ -5,8 +5,27 @@
 
 extern Vector3 cubemapFaceNormals[6][3]; //(x,y,z)
 
+#define SH_MAX_ORDER 4
+#define SH_MAX_COEFFS ((SH_MAX_ORDER + 1) * (SH_MAX_ORDER + 1))
+
 struct SphericalHarmonics {
-	Vector3 coeffs[9];
+	int order; //bands from 0 to order, (order + 1)^2 coefficients
+	Vector3 coeffs[SH_MAX_COEFFS];
+
+	SphericalHarmonics(int order = 2) { this->order = order; }
+	int getNumCoeffs() const { return (order + 1) * (order + 1); }
+
+	Vector3 evaluate(const Vector3& dir) const; //radiance from that direction (only for projectSH coefficients)
+	Vector3 evaluateIrradiance(const Vector3& normal) const; //convolved with the cosine lobe
 };
 
+//real SH basis (without the Condon-Shortley phase) of a normalized direction, out needs (order + 1)^2 values
+void evaluateSHBasis(const Vector3& dir, int order, float* out);
+
+//projects a cubemap (6 square faces in the order of cubemapFaceNormals) to the orthonormal SH basis up to order.
+//Faces and rows are processed in parallel by the workers, the result is the same with any number of threads.
+SphericalHarmonics projectSH( FloatImage images[], int order = 2, bool degamma = false);
+
+// give me a cubemap, its size and number of channels
+// and i'll give you spherical harmonics (9 coefficients with Forsyth's weights, ready to be evaluated)
 SphericalHarmonics computeSH( FloatImage images[], bool degamma = false);
@@ -3,36 +3,34 @@
 #include <thread>         // std::thread
 #include <chrono>		  //ms
 #include <cassert>
+#include <atomic>
+#include <memory>
+#include <algorithm>
 
 TaskManager TaskManager::foreground;
 TaskManager TaskManager::background;
+TaskManager TaskManager::workers;
 
 TaskManager::TaskManager()
 {
 	must_loop = false;
-	_thread = NULL;
 }
 
 void TaskManager::loop()
 {
-	using namespace std::chrono_literals;
-	std::cout << "Starting Task Manager ..." << std::endl;
-
 	while (must_loop)
 	{
-		if (pending_tasks.empty())
 		{
-			std::this_thread::sleep_for(10ms);
-			continue;
+			//sleep till there is something to do
+			std::unique_lock<std::mutex> lock(tasks_mutex);
+			tasks_condition.wait(lock, [this]() { return !pending_tasks.empty() || !must_loop; });
 		}
 
 		fetchTask();
 	}
-
-	std::cout << "Ending Task Manager" << std::endl;
 }
 
-void TaskManager::fetchTask()
+bool TaskManager::fetchTask()
 {
 	Task* task = NULL;
 	try
@@ -40,7 +38,7 @@ void TaskManager::fetchTask()
 		//lock
 		const std::lock_guard<std::mutex> lock(tasks_mutex);
 		if (pending_tasks.empty())
-			return;
+			return false;
 		task = pending_tasks.front();
 		pending_tasks.pop_front();
 		//unlock after finishing scope
@@ -49,12 +47,26 @@ void TaskManager::fetchTask()
 		std::cout << "[exception caught]\n";
 	}
 
-	if (task)
+	if (!task)
+		return false;
+
+	task->onExecute();
+	delete task;
+	return true;
+}
+
+int TaskManager::fetchTasks(float max_time)
+{
+	int num = 0;
+	auto start = std::chrono::steady_clock::now();
+	while (fetchTask())
 	{
-		task->onExecute();
-		delete task;
-		task = NULL;
+		num++;
+		std::chrono::duration<float, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+		if (elapsed.count() > max_time)
+			break;
 	}
+	return num;
 }
 
 void thread_loop_func(TaskManager* manager)
@@ -63,17 +75,76 @@ void thread_loop_func(TaskManager* manager)
 	//join?
 }
 
-void TaskManager::startThread()
+void TaskManager::startThreads(int num_threads)
 {
-	assert(!_thread && "TaskManager already in a thread");
+	assert(threads.empty() && "TaskManager already has threads");
+	std::cout << "Starting Task Manager with " << num_threads << " threads..." << std::endl;
 	must_loop = true;
-	_thread = new std::thread(thread_loop_func, this);
+	for (int i = 0; i < num_threads; ++i)
+		threads.push_back(new std::thread(thread_loop_func, this));
 }
 
 void TaskManager::addTask(Task* task)
 {
-	//block pending_tasks
-	const std::lock_guard<std::mutex> lock(tasks_mutex);
-	pending_tasks.push_back(task);
-	//release pending_tasks automatically
+	{
+		//block pending_tasks
+		const std::lock_guard<std::mutex> lock(tasks_mutex);
+		pending_tasks.push_back(task);
+		//release pending_tasks automatically
+	}
+	tasks_condition.notify_one();
+}
+
+//shared between the calling thread and the workers helping with a parallelFor
+struct sParallelForState {
+	std::function<void(int)> func;
+	int num;
+	std::atomic<int> next_item;
+	std::atomic<int> pending_items;
+	std::mutex mutex;
+	std::condition_variable finished;
+
+	void run()
+	{
+		int i;
+		while ((i = next_item++) < num)
+		{
+			func(i);
+			if (--pending_items == 0)
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				finished.notify_all();
+			}
+		}
+	}
+};
+
+void parallelFor(int num, std::function<void(int)> func)
+{
+	if (num <= 0)
+		return;
+
+	int num_helpers = std::min(num - 1, TaskManager::workers.getNumThreads());
+	if (num_helpers <= 0)
+	{
+		for (int i = 0; i < num; ++i)
+			func(i);
+		return;
+	}
+
+	//the state is shared so helpers that start late find nothing to do but can still access it
+	std::shared_ptr<sParallelForState> state = std::make_shared<sParallelForState>();
+	state->func = func;
+	state->num = num;
+	state->next_item = 0;
+	state->pending_items = num;
+
+	for (int i = 0; i < num_helpers; ++i)
+		TaskManager::workers.addTask(new Task([state]() { state->run(); }));
+
+	state->run();
+
+	//wait for the items still being processed by the workers
+	std::unique_lock<std::mutex> lock(state->mutex);
+	state->finished.wait(lock, [&state]() { return state->pending_items == 0; });
 }
\ No newline at end of file
@@ -3,6 +3,7 @@
 #include <vector>
 #include <list>
 #include <mutex>
+#include <condition_variable>
 #include <thread>         // std::thread
 #include <functional>
 
@@ -20,15 +21,24 @@ class TaskManager {
 public:
 	std::list<Task*> pending_tasks;
 	std::mutex tasks_mutex;  // protects pending_tasks
+	std::condition_variable tasks_condition; // wakes up the threads when a task is added
 	bool must_loop;
-	std::thread* _thread;
+	std::vector<std::thread*> threads;
 
-	static TaskManager foreground;
-	static TaskManager background;
+	static TaskManager foreground; //executed by the main thread every frame till its time budget is spent (the only one that can use OpenGL)
+	static TaskManager background; //one thread for slow tasks (like loading from disk)
+	static TaskManager workers; //one thread per core for short CPU tasks (see parallelFor)
 
 	TaskManager();
 	void addTask(Task* task);
-	void fetchTask();
+	bool fetchTask(); //returns false if there was no task
+	int fetchTasks(float max_time); //executes tasks till max_time (in ms) is spent, at least one, returns how many
 	void loop();
-	void startThread();
-};
\ No newline at end of file
+	void startThread() { startThreads(1); }
+	void startThreads(int num_threads);
+	int getNumThreads() { return (int)threads.size(); }
+};
+
+//calls func(i) for every i in [0,num), the items are spread among the workers and the calling thread
+//it returns once all the items have been processed. Items must be independent from each other.
+void parallelFor(int num, std::function<void(int)> func);
\ No newline at end of file
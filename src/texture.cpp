@@ -8,11 +8,16 @@
 
 #include "mesh.h"
 #include "shader.h"
-#include "extra/picopng.h"
 #include "extra/jpgd.h"
 #include <cassert>
+#include <chrono>
+#include <mutex>
+#include <unordered_map>
 
 #define STB_IMAGE_IMPLEMENTATION
+#define STBI_MALLOC(size) allocImageData(size)
+#define STBI_REALLOC(ptr, size) reallocImageData(ptr, size)
+#define STBI_FREE(ptr) freeImageData(ptr)
 //#include "extra/stb_image.h"
 //#include "engine/application.h"
 
@@ -57,11 +62,12 @@ Vector4 Image::getPixelInterpolatedHigh(float x, float y, bool repeat) {
 };
 
 
-std::map<std::string, Texture*> Texture::sTexturesLoaded;
+ResourceRegistry<Texture> Texture::sTexturesLoaded;
 
 int Texture::default_mag_filter = GL_LINEAR;
 int Texture::default_min_filter = GL_LINEAR_MIPMAP_LINEAR;
 FBO* Texture::global_fbo = NULL;
+bool Texture::compress_textures = true;
 
 Texture::Texture()
 {
@@ -73,63 +79,58 @@ Texture::Texture()
 	format = 0;
 	type = 0;
 	texture_type = GL_TEXTURE_2D;
-	loading = false;
+	wrapS = wrapT = GL_REPEAT;
+	stream = NULL;
+	array_pool = NULL;
+	array_layer = -1;
+	packable = false;
 }
 
 Texture::Texture(unsigned int width, unsigned int height, unsigned int format, unsigned int type, bool mipmaps, Uint8* data, unsigned int internal_format)
 {
-	loading = false;
 	texture_id = 0;
+	stream = NULL;
+	array_pool = NULL;
+	array_layer = -1;
+	packable = false;
 	create(width, height, format, type, mipmaps, data, internal_format);
 }
 
 Texture::Texture(Image* img)
 {
-	loading = false;
 	texture_id = 0;
+	stream = NULL;
+	array_pool = NULL;
+	array_layer = -1;
+	packable = false;
 	create(img->width, img->height, img->num_channels == 3 ? GL_RGB : GL_RGBA, GL_UNSIGNED_BYTE, true, img->data);
 }
 
 Texture::~Texture()
 {
+	TextureStreamer::unregisterTexture(this);
 	clear();
 }
 
 void Texture::clear()
 {
+	TextureArrayPool::remove(this); //the content is going to change
 	glBindTexture(this->texture_type, 0);
 
 	//external textures are handled by an outside system (like Android OS)
 	if( texture_type != GL_TEXTURE_EXTERNAL_OES)
 		glDeleteTextures(1, &texture_id);
 
-	if(!loading) //when loading the texture of 1x1 is replaced with the new one
+	if(texture_id && !isLoading())
 		stdlog("Destroy texture: " + filename );
 	texture_id = 0;
-
-	if (filename.size())
-	{
-		auto it = sTexturesLoaded.find(filename);
-		if (it != sTexturesLoaded.end())
-			sTexturesLoaded.erase(it);
-	}
 }
 
 void Texture::Release()
 {
-	std::vector<Texture *> texs;
-
-	for (auto mp : sTexturesLoaded)
-	{
-		Texture *m = mp.second;
-		texs.push_back(m);
-	}
-
-	for (Texture *m : texs)
-	{
-		delete m;
-	}
-	sTexturesLoaded.clear();
+	TextureUploader::release(); //the pending uploads hold handles
+	sTexturesLoaded.releaseAll();
+	TextureArrayPool::Release();
 }
 
 void Texture::debugInMenu()
@@ -137,6 +138,11 @@ void Texture::debugInMenu()
 	#ifdef IMGUI
 	if (this == NULL)
 		return;
+	if (array_pool) //no 2D copy, it is a layer of the array
+	{
+		ImGui::Text("layer %d", array_layer);
+		return;
+	}
 	this->bind();
 		ImGui::Image((void*)(intptr_t)texture_id, ImVec2(50, 50));
 	#endif
@@ -155,7 +161,7 @@ void Texture::create(unsigned int width, unsigned int height, unsigned int forma
 	this->mipmaps = mipmaps && isPowerOfTwo(width) && isPowerOfTwo(height) && format != GL_DEPTH_COMPONENT;
 
 	//Delete previous texture and ensure that previous bounded texture_id is not of another texture type
-	if (this->texture_id != 0)
+	if (this->texture_id != 0 || this->array_pool)
 		clear();
 
 	this->texture_type = GL_TEXTURE_2D;
@@ -167,7 +173,6 @@ void Texture::create(unsigned int width, unsigned int height, unsigned int forma
 	upload(format, type, mipmaps, data, internal_format);
 }
 
-/*
 void Texture::create3D(unsigned int width, unsigned int height, unsigned int depth, unsigned int format, unsigned int type, bool mipmaps, Uint8* data, unsigned int internal_format)
 {
 	assert(width && height && depth && "texture must have a size");
@@ -178,7 +183,7 @@ void Texture::create3D(unsigned int width, unsigned int height, unsigned int dep
 	this->format = format;
 	this->internal_format = internal_format;
 	this->type = type;
-	this->mipmaps = mipmaps && isPowerOfTwo(width) && isPowerOfTwo(height) && format != GL_DEPTH_COMPONENT && isPowerOfTwo(this->depth);
+	this->mipmaps = mipmaps && isPowerOfTwo(width) && isPowerOfTwo(height) && format != GL_DEPTH_COMPONENT && isPowerOfTwo(depth);
 
 	//Delete previous texture and ensure that previous bounded texture_id is not of another texture type
 	if (this->texture_id != 0)
@@ -193,7 +198,6 @@ void Texture::create3D(unsigned int width, unsigned int height, unsigned int dep
 
 	upload3D(format, type, mipmaps, data, internal_format);
 }
-*/
 
 void Texture::createCubemap(unsigned int width, unsigned int height, Uint8** data, unsigned int format, unsigned int type, bool mipmaps, unsigned int internal_format)
 {
@@ -221,10 +225,7 @@ void Texture::createCubemap(unsigned int width, unsigned int height, Uint8** dat
 Texture* Texture::Find(const char* filename)
 {
 	assert(filename);
-	auto it = sTexturesLoaded.find(filename);
-	if (it != sTexturesLoaded.end())
-		return it->second;
-	return NULL;
+	return sTexturesLoaded.find(filename);
 }
 
 Texture* Texture::Get(const char* filename, bool mipmaps, bool wrap)
@@ -244,22 +245,26 @@ Texture* Texture::Get(const char* filename, bool mipmaps, bool wrap)
 	return texture;
 }
 
-Texture* Texture::GetAsync(const char* filename, bool mipmaps, bool wrap)
+Texture* Texture::GetAsync(const char* filename, bool mipmaps, bool wrap, eTextureUsage usage)
 {
 	//check if exists
 	Texture* texture = Find(filename);
 	if (texture)
 		return texture;
 
-	//create temp texture
+	//register it without GL texture till it is loaded, the renderer skips it meanwhile
 	Texture* temp = new Texture();
-	temp->create(1, 1);
-	//register
-	temp->setName(filename);
-	temp->loading = true;
+	temp->state = RESOURCE_LOADING;
+	temp->filename = filename;
+	texture = sTexturesLoaded.add(filename, temp);
+	if (texture != temp) //another thread registered it first
+	{
+		delete temp;
+		return texture;
+	}
 
 	//add action to BG Thread 
-	LoadTextureTask* task = new LoadTextureTask(filename);
+	LoadTextureTask* task = new LoadTextureTask(filename, usage, mipmaps);
 	TaskManager::background.addTask(task);
 
 	return temp;
@@ -294,6 +299,7 @@ void Texture::loadFromImage(Image* image, bool mipmaps, bool wrap, unsigned int
 	glBindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
 	glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_S, (this->mipmaps && wrap) ? GL_REPEAT : GL_CLAMP_TO_EDGE);
 	glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_T, (this->mipmaps && wrap) ? GL_REPEAT : GL_CLAMP_TO_EDGE);
+	this->wrapS = this->wrapT = (this->mipmaps && wrap) ? GL_REPEAT : GL_CLAMP_TO_EDGE;
 	//glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_S, GL_REPEAT);
 	//glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_T, GL_REPEAT);
 	//if (mipmaps)
@@ -301,6 +307,111 @@ void Texture::loadFromImage(Image* image, bool mipmaps, bool wrap, unsigned int
 	glBindTexture(GL_TEXTURE_2D, 0);
 }
 
+void Texture::uploadFromBuffer(unsigned int buffer, size_t offset, unsigned int y, unsigned int rows, unsigned int format, bool wrap)
+{
+	assert(texture_id && texture_type == GL_TEXTURE_2D && y + rows <= (unsigned int)height && "create the texture before uploading rows to it");
+
+	//the pixels are read from the buffer at offset, the GPU copies them later
+	glBindTexture(this->texture_type, texture_id);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1); //rows are not padded
+	glTexSubImage2D(this->texture_type, 0, 0, y, (int)width, rows, format, GL_UNSIGNED_BYTE, (void*)offset);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	//not complete till the last rows arrive
+	if (y + rows < (unsigned int)height)
+	{
+		glBindTexture(this->texture_type, 0);
+		return;
+	}
+
+	glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_S, (this->mipmaps && wrap) ? GL_REPEAT : GL_CLAMP_TO_EDGE);
+	glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_T, (this->mipmaps && wrap) ? GL_REPEAT : GL_CLAMP_TO_EDGE);
+	this->wrapS = this->wrapT = (this->mipmaps && wrap) ? GL_REPEAT : GL_CLAMP_TO_EDGE;
+	if (this->mipmaps)
+		generateMipmaps();
+	glBindTexture(this->texture_type, 0);
+	assert(checkGLErrors() && "Error uploading texture from buffer");
+}
+
+bool Texture::supportsBlockFormat(eBlockFormat format)
+{
+#ifdef USE_GLEW
+	if ((format == BLOCK_BC1 || format == BLOCK_BC3) && !GLEW_EXT_texture_compression_s3tc)
+		return false;
+#endif
+	return format != BLOCK_NONE;
+}
+
+bool Texture::uploadCompressed(CompressedImage* img, bool wrap)
+{
+	assert(img->levels.size());
+	int first_level = img->getFirstLoadedLevel();
+	assert(first_level < (int)img->levels.size() && "no mips loaded");
+
+	//no S3TC (BC1/BC3) support, upload it decoded
+	if (!supportsBlockFormat(img->format))
+	{
+		Image decoded;
+		img->decompress(decoded, first_level);
+		loadFromImage(&decoded, img->levels.size() > 1, wrap);
+		return false;
+	}
+
+	if (this->texture_id != 0)
+		clear();
+
+	this->width = (float)img->width;
+	this->height = (float)img->height;
+	this->depth = 0;
+	this->format = img->format == BLOCK_BC4 ? GL_RED : (img->format == BLOCK_BC5 ? GL_RG : (img->format == BLOCK_BC3 ? GL_RGBA : GL_RGB));
+	this->type = GL_UNSIGNED_BYTE;
+	this->internal_format = img->getGLFormat();
+	this->texture_type = GL_TEXTURE_2D;
+	this->mipmaps = img->levels.size() > 1;
+	this->wrapS = this->wrapT = wrap ? GL_REPEAT : GL_CLAMP_TO_EDGE;
+
+	glGenTextures(1, &texture_id);
+	glBindTexture(this->texture_type, texture_id);
+
+	//the biggest mips may be missing if they are streamed, the size is still the one of level 0
+	int num_levels = (int)img->levels.size();
+	for (int i = first_level; i < num_levels; ++i)
+		glCompressedTexImage2D(this->texture_type, i, internal_format, img->getLevelWidth(i), img->getLevelHeight(i), 0, (GLsizei)img->levels[i].size(), &img->levels[i][0]);
+	glTexParameteri(this->texture_type, GL_TEXTURE_BASE_LEVEL, first_level);
+	glTexParameteri(this->texture_type, GL_TEXTURE_MAX_LEVEL, num_levels - 1);
+
+	glTexParameteri(this->texture_type, GL_TEXTURE_MAG_FILTER, Texture::default_mag_filter);
+	glTexParameteri(this->texture_type, GL_TEXTURE_MIN_FILTER, this->mipmaps ? Texture::default_min_filter : GL_LINEAR);
+	glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_S, wrap ? GL_REPEAT : GL_CLAMP_TO_EDGE);
+	glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_T, wrap ? GL_REPEAT : GL_CLAMP_TO_EDGE);
+
+	//single channel masks are read as grey like the uncompressed ones
+	if (img->format == BLOCK_BC4)
+	{
+		GLint swizzle[4] = { GL_RED, GL_RED, GL_RED, GL_ONE };
+		glTexParameteriv(this->texture_type, GL_TEXTURE_SWIZZLE_RGBA, swizzle);
+	}
+
+	glBindTexture(this->texture_type, 0);
+	assert(checkGLErrors() && "Error uploading compressed texture");
+	return true;
+}
+
+void Texture::uploadCompressedLevels(CompressedImage* img)
+{
+	assert(texture_id && img->getGLFormat() == internal_format);
+	int first_level = img->getFirstLoadedLevel();
+
+	glBindTexture(this->texture_type, texture_id);
+	for (int i = first_level; i < (int)img->levels.size() && img->levels[i].size(); ++i)
+		glCompressedTexImage2D(this->texture_type, i, internal_format, img->getLevelWidth(i), img->getLevelHeight(i), 0, (GLsizei)img->levels[i].size(), &img->levels[i][0]);
+	glTexParameteri(this->texture_type, GL_TEXTURE_BASE_LEVEL, first_level);
+	glBindTexture(this->texture_type, 0);
+	assert(checkGLErrors() && "Error uploading compressed mips");
+}
+
 void Texture::upload(Image* img)
 {
 	create(img->width, img->height, img->num_channels == 3 ? GL_RGB : GL_RGBA, GL_UNSIGNED_BYTE, true, img->data);
@@ -335,6 +446,7 @@ void Texture::upload( unsigned int format, unsigned int type, bool mipmaps, Uint
 	glTexParameteri(this->texture_type, GL_TEXTURE_MIN_FILTER, this->mipmaps ? Texture::default_min_filter : GL_LINEAR);   //set the mag filter
 	glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_S, this->mipmaps ? GL_REPEAT : GL_CLAMP_TO_EDGE);
 	glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_T, this->mipmaps ? GL_REPEAT : GL_CLAMP_TO_EDGE);
+	this->wrapS = this->wrapT = this->mipmaps ? GL_REPEAT : GL_CLAMP_TO_EDGE;
 	//glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, 4); //better quality but takes more resources
 
 	if (data && this->mipmaps)
@@ -344,13 +456,20 @@ void Texture::upload( unsigned int format, unsigned int type, bool mipmaps, Uint
 	assert(checkGLErrors() && "Error uploading texture");
 }
 
-/*
 void Texture::upload3D(unsigned int format, unsigned int type, bool mipmaps, Uint8* data, unsigned int internal_format) {
 	assert(texture_id && "Must create texture before uploading data.");
 	assert(texture_type == GL_TEXTURE_3D && "Texture type does not match.");
 
 	glBindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
 
+	if (internal_format == 0)
+	{
+		if (type == GL_FLOAT)
+			internal_format = format == GL_RGB ? GL_RGB32F : GL_RGBA32F;
+		else if (type == GL_HALF_FLOAT)
+			internal_format = format == GL_RGB ? GL_RGB16F : GL_RGBA16F;
+	}
+
 	glTexImage3D(this->texture_type, 0, internal_format == 0 ? format : internal_format, width, height, depth, 0, format, type, data);
 
 	glTexParameteri(this->texture_type, GL_TEXTURE_MAG_FILTER, Texture::default_mag_filter);	//set the min filter
@@ -358,6 +477,7 @@ void Texture::upload3D(unsigned int format, unsigned int type, bool mipmaps, Uin
 	glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_S, this->mipmaps ? GL_REPEAT : GL_CLAMP_TO_EDGE);
 	glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_T, this->mipmaps ? GL_REPEAT : GL_CLAMP_TO_EDGE);
 	glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_R, this->mipmaps ? GL_REPEAT : GL_CLAMP_TO_EDGE);
+	this->wrapS = this->wrapT = this->mipmaps ? GL_REPEAT : GL_CLAMP_TO_EDGE;
 
 	if (data && this->mipmaps)
 		generateMipmaps(); //glGenerateMipmapEXT(GL_TEXTURE_2D); 
@@ -365,7 +485,6 @@ void Texture::upload3D(unsigned int format, unsigned int type, bool mipmaps, Uin
 	glBindTexture(this->texture_type, 0);
 	assert(checkGLErrors() && "Error uploading texture");
 }
-*/
 
 void Texture::uploadCubemap(unsigned int format, unsigned int t, bool mips, Uint8** data, unsigned int intFormat, int level) {
 	
@@ -495,6 +614,7 @@ void Texture::uploadAsArray(unsigned int texture_size, bool mipmaps)
 
 void Texture::bind()
 {
+	assert(!array_pool && "packed texture, bind its array_pool->array and sample the layer");
 	//glEnable(this->texture_type); //enable the textures 
 	glBindTexture(this->texture_type, texture_id );	//enable the id of the texture we are going to use
 }
@@ -632,7 +752,7 @@ void Image::fromScreen(int width, int height)
 	{
 		this->width = width;
 		this->height = height;
-		data = new uint8[width * height * 4];
+		data = (uint8*)allocImageData(width * height * 4);
 	}
 
 	glReadPixels(0,0,width, height, GL_RGBA, GL_UNSIGNED_BYTE, data);
@@ -649,7 +769,7 @@ void Image::fromTexture(Texture* texture)
 	{
 		width = texture->width;
 		height = texture->height;
-		data = new uint8[width * height * 4];
+		data = (uint8*)allocImageData(width * height * 4);
 	}
 	
 	texture->bind();
@@ -683,7 +803,11 @@ bool Image::load(const char* filename)
 		return false;
 	}
 
-	std::cout << "[OK] Size: " << width << "x" << height << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
+	double seconds = (getTime() - time) * 0.001;
+	std::cout << "[OK] Size: " << width << "x" << height << " Time: " << seconds << "sec";
+	if (seconds > 0)
+		std::cout << " (" << (width * height * num_channels) / (1024.0 * 1024.0) / seconds << " MB/s)";
+	std::cout << std::endl;
 
 	return true;
 }
@@ -740,11 +864,12 @@ bool Image::loadTGA(const char* filename)
 
     imageSize = width * height * num_channels;
     
-    data = new GLubyte[imageSize];
+    data = (GLubyte*)allocImageData(imageSize);
     if (data == NULL || fread(data, 1, imageSize, file) != imageSize)
     {
         if (data != NULL)
-            delete []data;
+            freeImageData(data);
+        data = NULL;
         fclose(file);
         return NULL;
     }
@@ -777,9 +902,14 @@ bool Image::loadPNG(const char* filename, bool flip_y)
 }
 
 bool Image::loadPNG(std::vector<unsigned char>& buffer, bool flip_y)
+{
+	return loadPNG(buffer.empty() ? NULL : &buffer[0], buffer.size(), flip_y);
+}
+
+bool Image::loadPNG(const uint8* buffer, size_t size, bool flip_y)
 {
 #ifdef USE_SKIA
-    sk_sp<SkData> skData = SkData::MakeWithoutCopy(&buffer[0], buffer.size());
+    sk_sp<SkData> skData = SkData::MakeWithoutCopy(buffer, size);
     std::unique_ptr<SkCodec> codec(SkCodec::MakeFromData(skData));
     SkBitmap bitmap;
     const SkImageInfo skInfo = codec->getInfo();
@@ -796,25 +926,18 @@ bool Image::loadPNG(std::vector<unsigned char>& buffer, bool flip_y)
         this->height = (unsigned int)height;
         this->num_channels = skInfo.bytesPerPixel(); // (unsigned int)channels;
 
-        data = new unsigned char[nSize];
+        data = (uint8*)allocImageData(nSize);
         memcpy(data, pSrc, nSize);
     }
-#else
-    std::vector<unsigned char> out_image;
-
-	if (decodePNG(out_image, width, height, buffer.empty() ? 0 : &buffer[0], (unsigned long)buffer.size(), true) != 0)
-		return false;
-
-	data = new Uint8[out_image.size()];
-	memcpy(data, &out_image[0], out_image.size());
-	num_channels = 4;
-#endif
 
 	//flip pixels in Y
 	if (flip_y)
 		flipY();
-
 	return true;
+#else
+	//always RGBA, like the PNGs were loaded before
+	return decode(buffer, size, 4, flip_y);
+#endif
 }
 
 bool Image::loadJPG(const char* filename, bool flip_y)
@@ -827,26 +950,13 @@ bool Image::loadJPG(const char* filename, bool flip_y)
 
 bool Image::loadJPG(std::vector<unsigned char>& buffer, bool flip_y)
 {
-	std::vector<unsigned char> out_image;
-
-	int width;
-	int height;
-	int actual_comps;
-	int channels;
-
-	/*
-	int req_comps = 3;
-	assert(data == NULL); //image must be empty
-	data = jpgd::decompress_jpeg_image_from_memory(&buffer[0], (unsigned long)buffer.size(), &width, &height, &actual_comps, req_comps);
-	if(!data)
-		return false;
-
-	this->width = (unsigned int)width;
-	this->height = (unsigned int)height;
-	*/
+	return loadJPG(buffer.empty() ? NULL : &buffer[0], buffer.size(), flip_y);
+}
 
+bool Image::loadJPG(const uint8* buffer, size_t size, bool flip_y)
+{
 #ifdef USE_SKIA
-    sk_sp<SkData> skData = SkData::MakeWithoutCopy(&buffer[0], buffer.size());
+    sk_sp<SkData> skData = SkData::MakeWithoutCopy(buffer, size);
     std::unique_ptr<SkCodec> codec(SkCodec::MakeFromData(skData));
     SkBitmap bitmap;
     const SkImageInfo skInfo = codec->getInfo();
@@ -863,29 +973,64 @@ bool Image::loadJPG(std::vector<unsigned char>& buffer, bool flip_y)
         this->height = (unsigned int)height;
         this->num_channels = skInfo.bytesPerPixel(); // (unsigned int)channels;
 
-        data = new unsigned char[nSize];
+        data = (uint8*)allocImageData(nSize);
         memcpy(data, pSrc, nSize);
     }
+
+	//flip pixels in Y
+	if (flip_y)
+		flipY();
+	return true;
 #else
-	//stb_image
-	unsigned char* image_data = stbi_load_from_memory( (stbi_uc*) &buffer[0], (unsigned long)buffer.size(), &width, &height, &channels, STBI_rgb);
-	if (!image_data)
+	return decode(buffer, size, 3, flip_y);
+#endif
+}
+
+bool Image::loadFromMemory(const uint8* buffer, size_t size, bool flip_y)
+{
+	if (!buffer || size < 4)
 		return false;
-	this->width = (unsigned int)width;
-	this->height = (unsigned int)height;
-	this->num_channels = 3;// (unsigned int)channels;
+	if (!memcmp(buffer, "\x89PNG", 4))
+		return loadPNG(buffer, size, flip_y);
+	if (buffer[0] == 0xFF && buffer[1] == 0xD8) //JPEG start of image
+		return loadJPG(buffer, size, flip_y);
+	return false;
+}
 
-	//clone
-	data = new unsigned char[width * height * this->num_channels];
-	memcpy(data, image_data, width * height * this->num_channels);
+bool Image::canLoadFromMemory(const char* filename)
+{
+	std::string ext = filename;
+	ext = ext.size() > 4 ? ext.substr(ext.size() - 4, 4) : "";
+	return ext == ".png" || ext == ".PNG" || ext == ".jpg" || ext == ".JPG" || ext == "JPEG" || ext == "jpeg";
+}
 
-	stbi_image_free(image_data);
-#endif
+std::atomic<int> Image::decoded_images(0);
+std::atomic<uint64_t> Image::decoded_bytes(0);
+std::atomic<uint64_t> Image::decode_time(0);
 
-	//flip pixels in Y
-	if (flip_y)
-		flipY();
+float Image::getDecodeThroughput()
+{
+	return decode_time ? (float)(decoded_bytes / (1024.0 * 1024.0) / (decode_time * 0.000001)) : 0.0f;
+}
+
+//stb_image decodes straight into a pool buffer that the image keeps (no copies), the flip is done in place
+bool Image::decode(const uint8* buffer, size_t size, int num_channels, bool flip_y)
+{
+	if (!buffer || !size)
+		return false;
+	auto start = std::chrono::steady_clock::now();
+
+	int width, height, channels;
+	stbi_set_flip_vertically_on_load_thread(flip_y); //the flag is per thread
+	uint8* pixels = stbi_load_from_memory(buffer, (int)size, &width, &height, &channels, num_channels);
+	if (!pixels)
+		return false;
+	adopt(pixels, width, height, num_channels);
 
+	std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+	decoded_images++;
+	decoded_bytes += (uint64_t)width * height * num_channels;
+	decode_time += (uint64_t)elapsed.count();
 	return true;
 }
 
@@ -943,15 +1088,19 @@ void tImage<T>::flipY()
 #pragma omp simd
 	for (int y = 0; y < height*0.5; y += 1)
 	{
-		uint8* pos = data + y*row_size;
-		memcpy(temp_row, pos, row_size);
-		uint8* pos2 = data + (height - y - 1)*row_size;
-		memcpy(pos, pos2, row_size);
-		memcpy(pos2, temp_row, row_size);
+		T* pos = data + y*row_size;
+		memcpy(temp_row, pos, row_size * sizeof(T));
+		T* pos2 = data + (height - y - 1)*row_size;
+		memcpy(pos, pos2, row_size * sizeof(T));
+		memcpy(pos2, temp_row, row_size * sizeof(T));
 	}
 	delete[] temp_row;
 }
 
+//the decoders flip while loading, but it can still be called on any image
+template void tImage<uint8>::flipY();
+template void tImage<float>::flipY();
+
 struct tImageHeader {
 	int width;
 	int height;
@@ -1004,13 +1153,86 @@ void FloatImage::fromTexture(Texture* texture)
 	{
 		width = texture->width;
 		height = texture->height;
-		data = new float[width * height * num_channels];
+		data = (float*)allocImageData(width * height * num_channels * sizeof(float));
 	}
 
 	texture->bind();
 	glGetTexImage(GL_TEXTURE_2D, 0, num_channels == 3 ? GL_RGB : GL_RGBA, GL_FLOAT, data);
 }
 
+//*********************
+//pool of image buffers
+
+#define IMAGE_POOL_MIN_SIZE (256 * 1024) //smaller ones go straight to malloc
+#define IMAGE_POOL_MAX_BYTES (256 * 1024 * 1024) //freed buffers kept for reuse
+
+struct sImageBufferHeader {
+	size_t capacity; //bytes after the header
+	size_t padding; //keeps the pixels 16 bytes aligned
+};
+
+static std::mutex image_pool_mutex;
+static std::unordered_map<size_t, std::vector<sImageBufferHeader*> > image_pool; //free buffers by capacity
+static size_t image_pool_bytes = 0;
+
+void* allocImageData(size_t size)
+{
+	//big ones are rounded to pages so images of the same size share them
+	size_t capacity = size < IMAGE_POOL_MIN_SIZE ? size : (size + 4095) & ~(size_t)4095;
+	sImageBufferHeader* header = NULL;
+	if (capacity >= IMAGE_POOL_MIN_SIZE)
+	{
+		std::lock_guard<std::mutex> lock(image_pool_mutex);
+		auto it = image_pool.find(capacity);
+		if (it != image_pool.end() && it->second.size())
+		{
+			header = it->second.back();
+			it->second.pop_back();
+			image_pool_bytes -= capacity;
+		}
+	}
+	if (!header)
+	{
+		header = (sImageBufferHeader*)malloc(sizeof(sImageBufferHeader) + capacity);
+		if (!header)
+			return NULL;
+		header->capacity = capacity;
+	}
+	return header + 1;
+}
+
+void* reallocImageData(void* ptr, size_t size)
+{
+	if (!ptr)
+		return allocImageData(size);
+	sImageBufferHeader* header = (sImageBufferHeader*)ptr - 1;
+	if (size <= header->capacity)
+		return ptr;
+	void* result = allocImageData(size);
+	if (!result)
+		return NULL;
+	memcpy(result, ptr, header->capacity);
+	freeImageData(ptr);
+	return result;
+}
+
+void freeImageData(void* ptr)
+{
+	if (!ptr)
+		return;
+	sImageBufferHeader* header = (sImageBufferHeader*)ptr - 1;
+	if (header->capacity >= IMAGE_POOL_MIN_SIZE)
+	{
+		std::lock_guard<std::mutex> lock(image_pool_mutex);
+		if (image_pool_bytes + header->capacity <= IMAGE_POOL_MAX_BYTES)
+		{
+			image_pool[header->capacity].push_back(header);
+			image_pool_bytes += header->capacity;
+			return;
+		}
+	}
+	free(header);
+}
 
 bool isPowerOfTwo( int n )
 {
@@ -1019,39 +1241,131 @@ bool isPowerOfTwo( int n )
 
 //*********************
 
-LoadTextureTask::LoadTextureTask(const char* str)
+LoadTextureTask::LoadTextureTask(const char* str, eTextureUsage usage, bool mipmaps)
 {
 	filename = str;
 	image = NULL;
+	this->usage = usage;
+	this->mipmaps = mipmaps;
 }
 
 void LoadTextureTask::onExecute()
 {
-	image = new Image();
-	if (!image->load(filename.c_str()))
+	//the compressed version is baked the first time and stored next to the file
+	if (Texture::compress_textures && usage != TEXTURE_GENERIC)
+	{
+		std::string bakename = filename + ".ctex";
+		CompressedImage* compressed = new CompressedImage();
+
+		//when streaming only the small mips are read, the rest are loaded once they are visible
+		int first_level = 0;
+		CompressedImage info;
+		if (CompressedImage::loadHeader(bakename.c_str(), info) && Texture::supportsBlockFormat(info.format))
+			first_level = TextureStreamer::getFirstResidentLevel(info);
+
+		if (compressed->load(bakename.c_str(), first_level) && compressed->usage == usage && (compressed->levels.size() > 1) == mipmaps &&
+			compressed->matchesSource(filename.c_str()))
+		{
+			UploadTextureTask* upload_task = new UploadTextureTask(filename.c_str(), NULL, compressed);
+			TaskManager::foreground.addTask(upload_task);
+			return;
+		}
+		delete compressed;
+	}
+
+	//decoding (and baking) is CPU bound, it is done by a worker so this thread can read the next file
+	if (Image::canLoadFromMemory(filename.c_str()))
+	{
+		std::vector<unsigned char>* buffer = new std::vector<unsigned char>();
+		if (readFileBin(filename, *buffer))
+		{
+			std::string filename = this->filename;
+			eTextureUsage usage = this->usage;
+			bool mipmaps = this->mipmaps;
+			TaskManager::workers.addTask(new Task([=]() {
+				decode(filename, usage, mipmaps, buffer);
+				delete buffer;
+			}));
+			return;
+		}
+		delete buffer;
+	}
+
+	decode(filename, usage, mipmaps, NULL);
+}
+
+void LoadTextureTask::decode(const std::string& filename, eTextureUsage usage, bool mipmaps, std::vector<unsigned char>* buffer)
+{
+	Image* image = new Image();
+	bool loaded = false;
+	if (buffer)
+	{
+		double time = getTime();
+		loaded = image->loadFromMemory(buffer->empty() ? NULL : &(*buffer)[0], buffer->size());
+		double seconds = (getTime() - time) * 0.001;
+		if (loaded)
+			stdlog(" + Image decoded: " + filename + " Size: " + std::to_string(image->width) + "x" + std::to_string(image->height) + " Time: " + std::to_string(seconds) + "sec (" + std::to_string(seconds > 0 ? (image->width * image->height * image->num_channels) / (1024.0 * 1024.0) / seconds : 0) + " MB/s)");
+	}
+	else
+		loaded = image->load(filename.c_str());
+	if (!loaded)
 	{
 		delete image;
 		image = NULL;
 	}
 
+	CompressedImage* compressed = NULL;
+	if (Texture::compress_textures && usage != TEXTURE_GENERIC)
+	{
+		compressed = new CompressedImage();
+		double time = getTime();
+		if (image && compressed->compress(image, usage, mipmaps))
+		{
+			std::string bakename = filename + ".ctex";
+			compressed->setSource(filename.c_str());
+			compressed->save(bakename.c_str());
+			stdlog(" + Texture baked: " + bakename + " Time: " + std::to_string((getTime() - time) * 0.001) + "sec");
+			delete image;
+			image = NULL;
+
+			if (Texture::supportsBlockFormat(compressed->format))
+			{
+				int first_level = TextureStreamer::getFirstResidentLevel(*compressed);
+				for (int i = 0; i < first_level; ++i)
+					std::vector<uint8>().swap(compressed->levels[i]);
+			}
+		}
+		else
+		{
+			delete compressed;
+			compressed = NULL;
+		}
+	}
+
+	//plain images are copied to the upload ring from this worker
+	if (image && !compressed)
+	{
+		TextureUploader::upload(filename, image, mipmaps);
+		return;
+	}
+
 	//image loaded, ready to go back to main thread
-	UploadTextureTask* upload_task = new UploadTextureTask(filename.c_str(), image);
+	UploadTextureTask* upload_task = new UploadTextureTask(filename.c_str(), image, compressed);
 	TaskManager::foreground.addTask(upload_task);
 }
 
-UploadTextureTask::UploadTextureTask(const char* filename, Image* image)
+UploadTextureTask::UploadTextureTask(const char* filename, Image* image, CompressedImage* compressed)
 {
 	this->filename = filename;
 	this->image = image;
+	this->compressed = compressed;
 }
 
 void UploadTextureTask::onExecute()
 {
-	Texture* texture = NULL;
-
-	//in case somehow it got loaded while I was loading it in the background
-	auto it = Texture::sTexturesLoaded.find(filename);
-	if (it == Texture::sTexturesLoaded.end())
+	//it could have been destroyed while it was loading
+	Texture* texture = Texture::sTexturesLoaded.find(filename);
+	if (!texture)
 	{
 		/*
 		//create texture
@@ -1059,16 +1373,29 @@ void UploadTextureTask::onExecute()
 			texture = new Texture();
 		*/
 		delete image;
+		delete compressed;
 		std::cout << "Warning: image loaded in background not found foreground thread" << std::endl;
 		return;
 	}
 
-	texture = it->second;
+	if (compressed)
+	{
+		//the big mips are left to the streamer, if the format is not supported it was decoded instead
+		if (texture->uploadCompressed(compressed) && compressed->getFirstLoadedLevel() > 0)
+			TextureStreamer::registerTexture(texture, filename + ".ctex", *compressed);
+		texture->state = RESOURCE_READY;
+		if (texture->packable)
+			TextureArrayPool::pack(texture);
+		delete compressed;
+		return;
+	}
 
-	//upload to GPU
-	texture->loadFromImage(image);
-	texture->loading = false;
+	if (!image)
+	{
+		texture->state = RESOURCE_FAILED;
+		return;
+	}
 
-	//delete image
-	delete image;
+	//upload to GPU, it takes the image
+	TextureUploader::upload(texture, image);
 }
@@ -7,9 +7,15 @@
 #include "includes.h"
 #include "framework.h"
 #include "task.h"
+#include "resource.h"
+#include "texture_baker.h"
+#include "texture_streamer.h"
+#include "texture_uploader.h"
+#include "texture_array.h"
 #include <map>
 #include <set>
 #include <string>
+#include <atomic>
 #include <cassert>
 
 class Shader;
@@ -28,6 +34,12 @@ class Texture;
 	#define GL_TEXTURE_EXTERNAL_OES 0x8D65
 #endif
 
+//The pixels of the images come from a pool, big buffers are kept once freed and reused by the next image of
+//the same size. The decoders (stb_image) allocate through it too, so the images adopt their buffer without copying.
+void* allocImageData(size_t size);
+void* reallocImageData(void* ptr, size_t size);
+void freeImageData(void* ptr);
+
 //Simple class to handle images (stores RGBA always)
 template <typename T> class tImage
 {
@@ -40,10 +52,12 @@ public:
 
 	tImage() { width = height = 0; data = NULL; num_channels = 3; }
 	tImage(int w, int h, int num_channels = 3) { data = NULL; resize(w, h, num_channels); }
-	~tImage() { if (data) delete[]data; data = NULL; }
+	~tImage() { if (data) freeImageData(data); data = NULL; }
 
-	void resize(int w, int h, int num_channels = 3) { if (data) delete[] data; width = w; height = h; this->num_channels = num_channels; data = new T[w * h * num_channels]; memset(data, 0, w * h * sizeof(T) * num_channels); }
-	void clear() { if (data) delete[]data; data = NULL; width = height = 0; }
+	void resize(int w, int h, int num_channels = 3) { if (data) freeImageData(data); width = w; height = h; this->num_channels = num_channels; data = (T*)allocImageData(w * h * num_channels * sizeof(T)); memset(data, 0, w * h * sizeof(T) * num_channels); }
+	void clear() { if (data) freeImageData(data); data = NULL; width = height = 0; }
+	//takes ownership of a buffer from allocImageData
+	void adopt(T* buffer, int w, int h, int num_channels) { if (data) freeImageData(data); data = buffer; width = w; height = h; this->num_channels = num_channels; }
 	void flipY();
 };
 
@@ -68,13 +82,27 @@ public:
 	void fromScreen(int width, int height);
 
 	bool load(const char* filename);
+	//PNG or JPG already in memory, it can be called from any thread
+	bool loadFromMemory(const uint8* buffer, size_t size, bool flip_y = false);
+	static bool canLoadFromMemory(const char* filename); //formats loadFromMemory understands
 
 	bool loadTGA(const char* filename);
 	bool loadPNG(const char* filename, bool flip_y = true);
 	bool loadPNG(std::vector<unsigned char>& buffer, bool flip_y = false);
+	bool loadPNG(const uint8* buffer, size_t size, bool flip_y = false);
 	bool loadJPG(const char* filename, bool flip_y = false);
 	bool loadJPG(std::vector<unsigned char>& buffer, bool flip_y = false);
+	bool loadJPG(const uint8* buffer, size_t size, bool flip_y = false);
 	bool saveTGA(const char* filename, bool flip_y = false);
+
+	//decoding stats of all the threads, to measure the throughput
+	static std::atomic<int> decoded_images;
+	static std::atomic<uint64_t> decoded_bytes; //of pixels
+	static std::atomic<uint64_t> decode_time; //in microseconds, added from every thread
+	static float getDecodeThroughput(); //MB/s of a single thread
+
+private:
+	bool decode(const uint8* buffer, size_t size, int num_channels, bool flip_y);
 };
 
 class FloatImage : public tImage<float>
@@ -101,24 +129,24 @@ public:
 
 
 // TEXTURE CLASS
-class Texture
+class Texture : public Resource
 {
 public:
 	static int default_mag_filter;
 	static int default_min_filter;
 	static FBO* global_fbo;
+	static bool compress_textures; //textures loaded async with a usage are baked to block compressed formats (.ctex)
 
 	//a general struct to store all the information about a TGA file
 
 	//textures manager
-	static std::map<std::string, Texture*> sTexturesLoaded;
+	static ResourceRegistry<Texture> sTexturesLoaded;
 
 	GLuint texture_id; // GL id to identify the texture in opengl, every texture must have its own id
 	float width;
 	float height;
 	float depth;	//Optional for 3dTexture or 2dTexture array
 	std::string filename;
-	bool loading;
 
 	unsigned int format; //GL_RGB, GL_RGBA
 	unsigned int type; //GL_UNSIGNED_INT, GL_FLOAT
@@ -129,6 +157,11 @@ public:
 	unsigned int wrapS;
 	unsigned int wrapT;
 
+	sTextureStreamInfo* stream; //only the small mips are resident, the TextureStreamer loads the rest (NULL if not streamed)
+	TextureArrayPool* array_pool; //the array where it is copied as a layer (NULL if it is not packed)
+	int array_layer; //-1 if not packed
+	bool packable; //only sampled by materials, it is packed once loaded
+
 	//original data info
 	Image image;
 
@@ -143,15 +176,18 @@ public:
 	void clear();
 
 	void create(unsigned int width, unsigned int height, unsigned int format = GL_RGB, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8* data = NULL, unsigned int internal_format = 0);
-	//void create3D(unsigned int width, unsigned int height, unsigned int depth, unsigned int format = GL_RED, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8* data = NULL, unsigned int internal_format = 0);
+	void create3D(unsigned int width, unsigned int height, unsigned int depth, unsigned int format = GL_RED, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8* data = NULL, unsigned int internal_format = 0);
 	void createCubemap(unsigned int width, unsigned int height, Uint8** data = NULL, unsigned int format = GL_RGBA, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, unsigned int internal_format = 0);
 
 	void upload(Image* img);
 	void upload(FloatImage* img);
 	void upload(unsigned int format = GL_RGB, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8* data = NULL, unsigned int internal_format = 0);
-	//void upload3D(unsigned int format = GL_RED, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8* data = NULL, unsigned int internal_format = 0);
+	void upload3D(unsigned int format = GL_RED, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8* data = NULL, unsigned int internal_format = 0);
 	void uploadCubemap(unsigned int format = GL_RGB, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8** data = NULL, unsigned int internal_format = 0, int level = 0);
 	void uploadAsArray(unsigned int texture_size, bool mipmaps = true);
+	bool uploadCompressed(CompressedImage* img, bool wrap = true); //the mips stored in the image, returns false if it had to be decompressed
+	void uploadCompressedLevels(CompressedImage* img); //adds the bigger mips stored in the image to the current ones
+	static bool supportsBlockFormat(eBlockFormat format);
 
 	void bind();
 	void unbind();
@@ -165,14 +201,16 @@ public:
 	//load without using the manager
 	bool load(const char* filename, bool mipmaps = true, bool wrap = true, unsigned int type = GL_UNSIGNED_BYTE);
 	void loadFromImage(Image* image, bool mipmaps = true, bool wrap = true, unsigned int type = GL_UNSIGNED_BYTE);
+	//rows [y, y + rows) of 8 bit pixels from a pixel unpack buffer, create it first. The last rows set the wrap and build the mipmaps
+	void uploadFromBuffer(unsigned int buffer, size_t offset, unsigned int y, unsigned int rows, unsigned int format = GL_RGBA, bool wrap = true);
 
 	//load using the manager (caching loaded ones to avoid reloading them)
 	static Texture* Get(const char* filename, bool mipmaps = true, bool wrap = true);
-	static Texture* GetAsync(const char* filename, bool mipmaps = true, bool wrap = true);
+	static Texture* GetAsync(const char* filename, bool mipmaps = true, bool wrap = true, eTextureUsage usage = TEXTURE_GENERIC);
 	static Texture* Find(const char* filename);
 	void setName(const char* name) {
 		filename = name;
-		sTexturesLoaded[filename] = this;
+		sTexturesLoaded.add(filename, this);
 	}
 
 	void generateMipmaps();
@@ -191,23 +229,31 @@ bool isPowerOfTwo(int n);
 
 //When loading textures asyncrhonously, first we load them from the hard drive in a background thread
 //afterwards we pass the data to the main thread as bg threads cannot access opengl, and main thread
-//uploads to GPU. While loading a fake 1x1 texture is created
+//uploads to GPU. While loading the texture is registered in RESOURCE_LOADING state without a GL texture
+
+//The file is read in the background thread and decoded (and baked) by a worker, so several images are decoded at the same time
 
 class LoadTextureTask : public Task {
 public:
 	std::string filename;
 	Image* image;
+	eTextureUsage usage; //if it is not generic the texture is compressed
+	bool mipmaps;
 
-	LoadTextureTask(const char* filename);
+	LoadTextureTask(const char* filename, eTextureUsage usage = TEXTURE_GENERIC, bool mipmaps = true);
 	void onExecute();
+
+	//from the file content if buffer is not NULL, then sends it to the main thread
+	static void decode(const std::string& filename, eTextureUsage usage, bool mipmaps, std::vector<unsigned char>* buffer);
 };
 
 class UploadTextureTask : public Task {
 public:
 	std::string filename;
 	Image* image;
+	CompressedImage* compressed;
 
-	UploadTextureTask(const char* filename, Image* image);
+	UploadTextureTask(const char* filename, Image* image, CompressedImage* compressed = NULL);
 	void onExecute();
 };
 
@@ -0,0 +1,294 @@
+#include "texture_array.h"
+#include "texture.h"
+#include "resource.h"
+#include "utils.h"
+#include "includes.h"
+
+#include <cassert>
+#include <algorithm>
+
+bool TextureArrayPool::enabled = true;
+int TextureArrayPool::max_layers = 256;
+int TextureArrayPool::max_array_size = 128;
+std::vector<TextureArrayPool*> TextureArrayPool::pools;
+
+static int copy_image = -1; //GL_ARB_copy_image, -1 until checked
+static GLuint read_fbo = 0;
+static GLuint draw_fbo = 0;
+
+static bool isCompressedFormat(unsigned int internal_format)
+{
+	return internal_format == GL_COMPRESSED_RGB_S3TC_DXT1_EXT || internal_format == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT ||
+		internal_format == GL_COMPRESSED_RED_RGTC1 || internal_format == GL_COMPRESSED_RG_RGTC2;
+}
+
+//bytes of a level of one layer
+static size_t getLevelSize(unsigned int internal_format, unsigned int format, int width, int height)
+{
+	if (isCompressedFormat(internal_format))
+	{
+		size_t block_size = (internal_format == GL_COMPRESSED_RGB_S3TC_DXT1_EXT || internal_format == GL_COMPRESSED_RED_RGTC1) ? 8 : 16;
+		return (size_t)((width + 3) / 4) * ((height + 3) / 4) * block_size;
+	}
+	int channels = format == GL_RGBA ? 4 : (format == GL_RGB ? 3 : (format == GL_RG ? 2 : 1));
+	return (size_t)width * height * channels;
+}
+
+TextureArrayPool::TextureArrayPool(Texture* texture, int num_levels, int num_layers)
+{
+	width = (int)texture->width;
+	height = (int)texture->height;
+	this->num_levels = num_levels;
+	format = texture->format;
+	internal_format = texture->internal_format ? texture->internal_format : texture->format; //the same than the 2D ones, glCopyImageSubData needs it
+	wrap = texture->wrapS;
+	compressed = isCompressedFormat(internal_format);
+	num_used = 0;
+	array = new Texture();
+	array->texture_type = GL_TEXTURE_2D_ARRAY;
+	array->width = (float)width;
+	array->height = (float)height;
+	array->format = format;
+	array->internal_format = internal_format;
+	array->type = GL_UNSIGNED_BYTE;
+	array->mipmaps = num_levels > 1;
+	array->wrapS = array->wrapT = wrap;
+	array->depth = (float)num_layers;
+	layers.resize(num_layers, NULL);
+
+	glGenTextures(1, &array->texture_id);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, array->texture_id);
+	for (int i = 0; i < num_levels; ++i)
+	{
+		int w = std::max(width >> i, 1);
+		int h = std::max(height >> i, 1);
+		if (compressed)
+			glCompressedTexImage3D(GL_TEXTURE_2D_ARRAY, i, internal_format, w, h, num_layers, 0, (GLsizei)(getLevelSize(internal_format, format, w, h) * num_layers), NULL);
+		else
+			glTexImage3D(GL_TEXTURE_2D_ARRAY, i, internal_format, w, h, num_layers, 0, format, GL_UNSIGNED_BYTE, NULL);
+	}
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, num_levels - 1);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, Texture::default_mag_filter);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, num_levels > 1 ? Texture::default_min_filter : GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, wrap);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, wrap);
+	if (internal_format == GL_COMPRESSED_RED_RGTC1) //same swizzle than the 2D ones
+	{
+		GLint swizzle[4] = { GL_RED, GL_RED, GL_RED, GL_ONE };
+		glTexParameteriv(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_SWIZZLE_RGBA, swizzle);
+	}
+	glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+}
+
+TextureArrayPool::~TextureArrayPool()
+{
+	//only on exit, the packed textures have no other copy
+	for (Texture* texture : layers)
+		if (texture)
+		{
+			texture->array_pool = NULL;
+			texture->array_layer = -1;
+		}
+	delete array;
+}
+
+bool TextureArrayPool::matches(Texture* texture, int num_levels)
+{
+	unsigned int texture_format = texture->internal_format ? texture->internal_format : texture->format;
+	return width == (int)texture->width && height == (int)texture->height && this->num_levels == num_levels &&
+		format == texture->format && internal_format == texture_format && wrap == texture->wrapS;
+}
+
+//copies all the levels of a layer, from a 2D texture (src_layer is ignored) or another array
+void TextureArrayPool::copyLayer(unsigned int src_id, unsigned int src_target, int src_layer, unsigned int dst_id, int dst_layer)
+{
+	for (int i = 0; i < num_levels; ++i)
+	{
+		int w = std::max(width >> i, 1);
+		int h = std::max(height >> i, 1);
+		if (copy_image)
+		{
+			glCopyImageSubData(src_id, src_target, i, 0, 0, src_target == GL_TEXTURE_2D_ARRAY ? src_layer : 0,
+				dst_id, GL_TEXTURE_2D_ARRAY, i, 0, 0, dst_layer, w, h, 1);
+			continue;
+		}
+
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, read_fbo);
+		if (src_target == GL_TEXTURE_2D_ARRAY)
+			glFramebufferTextureLayer(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, src_id, i, src_layer);
+		else
+			glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, src_id, i);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, draw_fbo);
+		glFramebufferTextureLayer(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, dst_id, i, dst_layer);
+		glBlitFramebuffer(0, 0, w, h, 0, 0, w, h, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+	}
+}
+
+bool TextureArrayPool::pack(Texture* texture)
+{
+	assert(Resource::isMainThread());
+	if (texture->array_pool)
+		return true;
+	if (!enabled || !texture->packable || !texture->isReady())
+		return false;
+
+	if (copy_image == -1)
+	{
+#ifdef USE_GLEW
+		copy_image = GLEW_ARB_copy_image ? 1 : 0;
+#else
+		copy_image = SDL_GL_ExtensionSupported("GL_ARB_copy_image") ? 1 : 0;
+#endif
+		GLint limit = 0;
+		glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &limit);
+		max_layers = std::min(max_layers, (int)limit);
+	}
+
+	//only plain 2D textures that wont change, blits cannot copy compressed ones
+	bool compressed = isCompressedFormat(texture->internal_format);
+	if (!texture->texture_id || texture->texture_type != GL_TEXTURE_2D || texture->stream || texture->type != GL_UNSIGNED_BYTE ||
+		(compressed && !copy_image) || (!compressed && (texture->internal_format || (texture->format != GL_RGB && texture->format != GL_RGBA))))
+		return false;
+
+	int num_levels = 1;
+	if (texture->mipmaps)
+	{
+		GLint max_level = 0;
+		glBindTexture(GL_TEXTURE_2D, texture->texture_id);
+		glGetTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, &max_level);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		int full_chain = (int)log2(std::max(texture->width, texture->height)) + 1;
+		num_levels = std::min(full_chain, (int)max_level + 1);
+	}
+
+	//the first one with a free layer, if all are full a new one twice the biggest (but within max_array_size,
+	//the free layers of the last one are wasted)
+	TextureArrayPool* pool = NULL;
+	int num_layers = 1;
+	for (TextureArrayPool* candidate : pools)
+	{
+		if (!candidate->matches(texture, num_levels))
+			continue;
+		if (candidate->num_used < (int)candidate->layers.size())
+		{
+			pool = candidate;
+			break;
+		}
+		num_layers = std::max(num_layers, (int)candidate->layers.size());
+	}
+	if (!pool)
+	{
+		size_t layer_size = 0;
+		for (int i = 0; i < num_levels; ++i)
+			layer_size += getLevelSize(texture->internal_format ? texture->internal_format : texture->format, texture->format,
+				std::max((int)texture->width >> i, 1), std::max((int)texture->height >> i, 1));
+		int max_size = std::max(1, (int)((size_t)max_array_size * 1024 * 1024 / layer_size));
+		pool = new TextureArrayPool(texture, num_levels, std::min(std::min(num_layers * 2, max_size), max_layers));
+		pools.push_back(pool);
+	}
+
+	//blits need framebuffers, they are restored after copying
+	GLint prev_read = 0, prev_draw = 0;
+	if (!copy_image)
+	{
+		glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &prev_read);
+		glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &prev_draw);
+		if (!read_fbo)
+		{
+			glGenFramebuffers(1, &read_fbo);
+			glGenFramebuffers(1, &draw_fbo);
+		}
+	}
+
+	int layer = (int)(std::find(pool->layers.begin(), pool->layers.end(), (Texture*)NULL) - pool->layers.begin());
+	pool->copyLayer(texture->texture_id, GL_TEXTURE_2D, 0, pool->array->texture_id, layer);
+	pool->layers[layer] = texture;
+	pool->num_used++;
+	texture->array_pool = pool;
+	texture->array_layer = layer;
+
+	//only the layer is used from now on
+	glDeleteTextures(1, &texture->texture_id);
+	texture->texture_id = 0;
+
+	if (!copy_image)
+	{
+		//attached textures are not freed till they are detached
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, read_fbo);
+		glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, 0, 0);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, draw_fbo);
+		glFramebufferTextureLayer(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, 0, 0, 0);
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, prev_read);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, prev_draw);
+	}
+	assert(checkGLErrors() && "Error packing texture in array");
+	return true;
+}
+
+void TextureArrayPool::packWhenReady(Texture* texture)
+{
+	texture->packable = true;
+	if (texture->isReady())
+		pack(texture);
+}
+
+void TextureArrayPool::remove(Texture* texture)
+{
+	TextureArrayPool* pool = texture->array_pool;
+	int layer = texture->array_layer;
+	texture->array_pool = NULL;
+	texture->array_layer = -1;
+	if (!pool)
+		return;
+
+	assert(pool->layers[layer] == texture);
+	pool->layers[layer] = NULL;
+	pool->num_used--;
+
+	//empty arrays are freed
+	if (pool->num_used == 0)
+	{
+		pools.erase(std::find(pools.begin(), pools.end(), pool));
+		delete pool;
+	}
+}
+
+void TextureArrayPool::Release()
+{
+	for (TextureArrayPool* pool : pools)
+		delete pool;
+	pools.clear();
+	if (read_fbo)
+	{
+		glDeleteFramebuffers(1, &read_fbo);
+		glDeleteFramebuffers(1, &draw_fbo);
+	}
+	read_fbo = draw_fbo = 0;
+}
+
+size_t TextureArrayPool::getMemory()
+{
+	size_t size = 0;
+	for (int i = 0; i < num_levels; ++i)
+		size += getLevelSize(internal_format, format, std::max(width >> i, 1), std::max(height >> i, 1));
+	return size * layers.size();
+}
+
+size_t TextureArrayPool::getTotalMemory()
+{
+	size_t size = 0;
+	for (TextureArrayPool* pool : pools)
+		size += pool->getMemory();
+	return size;
+}
+
+void TextureArrayPool::renderInMenu()
+{
+#ifndef SKIP_IMGUI
+	ImGui::Checkbox("Pack textures in arrays", &enabled);
+	int num_layers = 0;
+	for (TextureArrayPool* pool : pools)
+		num_layers += pool->num_used;
+	ImGui::Text("Texture arrays: %d  Layers: %d  Memory: %.1f MB", (int)pools.size(), num_layers, getTotalMemory() / (1024.0f * 1024.0f));
+#endif
+}
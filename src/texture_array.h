@@ -0,0 +1,54 @@
+#pragma once
+
+#include "framework.h"
+#include <vector>
+
+class Texture;
+
+//Textures with the same size, format and mips are copied (in the GPU) as layers of a GL_TEXTURE_2D_ARRAY, so
+//materials with different textures can be drawn without changing the bound textures, the shader only needs
+//the layer of each one. That is what allows batching several materials in the same instanced or multi draw.
+//Compressed textures are copied with glCopyImageSubData (GL_ARB_copy_image), the rest with a framebuffer blit
+//if it is missing. Only material textures are packed, once they are loaded, and their 2D copy is freed then.
+//Streamed textures are not packed, their mips change. A full array is not reallocated, a new one with twice
+//the layers is created for the same format, so no layer is copied twice.
+
+class TextureArrayPool
+{
+public:
+	static bool enabled;
+	static int max_layers; //per array (limited by GL_MAX_ARRAY_TEXTURE_LAYERS)
+	static int max_array_size; //in MB, new arrays double the layers of the previous one till this
+	static std::vector<TextureArrayPool*> pools;
+
+	Texture* array; //GL_TEXTURE_2D_ARRAY with all the layers
+	int width;
+	int height;
+	int num_levels;
+	unsigned int format;
+	unsigned int internal_format;
+	unsigned int wrap;
+	bool compressed;
+	std::vector<Texture*> layers; //NULL if the layer is free
+	int num_used;
+
+	TextureArrayPool(Texture* texture, int num_levels, int num_layers);
+	~TextureArrayPool();
+
+	//copies the texture to the first free layer of a pool that matches and frees its 2D copy, returns false
+	//if it cannot be packed. It changes the bound textures and framebuffers, only from the main thread
+	static bool pack(Texture* texture);
+	//for the textures of materials, they are packed once loaded (now if they already are)
+	static void packWhenReady(Texture* texture);
+	//frees its layer (called when the texture is destroyed or replaced)
+	static void remove(Texture* texture);
+	static void Release();
+
+	size_t getMemory();
+	static size_t getTotalMemory();
+	static void renderInMenu();
+
+private:
+	bool matches(Texture* texture, int num_levels);
+	void copyLayer(unsigned int src_id, unsigned int src_target, int src_layer, unsigned int dst_id, int dst_layer);
+};
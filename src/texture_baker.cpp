@@ -0,0 +1,754 @@
+#include "texture_baker.h"
+#include "texture.h"
+#include "task.h"
+#include "utils.h"
+
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <mutex>
+#include <sys/stat.h>
+
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+	#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+	#define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT 0x83F3
+#endif
+#ifndef GL_COMPRESSED_RED_RGTC1
+	#define GL_COMPRESSED_RED_RGTC1 0x8DBB
+	#define GL_COMPRESSED_RG_RGTC2 0x8DBD
+#endif
+
+struct sCTEXHeader {
+	char signature[4]; //CTEX
+	int version;
+	long long source_size;
+	long long source_time;
+	int format;
+	int usage;
+	int width;
+	int height;
+	int num_levels;
+};
+
+static inline int clampInt(int v, int min, int max) { return v < min ? min : (v > max ? max : v); }
+
+// BC1 *******************************
+
+static inline uint16 packRGB565(const float* c)
+{
+	int r = clampInt((int)(c[0] * (31.0f / 255.0f) + 0.5f), 0, 31);
+	int g = clampInt((int)(c[1] * (63.0f / 255.0f) + 0.5f), 0, 63);
+	int b = clampInt((int)(c[2] * (31.0f / 255.0f) + 0.5f), 0, 31);
+	return (uint16)((r << 11) | (g << 5) | b);
+}
+
+static inline void unpackRGB565(uint16 c, int* rgb)
+{
+	int r = (c >> 11) & 31;
+	int g = (c >> 5) & 63;
+	int b = c & 31;
+	rgb[0] = (r << 3) | (r >> 2);
+	rgb[1] = (g << 2) | (g >> 4);
+	rgb[2] = (b << 3) | (b >> 2);
+}
+
+static void buildBC1Palette(uint16 c0, uint16 c1, int palette[4][4], bool allow_alpha_mode)
+{
+	unpackRGB565(c0, palette[0]);
+	unpackRGB565(c1, palette[1]);
+	palette[0][3] = palette[1][3] = palette[2][3] = palette[3][3] = 255;
+	if (c0 > c1 || !allow_alpha_mode)
+	{
+		for (int i = 0; i < 3; ++i)
+		{
+			palette[2][i] = (2 * palette[0][i] + palette[1][i] + 1) / 3;
+			palette[3][i] = (palette[0][i] + 2 * palette[1][i] + 1) / 3;
+		}
+	}
+	else //3 colors and transparent black
+	{
+		for (int i = 0; i < 3; ++i)
+		{
+			palette[2][i] = (palette[0][i] + palette[1][i]) / 2;
+			palette[3][i] = 0;
+		}
+		palette[3][3] = 0;
+	}
+}
+
+//assigns the closest color of the palette to every pixel, returns the squared error
+static int findBC1Indices(const uint8* rgba, int palette[4][4], uint32& indices)
+{
+	int error = 0;
+	indices = 0;
+	for (int i = 0; i < 16; ++i)
+	{
+		const uint8* p = rgba + i * 4;
+		int best = 0;
+		int best_dist = 0x7FFFFFFF;
+		for (int j = 0; j < 4; ++j)
+		{
+			int dr = p[0] - palette[j][0];
+			int dg = p[1] - palette[j][1];
+			int db = p[2] - palette[j][2];
+			int dist = dr * dr + dg * dg + db * db;
+			if (dist < best_dist)
+			{
+				best_dist = dist;
+				best = j;
+			}
+		}
+		indices |= best << (i * 2);
+		error += best_dist;
+	}
+	return error;
+}
+
+//quantizes the endpoints and finds the indices, returns the error
+static int fitBC1Block(const uint8* rgba, const float* e0, const float* e1, uint16& c0, uint16& c1, uint32& indices)
+{
+	c0 = packRGB565(e0);
+	c1 = packRGB565(e1);
+	if (c0 < c1)
+		std::swap(c0, c1);
+	int palette[4][4];
+	buildBC1Palette(c0, c1, palette, c0 != c1);
+	if (c0 == c1) //solid color, only the first entry is used
+	{
+		indices = 0;
+		int error = 0;
+		for (int i = 0; i < 16; ++i)
+			for (int j = 0; j < 3; ++j)
+				error += (rgba[i * 4 + j] - palette[0][j]) * (rgba[i * 4 + j] - palette[0][j]);
+		return error;
+	}
+	return findBC1Indices(rgba, palette, indices);
+}
+
+void encodeBC1Block(const uint8* rgba, uint8* block)
+{
+	//principal axis of the colors (power iteration on the covariance)
+	float mean[3] = { 0,0,0 };
+	for (int i = 0; i < 16; ++i)
+		for (int j = 0; j < 3; ++j)
+			mean[j] += rgba[i * 4 + j];
+	for (int j = 0; j < 3; ++j)
+		mean[j] /= 16.0f;
+
+	float cov[6] = { 0,0,0,0,0,0 }; //xx xy xz yy yz zz
+	float min_c[3] = { 255,255,255 }, max_c[3] = { 0,0,0 };
+	for (int i = 0; i < 16; ++i)
+	{
+		float r = rgba[i * 4] - mean[0], g = rgba[i * 4 + 1] - mean[1], b = rgba[i * 4 + 2] - mean[2];
+		cov[0] += r * r; cov[1] += r * g; cov[2] += r * b;
+		cov[3] += g * g; cov[4] += g * b; cov[5] += b * b;
+		for (int j = 0; j < 3; ++j)
+		{
+			min_c[j] = std::min(min_c[j], (float)rgba[i * 4 + j]);
+			max_c[j] = std::max(max_c[j], (float)rgba[i * 4 + j]);
+		}
+	}
+
+	float axis[3] = { max_c[0] - min_c[0], max_c[1] - min_c[1], max_c[2] - min_c[2] };
+	for (int it = 0; it < 8; ++it)
+	{
+		float x = cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2];
+		float y = cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2];
+		float z = cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2];
+		float len = std::max(std::max(fabs(x), fabs(y)), fabs(z));
+		if (len < 1e-6f)
+			break;
+		axis[0] = x / len; axis[1] = y / len; axis[2] = z / len;
+	}
+
+	//endpoints at the extremes of the projection on the axis
+	float min_t = 1e10f, max_t = -1e10f;
+	float axis_len2 = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+	for (int i = 0; i < 16; ++i)
+	{
+		float t = 0;
+		if (axis_len2 > 1e-8f)
+			t = ((rgba[i * 4] - mean[0]) * axis[0] + (rgba[i * 4 + 1] - mean[1]) * axis[1] + (rgba[i * 4 + 2] - mean[2]) * axis[2]) / axis_len2;
+		min_t = std::min(min_t, t);
+		max_t = std::max(max_t, t);
+	}
+	float e0[3], e1[3];
+	for (int j = 0; j < 3; ++j)
+	{
+		e0[j] = mean[j] + axis[j] * max_t;
+		e1[j] = mean[j] + axis[j] * min_t;
+	}
+
+	uint16 c0, c1;
+	uint32 indices;
+	int error = fitBC1Block(rgba, e0, e1, c0, c1, indices);
+
+	//refine the endpoints with least squares using the current indices
+	static const float weights[4] = { 1.0f, 0.0f, 2.0f / 3.0f, 1.0f / 3.0f };
+	for (int it = 0; it < 2 && error > 0 && c0 != c1; ++it)
+	{
+		float aa = 0, bb = 0, ab = 0;
+		float ax[3] = { 0,0,0 }, bx[3] = { 0,0,0 };
+		for (int i = 0; i < 16; ++i)
+		{
+			float a = weights[(indices >> (i * 2)) & 3];
+			float b = 1.0f - a;
+			aa += a * a; bb += b * b; ab += a * b;
+			for (int j = 0; j < 3; ++j)
+			{
+				ax[j] += a * rgba[i * 4 + j];
+				bx[j] += b * rgba[i * 4 + j];
+			}
+		}
+		float det = aa * bb - ab * ab;
+		if (fabs(det) < 1e-6f)
+			break;
+		for (int j = 0; j < 3; ++j)
+		{
+			e0[j] = (ax[j] * bb - bx[j] * ab) / det;
+			e1[j] = (bx[j] * aa - ax[j] * ab) / det;
+		}
+
+		uint16 new_c0, new_c1;
+		uint32 new_indices;
+		int new_error = fitBC1Block(rgba, e0, e1, new_c0, new_c1, new_indices);
+		if (new_error >= error)
+			break;
+		error = new_error;
+		c0 = new_c0; c1 = new_c1; indices = new_indices;
+	}
+
+	memcpy(block, &c0, 2);
+	memcpy(block + 2, &c1, 2);
+	memcpy(block + 4, &indices, 4);
+}
+
+void decodeBC1Block(const uint8* block, uint8* rgba, bool allow_alpha_mode)
+{
+	uint16 c0, c1;
+	uint32 indices;
+	memcpy(&c0, block, 2);
+	memcpy(&c1, block + 2, 2);
+	memcpy(&indices, block + 4, 4);
+	int palette[4][4];
+	buildBC1Palette(c0, c1, palette, allow_alpha_mode);
+	for (int i = 0; i < 16; ++i)
+	{
+		int* c = palette[(indices >> (i * 2)) & 3];
+		for (int j = 0; j < 4; ++j)
+			rgba[i * 4 + j] = (uint8)c[j];
+	}
+}
+
+// BC4 *******************************
+
+static void buildBC4Palette(int a0, int a1, int* palette)
+{
+	palette[0] = a0;
+	palette[1] = a1;
+	if (a0 > a1)
+	{
+		for (int i = 2; i < 8; ++i)
+			palette[i] = ((8 - i) * a0 + (i - 1) * a1 + 3) / 7;
+	}
+	else
+	{
+		for (int i = 2; i < 6; ++i)
+			palette[i] = ((6 - i) * a0 + (i - 1) * a1 + 2) / 5;
+		palette[6] = 0;
+		palette[7] = 255;
+	}
+}
+
+static int findBC4Indices(const int* values, int a0, int a1, uint8* indices)
+{
+	int palette[8];
+	buildBC4Palette(a0, a1, palette);
+	int error = 0;
+	for (int i = 0; i < 16; ++i)
+	{
+		int best = 0;
+		int best_dist = 0x7FFFFFFF;
+		for (int j = 0; j < 8; ++j)
+		{
+			int dist = (values[i] - palette[j]) * (values[i] - palette[j]);
+			if (dist < best_dist)
+			{
+				best_dist = dist;
+				best = j;
+			}
+		}
+		indices[i] = best;
+		error += best_dist;
+	}
+	return error;
+}
+
+void encodeBC4Block(const uint8* rgba, uint8* block, int channel)
+{
+	int values[16];
+	int min_v = 255, max_v = 0;
+	int min_inner = 255, max_inner = 0; //ignoring 0 and 255, which the 6 values mode has for free
+	for (int i = 0; i < 16; ++i)
+	{
+		int v = rgba[i * 4 + channel];
+		values[i] = v;
+		min_v = std::min(min_v, v);
+		max_v = std::max(max_v, v);
+		if (v != 0 && v != 255)
+		{
+			min_inner = std::min(min_inner, v);
+			max_inner = std::max(max_inner, v);
+		}
+	}
+
+	uint8 indices[16], candidate[16];
+	int best_a0 = max_v, best_a1 = min_v;
+	int best_error = findBC4Indices(values, best_a0, best_a1, indices);
+
+	//8 values mode, small search around the extremes
+	if (max_v > min_v)
+		for (int d0 = 0; d0 <= 2 && best_error; ++d0)
+			for (int d1 = 0; d1 <= 2 && best_error; ++d1)
+			{
+				int a0 = max_v - d0, a1 = min_v + d1;
+				if (a0 <= a1 || (d0 == 0 && d1 == 0))
+					continue;
+				int error = findBC4Indices(values, a0, a1, candidate);
+				if (error < best_error)
+				{
+					best_error = error;
+					best_a0 = a0; best_a1 = a1;
+					memcpy(indices, candidate, 16);
+				}
+			}
+
+	//6 values mode, better when there are pure 0 or 255 pixels
+	if (best_error && min_inner <= max_inner)
+	{
+		int error = findBC4Indices(values, min_inner, max_inner, candidate);
+		if (error < best_error)
+		{
+			best_error = error;
+			best_a0 = min_inner; best_a1 = max_inner;
+			memcpy(indices, candidate, 16);
+		}
+	}
+
+	block[0] = (uint8)best_a0;
+	block[1] = (uint8)best_a1;
+	unsigned long long bits = 0;
+	for (int i = 0; i < 16; ++i)
+		bits |= (unsigned long long)indices[i] << (i * 3);
+	for (int i = 0; i < 6; ++i)
+		block[2 + i] = (uint8)(bits >> (i * 8));
+}
+
+void decodeBC4Block(const uint8* block, uint8* rgba, int channel)
+{
+	int palette[8];
+	buildBC4Palette(block[0], block[1], palette);
+	unsigned long long bits = 0;
+	for (int i = 0; i < 6; ++i)
+		bits |= (unsigned long long)block[2 + i] << (i * 8);
+	for (int i = 0; i < 16; ++i)
+		rgba[i * 4 + channel] = (uint8)palette[(bits >> (i * 3)) & 7];
+}
+
+// BC3 and BC5 *******************************
+
+void encodeBC3Block(const uint8* rgba, uint8* block)
+{
+	encodeBC4Block(rgba, block, 3);
+	encodeBC1Block(rgba, block + 8);
+}
+
+void decodeBC3Block(const uint8* block, uint8* rgba)
+{
+	decodeBC1Block(block + 8, rgba, false);
+	decodeBC4Block(block, rgba, 3);
+}
+
+void encodeBC5Block(const uint8* rgba, uint8* block)
+{
+	encodeBC4Block(rgba, block, 0);
+	encodeBC4Block(rgba, block + 8, 1);
+}
+
+void decodeBC5Block(const uint8* block, uint8* rgba)
+{
+	decodeBC4Block(block, rgba, 0);
+	decodeBC4Block(block + 8, rgba, 1);
+	for (int i = 0; i < 16; ++i)
+	{
+		rgba[i * 4 + 2] = 0;
+		rgba[i * 4 + 3] = 255;
+	}
+}
+
+// IMAGES *******************************
+
+//reads a pixel as RGBA clamping the coordinates to the edges
+static inline void readPixelRGBA(Image* image, int x, int y, uint8* rgba)
+{
+	x = clampInt(x, 0, image->width - 1);
+	y = clampInt(y, 0, image->height - 1);
+	const uint8* p = image->data + (y * image->width + x) * image->num_channels;
+	rgba[0] = p[0];
+	rgba[1] = image->num_channels > 1 ? p[1] : p[0];
+	rgba[2] = image->num_channels > 2 ? p[2] : p[0];
+	rgba[3] = image->num_channels > 3 ? p[3] : 255;
+}
+
+static float srgb_to_linear[256];
+static std::once_flag srgb_table_once;
+
+void downsampleImage(Image* image, Image* result, eTextureUsage usage)
+{
+	std::call_once(srgb_table_once, []() {
+		for (int i = 0; i < 256; ++i)
+			srgb_to_linear[i] = pow(i / 255.0f, 2.2f);
+	});
+
+	int w = std::max(1u, image->width / 2);
+	int h = std::max(1u, image->height / 2);
+	int num_channels = image->num_channels;
+	result->resize(w, h, num_channels);
+
+	parallelFor(h, [&](int y) {
+		uint8 pixels[4][4];
+		for (int x = 0; x < w; ++x)
+		{
+			readPixelRGBA(image, x * 2, y * 2, pixels[0]);
+			readPixelRGBA(image, x * 2 + 1, y * 2, pixels[1]);
+			readPixelRGBA(image, x * 2, y * 2 + 1, pixels[2]);
+			readPixelRGBA(image, x * 2 + 1, y * 2 + 1, pixels[3]);
+
+			float c[4] = { 0,0,0,0 };
+			for (int i = 0; i < 4; ++i)
+				for (int j = 0; j < 4; ++j)
+					c[j] += (usage == TEXTURE_COLOR && j < 3) ? srgb_to_linear[pixels[i][j]] : pixels[i][j] / 255.0f;
+			for (int j = 0; j < 4; ++j)
+				c[j] *= 0.25f;
+
+			if (usage == TEXTURE_COLOR)
+				for (int j = 0; j < 3; ++j)
+					c[j] = pow(c[j], 1.0f / 2.2f);
+			else if (usage == TEXTURE_NORMALMAP)
+			{
+				Vector3 n(c[0] * 2.0f - 1.0f, c[1] * 2.0f - 1.0f, c[2] * 2.0f - 1.0f);
+				float len = (float)n.length();
+				if (len > 1e-5f)
+					n = n * (1.0f / len);
+				c[0] = n.x * 0.5f + 0.5f; c[1] = n.y * 0.5f + 0.5f; c[2] = n.z * 0.5f + 0.5f;
+			}
+
+			uint8* dst = result->data + (y * w + x) * num_channels;
+			for (int j = 0; j < num_channels; ++j)
+				dst[j] = (uint8)clampInt((int)(c[j] * 255.0f + 0.5f), 0, 255);
+		}
+	});
+}
+
+float computePSNR(Image* a, Image* b, int num_channels)
+{
+	assert(a->width == b->width && a->height == b->height);
+	double error = 0;
+	for (unsigned int y = 0; y < a->height; ++y)
+		for (unsigned int x = 0; x < a->width; ++x)
+		{
+			uint8 pa[4], pb[4];
+			readPixelRGBA(a, x, y, pa);
+			readPixelRGBA(b, x, y, pb);
+			for (int j = 0; j < num_channels; ++j)
+				error += (pa[j] - pb[j]) * (pa[j] - pb[j]);
+		}
+	double mse = error / ((double)a->width * a->height * num_channels);
+	if (mse <= 0)
+		return 100.0f; //identical
+	return (float)(10.0 * log10(255.0 * 255.0 / mse));
+}
+
+// COMPRESSED IMAGE *******************************
+
+unsigned int CompressedImage::getBlockSize(eBlockFormat format)
+{
+	switch (format)
+	{
+		case BLOCK_BC1: case BLOCK_BC4: return 8;
+		case BLOCK_BC3: case BLOCK_BC5: return 16;
+		default: return 0;
+	}
+}
+
+unsigned int CompressedImage::getGLFormat() const
+{
+	switch (format)
+	{
+		case BLOCK_BC1: return GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+		case BLOCK_BC3: return GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+		case BLOCK_BC4: return GL_COMPRESSED_RED_RGTC1;
+		case BLOCK_BC5: return GL_COMPRESSED_RG_RGTC2;
+		default: return 0;
+	}
+}
+
+size_t CompressedImage::getTotalSize() const
+{
+	size_t size = 0;
+	for (size_t i = 0; i < levels.size(); ++i)
+		size += levels[i].size();
+	return size;
+}
+
+size_t CompressedImage::getLevelSize(int level) const
+{
+	return (size_t)((getLevelWidth(level) + 3) / 4) * ((getLevelHeight(level) + 3) / 4) * getBlockSize(format);
+}
+
+int CompressedImage::getFirstLoadedLevel() const
+{
+	for (size_t i = 0; i < levels.size(); ++i)
+		if (levels[i].size())
+			return (int)i;
+	return (int)levels.size();
+}
+
+eBlockFormat CompressedImage::chooseFormat(Image* image, eTextureUsage usage)
+{
+	switch (usage)
+	{
+		case TEXTURE_COLOR:
+			if (image->num_channels == 4)
+			{
+				unsigned int num_pixels = image->width * image->height;
+				for (unsigned int i = 0; i < num_pixels; ++i)
+					if (image->data[i * 4 + 3] != 255)
+						return BLOCK_BC3;
+			}
+			return BLOCK_BC1;
+		case TEXTURE_NORMALMAP: return BLOCK_BC5;
+		case TEXTURE_MASK: return BLOCK_BC4;
+		case TEXTURE_DATA: return BLOCK_BC1;
+		default: return BLOCK_NONE;
+	}
+}
+
+bool CompressedImage::compress(Image* image, eTextureUsage usage, bool mipmaps)
+{
+	assert(image && image->data);
+	format = chooseFormat(image, usage);
+	if (format == BLOCK_NONE)
+		return false;
+
+	this->usage = usage;
+	width = image->width;
+	height = image->height;
+
+	//mip chain, the first one is the original image
+	std::vector<Image*> mips;
+	mips.push_back(image);
+	while (mipmaps && (mips.back()->width > 1 || mips.back()->height > 1))
+	{
+		Image* mip = new Image();
+		downsampleImage(mips.back(), mip, usage);
+		mips.push_back(mip);
+	}
+
+	//one job per row of blocks of every level
+	unsigned int block_size = getBlockSize(format);
+	std::vector< std::pair<int, int> > rows;
+	levels.resize(mips.size());
+	for (int i = 0; i < mips.size(); ++i)
+	{
+		int blocks_x = (mips[i]->width + 3) / 4;
+		int blocks_y = (mips[i]->height + 3) / 4;
+		levels[i].resize(blocks_x * blocks_y * block_size);
+		for (int y = 0; y < blocks_y; ++y)
+			rows.push_back(std::pair<int, int>(i, y));
+	}
+
+	eBlockFormat block_format = format;
+	parallelFor((int)rows.size(), [&](int row) {
+		int level = rows[row].first;
+		int by = rows[row].second;
+		Image* mip = mips[level];
+		int blocks_x = (mip->width + 3) / 4;
+		uint8* block = &levels[level][by * blocks_x * block_size];
+		uint8 rgba[64];
+		for (int bx = 0; bx < blocks_x; ++bx, block += block_size)
+		{
+			for (int i = 0; i < 16; ++i)
+				readPixelRGBA(mip, bx * 4 + (i & 3), by * 4 + (i >> 2), rgba + i * 4);
+			switch (block_format)
+			{
+				case BLOCK_BC1: encodeBC1Block(rgba, block); break;
+				case BLOCK_BC3: encodeBC3Block(rgba, block); break;
+				case BLOCK_BC4: encodeBC4Block(rgba, block); break;
+				case BLOCK_BC5: encodeBC5Block(rgba, block); break;
+				default: break;
+			}
+		}
+	});
+
+	for (int i = 1; i < mips.size(); ++i)
+		delete mips[i];
+	return true;
+}
+
+bool CompressedImage::decompress(Image& result, int level) const
+{
+	if (level >= levels.size())
+		return false;
+	int w = getLevelWidth(level);
+	int h = getLevelHeight(level);
+	int blocks_x = (w + 3) / 4;
+	int blocks_y = (h + 3) / 4;
+	unsigned int block_size = getBlockSize(format);
+	result.resize(w, h, 4);
+
+	const uint8* block = &levels[level][0];
+	uint8 rgba[64];
+	for (int by = 0; by < blocks_y; ++by)
+		for (int bx = 0; bx < blocks_x; ++bx, block += block_size)
+		{
+			memset(rgba, 255, sizeof(rgba));
+			switch (format)
+			{
+				case BLOCK_BC1: decodeBC1Block(block, rgba); break;
+				case BLOCK_BC3: decodeBC3Block(block, rgba); break;
+				case BLOCK_BC4: decodeBC4Block(block, rgba);
+					for (int i = 0; i < 16; ++i) //grey like the swizzle used in the GPU
+						rgba[i * 4 + 1] = rgba[i * 4 + 2] = rgba[i * 4];
+					break;
+				case BLOCK_BC5: decodeBC5Block(block, rgba); break;
+				default: return false;
+			}
+			for (int i = 0; i < 16; ++i)
+			{
+				int x = bx * 4 + (i & 3);
+				int y = by * 4 + (i >> 2);
+				if (x < w && y < h)
+					memcpy(result.data + (y * w + x) * 4, rgba + i * 4, 4);
+			}
+		}
+	return true;
+}
+
+bool CompressedImage::save(const char* filename)
+{
+	FILE* file = fopen(filename, "wb");
+	if (!file)
+		return false;
+
+	sCTEXHeader header;
+	memcpy(header.signature, "CTEX", 4);
+	header.version = CTEX_VERSION;
+	header.source_size = source_size;
+	header.source_time = source_time;
+	header.format = format;
+	header.usage = usage;
+	header.width = width;
+	header.height = height;
+	header.num_levels = (int)levels.size();
+	fwrite(&header, sizeof(header), 1, file);
+	for (size_t i = 0; i < levels.size(); ++i)
+	{
+		uint32 size = (uint32)levels[i].size();
+		fwrite(&size, sizeof(size), 1, file);
+		fwrite(&levels[i][0], 1, size, file);
+	}
+	fclose(file);
+	return true;
+}
+
+static FILE* openCTEX(const char* filename, sCTEXHeader& header)
+{
+	FILE* file = fopen(filename, "rb");
+	if (!file)
+		return NULL;
+	if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.signature, "CTEX", 4) != 0 || header.version != CTEX_VERSION)
+	{
+		fclose(file);
+		return NULL;
+	}
+	return file;
+}
+
+bool CompressedImage::setSource(const char* filename)
+{
+	struct stat stbuffer;
+	if (stat(filename, &stbuffer) != 0)
+		return false;
+	source_size = (long long)stbuffer.st_size;
+	source_time = (long long)stbuffer.st_mtime;
+	return true;
+}
+
+bool CompressedImage::matchesSource(const char* filename) const
+{
+	CompressedImage source;
+	if (!source.setSource(filename))
+		return true;
+	return source.source_size == source_size && source.source_time == source_time;
+}
+
+bool CompressedImage::loadHeader(const char* filename, CompressedImage& info)
+{
+	sCTEXHeader header;
+	FILE* file = openCTEX(filename, header);
+	if (!file)
+		return false;
+	fclose(file);
+
+	info.source_size = header.source_size;
+	info.source_time = header.source_time;
+	info.format = (eBlockFormat)header.format;
+	info.usage = (eTextureUsage)header.usage;
+	info.width = header.width;
+	info.height = header.height;
+	info.levels.clear();
+	info.levels.resize(header.num_levels);
+	return true;
+}
+
+bool CompressedImage::load(const char* filename, int first_level, int last_level)
+{
+	sCTEXHeader header;
+	FILE* file = openCTEX(filename, header);
+	if (!file)
+		return false;
+
+	source_size = header.source_size;
+	source_time = header.source_time;
+	format = (eBlockFormat)header.format;
+	usage = (eTextureUsage)header.usage;
+	width = header.width;
+	height = header.height;
+	levels.clear();
+	levels.resize(header.num_levels);
+	if (last_level < 0 || last_level >= header.num_levels)
+		last_level = header.num_levels - 1;
+	first_level = std::max(0, std::min(first_level, last_level));
+
+	bool ok = true;
+	for (int i = 0; i <= last_level && ok; ++i)
+	{
+		uint32 size = 0;
+		ok = fread(&size, sizeof(size), 1, file) == 1;
+		if (!ok)
+			break;
+		if (i < first_level) //skipped, the streamer loads it later if it is needed
+		{
+			ok = fseek(file, size, SEEK_CUR) == 0;
+			continue;
+		}
+		levels[i].resize(size);
+		ok = size && fread(&levels[i][0], 1, size, file) == size;
+	}
+	fclose(file);
+	if (!ok)
+		levels.clear();
+	return ok;
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include "framework.h"
+#include <vector>
+
+class Image;
+
+//Bakes the textures in block compressed formats with all their mips (done in the workers),
+//the result is cached next to the original file (.ctex) so it only happens the first time.
+
+#define CTEX_VERSION 2 //this is used to regenerate the .ctex if the format changes
+
+//how the texture is going to be used, it decides the compression format
+enum eTextureUsage {
+	TEXTURE_GENERIC,	//not compressed (render targets, UI, ...)
+	TEXTURE_COLOR,		//BC1, or BC3 if it has alpha
+	TEXTURE_NORMALMAP,	//BC5, only XY are stored, Z is reconstructed in the shader
+	TEXTURE_MASK,		//BC4, single channel (occlusion)
+	TEXTURE_DATA		//BC1, several channels without alpha (occlusion-roughness-metallic)
+};
+
+enum eBlockFormat {
+	BLOCK_NONE,
+	BLOCK_BC1,	//RGB 565 endpoints, 4 bits per pixel
+	BLOCK_BC3,	//BC1 + BC4 alpha, 8 bits per pixel
+	BLOCK_BC4,	//one channel, 4 bits per pixel
+	BLOCK_BC5	//two BC4 channels, 8 bits per pixel
+};
+
+//a block compressed texture with all its mips, as stored in the .ctex files
+class CompressedImage
+{
+public:
+	unsigned int width;
+	unsigned int height;
+	eBlockFormat format;
+	eTextureUsage usage;
+	std::vector< std::vector<uint8> > levels; //level 0 is the biggest
+	long long source_size; //of the file it was baked from, the .ctex is stale if the file changes
+	long long source_time;
+
+	CompressedImage() { width = height = 0; format = BLOCK_NONE; usage = TEXTURE_GENERIC; source_size = source_time = 0; }
+
+	unsigned int getGLFormat() const;
+	unsigned int getLevelWidth(int level) const { return std::max(1u, width >> level); }
+	unsigned int getLevelHeight(int level) const { return std::max(1u, height >> level); }
+	size_t getTotalSize() const;
+	size_t getLevelSize(int level) const; //bytes of a level, even if it is not loaded
+	int getFirstLoadedLevel() const; //levels before it are empty when they are streamed
+
+	static unsigned int getBlockSize(eBlockFormat format); //bytes per 4x4 block
+	static eBlockFormat chooseFormat(Image* image, eTextureUsage usage);
+
+	//compresses the image and its mips, the blocks are spread among the workers
+	bool compress(Image* image, eTextureUsage usage, bool mipmaps = true);
+	//decodes a level to RGBA, used when the GPU doesnt support the format and to measure the quality
+	bool decompress(Image& result, int level = 0) const;
+
+	//first_level skips the biggest mips (they stay empty), last_level -1 loads till the end
+	bool load(const char* filename, int first_level = 0, int last_level = -1);
+	static bool loadHeader(const char* filename, CompressedImage& info); //only the size and format, levels are left empty
+	bool save(const char* filename);
+
+	//stores the size and modification time of the original file, false if it doesnt exist
+	bool setSource(const char* filename);
+	//false if the original file changed since it was baked (true if it is not there, only the .ctex is shipped)
+	bool matchesSource(const char* filename) const;
+};
+
+//builds the next mip of the image (box filter), colors are averaged in linear space and normals renormalized
+void downsampleImage(Image* image, Image* result, eTextureUsage usage);
+
+//encoders and decoders of a single 4x4 block, pixels are 16 RGBA values (row by row)
+void encodeBC1Block(const uint8* rgba, uint8* block); //always in 4 colors mode (opaque)
+void encodeBC3Block(const uint8* rgba, uint8* block);
+void encodeBC4Block(const uint8* rgba, uint8* block, int channel = 0);
+void encodeBC5Block(const uint8* rgba, uint8* block);
+void decodeBC1Block(const uint8* block, uint8* rgba, bool allow_alpha_mode = true); //BC3 color blocks dont allow it
+void decodeBC3Block(const uint8* block, uint8* rgba);
+void decodeBC4Block(const uint8* block, uint8* rgba, int channel = 0);
+void decodeBC5Block(const uint8* block, uint8* rgba);
+
+//peak signal to noise ratio (in dB) of the first num_channels of both images, higher is better
+float computePSNR(Image* a, Image* b, int num_channels = 3);
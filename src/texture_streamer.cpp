@@ -0,0 +1,231 @@
+#include "texture_streamer.h"
+#include "texture.h"
+#include "resource.h"
+#include "task.h"
+#include "utils.h"
+#include "includes.h"
+
+#include <cassert>
+#include <algorithm>
+#include <numeric>
+
+bool TextureStreamer::enabled = true;
+int TextureStreamer::budget = 256;
+int TextureStreamer::min_resident_size = 128;
+int TextureStreamer::max_loads_in_flight = 4;
+int TextureStreamer::keep_frames = 60;
+long TextureStreamer::frame = 0;
+std::vector<Texture*> TextureStreamer::textures;
+
+static int loads_in_flight = 0; //only touched from the main thread
+
+size_t sTextureStreamInfo::getSize(int first_level) const
+{
+	size_t size = 0;
+	for (int i = first_level; i < num_levels; ++i)
+		size += level_sizes[i];
+	return size;
+}
+
+int TextureStreamer::getFirstResidentLevel(const CompressedImage& image)
+{
+	int num_levels = (int)image.levels.size();
+	if (!enabled || num_levels < 2)
+		return 0;
+	int level = 0;
+	while (level < num_levels - 1 && (int)std::max(image.getLevelWidth(level), image.getLevelHeight(level)) > min_resident_size)
+		level++;
+	return level;
+}
+
+void TextureStreamer::registerTexture(Texture* texture, const std::string& filename, const CompressedImage& image)
+{
+	assert(Resource::isMainThread());
+	if (texture->stream)
+		unregisterTexture(texture);
+
+	sTextureStreamInfo* info = new sTextureStreamInfo();
+	info->filename = filename;
+	info->num_levels = std::min((int)image.levels.size(), 32);
+	for (int i = 0; i < info->num_levels; ++i)
+		info->level_sizes[i] = image.getLevelSize(i);
+	info->min_level = info->resident_level = image.getFirstLoadedLevel();
+	info->requested_level = info->wanted_level = info->min_level;
+	info->pending_level = -1;
+	info->last_used_frame = frame;
+
+	texture->stream = info;
+	textures.push_back(texture);
+}
+
+void TextureStreamer::unregisterTexture(Texture* texture)
+{
+	if (!texture->stream)
+		return;
+	auto it = std::find(textures.begin(), textures.end(), texture);
+	if (it != textures.end())
+	{
+		*it = textures.back();
+		textures.pop_back();
+	}
+	delete texture->stream;
+	texture->stream = NULL;
+}
+
+void TextureStreamer::requestLevel(Texture* texture, int level)
+{
+	sTextureStreamInfo* info = texture->stream;
+	if (!info)
+		return;
+	level = std::max(0, std::min(level, info->min_level));
+	info->requested_level = std::min(info->requested_level, level);
+	info->last_used_frame = frame;
+}
+
+//reads the mips from the .ctex in the background thread and uploads them in the main thread,
+//finer mips are added to the current texture, dropping them recreates it with the smaller chain
+static void loadLevels(Texture* texture, int level)
+{
+	sTextureStreamInfo* info = texture->stream;
+	info->pending_level = level;
+	loads_in_flight++;
+
+	std::string name = texture->filename;
+	std::string filename = info->filename;
+	bool add_levels = level < info->resident_level;
+	int last_level = add_levels ? info->resident_level - 1 : info->num_levels - 1;
+
+	TaskManager::background.addTask(new Task([=]() {
+		CompressedImage* image = new CompressedImage();
+		if (!image->load(filename.c_str(), level, last_level))
+		{
+			delete image;
+			image = NULL;
+		}
+
+		TaskManager::foreground.addTask(new Task([=]() {
+			loads_in_flight--;
+
+			//it could have been destroyed or reloaded meanwhile
+			Texture* texture = Texture::sTexturesLoaded.find(name);
+			sTextureStreamInfo* info = texture ? texture->stream : NULL;
+			if (!info || info->pending_level != level)
+			{
+				delete image;
+				return;
+			}
+			info->pending_level = -1;
+
+			if (!image || (int)image->levels.size() != info->num_levels)
+			{
+				//the file changed or is gone, keep what we have and stop streaming it
+				std::cout << "Warning: cannot stream mips of " << filename << std::endl;
+				info->min_level = info->requested_level = info->wanted_level = info->resident_level;
+				delete image;
+				return;
+			}
+
+			if (add_levels)
+				texture->uploadCompressedLevels(image);
+			else
+				texture->uploadCompressed(image, texture->wrapS == GL_REPEAT);
+			info->resident_level = level;
+			delete image;
+		}));
+	}));
+}
+
+void TextureStreamer::update()
+{
+	assert(Resource::isMainThread());
+	frame++;
+	if (!enabled || textures.empty())
+		return;
+
+	//requests are remembered for a window of frames so the mips dont bounce every frame
+	bool new_window = (frame % std::max(keep_frames, 1)) == 0;
+	int num = (int)textures.size();
+	std::vector<int> target(num);
+	size_t total = 0;
+	for (int i = 0; i < num; ++i)
+	{
+		sTextureStreamInfo* info = textures[i]->stream;
+		target[i] = std::min(info->wanted_level, info->requested_level);
+		total += info->getSize(target[i]);
+		if (new_window)
+		{
+			info->wanted_level = info->requested_level;
+			info->requested_level = info->min_level;
+		}
+	}
+
+	//least recently used first
+	std::vector<int> order(num);
+	std::iota(order.begin(), order.end(), 0);
+	std::sort(order.begin(), order.end(), [](int a, int b) { return textures[a]->stream->last_used_frame < textures[b]->stream->last_used_frame; });
+
+	//over budget: drop mips from the least recently used, the ones used in the same frame degrade evenly.
+	//The texture arrays share the budget, their layers cannot be dropped
+	size_t budget_bytes = (size_t)budget * 1024 * 1024;
+	size_t arrays_bytes = TextureArrayPool::getTotalMemory();
+	budget_bytes = budget_bytes > arrays_bytes ? budget_bytes - arrays_bytes : 0;
+	for (int start = 0; start < num && total > budget_bytes; )
+	{
+		long last_used = textures[order[start]]->stream->last_used_frame;
+		int end = start;
+		while (end < num && textures[order[end]]->stream->last_used_frame == last_used)
+			end++;
+
+		bool dropped = true;
+		while (total > budget_bytes && dropped)
+		{
+			dropped = false;
+			for (int k = start; k < end && total > budget_bytes; ++k)
+			{
+				int i = order[k];
+				sTextureStreamInfo* info = textures[i]->stream;
+				if (target[i] >= info->min_level)
+					continue;
+				total -= info->level_sizes[target[i]];
+				target[i]++;
+				dropped = true;
+			}
+		}
+		start = end;
+	}
+
+	//launch the loads, most recently used first
+	for (int k = num - 1; k >= 0 && loads_in_flight < max_loads_in_flight; --k)
+	{
+		int i = order[k];
+		sTextureStreamInfo* info = textures[i]->stream;
+		if (info->pending_level == -1 && target[i] != info->resident_level)
+			loadLevels(textures[i], target[i]);
+	}
+}
+
+size_t TextureStreamer::getResidentMemory()
+{
+	size_t size = 0;
+	for (Texture* texture : textures)
+		size += texture->stream->getSize(texture->stream->resident_level);
+	return size;
+}
+
+size_t TextureStreamer::getRequestedMemory()
+{
+	size_t size = 0;
+	for (Texture* texture : textures)
+		size += texture->stream->getSize(std::min(texture->stream->wanted_level, texture->stream->requested_level));
+	return size;
+}
+
+void TextureStreamer::renderInMenu()
+{
+#ifndef SKIP_IMGUI
+	ImGui::Checkbox("Stream Textures", &enabled);
+	ImGui::SliderInt("Budget (MB)", &budget, 16, 2048);
+	ImGui::Text("Streamed textures: %d  Loading: %d", (int)textures.size(), loads_in_flight);
+	ImGui::Text("Resident: %.1f MB  Requested: %.1f MB  Arrays: %.1f MB", getResidentMemory() / (1024.0f * 1024.0f), getRequestedMemory() / (1024.0f * 1024.0f), TextureArrayPool::getTotalMemory() / (1024.0f * 1024.0f));
+#endif
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "framework.h"
+#include <string>
+#include <vector>
+
+class Texture;
+class CompressedImage;
+
+//Compressed textures start with only their small mips in VRAM. Every frame the renderer tells which mip
+//each visible texture needs (from its size on screen) and the streamer loads or drops the big mips
+//from the .ctex to fit the memory budget, dropping first the ones that were used less recently.
+
+struct sTextureStreamInfo {
+	std::string filename;		//the .ctex with all the mips
+	int num_levels;
+	size_t level_sizes[32];		//bytes of every mip
+	int min_level;				//smallest mips are always resident, from this one to the end
+	int resident_level;			//first mip in VRAM
+	int requested_level;		//finest mip requested by the renderer in the current window of frames
+	int wanted_level;			//finest mip requested in the last window
+	int pending_level;			//being loaded, -1 if none
+	long last_used_frame;
+
+	size_t getSize(int first_level) const; //bytes from first_level to the end
+};
+
+class TextureStreamer
+{
+public:
+	static bool enabled;
+	static int budget;				//in MB, the texture arrays count too
+	static int min_resident_size;	//mips bigger than this (in pixels) are only loaded when needed
+	static int max_loads_in_flight;
+	static int keep_frames;			//frames a request is remembered before the mips can be dropped
+	static long frame;
+
+	static std::vector<Texture*> textures;
+
+	//first mip that is loaded when the texture is created
+	static int getFirstResidentLevel(const CompressedImage& image);
+
+	//called once the low mips are uploaded, the texture must be in the registry
+	static void registerTexture(Texture* texture, const std::string& filename, const CompressedImage& image);
+	static void unregisterTexture(Texture* texture);
+
+	//the renderer needs this mip (or finer) of the texture this frame
+	static void requestLevel(Texture* texture, int level);
+
+	//decides what to load or drop and launches the loads, from the main thread once per frame
+	static void update();
+
+	static size_t getResidentMemory();
+	static size_t getRequestedMemory(); //what would be resident without budget
+	static void renderInMenu();
+};
@@ -0,0 +1,356 @@
+#include "texture_uploader.h"
+#include "texture.h"
+#include "resource.h"
+#include "includes.h"
+
+#include <cassert>
+#include <deque>
+#include <mutex>
+#include <algorithm>
+#include <chrono>
+
+#ifndef GL_MAP_PERSISTENT_BIT
+	#define GL_MAP_PERSISTENT_BIT 0x0040
+	#define GL_MAP_COHERENT_BIT 0x0080
+#endif
+
+bool TextureUploader::enabled = true;
+int TextureUploader::ring_size = 64;
+int TextureUploader::frame_budget = 8;
+
+int TextureUploader::num_uploads = 0;
+float TextureUploader::avg_latency = 0;
+float TextureUploader::max_latency = 0;
+float TextureUploader::last_frame_time = 0;
+float TextureUploader::max_frame_time = 0;
+
+//a part of the ring, they are released in the same order they were allocated
+struct sRingSlice {
+	int id;
+	size_t offset;
+	size_t size;
+	GLsync fence;	//set once the upload is issued
+	bool released;	//nothing will read it (or the fence is set)
+};
+
+struct sPendingUpload {
+	std::string name;
+	Handle<Texture> texture; //if it is not looked up by name
+	Image* image;		//NULL once copied to the ring
+	int slice_id;		//-1 if not in the ring
+	size_t offset;
+	unsigned int width, height, num_channels;
+	unsigned int rows_done;	//big images are uploaded in bands of rows over several frames
+	bool mipmaps, wrap;
+	std::chrono::steady_clock::time_point start_time;
+};
+
+static GLuint ring_pbo = 0;
+static uint8* ring_data = NULL; //persistently mapped
+static size_t ring_capacity = 0;
+static bool ring_tried = false;
+
+static std::mutex ring_mutex; //protects the slices
+static std::deque<sRingSlice> slices;
+static size_t ring_head = 0;
+static int last_slice_id = 0;
+
+static std::mutex ready_mutex;
+static std::vector<sPendingUpload*> ready; //staged by any thread
+static std::deque<sPendingUpload*> queued; //main thread only
+
+static void createRing()
+{
+	ring_tried = true;
+	if (!SDL_GL_ExtensionSupported("GL_ARB_buffer_storage"))
+	{
+		std::cout << "TextureUploader: no persistent mapping, textures will be uploaded directly" << std::endl;
+		return;
+	}
+
+	size_t capacity = (size_t)TextureUploader::ring_size * 1024 * 1024;
+	GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+	glGenBuffers(1, &ring_pbo);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, ring_pbo);
+	glBufferStorage(GL_PIXEL_UNPACK_BUFFER, capacity, NULL, flags);
+	uint8* data = (uint8*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, capacity, flags);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	if (!data)
+	{
+		glDeleteBuffers(1, &ring_pbo);
+		ring_pbo = 0;
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(ring_mutex);
+	ring_data = data;
+	ring_capacity = capacity;
+}
+
+//reserves size bytes of the ring, returns -1 if they dont fit now
+static int allocSlice(size_t size, size_t& offset)
+{
+	size = (size + 255) & ~(size_t)255;
+	std::lock_guard<std::mutex> lock(ring_mutex);
+	if (!ring_data || size >= ring_capacity)
+		return -1;
+
+	size_t start;
+	if (slices.empty())
+		start = 0;
+	else
+	{
+		size_t tail = slices.front().offset;
+		if (ring_head > tail) //free at the end and at the beginning
+		{
+			if (ring_head + size <= ring_capacity)
+				start = ring_head;
+			else if (size < tail)
+				start = 0;
+			else
+				return -1;
+		}
+		else if (ring_head + size < tail) //wrapped, free till the tail
+			start = ring_head;
+		else
+			return -1;
+	}
+
+	ring_head = start + size;
+	sRingSlice slice;
+	slice.id = ++last_slice_id;
+	slice.offset = start;
+	slice.size = size;
+	slice.fence = NULL;
+	slice.released = false;
+	slices.push_back(slice);
+	offset = start;
+	return slice.id;
+}
+
+static void releaseSlice(int id, GLsync fence)
+{
+	std::lock_guard<std::mutex> lock(ring_mutex);
+	for (sRingSlice& slice : slices)
+		if (slice.id == id)
+		{
+			slice.fence = fence;
+			slice.released = true;
+			return;
+		}
+}
+
+//frees the oldest slices once the GPU is done with them
+static void reclaimSlices()
+{
+	std::lock_guard<std::mutex> lock(ring_mutex);
+	while (slices.size() && slices.front().released)
+	{
+		sRingSlice& slice = slices.front();
+		if (slice.fence)
+		{
+			GLenum result = glClientWaitSync(slice.fence, 0, 0);
+			if (result != GL_ALREADY_SIGNALED && result != GL_CONDITION_SATISFIED)
+				break;
+			glDeleteSync(slice.fence);
+		}
+		slices.pop_front();
+	}
+}
+
+//copies the pixels to the ring if there is space (from any thread)
+static void stage(sPendingUpload* item, Image* image)
+{
+	item->image = image;
+	item->slice_id = -1;
+	item->width = image->width;
+	item->height = image->height;
+	item->num_channels = image->num_channels;
+	item->rows_done = 0;
+	item->start_time = std::chrono::steady_clock::now();
+
+	size_t size = (size_t)image->width * image->height * image->num_channels;
+	if (TextureUploader::enabled && image->data)
+		item->slice_id = allocSlice(size, item->offset);
+	if (item->slice_id != -1)
+	{
+		memcpy(ring_data + item->offset, image->data, size);
+		delete image;
+		item->image = NULL;
+	}
+
+	std::lock_guard<std::mutex> lock(ready_mutex);
+	ready.push_back(item);
+}
+
+void TextureUploader::upload(const std::string& texture_name, Image* image, bool mipmaps, bool wrap)
+{
+	assert(image);
+	sPendingUpload* item = new sPendingUpload();
+	item->name = texture_name;
+	item->mipmaps = mipmaps;
+	item->wrap = wrap;
+	stage(item, image);
+}
+
+void TextureUploader::upload(Texture* texture, Image* image, bool mipmaps, bool wrap)
+{
+	assert(image && Resource::isMainThread()); //the handle cannot be taken from other threads safely
+	sPendingUpload* item = new sPendingUpload();
+	item->texture = texture;
+	item->mipmaps = mipmaps;
+	item->wrap = wrap;
+	stage(item, image);
+}
+
+void TextureUploader::update()
+{
+	assert(Resource::isMainThread());
+	auto start = std::chrono::steady_clock::now();
+
+	if (!ring_tried && enabled)
+		createRing();
+	reclaimSlices();
+
+	{
+		std::lock_guard<std::mutex> lock(ready_mutex);
+		for (sPendingUpload* item : ready)
+			queued.push_back(item);
+		ready.clear();
+	}
+
+	size_t budget = (size_t)frame_budget * 1024 * 1024;
+	size_t uploaded = 0;
+	std::vector<sPendingUpload*> waiting; //for space in the ring
+	while (queued.size() && (uploaded == 0 || uploaded < budget))
+	{
+		sPendingUpload* item = queued.front();
+		queued.pop_front();
+		size_t size = (size_t)item->width * item->height * item->num_channels;
+
+		//it could have been destroyed while it was loading
+		Texture* texture = item->texture ? item->texture.get() : Texture::sTexturesLoaded.find(item->name);
+		if (!texture)
+		{
+			//the rows already uploaded may still be read from the ring
+			if (item->slice_id != -1)
+				releaseSlice(item->slice_id, item->rows_done ? glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0) : NULL);
+			delete item->image;
+			delete item;
+			continue;
+		}
+
+		//the ring was full when it was staged
+		if (item->slice_id == -1 && item->image && ring_data && enabled)
+		{
+			item->slice_id = allocSlice(size, item->offset);
+			if (item->slice_id != -1)
+			{
+				memcpy(ring_data + item->offset, item->image->data, size);
+				delete item->image;
+				item->image = NULL;
+			}
+			else if (size < ring_capacity)
+			{
+				//it will fit once the GPU is done with the oldest uploads, uploading it directly would stall the frame
+				waiting.push_back(item);
+				continue;
+			}
+		}
+
+		unsigned int format = item->num_channels == 3 ? GL_RGB : GL_RGBA;
+		if (item->slice_id != -1)
+		{
+			//as many rows as the budget allows, the rest next frame
+			size_t row_size = (size_t)item->width * item->num_channels;
+			unsigned int rows = item->height - item->rows_done;
+			rows = std::max(1u, std::min(rows, (unsigned int)((budget - uploaded) / row_size)));
+			if (item->rows_done == 0)
+				texture->create(item->width, item->height, format, GL_UNSIGNED_BYTE, item->mipmaps);
+			texture->uploadFromBuffer(ring_pbo, item->offset + item->rows_done * row_size, item->rows_done, rows, format, item->wrap);
+			item->rows_done += rows;
+			uploaded += rows * row_size;
+			if (item->rows_done < item->height)
+			{
+				queued.push_front(item);
+				continue;
+			}
+			releaseSlice(item->slice_id, glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0));
+		}
+		else
+		{
+			texture->loadFromImage(item->image, item->mipmaps, item->wrap);
+			delete item->image;
+			uploaded += size;
+		}
+		texture->state = RESOURCE_READY;
+		if (texture->packable)
+			TextureArrayPool::pack(texture);
+
+		float latency = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - item->start_time).count();
+		avg_latency = (avg_latency * num_uploads + latency) / (num_uploads + 1);
+		max_latency = std::max(max_latency, latency);
+		num_uploads++;
+		delete item;
+	}
+	queued.insert(queued.begin(), waiting.begin(), waiting.end());
+
+	last_frame_time = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+	max_frame_time = std::max(max_frame_time, last_frame_time);
+}
+
+void TextureUploader::release()
+{
+	for (sPendingUpload* item : queued)
+	{
+		delete item->image;
+		delete item;
+	}
+	queued.clear();
+	{
+		std::lock_guard<std::mutex> lock(ready_mutex);
+		for (sPendingUpload* item : ready)
+		{
+			delete item->image;
+			delete item;
+		}
+		ready.clear();
+	}
+
+	std::lock_guard<std::mutex> lock(ring_mutex);
+	for (sRingSlice& slice : slices)
+		if (slice.fence)
+			glDeleteSync(slice.fence);
+	slices.clear();
+	if (ring_pbo)
+	{
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, ring_pbo);
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		glDeleteBuffers(1, &ring_pbo);
+	}
+	ring_pbo = 0;
+	ring_data = NULL;
+	ring_capacity = 0;
+}
+
+void TextureUploader::renderInMenu()
+{
+#ifndef SKIP_IMGUI
+	ImGui::Checkbox("Upload through PBO ring", &enabled);
+	ImGui::SliderInt("Upload budget (MB/frame)", &frame_budget, 1, 64);
+	int num_slices = 0;
+	{
+		std::lock_guard<std::mutex> lock(ring_mutex);
+		num_slices = (int)slices.size();
+	}
+	ImGui::Text("Ring: %s  In use: %d slices", ring_data ? "persistent" : "none (direct uploads)", num_slices);
+	ImGui::Text("Uploads: %d  Latency avg: %.1f ms  max: %.1f ms", num_uploads, avg_latency, max_latency);
+	ImGui::Text("Upload time last frame: %.2f ms  worst: %.2f ms", last_frame_time, max_frame_time);
+	if (ImGui::Button("Reset stats"))
+	{
+		num_uploads = 0;
+		avg_latency = max_latency = max_frame_time = 0;
+	}
+#endif
+}
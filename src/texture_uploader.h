@@ -0,0 +1,39 @@
+#pragma once
+
+#include "framework.h"
+#include <string>
+
+class Texture;
+class Image;
+
+//Uploads the decoded images without stalling the frame. The workers copy the pixels into a ring of pixel
+//buffer memory that stays mapped, and the main thread only issues the texture upload from it, a few MB per
+//frame. Every upload leaves a fence so its part of the ring is reused once the GPU has read it.
+//Images bigger than the budget are uploaded in bands of rows over several frames. When the ring is full the
+//images wait for space, only the ones that never fit in it are uploaded directly.
+//Without persistent mapping (GL_ARB_buffer_storage) the images are uploaded directly, still within the budget.
+
+class TextureUploader
+{
+public:
+	static bool enabled;
+	static int ring_size;		//in MB, created the first frame
+	static int frame_budget;	//MB uploaded per frame (at least a band of rows, or a whole image that is not in the ring)
+
+	//from any thread, it takes the image. The texture is looked up by name when it is uploaded.
+	static void upload(const std::string& texture_name, Image* image, bool mipmaps = true, bool wrap = true);
+	//only from the main thread, for textures that may not be registered by name
+	static void upload(Texture* texture, Image* image, bool mipmaps = true, bool wrap = true);
+
+	//main thread, once per frame: recycles the parts of the ring already read and uploads what fits in the budget
+	static void update();
+	static void release();
+
+	//stats
+	static int num_uploads;
+	static float avg_latency;	//ms from upload() till the texture is ready
+	static float max_latency;
+	static float last_frame_time;	//ms spent in update the last frame
+	static float max_frame_time;	//the worst frame
+	static void renderInMenu();
+};
@@ -0,0 +1,136 @@
+//rays per second of the mesh BVH (bvh.cpp) against the coldet collision models it replaced, and the time to build it.
+//Built and run by "make bench", single thread unless a number of workers is given: tests/bench_bvh 4
+#include "framework.h"
+#include "bvh.h"
+#include "task.h"
+#include "extra/coldet/coldet.h"
+#include "bumpy_sphere.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+
+static const int NUM_RAYS = 20000;
+static const int NUM_REPEATS = 3;
+static int sink = 0; //so the compiler doesn't remove the work
+
+static float randomUnit()
+{
+	return rand() / (float)RAND_MAX;
+}
+
+static Vector3 randomVector()
+{
+	float z = randomUnit() - 0.5f, y = randomUnit() - 0.5f;
+	return Vector3(randomUnit() - 0.5f, y, z);
+}
+
+template<typename F> static double millis(F func)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+	func();
+	return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+//the best of the repeats, in millions of rays per second
+template<typename F> static void report(const char* name, int num_rays, F func)
+{
+	double best = 1e30;
+	for (int n = 0; n < NUM_REPEATS; ++n)
+		best = std::min(best, millis(func));
+	printf("  %-26s %6.2f Mrays/s\n", name, num_rays / best / 1000.0);
+}
+
+int main(int argc, char** argv)
+{
+	int num_workers = argc > 1 ? atoi(argv[1]) : 0;
+	if (num_workers)
+		TaskManager::workers.startThreads(num_workers);
+	srand(1);
+
+	std::vector<Vector3> vertices;
+	std::vector<unsigned int> indices;
+	createBumpySphere(256, vertices, indices);
+	int num_triangles = (int)indices.size() / 3;
+	Matrix44 model = bumpySphereModel();
+	Matrix44 inverse = model;
+	inverse.affineInverse();
+	printf("mesh BVH, %d triangles, %d workers\n", num_triangles, num_workers);
+
+	MeshBVH bvh;
+	double ms = millis([&]() { bvh.build(&vertices[0], sizeof(Vector3), (int)vertices.size(), &indices[0], num_triangles); });
+	printf("  %-26s %6.1f ms, %d nodes, %d KB\n", "build", ms, (int)bvh.nodes.size(), (int)(bvh.getMemorySize() / 1024));
+
+	CollisionModel3D* coldet = newCollisionModel3D(false);
+	ms = millis([&]() {
+		coldet->setTriangleNumber(num_triangles);
+		for (int i = 0; i < num_triangles; ++i)
+			coldet->addTriangle(vertices[indices[i * 3]].v, vertices[indices[i * 3 + 1]].v, vertices[indices[i * 3 + 2]].v);
+		coldet->finalize();
+	});
+	coldet->setTransform(model.m);
+	printf("  %-26s %6.1f ms\n", "build coldet", ms);
+
+	//random rays from all around aimed at the mesh, the BVH gets them in object space
+	Vector3 center = model * Vector3(0, 0, 0);
+	std::vector<Ray> rays(NUM_RAYS), object_rays(NUM_RAYS);
+	for (int i = 0; i < NUM_RAYS; ++i)
+	{
+		Vector3 dir = randomVector().normalize();
+		rays[i].origin = center - dir * 8;
+		Vector3 target = center + randomVector() * 5;
+		rays[i].direction = (target - rays[i].origin).normalize();
+		object_rays[i].origin = inverse * rays[i].origin;
+		object_rays[i].direction = inverse.rotateVector(rays[i].direction);
+	}
+	std::vector<RayHit> hits(NUM_RAYS);
+	printf("random rays\n");
+	report("coldet (closest hit)", NUM_RAYS, [&]() {
+		for (int i = 0; i < NUM_RAYS; ++i)
+			sink += coldet->rayCollision(rays[i].origin.v, rays[i].direction.v, true, 0, 3.4e38f);
+	});
+	report("testRay", NUM_RAYS, [&]() {
+		for (int i = 0; i < NUM_RAYS; ++i)
+			sink += bvh.testRay(object_rays[i].origin, object_rays[i].direction, 1e30f, hits[i]);
+	});
+	report("testRays", NUM_RAYS, [&]() { sink += bvh.testRays(&object_rays[0], NUM_RAYS, 1e30f, &hits[0]); });
+
+	//a camera looking at the mesh where every packet is a 2x2 tile of pixels
+	const int RESOLUTION = 160;
+	const int NUM_CAMERA_RAYS = RESOLUTION * RESOLUTION;
+	std::vector<Ray> camera_rays(NUM_CAMERA_RAYS);
+	Vector3 eye = inverse * (center + Vector3(0, 0, 6));
+	Vector3 front = (Vector3(0, 0, 0) - eye).normalize();
+	Vector3 right = front.cross(Vector3(0, 1, 0)).normalize();
+	Vector3 up = right.cross(front);
+	for (int y = 0; y < RESOLUTION; y += 2)
+		for (int x = 0; x < RESOLUTION; x += 2)
+			for (int k = 0; k < 4; ++k)
+			{
+				float px = (x + (k & 1)) / (float)RESOLUTION - 0.5f, py = (y + (k >> 1)) / (float)RESOLUTION - 0.5f;
+				Ray& ray = camera_rays[((y / 2) * (RESOLUTION / 2) + x / 2) * 4 + k];
+				ray.origin = eye;
+				ray.direction = (front + right * (px * 0.8f) + up * (py * 0.8f)).normalize();
+			}
+	hits.resize(NUM_CAMERA_RAYS);
+	printf("coherent rays\n");
+	report("testRay", NUM_CAMERA_RAYS, [&]() {
+		for (int i = 0; i < NUM_CAMERA_RAYS; ++i)
+			sink += bvh.testRay(camera_rays[i].origin, camera_rays[i].direction, 1e30f, hits[i]);
+	});
+	report("testRayPacket", NUM_CAMERA_RAYS, [&]() {
+		for (int i = 0; i < NUM_CAMERA_RAYS; i += 4)
+		{
+			float distances[4] = { 1e30f, 1e30f, 1e30f, 1e30f };
+			sink += bvh.testRayPacket(&camera_rays[i], distances, &hits[i]);
+		}
+	});
+	report("testRays", NUM_CAMERA_RAYS, [&]() { sink += bvh.testRays(&camera_rays[0], NUM_CAMERA_RAYS, 1e30f, &hits[0]); });
+
+	delete coldet;
+	//the workers wait for tasks forever (TaskManager can't stop them), destroying their condition variable at exit would block
+	fflush(stdout);
+	std::_Exit(sink == 12345 ? 1 : 0);
+}
@@ -0,0 +1,181 @@
+//times the matrix kernels of framework.cpp against the scalar code they replaced. Built and run by "make bench"
+#include "framework.h"
+#include "simd.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+
+static const int NUM_MATRICES = 4096;
+static const int NUM_REPEATS = 200;
+static float sink = 0; //so the compiler doesn't remove the work
+
+static float random(float min, float max)
+{
+	return min + (max - min) * (rand() / (float)RAND_MAX);
+}
+
+static Matrix44 randomAffine()
+{
+	Matrix44 m;
+	m.setRotation(random(0.0f, 6.28f), Vector3(random(-1, 1), random(-1, 1), random(-1, 1)).normalize());
+	Matrix44 s;
+	s.setScale(random(0.2f, 5.0f), random(0.2f, 5.0f), random(0.2f, 5.0f));
+	m = s * m;
+	m.m[12] = random(-100, 100); m.m[13] = random(-100, 100); m.m[14] = random(-100, 100);
+	return m;
+}
+
+template<typename F> static double millis(F func)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+	func();
+	return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+static void report(const char* name, double scalar_ms, double ms, int count)
+{
+	printf("  %-22s %8.2f ns  scalar %8.2f ns  x%.1f\n", name, ms * 1e6 / count, scalar_ms * 1e6 / count, scalar_ms / ms);
+}
+
+// --- the scalar versions ---
+
+static Matrix44 scalarMultiply(const Matrix44& a, const Matrix44& b)
+{
+	Matrix44 r;
+	for (int i = 0; i < 4; ++i)
+		for (int j = 0; j < 4; ++j)
+		{
+			float v = a.M[i][0] * b.M[0][j];
+			v += a.M[i][1] * b.M[1][j];
+			v += a.M[i][2] * b.M[2][j];
+			v += a.M[i][3] * b.M[3][j];
+			r.M[i][j] = v;
+		}
+	return r;
+}
+
+//gauss-jordan with partial pivoting, like the one Matrix44::inverse used to have
+static bool scalarInverse(Matrix44& m)
+{
+	float a[4][8];
+	for (int i = 0; i < 4; ++i)
+		for (int j = 0; j < 4; ++j)
+		{
+			a[i][j] = m.M[i][j];
+			a[i][j + 4] = i == j ? 1.0f : 0.0f;
+		}
+	for (int c = 0; c < 4; ++c)
+	{
+		int pivot = c;
+		for (int r = c + 1; r < 4; ++r)
+			if (fabsf(a[r][c]) > fabsf(a[pivot][c]))
+				pivot = r;
+		if (a[pivot][c] == 0.0f)
+			return false;
+		for (int j = 0; j < 8; ++j)
+			std::swap(a[c][j], a[pivot][j]);
+		float f = 1.0f / a[c][c];
+		for (int j = 0; j < 8; ++j)
+			a[c][j] *= f;
+		for (int r = 0; r < 4; ++r)
+			if (r != c)
+			{
+				float g = a[r][c];
+				for (int j = 0; j < 8; ++j)
+					a[r][j] -= g * a[c][j];
+			}
+	}
+	for (int i = 0; i < 4; ++i)
+		for (int j = 0; j < 4; ++j)
+			m.M[i][j] = a[i][j + 4];
+	return true;
+}
+
+static BoundingBox scalarBoundingBox(const Matrix44& m, const BoundingBox& box)
+{
+	Vector3 bmin(1e30f, 1e30f, 1e30f), bmax(-1e30f, -1e30f, -1e30f);
+	for (int k = 0; k < 8; ++k)
+	{
+		Vector3 corner = box.center + Vector3(k & 1 ? 1.0f : -1.0f, k & 2 ? 1.0f : -1.0f, k & 4 ? 1.0f : -1.0f) * box.halfsize;
+		Vector3 p = m * corner;
+		bmin.setMin(p);
+		bmax.setMax(p);
+	}
+	return BoundingBox((bmin + bmax) * 0.5f, (bmax - bmin) * 0.5f);
+}
+
+int main()
+{
+#if defined(SIMD_SSE)
+	printf("math kernels (SSE), per operation\n");
+#elif defined(SIMD_NEON)
+	printf("math kernels (NEON), per operation\n");
+#else
+	printf("math kernels (scalar), per operation\n");
+#endif
+	srand(1);
+	std::vector<Matrix44> a(NUM_MATRICES), b(NUM_MATRICES), r(NUM_MATRICES);
+	for (int i = 0; i < NUM_MATRICES; ++i)
+	{
+		a[i] = randomAffine();
+		b[i] = randomAffine();
+	}
+	int count = NUM_MATRICES * NUM_REPEATS;
+
+	double scalar_ms = millis([&]() { for (int n = 0; n < NUM_REPEATS; ++n) for (int i = 0; i < NUM_MATRICES; ++i) r[i] = scalarMultiply(a[i], b[(i + n) % NUM_MATRICES]); });
+	sink += r[7].m[5];
+	double ms = millis([&]() { for (int n = 0; n < NUM_REPEATS; ++n) for (int i = 0; i < NUM_MATRICES; ++i) r[i] = a[i] * b[(i + n) % NUM_MATRICES]; });
+	sink += r[7].m[5];
+	report("multiply", scalar_ms, ms, count);
+
+	scalar_ms = millis([&]() { for (int n = 0; n < NUM_REPEATS; ++n) for (int i = 0; i < NUM_MATRICES; ++i) { r[i] = a[i]; scalarInverse(r[i]); } });
+	sink += r[7].m[5];
+	ms = millis([&]() { for (int n = 0; n < NUM_REPEATS; ++n) for (int i = 0; i < NUM_MATRICES; ++i) { r[i] = a[i]; r[i].inverse(); } });
+	sink += r[7].m[5];
+	report("inverse", scalar_ms, ms, count);
+	ms = millis([&]() { for (int n = 0; n < NUM_REPEATS; ++n) for (int i = 0; i < NUM_MATRICES; ++i) { r[i] = a[i]; r[i].affineInverse(); } });
+	sink += r[7].m[5];
+	report("affineInverse", scalar_ms, ms, count);
+
+	std::vector<Vector3> points(NUM_MATRICES), result(NUM_MATRICES);
+	for (int i = 0; i < NUM_MATRICES; ++i)
+		points[i].set(random(-100, 100), random(-100, 100), random(-100, 100));
+	scalar_ms = millis([&]() { for (int n = 0; n < NUM_REPEATS; ++n) for (int i = 0; i < NUM_MATRICES; ++i) result[i] = a[n] * points[i]; });
+	sink += result[7].x;
+	ms = millis([&]() { for (int n = 0; n < NUM_REPEATS; ++n) transformPoints(a[n], &points[0], &result[0], NUM_MATRICES); });
+	sink += result[7].x;
+	report("transformPoints", scalar_ms, ms, count);
+	//the inverse once per matrix, then every normal by its transpose
+	scalar_ms = millis([&]() {
+		for (int n = 0; n < NUM_REPEATS; ++n)
+		{
+			Matrix44 inv = a[n];
+			scalarInverse(inv);
+			for (int i = 0; i < NUM_MATRICES; ++i)
+			{
+				const Vector3& v = points[i];
+				result[i].set(inv.m[0] * v.x + inv.m[1] * v.y + inv.m[2] * v.z, inv.m[4] * v.x + inv.m[5] * v.y + inv.m[6] * v.z, inv.m[8] * v.x + inv.m[9] * v.y + inv.m[10] * v.z);
+				result[i].normalize();
+			}
+		}
+	});
+	sink += result[7].x;
+	ms = millis([&]() { for (int n = 0; n < NUM_REPEATS; ++n) transformNormals(a[n], &points[0], &result[0], NUM_MATRICES); });
+	sink += result[7].x;
+	report("transformNormals", scalar_ms, ms, count);
+
+	std::vector<BoundingBox> boxes(NUM_MATRICES), boxes_result(NUM_MATRICES);
+	for (int i = 0; i < NUM_MATRICES; ++i)
+		boxes[i] = BoundingBox(points[i], Vector3(random(0, 10), random(0, 10), random(0, 10)));
+	scalar_ms = millis([&]() { for (int n = 0; n < NUM_REPEATS; ++n) for (int i = 0; i < NUM_MATRICES; ++i) boxes_result[i] = scalarBoundingBox(a[n], boxes[i]); });
+	sink += boxes_result[7].center.x;
+	ms = millis([&]() { for (int n = 0; n < NUM_REPEATS; ++n) transformBoundingBoxes(a[n], &boxes[0], &boxes_result[0], NUM_MATRICES); });
+	sink += boxes_result[7].center.x;
+	report("transformBoundingBoxes", scalar_ms, ms, count);
+
+	return sink == 12345.0f ? 1 : 0;
+}
@@ -0,0 +1,35 @@
+//the mesh of the BVH test and benchmark: a sphere of radius 1 with bumps so the triangles are not all alike.
+//slices * slices triangles, 256 gives 65536
+#pragma once
+
+#include "framework.h"
+#include <vector>
+
+inline void createBumpySphere(int slices, std::vector<Vector3>& vertices, std::vector<unsigned int>& indices)
+{
+	int rows = slices / 2;
+	for (int j = 0; j <= rows; ++j)
+		for (int i = 0; i <= slices; ++i)
+		{
+			float theta = j * PI / rows, phi = i * 2 * PI / slices;
+			float r = 1 + 0.1f * sin(theta * 9) * cos(phi * 7);
+			vertices.push_back(Vector3(r * sin(theta) * cos(phi), r * cos(theta), r * sin(theta) * sin(phi)));
+		}
+	for (int j = 0; j < rows; ++j)
+		for (int i = 0; i < slices; ++i)
+		{
+			unsigned int a = j * (slices + 1) + i, b = a + 1, c = a + slices + 1, d = c + 1;
+			unsigned int quad[6] = { a, c, b, b, c, d };
+			indices.insert(indices.end(), quad, quad + 6);
+		}
+}
+
+//rotated, scaled and moved, like the model of an entity
+inline Matrix44 bumpySphereModel()
+{
+	Matrix44 model;
+	model.setTranslation(3, -1, 2);
+	model.rotate(0.7f, Vector3(1, 1, 0).normalize());
+	model.scale(2, 2, 2);
+	return model;
+}
@@ -0,0 +1,263 @@
+//compares the queries of MeshBVH (bvh.cpp) with the coldet collision models it replaced and with a brute force search
+//over all the triangles. Built and run by "make test", returns 1 if any of them fails
+#include "framework.h"
+#include "bvh.h"
+#include "extra/coldet/coldet.h"
+#include "bumpy_sphere.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+static const int NUM_RAYS = 20000;
+static const int NUM_SPHERES = 5000;
+//coldet says these spheres collide but all the triangles are farther than the radius: it moves the center to model
+//space but not the radius, so with the scale of the model (2) it tests bigger spheres. Recorded with the rand() of glibc
+static const int COLDET_SPHERES_OUTSIDE = 689;
+static int num_failed = 0;
+
+static float randomUnit()
+{
+	return rand() / (float)RAND_MAX;
+}
+
+//z first, the order in which the recorded numbers were taken
+static Vector3 randomVector()
+{
+	float z = randomUnit() - 0.5f, y = randomUnit() - 0.5f;
+	return Vector3(randomUnit() - 0.5f, y, z);
+}
+
+static void report(const char* name, bool ok, const char* details)
+{
+	printf("  %-22s %s  %s\n", name, ok ? "ok    " : "FAILED", details);
+	if (!ok)
+		num_failed++;
+}
+
+//distance from p to the triangle in double precision, the projection on the plane if it falls inside, otherwise the closest edge
+static double distanceToTriangle(const Vector3& p, const Vector3& a, const Vector3& b, const Vector3& c)
+{
+	double v[3][3] = { { a.x, a.y, a.z }, { b.x, b.y, b.z }, { c.x, c.y, c.z } };
+	double q[3] = { p.x, p.y, p.z };
+	double e1[3], e2[3], n[3];
+	for (int k = 0; k < 3; ++k)
+	{
+		e1[k] = v[1][k] - v[0][k];
+		e2[k] = v[2][k] - v[0][k];
+	}
+	n[0] = e1[1] * e2[2] - e1[2] * e2[1];
+	n[1] = e1[2] * e2[0] - e1[0] * e2[2];
+	n[2] = e1[0] * e2[1] - e1[1] * e2[0];
+	double area = n[0] * n[0] + n[1] * n[1] + n[2] * n[2];
+	if (area > 0)
+	{
+		double t = ((q[0] - v[0][0]) * n[0] + (q[1] - v[0][1]) * n[1] + (q[2] - v[0][2]) * n[2]) / area;
+		double proj[3] = { q[0] - n[0] * t, q[1] - n[1] * t, q[2] - n[2] * t };
+		bool inside = true;
+		for (int i = 0; i < 3 && inside; ++i)
+		{
+			const double* s = v[i];
+			const double* e = v[(i + 1) % 3];
+			double d[3] = { e[0] - s[0], e[1] - s[1], e[2] - s[2] };
+			double w[3] = { proj[0] - s[0], proj[1] - s[1], proj[2] - s[2] };
+			double cross[3] = { d[1] * w[2] - d[2] * w[1], d[2] * w[0] - d[0] * w[2], d[0] * w[1] - d[1] * w[0] };
+			inside = cross[0] * n[0] + cross[1] * n[1] + cross[2] * n[2] >= 0;
+		}
+		if (inside)
+			return fabs(t) * sqrt(area);
+	}
+	double best = 1e30;
+	for (int i = 0; i < 3; ++i)
+	{
+		const double* s = v[i];
+		const double* e = v[(i + 1) % 3];
+		double d[3] = { e[0] - s[0], e[1] - s[1], e[2] - s[2] };
+		double w[3] = { q[0] - s[0], q[1] - s[1], q[2] - s[2] };
+		double length = d[0] * d[0] + d[1] * d[1] + d[2] * d[2];
+		double t = length > 0 ? std::min(std::max((w[0] * d[0] + w[1] * d[1] + w[2] * d[2]) / length, 0.0), 1.0) : 0.0;
+		double x = w[0] - d[0] * t, y = w[1] - d[1] * t, z = w[2] - d[2] * t;
+		best = std::min(best, sqrt(x * x + y * y + z * z));
+	}
+	return best;
+}
+
+int main()
+{
+	printf("mesh BVH against coldet and brute force\n");
+	srand(1);
+
+	std::vector<Vector3> vertices;
+	std::vector<unsigned int> indices;
+	createBumpySphere(256, vertices, indices);
+	int num_triangles = (int)indices.size() / 3;
+	Matrix44 model = bumpySphereModel();
+	Matrix44 inverse = model;
+	inverse.affineInverse();
+	float scale = model.rotateVector(Vector3(1, 0, 0)).length();
+
+	MeshBVH bvh;
+	bvh.build(&vertices[0], sizeof(Vector3), (int)vertices.size(), &indices[0], num_triangles);
+
+	CollisionModel3D* coldet = newCollisionModel3D(false);
+	coldet->setTriangleNumber(num_triangles);
+	for (int i = 0; i < num_triangles; ++i)
+		coldet->addTriangle(vertices[indices[i * 3]].v, vertices[indices[i * 3 + 1]].v, vertices[indices[i * 3 + 2]].v);
+	coldet->finalize();
+	coldet->setTransform(model.m);
+
+	//rays from all around aimed at the mesh, some of them miss. The BVH gets them in object space, like Mesh does
+	Vector3 center = model * Vector3(0, 0, 0);
+	std::vector<Ray> rays(NUM_RAYS), object_rays(NUM_RAYS);
+	for (int i = 0; i < NUM_RAYS; ++i)
+	{
+		Vector3 dir = randomVector().normalize();
+		rays[i].origin = center - dir * 8;
+		Vector3 target = center + randomVector() * 5;
+		rays[i].direction = (target - rays[i].origin).normalize();
+		object_rays[i].origin = inverse * rays[i].origin;
+		object_rays[i].direction = inverse.rotateVector(rays[i].direction);
+	}
+
+	//the closest hit is the same as the one of coldet
+	std::vector<RayHit> hits(NUM_RAYS);
+	int mismatches = 0, num_hits = 0;
+	double max_error = 0;
+	for (int i = 0; i < NUM_RAYS; ++i)
+	{
+		bool hit = bvh.testRay(object_rays[i].origin, object_rays[i].direction, 1e30f, hits[i]);
+		bool coldet_hit = coldet->rayCollision(rays[i].origin.v, rays[i].direction.v, true, 0, 3.4e38f);
+		if (hit != coldet_hit)
+		{
+			mismatches++;
+			continue;
+		}
+		if (!hit)
+			continue;
+		num_hits++;
+		Vector3 point = model * (object_rays[i].origin + object_rays[i].direction * hits[i].distance);
+		Vector3 coldet_point;
+		coldet->getCollisionPoint(coldet_point.v, false);
+		max_error = std::max(max_error, (double)point.distance(coldet_point));
+	}
+	char details[256];
+	snprintf(details, sizeof(details), "%d of %d rays differ from coldet (%d hits)", mismatches, NUM_RAYS, num_hits);
+	report("rays hit or miss", mismatches == 0, details);
+	snprintf(details, sizeof(details), "max distance to the point of coldet %g (tolerance %g)", max_error, 1e-4);
+	report("rays hit point", max_error < 1e-4, details);
+
+	//testRays (packets of the rays that go to the same octant, spread among the workers) finds the same triangles
+	std::vector<RayHit> many_hits(NUM_RAYS);
+	bvh.testRays(&object_rays[0], NUM_RAYS, 1e30f, &many_hits[0]);
+	mismatches = 0;
+	for (int i = 0; i < NUM_RAYS; ++i)
+		if (many_hits[i].triangle != hits[i].triangle || (hits[i].triangle != -1 && fabs(many_hits[i].distance - hits[i].distance) > 1e-5f * hits[i].distance))
+			mismatches++;
+	snprintf(details, sizeof(details), "%d rays differ from testRay", mismatches);
+	report("testRays", mismatches == 0, details);
+
+	//coherent rays, a camera looking at the mesh where every packet is a 2x2 tile of pixels
+	const int RESOLUTION = 160;
+	std::vector<Ray> camera_rays(RESOLUTION * RESOLUTION);
+	Vector3 eye = inverse * (center + Vector3(0, 0, 6));
+	Vector3 front = (Vector3(0, 0, 0) - eye).normalize();
+	Vector3 right = front.cross(Vector3(0, 1, 0)).normalize();
+	Vector3 up = right.cross(front);
+	for (int y = 0; y < RESOLUTION; y += 2)
+		for (int x = 0; x < RESOLUTION; x += 2)
+			for (int k = 0; k < 4; ++k)
+			{
+				float px = (x + (k & 1)) / (float)RESOLUTION - 0.5f, py = (y + (k >> 1)) / (float)RESOLUTION - 0.5f;
+				Ray& ray = camera_rays[((y / 2) * (RESOLUTION / 2) + x / 2) * 4 + k];
+				ray.origin = eye;
+				ray.direction = (front + right * (px * 0.8f) + up * (py * 0.8f)).normalize();
+			}
+	mismatches = 0;
+	for (int i = 0; i < (int)camera_rays.size(); i += 4)
+	{
+		float distances[4] = { 1e30f, 1e30f, 1e30f, 1e30f };
+		RayHit packet[4];
+		int mask = bvh.testRayPacket(&camera_rays[i], distances, packet);
+		for (int k = 0; k < 4; ++k)
+		{
+			RayHit single;
+			bool hit = bvh.testRay(camera_rays[i + k].origin, camera_rays[i + k].direction, 1e30f, single);
+			if (hit != ((mask >> k) & 1) || packet[k].triangle != single.triangle || (hit && fabs(packet[k].distance - single.distance) > 1e-5f * single.distance))
+				mismatches++;
+		}
+	}
+	snprintf(details, sizeof(details), "%d rays differ from testRay", mismatches);
+	report("testRayPacket", mismatches == 0, details);
+
+	//spheres: the BVH finds the closest point of the mesh if it is inside, the same as testing all the triangles.
+	//coldet says yes to more spheres, the brute force confirms they don't touch any triangle. With the radius in model
+	//space coldet gives the same answer as the BVH
+	std::vector<Vector3> boxes(num_triangles * 2);
+	for (int t = 0; t < num_triangles; ++t)
+	{
+		boxes[t * 2] = boxes[t * 2 + 1] = vertices[indices[t * 3]];
+		for (int k = 1; k < 3; ++k)
+		{
+			boxes[t * 2].setMin(vertices[indices[t * 3 + k]]);
+			boxes[t * 2 + 1].setMax(vertices[indices[t * 3 + k]]);
+		}
+	}
+	int wrong = 0, coldet_outside = 0, coldet_wrong = 0, coldet_scaled_wrong = 0;
+	max_error = 0;
+	for (int i = 0; i < NUM_SPHERES; ++i)
+	{
+		Vector3 sphere = center + randomVector() * 6;
+		float radius = randomUnit() * 0.5f;
+		Vector3 collision;
+		int triangle;
+		Vector3 object_center = inverse * sphere;
+		bool hit = bvh.testSphere(object_center, radius / scale, collision, triangle);
+		bool coldet_hit = coldet->sphereCollision(sphere.v, radius);
+		bool coldet_scaled_hit = coldet->sphereCollision(sphere.v, radius / scale);
+
+		//only the triangles whose box is near enough can be inside, the others are skipped
+		double closest = 1e30;
+		float reach = radius / scale + 1e-3f;
+		for (int t = 0; t < num_triangles; ++t)
+		{
+			const Vector3* box = &boxes[t * 2];
+			float distance = 0.0f;
+			for (int k = 0; k < 3; ++k)
+			{
+				float d = std::max(std::max(box[0].v[k] - object_center.v[k], object_center.v[k] - box[1].v[k]), 0.0f);
+				distance += d * d;
+			}
+			if (distance <= reach * reach)
+				closest = std::min(closest, distanceToTriangle(object_center, vertices[indices[t * 3]], vertices[indices[t * 3 + 1]], vertices[indices[t * 3 + 2]]));
+		}
+		closest *= scale;
+		if (fabs(closest - radius) < 1e-5) //too close to the surface to tell in floats
+			continue;
+		bool inside = closest < radius;
+		if (hit != inside)
+			wrong++;
+		else if (hit)
+			max_error = std::max(max_error, fabs((model * collision).distance(sphere) - closest));
+		if (coldet_hit != inside)
+		{
+			if (coldet_hit)
+				coldet_outside++;
+			else
+				coldet_wrong++;
+		}
+		if (coldet_scaled_hit != inside)
+			coldet_scaled_wrong++;
+	}
+	snprintf(details, sizeof(details), "%d of %d differ from brute force, max error of the closest point %g", wrong, NUM_SPHERES, max_error);
+	report("spheres", wrong == 0 && max_error < 1e-4, details);
+	snprintf(details, sizeof(details), "coldet misses %d, says yes to %d spheres outside (expected %d)", coldet_wrong, coldet_outside, COLDET_SPHERES_OUTSIDE);
+	report("spheres coldet", coldet_wrong == 0 && coldet_outside == COLDET_SPHERES_OUTSIDE, details);
+	snprintf(details, sizeof(details), "%d differ from coldet with the radius in model space", coldet_scaled_wrong);
+	report("spheres coldet scaled", coldet_scaled_wrong == 0, details);
+
+	delete coldet;
+	printf(num_failed ? "%d FAILED\n" : "all passed\n", num_failed);
+	return num_failed ? 1 : 0;
+}
@@ -0,0 +1,317 @@
+//compares the matrix kernels of framework.cpp (SIMD or FRAMEWORK_NO_SIMD) against plain scalar code in double precision.
+//Built and run by "make test" in both versions, returns 1 if any of them fails
+#include "framework.h"
+#include "simd.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
+#include <cstring>
+
+static const int NUM_SAMPLES = 20000;
+static int num_failed = 0;
+
+static float random(float min, float max)
+{
+	return min + (max - min) * (rand() / (float)RAND_MAX);
+}
+
+static Vector3 randomVector(float range)
+{
+	return Vector3(random(-range, range), random(-range, range), random(-range, range));
+}
+
+//rotation, scale (mirrored sometimes) and translation, the kind of matrix of the models
+static Matrix44 randomAffine()
+{
+	Matrix44 m;
+	m.setRotation(random(0.0f, 6.28f), randomVector(1.0f).normalize());
+	float sign = rand() % 8 == 0 ? -1.0f : 1.0f;
+	Matrix44 s;
+	s.setScale(sign * random(0.2f, 5.0f), random(0.2f, 5.0f), random(0.2f, 5.0f));
+	m = s * m;
+	Vector3 t = randomVector(100.0f);
+	m.m[12] = t.x; m.m[13] = t.y; m.m[14] = t.z;
+	return m;
+}
+
+static Matrix44 randomMatrix()
+{
+	Matrix44 m;
+	for (int i = 0; i < 16; ++i)
+		m.m[i] = random(-2.0f, 2.0f);
+	return m;
+}
+
+//gauss-jordan with partial pivoting, false if it is singular
+static bool referenceInverse(const Matrix44& m, double* inv)
+{
+	double a[4][8];
+	for (int i = 0; i < 4; ++i)
+		for (int j = 0; j < 4; ++j)
+		{
+			a[i][j] = m.M[i][j];
+			a[i][j + 4] = i == j ? 1.0 : 0.0;
+		}
+	for (int c = 0; c < 4; ++c)
+	{
+		int pivot = c;
+		for (int r = c + 1; r < 4; ++r)
+			if (fabs(a[r][c]) > fabs(a[pivot][c]))
+				pivot = r;
+		if (fabs(a[pivot][c]) < 1e-12)
+			return false;
+		for (int j = 0; j < 8; ++j)
+			std::swap(a[c][j], a[pivot][j]);
+		double f = 1.0 / a[c][c];
+		for (int j = 0; j < 8; ++j)
+			a[c][j] *= f;
+		for (int r = 0; r < 4; ++r)
+			if (r != c)
+			{
+				double g = a[r][c];
+				for (int j = 0; j < 8; ++j)
+					a[r][j] -= g * a[c][j];
+			}
+	}
+	for (int i = 0; i < 4; ++i)
+		for (int j = 0; j < 4; ++j)
+			inv[i * 4 + j] = a[i][j + 4];
+	return true;
+}
+
+//largest element of the matrix and of its inverse, the error of an inverse grows with it
+static double conditionNumber(const Matrix44& m, const double* inv)
+{
+	double norm = 0, inv_norm = 0;
+	for (int i = 0; i < 16; ++i)
+	{
+		norm = std::max(norm, (double)fabs(m.m[i]));
+		inv_norm = std::max(inv_norm, fabs(inv[i]));
+	}
+	return norm * inv_norm;
+}
+
+static void report(const char* name, bool ok, double max_error, double tolerance)
+{
+	printf("  %-22s %s  max error %g (tolerance %g)\n", name, ok ? "ok    " : "FAILED", max_error, tolerance);
+	if (!ok)
+		num_failed++;
+}
+
+//the same order of operations as the scalar loop, so the result must be the same bit by bit
+static void testMultiply()
+{
+	int mismatches = 0;
+	for (int n = 0; n < NUM_SAMPLES; ++n)
+	{
+		Matrix44 a = rand() % 2 ? randomMatrix() : randomAffine();
+		Matrix44 b = rand() % 2 ? randomMatrix() : randomAffine();
+		Matrix44 r = a * b;
+		for (int i = 0; i < 4; ++i)
+			for (int j = 0; j < 4; ++j)
+			{
+				float v = a.M[i][0] * b.M[0][j];
+				v += a.M[i][1] * b.M[1][j];
+				v += a.M[i][2] * b.M[2][j];
+				v += a.M[i][3] * b.M[3][j];
+				if (v != r.M[i][j])
+					mismatches++;
+			}
+	}
+	report("multiply", mismatches == 0, mismatches, 0);
+}
+
+static void testInverse()
+{
+	double max_error = 0;
+	double tolerance = 1e-5;
+	int wrong = 0;
+	for (int n = 0; n < NUM_SAMPLES; ++n)
+	{
+		Matrix44 m;
+		if (n % 3 == 0)
+			m = randomMatrix();
+		else if (n % 3 == 1)
+			m = randomAffine();
+		else
+		{
+			m.perspective(random(30.0f, 90.0f), random(0.5f, 2.0f), random(0.1f, 1.0f), random(100.0f, 10000.0f));
+			m = randomAffine() * m;
+		}
+		double ref[16];
+		if (!referenceInverse(m, ref))
+			continue;
+		double condition = conditionNumber(m, ref);
+		if (condition > 1e4)
+			continue;
+		Matrix44 inv = m;
+		if (!inv.inverse())
+		{
+			wrong++;
+			continue;
+		}
+		//relative to the biggest element of the inverse and the condition of the matrix
+		double scale = 0;
+		for (int i = 0; i < 16; ++i)
+			scale = std::max(scale, fabs(ref[i]));
+		for (int i = 0; i < 16; ++i)
+			max_error = std::max(max_error, fabs(inv.m[i] - ref[i]) / (scale * condition));
+	}
+
+	//singular matrices are not modified
+	Matrix44 singular = randomMatrix();
+	singular.M[2][0] = singular.M[2][1] = singular.M[2][2] = singular.M[2][3] = 0.0f;
+	Matrix44 copy = singular;
+	if (singular.inverse() || memcmp(copy.m, singular.m, sizeof(copy.m)) != 0)
+		wrong++;
+	report("inverse", wrong == 0 && max_error < tolerance, max_error, tolerance);
+}
+
+static void testAffineInverse()
+{
+	double max_error = 0;
+	double tolerance = 1e-5;
+	int wrong = 0;
+	for (int n = 0; n < NUM_SAMPLES; ++n)
+	{
+		Matrix44 m = randomAffine();
+		double ref[16];
+		if (!referenceInverse(m, ref))
+			continue;
+		double condition = conditionNumber(m, ref);
+		Matrix44 inv = m;
+		if (!inv.affineInverse())
+		{
+			wrong++;
+			continue;
+		}
+		double scale = 0;
+		for (int i = 0; i < 16; ++i)
+			scale = std::max(scale, fabs(ref[i]));
+		for (int i = 0; i < 16; ++i)
+			max_error = std::max(max_error, fabs(inv.m[i] - ref[i]) / (scale * condition));
+	}
+
+	Matrix44 singular = randomAffine();
+	singular.M[1][0] = singular.M[1][1] = singular.M[1][2] = 0.0f;
+	Matrix44 copy = singular;
+	if (singular.affineInverse() || memcmp(copy.m, singular.m, sizeof(copy.m)) != 0)
+		wrong++;
+	report("affineInverse", wrong == 0 && max_error < tolerance, max_error, tolerance);
+}
+
+//transformPoints must give the same as the operator* of one point
+static void testPoints()
+{
+	const int count = 1001; //not a multiple of four
+	Vector3 points[count], result[count];
+	int mismatches = 0;
+	for (int n = 0; n < NUM_SAMPLES / count + 1; ++n)
+	{
+		Matrix44 m = randomAffine();
+		for (int i = 0; i < count; ++i)
+			points[i] = randomVector(1000.0f);
+		transformPoints(m, points, result, count);
+		for (int i = 0; i < count; ++i)
+		{
+			Vector3 p = m * points[i];
+			if (p.x != result[i].x || p.y != result[i].y || p.z != result[i].z)
+				mismatches++;
+		}
+	}
+	report("transformPoints", mismatches == 0, mismatches, 0);
+}
+
+//the inverse transpose of the 3x3 part, then normalized. Mirrored matrices keep the normals outside
+static void testNormals()
+{
+	const int count = 1001;
+	Vector3 normals[count], result[count];
+	double max_error = 0;
+	double tolerance = 1e-5;
+	for (int n = 0; n < NUM_SAMPLES / count + 1; ++n)
+	{
+		Matrix44 m = randomAffine();
+		double ref[16];
+		referenceInverse(m, ref);
+		for (int i = 0; i < count; ++i)
+			normals[i] = randomVector(1.0f).normalize();
+		transformNormals(m, normals, result, count);
+		for (int i = 0; i < count; ++i)
+		{
+			//the transpose of the inverse multiplies the vector as a column
+			double v[3];
+			for (int j = 0; j < 3; ++j)
+				v[j] = ref[j * 4 + 0] * normals[i].x + ref[j * 4 + 1] * normals[i].y + ref[j * 4 + 2] * normals[i].z;
+			double length = sqrt(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+			for (int j = 0; j < 3; ++j)
+				max_error = std::max(max_error, fabs(result[i].v[j] - v[j] / length));
+		}
+	}
+	report("transformNormals", max_error < tolerance, max_error, tolerance);
+}
+
+//the box around the eight transformed corners
+static void testBoundingBoxes()
+{
+	const int count = 1001;
+	BoundingBox boxes[count], result[count];
+	double max_error = 0;
+	double tolerance = 1e-5;
+	for (int n = 0; n < NUM_SAMPLES / count + 1; ++n)
+	{
+		Matrix44 m = randomAffine();
+		for (int i = 0; i < count; ++i)
+		{
+			boxes[i].center = randomVector(500.0f);
+			boxes[i].halfsize = Vector3(random(0.0f, 100.0f), random(0.0f, 100.0f), random(0.0f, 100.0f));
+		}
+		transformBoundingBoxes(m, boxes, result, count);
+		for (int i = 0; i < count; ++i)
+		{
+			double bmin[3] = { 1e30, 1e30, 1e30 }, bmax[3] = { -1e30, -1e30, -1e30 };
+			for (int k = 0; k < 8; ++k)
+			{
+				double c[3];
+				for (int j = 0; j < 3; ++j)
+					c[j] = boxes[i].center.v[j] + ((k >> j) & 1 ? 1.0 : -1.0) * boxes[i].halfsize.v[j];
+				for (int j = 0; j < 3; ++j)
+				{
+					double v = m.m[j] * c[0] + m.m[4 + j] * c[1] + m.m[8 + j] * c[2] + m.m[12 + j];
+					bmin[j] = std::min(bmin[j], v);
+					bmax[j] = std::max(bmax[j], v);
+				}
+			}
+			//relative to the size of the box, the floats lose precision far from the origin
+			double size = std::max(1.0, std::max(fabs(bmin[0]), std::max(fabs(bmax[1]), fabs(bmax[2]))));
+			for (int j = 0; j < 3; ++j)
+			{
+				max_error = std::max(max_error, fabs(result[i].center.v[j] - (bmin[j] + bmax[j]) * 0.5) / size);
+				max_error = std::max(max_error, fabs(result[i].halfsize.v[j] - (bmax[j] - bmin[j]) * 0.5) / size);
+			}
+		}
+	}
+	report("transformBoundingBoxes", max_error < tolerance, max_error, tolerance);
+}
+
+int main()
+{
+#if defined(SIMD_SSE)
+	printf("math kernels (SSE)\n");
+#elif defined(SIMD_NEON)
+	printf("math kernels (NEON)\n");
+#else
+	printf("math kernels (scalar)\n");
+#endif
+	srand(1);
+	testMultiply();
+	testInverse();
+	testAffineInverse();
+	testPoints();
+	testNormals();
+	testBoundingBoxes();
+	printf(num_failed ? "%d FAILED\n" : "all passed\n", num_failed);
+	return num_failed ? 1 : 0;
+}